@@ -8,38 +8,136 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/epoll.h>
 #include <sys/queue.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 
 #include "iothread.h"
+#include "dm_string.h"
 #include "log.h"
 #include "mevent.h"
 
 
 #define MEVENT_MAX 64
 #define MAX_EVENT_NUM 64
+
+/* The poll window never drops below this, so that it can grow again */
+#define IOTHREAD_POLL_MIN_NS	1000UL
+
 struct iothread_ctx {
 	pthread_t tid;
 	int epfd;
 	bool started;
 	pthread_mutex_t mtx;
+	int idx;
+
+	/* mevents with a poll callback, protected by mtx */
+	struct iothread_mevent *pollers[MEVENT_MAX];
+	int npollers;
+	unsigned int pollers_gen;	/* bumped when a poller is removed */
+	bool polling;			/* a poll pass uses a snapshot of pollers */
+	pthread_cond_t poll_done;	/* signaled when polling drops */
+	/* current poll window, adapts between IOTHREAD_POLL_MIN_NS and iothread_poll_max_ns */
+	uint64_t poll_ns;
 };
-static struct iothread_ctx ioctx;
+static struct iothread_ctx ioctxs[IOTHREAD_MAX];
+
+static int iothread_num = 1;
+static int iothread_cpus[IOTHREAD_MAX];
+static int iothread_nr_cpus;
+static uint64_t iothread_poll_max_ns;
+static int iothread_next;	/* round-robin assignment */
+
+static uint64_t
+iothread_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Spin on the pollers for the poll window before going back to epoll_wait,
+ * a request that comes in meanwhile is served without a wakeup. The window
+ * doubles when polling found work and halves when it didn't.
+ *
+ * The pass works on a snapshot of the pollers and calls them without
+ * ioctx->mtx, since devices add and remove their mevents with the device
+ * lock held. iothread_del_poller() ends the pass and waits for it, so a
+ * removed poller is not called afterwards. The poll callbacks therefore
+ * must not block on the device lock.
+ */
+static void
+iothread_poll(struct iothread_ctx *ioctx)
+{
+	struct iothread_mevent *pollers[MEVENT_MAX], *aevp;
+	uint64_t now, deadline;
+	bool found, progress = false;
+	unsigned int gen;
+	int i, n;
+
+	pthread_mutex_lock(&ioctx->mtx);
+	n = ioctx->npollers;
+	memcpy(pollers, ioctx->pollers, n * sizeof(pollers[0]));
+	gen = ioctx->pollers_gen;
+	ioctx->polling = true;
+	pthread_mutex_unlock(&ioctx->mtx);
+
+	now = iothread_now_ns();
+	deadline = now + ioctx->poll_ns;
+	while (ioctx->started && now < deadline) {
+		found = false;
+		for (i = 0; i < n; i++) {
+			if (__atomic_load_n(&ioctx->pollers_gen, __ATOMIC_ACQUIRE) != gen)
+				break;
+			aevp = pollers[i];
+			if ((*aevp->poll)(aevp->arg))
+				found = true;
+		}
+		if (i < n)
+			break;
+
+		now = iothread_now_ns();
+		if (found) {
+			progress = true;
+			deadline = now + ioctx->poll_ns;
+		}
+	}
+
+	if (progress) {
+		ioctx->poll_ns *= 2;
+		if (ioctx->poll_ns > iothread_poll_max_ns)
+			ioctx->poll_ns = iothread_poll_max_ns;
+	} else {
+		ioctx->poll_ns /= 2;
+		if (ioctx->poll_ns < IOTHREAD_POLL_MIN_NS)
+			ioctx->poll_ns = IOTHREAD_POLL_MIN_NS;
+	}
+
+	pthread_mutex_lock(&ioctx->mtx);
+	ioctx->polling = false;
+	pthread_cond_broadcast(&ioctx->poll_done);
+	pthread_mutex_unlock(&ioctx->mtx);
+}
 
 static void *
 io_thread(void *arg)
 {
+	struct iothread_ctx *ioctx = arg;
 	struct epoll_event eventlist[MEVENT_MAX];
 	struct iothread_mevent *aevp;
 	int i, n, status;
 	char buf[MAX_EVENT_NUM];
 
-	while(ioctx.started) {
-		n = epoll_wait(ioctx.epfd, eventlist, MEVENT_MAX, -1);
+	while(ioctx->started) {
+		n = epoll_wait(ioctx->epfd, eventlist, MEVENT_MAX, -1);
 		if (n < 0) {
 			if (errno == EINTR)
 				pr_info("%s: exit from epoll_wait\n", __func__);
@@ -57,50 +155,113 @@ io_thread(void *arg)
 				(*aevp->run)(aevp->arg);
 			}
 		}
+
+		if (iothread_poll_max_ns > 0 && ioctx->npollers > 0)
+			iothread_poll(ioctx);
 	}
 
 	return NULL;
 }
 
 static int
-iothread_start(void)
+iothread_start(struct iothread_ctx *ioctx)
 {
-	pthread_mutex_lock(&ioctx.mtx);
+	char name[16];
+	cpu_set_t cpus;
+	int cpu;
+
+	pthread_mutex_lock(&ioctx->mtx);
 
-	if (ioctx.started) {
-		pthread_mutex_unlock(&ioctx.mtx);
+	if (ioctx->started) {
+		pthread_mutex_unlock(&ioctx->mtx);
 		return 0;
 	}
 
-	if (pthread_create(&ioctx.tid, NULL, io_thread, NULL) != 0) {
-		pthread_mutex_unlock(&ioctx.mtx);
+	ioctx->started = true;
+	if (pthread_create(&ioctx->tid, NULL, io_thread, ioctx) != 0) {
+		ioctx->started = false;
+		pthread_mutex_unlock(&ioctx->mtx);
 		pr_err("%s", "iothread create failed\r\n");
 		return -1;
 	}
-	ioctx.started = true;
-	pthread_setname_np(ioctx.tid, "iothread");
-	pthread_mutex_unlock(&ioctx.mtx);
-	pr_info("iothread started\n");
+	snprintf(name, sizeof(name), "iothread%d", ioctx->idx);
+	pthread_setname_np(ioctx->tid, name);
+
+	if (iothread_nr_cpus > 0) {
+		cpu = iothread_cpus[ioctx->idx % iothread_nr_cpus];
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		if (pthread_setaffinity_np(ioctx->tid, sizeof(cpus), &cpus))
+			pr_err("%s: failed to pin iothread %d to cpu %d\n", __func__, ioctx->idx, cpu);
+	}
+	pthread_mutex_unlock(&ioctx->mtx);
+	pr_info("%s started\n", name);
 	return 0;
 }
 
+static void
+iothread_add_poller(struct iothread_ctx *ioctx, struct iothread_mevent *aevt)
+{
+	pthread_mutex_lock(&ioctx->mtx);
+	if (ioctx->npollers < MEVENT_MAX)
+		ioctx->pollers[ioctx->npollers++] = aevt;
+	pthread_mutex_unlock(&ioctx->mtx);
+}
+
+static void
+iothread_del_poller(struct iothread_ctx *ioctx, struct iothread_mevent *aevt)
+{
+	int i;
+
+	pthread_mutex_lock(&ioctx->mtx);
+	for (i = 0; i < ioctx->npollers; i++) {
+		if (ioctx->pollers[i] == aevt) {
+			ioctx->npollers--;
+			ioctx->pollers[i] = ioctx->pollers[ioctx->npollers];
+			break;
+		}
+	}
+	__atomic_add_fetch(&ioctx->pollers_gen, 1, __ATOMIC_RELEASE);
+
+	/* A poller removed from its own callback is not called again either */
+	if (!pthread_equal(pthread_self(), ioctx->tid)) {
+		while (ioctx->polling)
+			pthread_cond_wait(&ioctx->poll_done, &ioctx->mtx);
+	}
+	pthread_mutex_unlock(&ioctx->mtx);
+}
+
+/*
+ * Serve fd on iothread idx, or on the next one in turn if idx is negative.
+ * idx wraps around the number of iothreads.
+ */
 int
-iothread_add(int fd, struct iothread_mevent *aevt)
+iothread_add(int idx, int fd, struct iothread_mevent *aevt)
 {
+	struct iothread_ctx *ioctx;
 	struct epoll_event ee;
 	int ret;
+
+	if (idx < 0)
+		idx = __atomic_fetch_add(&iothread_next, 1, __ATOMIC_RELAXED);
+	ioctx = &ioctxs[idx % iothread_num];
+	aevt->ioctx = ioctx;
+
 	/* Create a epoll instance before the first fd is added.*/
 	ee.events = EPOLLIN;
 	ee.data.ptr = aevt;
-	ret = epoll_ctl(ioctx.epfd, EPOLL_CTL_ADD, fd, &ee);
+	ret = epoll_ctl(ioctx->epfd, EPOLL_CTL_ADD, fd, &ee);
 	if (ret < 0) {
 		pr_err("%s: failed to add fd, error is %d\n",
 			__func__, errno);
 		return ret;
 	}
 
+	if (aevt->poll)
+		iothread_add_poller(ioctx, aevt);
+
 	/* Start the iothread after the first fd is added.*/
-	ret = iothread_start();
+	ret = iothread_start(ioctx);
 	if (ret < 0) {
 		pr_err("%s: failed to start iothread thread\n",
 			__func__);
@@ -109,12 +270,15 @@ iothread_add(int fd, struct iothread_mevent *aevt)
 }
 
 int
-iothread_del(int fd)
+iothread_del(int fd, struct iothread_mevent *aevt)
 {
+	struct iothread_ctx *ioctx = aevt->ioctx;
 	int ret = 0;
 
-	if (ioctx.epfd) {
-		ret = epoll_ctl(ioctx.epfd, EPOLL_CTL_DEL, fd, NULL);
+	if (ioctx && ioctx->epfd > 0) {
+		if (aevt->poll)
+			iothread_del_poller(ioctx, aevt);
+		ret = epoll_ctl(ioctx->epfd, EPOLL_CTL_DEL, fd, NULL);
 		if (ret < 0)
 			pr_err("%s: failed to delete fd from epoll fd, error is %d\n",
 				__func__, errno);
@@ -122,44 +286,116 @@ iothread_del(int fd)
 	return ret;
 }
 
+/*
+ * --iothreads <num>[:<cpu_list>]
+ */
+int
+iothread_parse_options(char *opt)
+{
+	char *cp, *cp_opt, *str;
+	int num, cpu;
+
+	cp_opt = cp = strdup(opt);
+	if (!cp) {
+		pr_err("%s: strdup returns NULL\n", __func__);
+		return -1;
+	}
+
+	str = strsep(&cp, ":");
+	if (dm_strtoi(str, NULL, 10, &num) || num < 1 || num > IOTHREAD_MAX)
+		goto err;
+
+	iothread_nr_cpus = 0;
+	while (cp && *cp != '\0') {
+		str = strsep(&cp, ",");
+		if (dm_strtoi(str, NULL, 10, &cpu) || cpu < 0 || cpu >= CPU_SETSIZE ||
+				iothread_nr_cpus >= IOTHREAD_MAX)
+			goto err;
+		iothread_cpus[iothread_nr_cpus++] = cpu;
+	}
+
+	iothread_num = num;
+	free(cp_opt);
+	return 0;
+
+err:
+	free(cp_opt);
+	return -1;
+}
+
+/*
+ * --iothread_poll <max_us>
+ */
+int
+iothread_parse_poll(char *opt)
+{
+	int us;
+
+	if (dm_strtoi(opt, NULL, 10, &us) || us < 0)
+		return -1;
+
+	iothread_poll_max_ns = (uint64_t)us * 1000UL;
+	return 0;
+}
+
 void
 iothread_deinit(void)
 {
+	struct iothread_ctx *ioctx;
 	void *jval;
+	int i;
 
-	if (ioctx.tid > 0) {
-		pthread_mutex_lock(&ioctx.mtx);
-		ioctx.started = false;
-		pthread_mutex_unlock(&ioctx.mtx);
-		pthread_kill(ioctx.tid, SIGCONT);
-		pthread_join(ioctx.tid, &jval);
-	}
-	if (ioctx.epfd > 0) {
-		close(ioctx.epfd);
-		ioctx.epfd = -1;
+	for (i = 0; i < iothread_num; i++) {
+		ioctx = &ioctxs[i];
+		if (ioctx->tid > 0) {
+			pthread_mutex_lock(&ioctx->mtx);
+			ioctx->started = false;
+			pthread_mutex_unlock(&ioctx->mtx);
+			pthread_kill(ioctx->tid, SIGCONT);
+			pthread_join(ioctx->tid, &jval);
+			ioctx->tid = 0;
+		}
+		if (ioctx->epfd > 0) {
+			close(ioctx->epfd);
+			ioctx->epfd = -1;
+		}
+		ioctx->npollers = 0;
+		pthread_cond_destroy(&ioctx->poll_done);
+		pthread_mutex_destroy(&ioctx->mtx);
 	}
-	pthread_mutex_destroy(&ioctx.mtx);
 	pr_info("iothread stop\n");
 }
 
 int
 iothread_init(void)
 {
+	struct iothread_ctx *ioctx;
 	pthread_mutexattr_t attr;
+	int i;
 
 	pthread_mutexattr_init(&attr);
 	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&ioctx.mtx, &attr);
-	pthread_mutexattr_destroy(&attr);
 
-	ioctx.tid = 0;
-	ioctx.started = false;
-	ioctx.epfd = epoll_create1(0);
+	for (i = 0; i < iothread_num; i++) {
+		ioctx = &ioctxs[i];
+		pthread_mutex_init(&ioctx->mtx, &attr);
+		pthread_cond_init(&ioctx->poll_done, NULL);
+		ioctx->tid = 0;
+		ioctx->started = false;
+		ioctx->idx = i;
+		ioctx->npollers = 0;
+		ioctx->pollers_gen = 0;
+		ioctx->polling = false;
+		ioctx->poll_ns = IOTHREAD_POLL_MIN_NS;
+		ioctx->epfd = epoll_create1(0);
 
-	if (ioctx.epfd < 0) {
-		pr_err("%s: failed to create epoll fd, error is %d\r\n",
-			__func__, errno);
-		return -1;
+		if (ioctx->epfd < 0) {
+			pr_err("%s: failed to create epoll fd, error is %d\r\n",
+				__func__, errno);
+			pthread_mutexattr_destroy(&attr);
+			return -1;
+		}
 	}
+	pthread_mutexattr_destroy(&attr);
 	return 0;
 }
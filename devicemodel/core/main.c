@@ -37,6 +37,8 @@
 #include <sysexits.h>
 #include <stdbool.h>
 #include <getopt.h>
+#include <signal.h>
+#include <time.h>
 
 #include "vmmapi.h"
 #include "sw_load.h"
@@ -71,11 +73,15 @@
 #include "cmd_monitor.h"
 #include "vdisplay.h"
 #include "iothread.h"
+#include "timer.h"
 
 #define	VM_MAXCPU		16	/* maximum virtual cpus */
 
 #define GUEST_NIO_PORT		0x488	/* guest upcalls via i/o port */
 
+/* How long vm_loop waits for a busy ioreq thread before re-attaching */
+#define IOREQ_REATTACH_WAIT_NS	50000
+
 /* Values returned for reads on invalid I/O requests. */
 #define IOREQ_PIO_INVAL		(~0U)
 #define IOREQ_MMIO_INVAL	(~0UL)
@@ -114,6 +120,7 @@ static const int BSP;
 static cpuset_t cpumask;
 
 static void vm_loop(struct vmctx *ctx);
+static bool handle_vmexit(struct vmctx *ctx, struct acrn_io_request *io_req, int vcpu);
 
 static char io_request_page[4096] __aligned(4096);
 static char asyncio_page[4096] __aligned(4096);
@@ -138,6 +145,36 @@ struct mt_vmm_info {
 	int		mt_vcpu;
 } mt_vmm_info[VM_MAXCPU];
 
+/*
+ * Optional ioreq dispatch threads. vm_loop() still attaches to the ioreq
+ * client, but hands the pending requests over to the worker owning the
+ * vCPU (vcpu_id % ioreq_nthreads) instead of serving them in turn. With
+ * ioreq_nthreads == 0 every request is served by vm_loop() itself.
+ */
+struct ioreq_worker {
+	pthread_t	tid;
+	int		id;
+	struct vmctx	*ctx;
+	pthread_mutex_t	mtx;
+	pthread_cond_t	cond;
+	uint32_t	pending;	/* vCPUs whose request is queued to this worker */
+	bool		stopping;
+} ioreq_workers[VM_MAXCPU];
+
+static int ioreq_nthreads;
+static int ioreq_thread_cpus[VM_MAXCPU];
+static int ioreq_nr_thread_cpus;
+
+/* vCPUs whose request was dispatched and not yet completed */
+static uint32_t ioreq_inflight;
+/* number of dispatched requests the workers have not finished handling */
+static int ioreq_busy;
+static pthread_mutex_t ioreq_done_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ioreq_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* serializes the handlers which are not declared thread-safe */
+static pthread_mutex_t ioreq_serial_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 static struct vmctx *_ctx;
 
 static void
@@ -154,6 +191,9 @@ usage(int code)
 		"       %*s [--vtpm2 sock_path] [--virtio_poll interval]\n"
 		"       %*s [--cpu_affinity lapic_id] [--lapic_pt] [--rtvm] [--windows]\n"
 		"       %*s [--debugexit] [--logger_setting param_setting]\n"
+		"       %*s [--ioreq_threads num[:cpu_list]]\n"
+		"       %*s [--iothreads num[:cpu_list]] [--iothread_poll max_us]\n"
+		"       %*s [--timer_mux]\n"
 		"       %*s [--ssram] <vm>\n"
 		"       -B: bootargs for kernel\n"
 		"       -E: elf image path\n"
@@ -184,12 +224,19 @@ usage(int code)
 		"       --logger_setting: params like console,level=4;kmsg,level=3\n"
 		"       --windows: support Oracle virtio-blk, virtio-net and virtio-input devices\n"
 		"            for windows guest with secure boot\n"
-		"       --virtio_msi: force virtio to use single-vector MSI\n",
+		"       --virtio_msi: force virtio to use single-vector MSI\n"
+		"       --ioreq_threads: serve I/O requests with num threads, the vCPUs are\n"
+		"            distributed among them; cpu_list (e.g. 2,3) pins the threads\n"
+		"       --iothreads: serve ioeventfd kicks with num iothreads; cpu_list pins them\n"
+		"       --iothread_poll: let iothreads poll the virtqueues for up to max_us after a kick\n"
+		"       --timer_mux: serve the device model timers with one timerfd per clock\n",
 		progname, (int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
-		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "");
+		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
+		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
+		(int)strnlen(progname, PATH_MAX), "");
 
 	exit(code);
 }
@@ -304,6 +351,223 @@ notify_vmloop_thread(void)
 }
 #endif
 
+void
+ioreq_serial_lock(void)
+{
+	if (ioreq_nthreads > 0)
+		pthread_mutex_lock(&ioreq_serial_mtx);
+}
+
+void
+ioreq_serial_unlock(void)
+{
+	if (ioreq_nthreads > 0)
+		pthread_mutex_unlock(&ioreq_serial_mtx);
+}
+
+static int
+acrn_parse_ioreq_threads(char *opt)
+{
+	char *cp, *cp_opt, *str;
+	int num, cpu;
+
+	cp_opt = cp = strdup(opt);
+	if (!cp) {
+		pr_err("%s: strdup returns NULL\n", __func__);
+		return -1;
+	}
+
+	str = strsep(&cp, ":");
+	if (dm_strtoi(str, NULL, 10, &num) || num < 1 || num > VM_MAXCPU)
+		goto err;
+
+	ioreq_nr_thread_cpus = 0;
+	while (cp && *cp != '\0') {
+		str = strsep(&cp, ",");
+		if (dm_strtoi(str, NULL, 10, &cpu) || cpu < 0 ||
+				ioreq_nr_thread_cpus >= VM_MAXCPU)
+			goto err;
+		ioreq_thread_cpus[ioreq_nr_thread_cpus++] = cpu;
+	}
+
+	ioreq_nthreads = num;
+	free(cp_opt);
+	return 0;
+
+err:
+	free(cp_opt);
+	return -1;
+}
+
+static void *
+ioreq_worker_thread(void *param)
+{
+	struct ioreq_worker *worker = param;
+	uint32_t pending;
+	int vcpu_id;
+
+	while (1) {
+		pthread_mutex_lock(&worker->mtx);
+		while (!worker->pending && !worker->stopping)
+			pthread_cond_wait(&worker->cond, &worker->mtx);
+		if (worker->stopping) {
+			pthread_mutex_unlock(&worker->mtx);
+			break;
+		}
+		pending = worker->pending;
+		worker->pending = 0;
+		pthread_mutex_unlock(&worker->mtx);
+
+		while (pending) {
+			vcpu_id = __builtin_ctz(pending);
+			pending &= ~(1U << vcpu_id);
+
+			/*
+			 * A request left un-notified for a suspend or reset
+			 * stays in flight so that vm_loop does not dispatch it
+			 * again; vm_clear_ioreq() takes care of it.
+			 */
+			if (handle_vmexit(worker->ctx, &ioreq_buf[vcpu_id], vcpu_id))
+				atomic_and_fetch(&ioreq_inflight, ~(1U << vcpu_id));
+
+			pthread_mutex_lock(&ioreq_done_mtx);
+			ioreq_busy--;
+			pthread_cond_broadcast(&ioreq_done_cond);
+			pthread_mutex_unlock(&ioreq_done_mtx);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+ioreq_workers_start(struct vmctx *ctx)
+{
+	char tname[MAXCOMLEN + 1];
+	struct ioreq_worker *worker;
+	cpu_set_t cpus;
+	int i, nthreads;
+
+	nthreads = ioreq_nthreads;
+	if (nthreads > guest_ncpus)
+		nthreads = guest_ncpus;
+
+	ioreq_inflight = 0;
+	ioreq_busy = 0;
+	for (i = 0; i < nthreads; i++) {
+		worker = &ioreq_workers[i];
+		worker->id = i;
+		worker->ctx = ctx;
+		worker->pending = 0;
+		worker->stopping = false;
+		pthread_mutex_init(&worker->mtx, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+
+		if (pthread_create(&worker->tid, NULL, ioreq_worker_thread, worker) != 0) {
+			pr_err("%s: failed to create ioreq thread %d, use %d thread(s)\n",
+					__func__, i, i);
+			pthread_mutex_destroy(&worker->mtx);
+			pthread_cond_destroy(&worker->cond);
+			break;
+		}
+
+		snprintf(tname, sizeof(tname), "ioreq %d", i);
+		pthread_setname_np(worker->tid, tname);
+
+		if (ioreq_nr_thread_cpus > 0) {
+			CPU_ZERO(&cpus);
+			CPU_SET(ioreq_thread_cpus[i % ioreq_nr_thread_cpus], &cpus);
+			if (pthread_setaffinity_np(worker->tid, sizeof(cpus), &cpus))
+				pr_err("%s: failed to pin ioreq thread %d to cpu %d\n", __func__,
+						i, ioreq_thread_cpus[i % ioreq_nr_thread_cpus]);
+		}
+	}
+
+	/* Fall back to serving the requests in vm_loop if no thread is up */
+	ioreq_nthreads = i;
+	pr_info("%s: %d ioreq thread(s) started\n", __func__, i);
+}
+
+static void
+ioreq_workers_stop(void)
+{
+	struct ioreq_worker *worker;
+	int i;
+
+	for (i = 0; i < ioreq_nthreads; i++) {
+		worker = &ioreq_workers[i];
+		pthread_mutex_lock(&worker->mtx);
+		worker->stopping = true;
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->mtx);
+		pthread_join(worker->tid, NULL);
+		pthread_mutex_destroy(&worker->mtx);
+		pthread_cond_destroy(&worker->cond);
+	}
+}
+
+/*
+ * Queue the request of vcpu_id to its worker unless it is being served.
+ *
+ * @return true if the request is newly dispatched.
+ */
+static bool
+ioreq_dispatch(int vcpu_id)
+{
+	struct ioreq_worker *worker;
+
+	if (atomic_fetch_or(&ioreq_inflight, 1U << vcpu_id) & (1U << vcpu_id))
+		return false;
+
+	pthread_mutex_lock(&ioreq_done_mtx);
+	ioreq_busy++;
+	pthread_mutex_unlock(&ioreq_done_mtx);
+
+	worker = &ioreq_workers[vcpu_id % ioreq_nthreads];
+	pthread_mutex_lock(&worker->mtx);
+	worker->pending |= 1U << vcpu_id;
+	pthread_cond_signal(&worker->cond);
+	pthread_mutex_unlock(&worker->mtx);
+
+	return true;
+}
+
+/*
+ * The HSM keeps waking up the ioreq client as long as a request is not
+ * completed, so vm_loop waits a bit for the workers instead of spinning
+ * on requests which are already being served.
+ */
+static void
+ioreq_wait_completion(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += IOREQ_REATTACH_WAIT_NS;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&ioreq_done_mtx);
+	if (ioreq_busy > 0)
+		pthread_cond_timedwait(&ioreq_done_cond, &ioreq_done_mtx, &ts);
+	pthread_mutex_unlock(&ioreq_done_mtx);
+}
+
+/* Wait until the workers are done with every dispatched request */
+static void
+ioreq_workers_drain(void)
+{
+	if (ioreq_nthreads == 0)
+		return;
+
+	pthread_mutex_lock(&ioreq_done_mtx);
+	while (ioreq_busy > 0)
+		pthread_cond_wait(&ioreq_done_cond, &ioreq_done_mtx);
+	pthread_mutex_unlock(&ioreq_done_mtx);
+}
+
 static void
 vmexit_inout(struct vmctx *ctx, struct acrn_io_request *io_req, int *pvcpu)
 {
@@ -332,7 +596,7 @@ vmexit_mmio_emul(struct vmctx *ctx, struct acrn_io_request *io_req, int *pvcpu)
 {
 	int err;
 
-	stats.vmexit_mmio_emul++;
+	atomic_add_fetch(&stats.vmexit_mmio_emul, 1);
 	err = emulate_mem(ctx, &io_req->reqs.mmio_request);
 
 	if (err) {
@@ -356,6 +620,8 @@ vmexit_pci_emul(struct vmctx *ctx, struct acrn_io_request *io_req, int *pvcpu)
 {
 	int err, in = (io_req->reqs.pci_request.direction == ACRN_IOREQ_DIR_READ);
 
+	/* PCI config space accesses are always serialized */
+	ioreq_serial_lock();
 	err = emulate_pci_cfgrw(ctx, *pvcpu, in,
 			io_req->reqs.pci_request.bus,
 			io_req->reqs.pci_request.dev,
@@ -363,6 +629,7 @@ vmexit_pci_emul(struct vmctx *ctx, struct acrn_io_request *io_req, int *pvcpu)
 			io_req->reqs.pci_request.reg,
 			io_req->reqs.pci_request.size,
 			&io_req->reqs.pci_request.value);
+	ioreq_serial_unlock();
 	if (err) {
 		pr_err("Unhandled pci cfg rw at %x:%x.%x reg 0x%x\n",
 			io_req->reqs.pci_request.bus,
@@ -399,7 +666,10 @@ static vmexit_handler_t handler[VM_EXITCODE_MAX] = {
 	[VM_EXITCODE_PCI_CFG] = vmexit_pci_emul,
 };
 
-static void
+/*
+ * @return true if the completion of the request is notified.
+ */
+static bool
 handle_vmexit(struct vmctx *ctx, struct acrn_io_request *io_req, int vcpu)
 {
 	enum vm_exitcode exitcode;
@@ -422,9 +692,10 @@ handle_vmexit(struct vmctx *ctx, struct acrn_io_request *io_req, int vcpu)
 	 */
 	if ((VM_SUSPEND_SYSTEM_RESET == vm_get_suspend_mode()) ||
 		(VM_SUSPEND_SUSPEND == vm_get_suspend_mode()))
-		return;
+		return false;
 
 	vm_notify_request_done(ctx, vcpu);
+	return true;
 }
 
 static int
@@ -642,6 +913,7 @@ vm_system_reset(struct vmctx *ctx)
 	 */
 
 	vm_pause(ctx);
+	ioreq_workers_drain();
 
 	/*
 	 * After vm_pause, there should be no new coming ioreq.
@@ -659,6 +931,7 @@ vm_system_reset(struct vmctx *ctx)
 	 * reset in hypervisor reset all ioreqs.
 	 */
 	vm_clear_ioreq(ctx);
+	ioreq_inflight = 0;
 
 	vm_reset_vdevs(ctx);
 	vm_reset(ctx);
@@ -685,8 +958,10 @@ vm_suspend_resume(struct vmctx *ctx)
 	 *   6. hypercall restart vm
 	 */
 	vm_pause(ctx);
+	ioreq_workers_drain();
 
 	vm_clear_ioreq(ctx);
+	ioreq_inflight = 0;
 	vm_stop_watchdog(ctx);
 	wait_for_resume(ctx);
 
@@ -710,13 +985,18 @@ vm_loop(struct vmctx *ctx)
 		return;
 	}
 
+	if (ioreq_nthreads > 0)
+		ioreq_workers_start(ctx);
+
 	if (vm_run(ctx) != 0) {
 		pr_err("%s, failed to run VM.\n", __func__);
+		ioreq_workers_stop();
 		return;
 	}
 
 	while (1) {
 		int vcpu_id;
+		bool dispatched = false;
 		struct acrn_io_request *io_req;
 
 		error = vm_attach_ioreq_client(ctx);
@@ -726,10 +1006,17 @@ vm_loop(struct vmctx *ctx)
 		for (vcpu_id = 0; vcpu_id < guest_ncpus; vcpu_id++) {
 			io_req = &ioreq_buf[vcpu_id];
 			if ((atomic_load(&io_req->processed) == ACRN_IOREQ_STATE_PROCESSING)
-				&& !io_req->kernel_handled)
-				handle_vmexit(ctx, io_req, vcpu_id);
+				&& !io_req->kernel_handled) {
+				if (ioreq_nthreads > 0)
+					dispatched |= ioreq_dispatch(vcpu_id);
+				else
+					handle_vmexit(ctx, io_req, vcpu_id);
+			}
 		}
 
+		if ((ioreq_nthreads > 0) && !dispatched)
+			ioreq_wait_completion();
+
 		if (VM_SUSPEND_FULL_RESET == vm_get_suspend_mode() ||
 		    VM_SUSPEND_POWEROFF == vm_get_suspend_mode()) {
 			break;
@@ -744,6 +1031,7 @@ vm_loop(struct vmctx *ctx)
 			vm_suspend_resume(ctx);
 		}
 	}
+	ioreq_workers_stop();
 	pr_err("VM loop exit\n");
 }
 
@@ -790,6 +1078,10 @@ enum {
 	CMD_OPT_PM_BY_VUART,
 	CMD_OPT_WINDOWS,
 	CMD_OPT_FORCE_VIRTIO_MSI,
+	CMD_OPT_IOREQ_THREADS,
+	CMD_OPT_IOTHREADS,
+	CMD_OPT_IOTHREAD_POLL,
+	CMD_OPT_TIMER_MUX,
 };
 
 static struct option long_options[] = {
@@ -833,6 +1125,10 @@ static struct option long_options[] = {
 	{"pm_by_vuart",	required_argument,	0, CMD_OPT_PM_BY_VUART},
 	{"windows",		no_argument,		0, CMD_OPT_WINDOWS},
 	{"virtio_msi",		no_argument,		0, CMD_OPT_FORCE_VIRTIO_MSI},
+	{"ioreq_threads",	required_argument,	0, CMD_OPT_IOREQ_THREADS},
+	{"iothreads",		required_argument,	0, CMD_OPT_IOTHREADS},
+	{"iothread_poll",	required_argument,	0, CMD_OPT_IOTHREAD_POLL},
+	{"timer_mux",		no_argument,		0, CMD_OPT_TIMER_MUX},
 	{0,			0,			0,  0  },
 };
 
@@ -1043,6 +1339,21 @@ main(int argc, char *argv[])
 		case CMD_OPT_FORCE_VIRTIO_MSI:
 			virtio_msix = 0;
 			break;
+		case CMD_OPT_IOREQ_THREADS:
+			if (acrn_parse_ioreq_threads(optarg) != 0)
+				errx(EX_USAGE, "invalid ioreq threads param %s", optarg);
+			break;
+		case CMD_OPT_IOTHREADS:
+			if (iothread_parse_options(optarg) != 0)
+				errx(EX_USAGE, "invalid iothreads param %s", optarg);
+			break;
+		case CMD_OPT_IOTHREAD_POLL:
+			if (iothread_parse_poll(optarg) != 0)
+				errx(EX_USAGE, "invalid iothread poll param %s", optarg);
+			break;
+		case CMD_OPT_TIMER_MUX:
+			acrn_timer_set_mux(true);
+			break;
 		case 'h':
 			usage(0);
 		default:
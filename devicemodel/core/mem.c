@@ -38,6 +38,7 @@
 #include <string.h>
 #include <pthread.h>
 
+#include "dm.h"
 #include "mem.h"
 #include "tree.h"
 
@@ -48,6 +49,7 @@ struct mmio_rb_range {
 	struct mem_range	mr_param;
 	uint64_t                mr_base;
 	uint64_t                mr_end;
+	int                     mr_refcnt;	/* the tree's and the running handlers' */
 };
 
 static RB_HEAD(mmio_rb_tree, mmio_rb_range) mmio_rb_root, mmio_rb_fallback;
@@ -127,6 +129,19 @@ mmio_rb_dump(struct mmio_rb_tree *rbt)
 
 RB_GENERATE_STATIC(mmio_rb_tree, mmio_rb_range, mr_link, mmio_rb_range_compare);
 
+/*
+ * A handler runs without mmio_rwlock, since it may register or unregister
+ * ranges itself (a BAR write through ECFG, for example). The entry it was
+ * found in is kept alive by a reference until it returns, even if another
+ * ioreq thread unregisters the range meanwhile.
+ */
+static void
+mmio_rb_range_put(struct mmio_rb_range *entry)
+{
+	if (__atomic_sub_fetch(&entry->mr_refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		free(entry);
+}
+
 static int
 mem_read(void *ctx, int vcpu, uint64_t gpa, uint64_t *rval, int size, void *arg)
 {
@@ -155,37 +170,49 @@ emulate_mem(struct vmctx *ctx, struct acrn_mmio_request *mmio_req)
 	uint64_t paddr = mmio_req->address;
 	int size = mmio_req->size;
 	struct mmio_rb_range *hint, *entry = NULL;
+	bool mt_safe;
 	int err;
 
 	pthread_rwlock_rdlock(&mmio_rwlock);
 
 	/*
-	 * First check the per-VM cache
+	 * First check the per-VM cache. Several ioreq threads may update it
+	 * under the read lock, unregister_mem_int() clears it under the write
+	 * lock.
 	 */
-	hint = mmio_hint;
+	hint = __atomic_load_n(&mmio_hint, __ATOMIC_RELAXED);
 
 	if (hint && paddr >= hint->mr_base && paddr <= hint->mr_end)
 		entry = hint;
 	else if (mmio_rb_lookup(&mmio_rb_root, paddr, &entry) == 0)
 		/* Update the per-VM cache */
-		mmio_hint = entry;
+		__atomic_store_n(&mmio_hint, entry, __ATOMIC_RELAXED);
 	else if (mmio_rb_lookup(&mmio_rb_fallback, paddr, &entry)) {
 		pthread_rwlock_unlock(&mmio_rwlock);
 		return -ESRCH;
 	}
 
+	if (entry != NULL)
+		__atomic_add_fetch(&entry->mr_refcnt, 1, __ATOMIC_RELAXED);
+
 	pthread_rwlock_unlock(&mmio_rwlock);
 
 	if (entry == NULL)
 		return -EINVAL;
 
+	mt_safe = (entry->mr_param.flags & MEM_F_MT_SAFE) != 0;
+	if (!mt_safe)
+		ioreq_serial_lock();
 	if (mmio_req->direction == ACRN_IOREQ_DIR_READ)
 		err = mem_read(ctx, 0, paddr, (uint64_t *)&mmio_req->value,
 				size, &entry->mr_param);
 	else
 		err = mem_write(ctx, 0, paddr, mmio_req->value,
 				size, &entry->mr_param);
+	if (!mt_safe)
+		ioreq_serial_unlock();
 
+	mmio_rb_range_put(entry);
 	return err;
 }
 
@@ -203,6 +230,7 @@ register_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 		mrp->mr_param = *memp;
 		mrp->mr_base = memp->base;
 		mrp->mr_end = memp->base + memp->size - 1;
+		mrp->mr_refcnt = 1;
 		pthread_rwlock_wrlock(&mmio_rwlock);
 		if (mmio_rb_lookup(rbt, memp->base, &entry) != 0)
 			err = mmio_rb_add(rbt, mrp);
@@ -247,12 +275,14 @@ unregister_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 			/* flush Per-VM cache */
 			if (mmio_hint == entry)
 				mmio_hint = NULL;
-
-			free(entry);
 		}
 	}
 	pthread_rwlock_unlock(&mmio_rwlock);
 
+	/* freed now, or when the last handler running on it returns */
+	if (err == 0)
+		mmio_rb_range_put(entry);
+
 	return err;
 }
 
@@ -5,8 +5,11 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/timerfd.h>
 
 #include "vmmapi.h"
@@ -22,7 +25,326 @@
  * Please note timerfd and epoll are all Linux specific. If the code need to be
  * ported to other OS, we can modify the api with POSIX timers and sigevent
  * mechanism.
+ *
+ * With acrn_timer_set_mux(), the timers share one timerfd per clock
+ * instead: the armed timers are kept in a min-heap ordered by expiration,
+ * the timerfd is set to the earliest one, and all the timers due when it
+ * fires are handled in one go.
+ */
+
+/* The expiration callbacks collected per lock hold */
+#define TIMER_MUX_BATCH		32
+
+struct timer_mux {
+	int32_t fd;
+	clockid_t clockid;
+	struct mevent *mevp;
+	pthread_mutex_t mtx;
+
+	/* armed timers, heap[0] expires first */
+	struct acrn_timer **heap;
+	int32_t nr;
+	int32_t size;
+	uint64_t armed_ns;	/* expiration the timerfd is set to, 0 if disarmed */
+};
+
+static bool timer_mux_enabled;
+static pthread_mutex_t timer_mux_init_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct timer_mux timer_muxes[] = {
+	{ .fd = -1, .clockid = CLOCK_REALTIME, .mtx = PTHREAD_MUTEX_INITIALIZER },
+	{ .fd = -1, .clockid = CLOCK_MONOTONIC, .mtx = PTHREAD_MUTEX_INITIALIZER },
+};
+
+static inline uint64_t
+ts_to_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+}
+
+static inline void
+ns_to_ts(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / NS_PER_SEC;
+	ts->tv_nsec = ns % NS_PER_SEC;
+}
+
+static uint64_t
+timer_mux_now(struct timer_mux *mux)
+{
+	struct timespec now;
+
+	clock_gettime(mux->clockid, &now);
+	return ts_to_ns(&now);
+}
+
+static void
+timer_heap_swap(struct timer_mux *mux, int32_t i, int32_t j)
+{
+	struct acrn_timer *timer = mux->heap[i];
+
+	mux->heap[i] = mux->heap[j];
+	mux->heap[j] = timer;
+	mux->heap[i]->heap_idx = i;
+	mux->heap[j]->heap_idx = j;
+}
+
+static void
+timer_heap_up(struct timer_mux *mux, int32_t i)
+{
+	int32_t parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (mux->heap[parent]->expire_ns <= mux->heap[i]->expire_ns)
+			break;
+		timer_heap_swap(mux, i, parent);
+		i = parent;
+	}
+}
+
+static void
+timer_heap_down(struct timer_mux *mux, int32_t i)
+{
+	int32_t child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= mux->nr)
+			break;
+		if ((child + 1 < mux->nr) &&
+				(mux->heap[child + 1]->expire_ns < mux->heap[child]->expire_ns))
+			child++;
+		if (mux->heap[i]->expire_ns <= mux->heap[child]->expire_ns)
+			break;
+		timer_heap_swap(mux, i, child);
+		i = child;
+	}
+}
+
+/*
+ * Put the timer at its place in the heap after its expiration was set.
+ *
+ * Called with mux->mtx held.
  */
+static int32_t
+timer_mux_queue(struct timer_mux *mux, struct acrn_timer *timer)
+{
+	struct acrn_timer **heap;
+	int32_t size;
+
+	if (timer->heap_idx >= 0) {
+		timer_heap_up(mux, timer->heap_idx);
+		timer_heap_down(mux, timer->heap_idx);
+		return 0;
+	}
+
+	if (mux->nr == mux->size) {
+		size = (mux->size > 0) ? (mux->size * 2) : 16;
+		heap = realloc(mux->heap, size * sizeof(*heap));
+		if (heap == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		mux->heap = heap;
+		mux->size = size;
+	}
+
+	timer->heap_idx = mux->nr;
+	mux->heap[mux->nr++] = timer;
+	timer_heap_up(mux, timer->heap_idx);
+	return 0;
+}
+
+/*
+ * Called with mux->mtx held.
+ */
+static void
+timer_mux_dequeue(struct timer_mux *mux, struct acrn_timer *timer)
+{
+	int32_t i = timer->heap_idx;
+
+	if (i < 0)
+		return;
+
+	mux->nr--;
+	if (i != mux->nr) {
+		mux->heap[i] = mux->heap[mux->nr];
+		mux->heap[i]->heap_idx = i;
+		timer_heap_down(mux, i);
+		timer_heap_up(mux, mux->heap[i]->heap_idx);
+	}
+	timer->heap_idx = -1;
+}
+
+/*
+ * Consume the expirations of a timer that is due, like reading its
+ * timerfd would: a periodic timer moves to its next period, a one-shot
+ * timer is disarmed.
+ *
+ * Called with mux->mtx held.
+ */
+static uint64_t
+timer_mux_expire(struct timer_mux *mux, struct acrn_timer *timer, uint64_t now)
+{
+	uint64_t nexp = 1;
+
+	if (timer->interval_ns != 0) {
+		nexp += (now - timer->expire_ns) / timer->interval_ns;
+		timer->expire_ns += nexp * timer->interval_ns;
+		timer_heap_down(mux, timer->heap_idx);
+	} else {
+		timer_mux_dequeue(mux, timer);
+	}
+	return nexp;
+}
+
+/*
+ * Set the timerfd to the earliest expiration.
+ *
+ * Called with mux->mtx held.
+ */
+static void
+timer_mux_program(struct timer_mux *mux)
+{
+	struct itimerspec its = { 0 };
+	uint64_t next;
+
+	next = (mux->nr > 0) ? mux->heap[0]->expire_ns : 0;
+	if (next == mux->armed_ns)
+		return;
+
+	ns_to_ts(next, &its.it_value);
+	if (timerfd_settime(mux->fd, TFD_TIMER_ABSTIME, &its, NULL) == 0)
+		mux->armed_ns = next;
+	else
+		pr_err("acrn_timer mux settime error %d\n", errno);
+}
+
+static void
+timer_mux_handler(int fd __attribute__((unused)),
+		  enum ev_type t __attribute__((unused)),
+		  void *arg)
+{
+	struct timer_mux *mux = arg;
+	struct {
+		struct acrn_timer *timer;
+		uint32_t gen;
+		uint64_t nexp;
+	} batch[TIMER_MUX_BATCH];
+	struct acrn_timer *timer;
+	void (*cb)(void *, uint64_t);
+	void *param;
+	uint64_t nexp, now;
+	ssize_t size;
+	int32_t i, n;
+
+	/* Consume the event, the heap tells which timers are due */
+	size = read(mux->fd, &nexp, sizeof(nexp));
+	if (size < 0 && errno != EAGAIN)
+		pr_err("acrn_timer read timerfd error");
+
+	/*
+	 * The callbacks run without the lock, they may set their timer again
+	 * or any other one. A timer that was set or deinitialized after it was
+	 * collected is skipped, like a timerfd drops its pending expirations
+	 * on settime.
+	 */
+	do {
+		n = 0;
+		pthread_mutex_lock(&mux->mtx);
+		/* the timerfd is one-shot, it's disarmed now */
+		mux->armed_ns = 0;
+		now = timer_mux_now(mux);
+		while ((mux->nr > 0) && (n < TIMER_MUX_BATCH)) {
+			timer = mux->heap[0];
+			if (timer->expire_ns > now)
+				break;
+			batch[n].timer = timer;
+			batch[n].gen = timer->gen;
+			batch[n].nexp = timer_mux_expire(mux, timer, now);
+			n++;
+		}
+		timer_mux_program(mux);
+		pthread_mutex_unlock(&mux->mtx);
+
+		for (i = 0; i < n; i++) {
+			timer = batch[i].timer;
+			pthread_mutex_lock(&mux->mtx);
+			cb = (timer->gen == batch[i].gen) ? timer->callback : NULL;
+			param = timer->callback_param;
+			pthread_mutex_unlock(&mux->mtx);
+			if (cb != NULL)
+				(*cb)(param, batch[i].nexp);
+		}
+	} while (n == TIMER_MUX_BATCH);
+}
+
+static struct timer_mux *
+timer_mux_get(int32_t clockid)
+{
+	struct timer_mux *mux;
+	int32_t fd;
+
+	mux = &timer_muxes[(clockid == CLOCK_MONOTONIC) ? 1 : 0];
+
+	pthread_mutex_lock(&timer_mux_init_mtx);
+	if (mux->fd < 0) {
+		fd = timerfd_create(clockid, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (fd >= 0) {
+			mux->mevp = mevent_add(fd, EVF_READ, timer_mux_handler, mux, NULL, NULL);
+			if (mux->mevp != NULL)
+				mux->fd = fd;
+			else
+				close(fd);
+		}
+	}
+	pthread_mutex_unlock(&timer_mux_init_mtx);
+
+	return (mux->fd >= 0) ? mux : NULL;
+}
+
+static int32_t
+timer_mux_settime(struct acrn_timer *timer, const struct itimerspec *new_value,
+		bool abs)
+{
+	struct timer_mux *mux = timer->mux;
+	uint64_t value;
+	int32_t ret = 0;
+
+	if ((new_value->it_value.tv_nsec < 0) ||
+			(new_value->it_value.tv_nsec >= (long)NS_PER_SEC) ||
+			(new_value->it_interval.tv_nsec < 0) ||
+			(new_value->it_interval.tv_nsec >= (long)NS_PER_SEC)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	value = ts_to_ns(&new_value->it_value);
+
+	pthread_mutex_lock(&mux->mtx);
+	timer->gen++;
+	if (value == 0) {
+		timer_mux_dequeue(mux, timer);
+	} else {
+		timer->expire_ns = abs ? value : (timer_mux_now(mux) + value);
+		timer->interval_ns = ts_to_ns(&new_value->it_interval);
+		ret = timer_mux_queue(mux, timer);
+	}
+	timer_mux_program(mux);
+	pthread_mutex_unlock(&mux->mtx);
+
+	return ret;
+}
+
+/*
+ * Serve the acrn_timers initialized from now on with one timerfd per clock,
+ * see --timer_mux.
+ */
+void
+acrn_timer_set_mux(bool enable)
+{
+	timer_mux_enabled = enable;
+}
 
 static void
 timer_handler(int fd __attribute__((unused)),
@@ -69,14 +391,29 @@ acrn_timer_init(struct acrn_timer *timer, void (*cb)(void *, uint64_t),
 	}
 
 	timer->fd = -1;
-	if ((timer->clockid == CLOCK_REALTIME) ||
-			(timer->clockid == CLOCK_MONOTONIC)) {
-		timer->fd = timerfd_create(timer->clockid,
-					TFD_NONBLOCK | TFD_CLOEXEC);
-	} else {
+	timer->mevp = NULL;
+	timer->mux = NULL;
+	timer->heap_idx = -1;
+	timer->gen = 0;
+	if ((timer->clockid != CLOCK_REALTIME) &&
+			(timer->clockid != CLOCK_MONOTONIC)) {
 		pr_err("acrn_timer clockid is not supported.\n");
+		return -1;
+	}
+
+	if (timer_mux_enabled) {
+		timer->mux = timer_mux_get(timer->clockid);
+		if (timer->mux == NULL) {
+			pr_err("acrn_timer mux create failed.\n");
+			return -1;
+		}
+		timer->callback = cb;
+		timer->callback_param = param;
+		return 0;
 	}
 
+	timer->fd = timerfd_create(timer->clockid, TFD_NONBLOCK | TFD_CLOEXEC);
+
 	if (timer->fd <= 0) {
 		pr_err("acrn_timer create failed.\n");
 		return -1;
@@ -102,6 +439,17 @@ acrn_timer_deinit(struct acrn_timer *timer)
 		return;
 	}
 
+	if (timer->mux != NULL) {
+		pthread_mutex_lock(&timer->mux->mtx);
+		timer->gen++;
+		timer_mux_dequeue(timer->mux, timer);
+		timer_mux_program(timer->mux);
+		timer->callback = NULL;
+		timer->callback_param = NULL;
+		pthread_mutex_unlock(&timer->mux->mtx);
+		timer->mux = NULL;
+	}
+
 	if (timer->mevp != NULL) {
 		mevent_delete_close(timer->mevp);
 		timer->mevp = NULL;
@@ -120,6 +468,9 @@ acrn_timer_settime(struct acrn_timer *timer, const struct itimerspec *new_value)
 		return -1;
 	}
 
+	if (timer->mux != NULL)
+		return timer_mux_settime(timer, new_value, false);
+
 	return timerfd_settime(timer->fd, 0, new_value, NULL);
 }
 
@@ -132,16 +483,65 @@ acrn_timer_settime_abs(struct acrn_timer *timer,
 		return -1;
 	}
 
+	if (timer->mux != NULL)
+		return timer_mux_settime(timer, new_value, true);
+
 	return timerfd_settime(timer->fd, TFD_TIMER_ABSTIME, new_value, NULL);
 }
 
 int32_t
 acrn_timer_gettime(struct acrn_timer *timer, struct itimerspec *cur_value)
 {
+	uint64_t now;
+
 	if (timer == NULL) {
 		errno = EINVAL;
 		return -1;
 	}
 
+	if (timer->mux != NULL) {
+		pthread_mutex_lock(&timer->mux->mtx);
+		if (timer->heap_idx < 0) {
+			memset(cur_value, 0, sizeof(*cur_value));
+		} else {
+			now = timer_mux_now(timer->mux);
+			/* due but not handled yet, report it as about to expire */
+			ns_to_ts((timer->expire_ns > now) ? (timer->expire_ns - now) : 1,
+					&cur_value->it_value);
+			ns_to_ts(timer->interval_ns, &cur_value->it_interval);
+		}
+		pthread_mutex_unlock(&timer->mux->mtx);
+		return 0;
+	}
+
 	return timerfd_gettime(timer->fd, cur_value);
 }
+
+/*
+ * Consume the expirations of the timer that are due but that its callback
+ * has not been called for yet.
+ *
+ * @return the number of expirations consumed
+ */
+uint64_t
+acrn_timer_pending(struct acrn_timer *timer)
+{
+	uint64_t nexp = 0, now;
+
+	if (timer == NULL)
+		return 0;
+
+	if (timer->mux != NULL) {
+		pthread_mutex_lock(&timer->mux->mtx);
+		now = timer_mux_now(timer->mux);
+		if ((timer->heap_idx >= 0) && (timer->expire_ns <= now)) {
+			nexp = timer_mux_expire(timer->mux, timer, now);
+			timer_mux_program(timer->mux);
+		}
+		pthread_mutex_unlock(&timer->mux->mtx);
+	} else if (read(timer->fd, &nexp, sizeof(nexp)) <= 0) {
+		nexp = 0;
+	}
+
+	return nexp;
+}
@@ -368,6 +368,69 @@ vm_map_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
 	return error;
 }
 
+static int
+vm_dirty_log_cmd(struct vmctx *ctx, uint32_t cmd, uint32_t flags,
+	vm_paddr_t gpa, size_t len, uint64_t *bitmap)
+{
+	struct acrn_dirty_log log;
+	int error;
+
+	bzero(&log, sizeof(struct acrn_dirty_log));
+	log.cmd = cmd;
+	log.flags = flags;
+	log.gpa = gpa;
+	log.size = len;
+	log.bitmap = (uint64_t)bitmap;
+	error = ioctl(ctx->fd, ACRN_IOCTL_DIRTY_LOG, &log);
+	if (error) {
+		pr_err("ACRN_IOCTL_DIRTY_LOG ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+/*
+ * Start tracking the writes to guest RAM, lowmem and highmem. The BIOS
+ * and framebuffer regions are rebuilt by the DM and are not logged.
+ */
+int
+vm_enable_dirty_log(struct vmctx *ctx)
+{
+	int error;
+
+	error = vm_dirty_log_cmd(ctx, ACRN_DIRTY_LOG_ENABLE, 0, 0, ctx->lowmem, NULL);
+	if (!error && ctx->highmem > 0)
+		error = vm_dirty_log_cmd(ctx, ACRN_DIRTY_LOG_ENABLE, 0,
+				ctx->highmem_gpa_base, ctx->highmem, NULL);
+	if (error)
+		(void)vm_disable_dirty_log(ctx);
+	return error;
+}
+
+int
+vm_disable_dirty_log(struct vmctx *ctx)
+{
+	int error;
+
+	error = vm_dirty_log_cmd(ctx, ACRN_DIRTY_LOG_DISABLE, 0, 0, ctx->lowmem, NULL);
+	if (ctx->highmem > 0)
+		error |= vm_dirty_log_cmd(ctx, ACRN_DIRTY_LOG_DISABLE, 0,
+				ctx->highmem_gpa_base, ctx->highmem, NULL);
+	return error;
+}
+
+/*
+ * Fill bitmap, one bit per 4K page of [gpa, gpa + len), with the pages
+ * written since logging started or, with clear, since the last call.
+ * gpa and len are multiples of ACRN_DIRTY_LOG_ALIGN.
+ */
+int
+vm_get_dirty_log(struct vmctx *ctx, vm_paddr_t gpa, size_t len,
+	uint64_t *bitmap, bool clear)
+{
+	return vm_dirty_log_cmd(ctx, ACRN_DIRTY_LOG_GET,
+			clear ? ACRN_DIRTY_LOG_CLEAR : 0, gpa, len, bitmap);
+}
+
 int
 vm_setup_memory(struct vmctx *ctx, size_t memsize)
 {
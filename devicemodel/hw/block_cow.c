@@ -0,0 +1,814 @@
+/*
+ * Copyright (C) 2024 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Copy-on-write disk images.
+ *
+ * The first cluster of an image holds the header and the path of the
+ * backing image. The L1 table follows, each of its entries points to an L2
+ * table of one cluster, whose entries point to the data clusters. Offsets
+ * are in bytes from the start of the image, 0 means not allocated.
+ *
+ * A data cluster is allocated at the end of the image the first time it is
+ * written, and filled from the backing image if the write doesn't cover it.
+ * The clusters never written are read from the backing image, which is a
+ * raw image or another COW image opened read-only, or read as zeros if
+ * there is none. A discarded cluster is marked COW_ENTRY_ZERO so that the
+ * backing data doesn't show through again.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+
+#include "block_cow.h"
+#include "log.h"
+
+#define COW_MAGIC		0x574f4341U	/* "ACOW" */
+#define COW_VERSION		1U
+#define COW_CLUSTER_BITS	16U
+#define COW_CLUSTER_BITS_MIN	12U
+#define COW_CLUSTER_BITS_MAX	21U
+#define COW_L2_CACHE_SIZE	32
+#define COW_MAX_CHAIN		16
+
+/* The entries are cluster aligned, their low bits carry flags */
+#define COW_ENTRY_ZERO		0x1UL
+#define COW_ENTRY_FLAGS		0xfffUL
+
+enum cow_backing_fmt {
+	COW_BACKING_NONE,
+	COW_BACKING_RAW,
+	COW_BACKING_COW
+};
+
+struct cow_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	cluster_bits;
+	uint32_t	backing_fmt;
+	uint64_t	size;		/* virtual disk size in bytes */
+	uint64_t	l1_offset;
+	uint32_t	l1_entries;
+	uint32_t	backing_len;	/* the path follows the header */
+} __attribute__((packed));
+
+/* An L2 table cached in memory */
+struct cow_l2 {
+	uint64_t	offset;		/* of the table in the image, 0 if unused */
+	uint64_t	*table;
+	uint64_t	last_use;
+};
+
+struct cow_image {
+	int		fd;
+	int		own_fd;		/* backing images are opened here */
+	int		raw;		/* raw backing image, no metadata */
+	int		ro;
+	off_t		size;
+	uint32_t	cluster_bits;
+	uint64_t	cluster_size;
+	uint32_t	l2_bits;
+	uint64_t	*l1;
+	uint32_t	l1_entries;
+	uint64_t	l1_offset;
+	uint64_t	data_offset;	/* first cluster past the L1 table */
+	off_t		end;		/* where the next cluster is allocated */
+	void		*buf;		/* one cluster, for the partial writes */
+
+	struct cow_l2	l2_cache[COW_L2_CACHE_SIZE];
+	uint64_t	l2_clock;
+
+	struct cow_image *backing;
+	pthread_mutex_t	mtx;		/* protects the metadata */
+};
+
+static struct cow_image *cow_load(int fd, int ro, const char *backing,
+				  const char *backing_fmt, int depth);
+
+static int
+cow_pread(int fd, void *buf, size_t len, off_t off)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, p, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (n == 0) {
+			/* past the end of the file */
+			memset(p, 0, len);
+			break;
+		}
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int
+cow_pwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, p, len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (n == 0)
+			return EIO;
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static size_t
+cow_iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/*
+ * Take the part [skip, skip + len) of iov, out has room for iovcnt entries.
+ */
+static int
+cow_iov_slice(const struct iovec *iov, int iovcnt, size_t skip, size_t len,
+	      struct iovec *out)
+{
+	size_t l;
+	int i, n;
+
+	n = 0;
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		l = MIN(iov[i].iov_len - skip, len);
+		out[n].iov_base = (char *)iov[i].iov_base + skip;
+		out[n].iov_len = l;
+		n++;
+		len -= l;
+		skip = 0;
+	}
+	return n;
+}
+
+static void
+cow_iov_zero(const struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		memset(iov[i].iov_base, 0, iov[i].iov_len);
+}
+
+static void
+cow_iov_to_buf(const struct iovec *iov, int iovcnt, char *buf)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+		buf += iov[i].iov_len;
+	}
+}
+
+static uint32_t
+cow_l1_index(struct cow_image *img, off_t offset)
+{
+	return offset >> (img->cluster_bits + img->l2_bits);
+}
+
+static uint32_t
+cow_l2_index(struct cow_image *img, off_t offset)
+{
+	return (offset >> img->cluster_bits) & ((1U << img->l2_bits) - 1);
+}
+
+/*
+ * A cluster referenced by the metadata must lie between the L1 table and
+ * the end of the image.
+ */
+static int
+cow_cluster_valid(struct cow_image *img, uint64_t offset)
+{
+	return (offset & (img->cluster_size - 1)) == 0 &&
+		offset >= img->data_offset &&
+		offset <= (uint64_t)img->end - img->cluster_size;
+}
+
+/*
+ * Get the L2 table at offset from the cache, evicting the least recently
+ * used one on a miss. A fresh table is zeroed instead of read, it is not
+ * in the image yet.
+ *
+ * @pre img->mtx is held
+ */
+static int
+cow_l2_get(struct cow_image *img, uint64_t offset, int fresh, uint64_t **table)
+{
+	struct cow_l2 *l2, *victim;
+	uint64_t data;
+	int i, err;
+
+	victim = NULL;
+	for (i = 0; i < COW_L2_CACHE_SIZE; i++) {
+		l2 = &img->l2_cache[i];
+		if (l2->offset == offset) {
+			victim = l2;
+			break;
+		}
+		if (victim == NULL || l2->last_use < victim->last_use)
+			victim = l2;
+	}
+
+	if (victim->offset != offset || fresh) {
+		if (victim->table == NULL) {
+			victim->table = malloc(img->cluster_size);
+			if (victim->table == NULL)
+				return ENOMEM;
+		}
+		if (fresh) {
+			memset(victim->table, 0, img->cluster_size);
+			err = 0;
+		} else {
+			err = cow_pread(img->fd, victim->table, img->cluster_size, offset);
+			for (i = 0; !err && i < (int)(img->cluster_size / sizeof(uint64_t)); i++) {
+				data = victim->table[i] & ~COW_ENTRY_FLAGS;
+				if (data != 0 && !cow_cluster_valid(img, data)) {
+					pr_err("cow: L2 entry out of the image\n");
+					err = EINVAL;
+				}
+			}
+		}
+		if (err) {
+			victim->offset = 0;
+			victim->last_use = 0;
+			return err;
+		}
+		victim->offset = offset;
+	}
+
+	victim->last_use = ++img->l2_clock;
+	*table = victim->table;
+	return 0;
+}
+
+/*
+ * @pre img->mtx is held
+ */
+static int
+cow_get_entry(struct cow_image *img, off_t offset, uint64_t *entry)
+{
+	uint32_t l1i = cow_l1_index(img, offset);
+	uint64_t *table;
+	int err;
+
+	*entry = 0;
+	if (l1i >= img->l1_entries)
+		return EINVAL;
+	if (img->l1[l1i] == 0)
+		return 0;
+
+	err = cow_l2_get(img, img->l1[l1i], 0, &table);
+	if (!err)
+		*entry = table[cow_l2_index(img, offset)];
+	return err;
+}
+
+/*
+ * Set the L2 entry of the cluster at offset, allocating the L2 table if
+ * needed. A new table is written before the L1 entry pointing to it.
+ *
+ * @pre img->mtx is held
+ */
+static int
+cow_set_entry(struct cow_image *img, off_t offset, uint64_t entry)
+{
+	uint32_t l1i = cow_l1_index(img, offset);
+	uint32_t l2i = cow_l2_index(img, offset);
+	uint64_t *table, l2off;
+	int err;
+
+	if (l1i >= img->l1_entries)
+		return EINVAL;
+
+	l2off = img->l1[l1i];
+	if (l2off == 0) {
+		l2off = img->end;
+		err = cow_l2_get(img, l2off, 1, &table);
+		if (err)
+			return err;
+		table[l2i] = entry;
+		err = cow_pwrite(img->fd, table, img->cluster_size, l2off);
+		if (!err)
+			err = cow_pwrite(img->fd, &l2off, sizeof(l2off),
+					img->l1_offset + l1i * sizeof(uint64_t));
+		if (!err) {
+			img->end += img->cluster_size;
+			img->l1[l1i] = l2off;
+		}
+		return err;
+	}
+
+	err = cow_l2_get(img, l2off, 0, &table);
+	if (!err)
+		err = cow_pwrite(img->fd, &entry, sizeof(entry),
+				l2off + l2i * sizeof(uint64_t));
+	if (!err)
+		table[l2i] = entry;
+	return err;
+}
+
+/*
+ * Write to a cluster which has no data in the image yet. The cluster is
+ * allocated at the end of the image, completed from the backing image
+ * unless the write covers it all, and made durable before its entry points
+ * to it, so that a crash never exposes a cluster which wasn't written.
+ *
+ * @pre img->mtx is held
+ */
+static int
+cow_alloc_write(struct cow_image *img, off_t offset, uint64_t entry,
+		const struct iovec *iov, int iovcnt, size_t len)
+{
+	off_t start = offset & ~(off_t)(img->cluster_size - 1);
+	uint64_t data = img->end;
+	struct iovec whole;
+	ssize_t ret;
+	int err;
+
+	err = 0;
+	if (len == img->cluster_size) {
+		ret = pwritev(img->fd, iov, iovcnt, data);
+		if (ret < 0)
+			err = errno;
+		else if ((size_t)ret < len)
+			err = EIO;
+	} else {
+		whole.iov_base = img->buf;
+		whole.iov_len = img->cluster_size;
+		if ((entry & COW_ENTRY_ZERO) || img->backing == NULL)
+			memset(img->buf, 0, img->cluster_size);
+		else if (cow_preadv(img->backing, &whole, 1, start) < 0)
+			return errno;
+		cow_iov_to_buf(iov, iovcnt, (char *)img->buf + (offset - start));
+		err = cow_pwrite(img->fd, img->buf, img->cluster_size, data);
+	}
+
+	if (!err && fdatasync(img->fd))
+		err = errno;
+	if (!err) {
+		img->end += img->cluster_size;
+		err = cow_set_entry(img, start, data);
+	}
+	return err;
+}
+
+ssize_t
+cow_preadv(struct cow_image *img, const struct iovec *iov, int iovcnt,
+	   off_t offset)
+{
+	struct iovec slice[IOV_MAX];
+	uint64_t entry, data;
+	size_t len, done, n, inoff;
+	ssize_t ret;
+	int cnt, err;
+
+	if (iovcnt > IOV_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	len = cow_iov_len(iov, iovcnt);
+
+	if (img->raw) {
+		ret = preadv(img->fd, iov, iovcnt, offset);
+		if (ret >= 0 && (size_t)ret < len) {
+			/* past the end of the backing image */
+			cnt = cow_iov_slice(iov, iovcnt, ret, len - ret, slice);
+			cow_iov_zero(slice, cnt);
+			ret = len;
+		}
+		return ret;
+	}
+
+	for (done = 0; done < len; done += n) {
+		inoff = (offset + done) & (img->cluster_size - 1);
+		n = MIN(img->cluster_size - inoff, len - done);
+		cnt = cow_iov_slice(iov, iovcnt, done, n, slice);
+
+		pthread_mutex_lock(&img->mtx);
+		err = cow_get_entry(img, offset + done, &entry);
+		pthread_mutex_unlock(&img->mtx);
+		if (err)
+			goto fail;
+
+		data = entry & ~COW_ENTRY_FLAGS;
+		if (data != 0) {
+			ret = preadv(img->fd, slice, cnt, data + inoff);
+			if (ret < 0) {
+				err = errno;
+				goto fail;
+			}
+			if ((size_t)ret < n) {
+				err = EIO;
+				goto fail;
+			}
+		} else if ((entry & COW_ENTRY_ZERO) || img->backing == NULL) {
+			cow_iov_zero(slice, cnt);
+		} else if (cow_preadv(img->backing, slice, cnt, offset + done) < 0) {
+			err = errno;
+			goto fail;
+		}
+	}
+	return len;
+
+fail:
+	errno = err;
+	return -1;
+}
+
+ssize_t
+cow_pwritev(struct cow_image *img, const struct iovec *iov, int iovcnt,
+	    off_t offset)
+{
+	struct iovec slice[IOV_MAX];
+	uint64_t entry, data;
+	size_t len, done, n, inoff;
+	ssize_t ret;
+	int cnt, err;
+
+	if (img->ro || img->raw) {
+		errno = EROFS;
+		return -1;
+	}
+	if (iovcnt > IOV_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	len = cow_iov_len(iov, iovcnt);
+
+	for (done = 0; done < len; done += n) {
+		inoff = (offset + done) & (img->cluster_size - 1);
+		n = MIN(img->cluster_size - inoff, len - done);
+		cnt = cow_iov_slice(iov, iovcnt, done, n, slice);
+
+		pthread_mutex_lock(&img->mtx);
+		err = cow_get_entry(img, offset + done, &entry);
+		data = entry & ~COW_ENTRY_FLAGS;
+		if (!err && data == 0)
+			err = cow_alloc_write(img, offset + done, entry, slice, cnt, n);
+		pthread_mutex_unlock(&img->mtx);
+		if (err)
+			goto fail;
+
+		/* the cluster was there already, write it in place */
+		if (data != 0) {
+			ret = pwritev(img->fd, slice, cnt, data + inoff);
+			if (ret < 0) {
+				err = errno;
+				goto fail;
+			}
+			if ((size_t)ret < n) {
+				err = EIO;
+				goto fail;
+			}
+		}
+	}
+	return len;
+
+fail:
+	errno = err;
+	return -1;
+}
+
+/*
+ * Drop the data of [offset, offset + len). The clusters it covers read as
+ * zeros from now on and give their space back to the file system. The
+ * clusters it covers partly are only punched if they have data in the
+ * image.
+ *
+ * @return 0 on success, or an errno.
+ */
+int
+cow_discard(struct cow_image *img, off_t offset, off_t len)
+{
+	uint64_t entry, data;
+	off_t inoff, n;
+	int err;
+
+	if (img->ro || img->raw)
+		return EROFS;
+
+	err = 0;
+	pthread_mutex_lock(&img->mtx);
+	while (!err && len > 0) {
+		inoff = offset & (img->cluster_size - 1);
+		n = MIN((off_t)img->cluster_size - inoff, len);
+		err = cow_get_entry(img, offset, &entry);
+		data = entry & ~COW_ENTRY_FLAGS;
+
+		if (!err && n == (off_t)img->cluster_size) {
+			if (entry != COW_ENTRY_ZERO && (data != 0 || img->backing != NULL))
+				err = cow_set_entry(img, offset, COW_ENTRY_ZERO);
+			if (!err && data != 0 &&
+			    fallocate(img->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				      data, img->cluster_size))
+				err = errno;
+		} else if (!err && data != 0) {
+			if (fallocate(img->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				      data + inoff, n))
+				err = errno;
+		}
+
+		offset += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&img->mtx);
+
+	return err;
+}
+
+static struct cow_image *
+cow_alloc(int fd, int ro)
+{
+	struct cow_image *img;
+
+	img = calloc(1, sizeof(*img));
+	if (img == NULL) {
+		pr_err("cow: calloc failed\n");
+		return NULL;
+	}
+	img->fd = fd;
+	img->ro = ro;
+	pthread_mutex_init(&img->mtx, NULL);
+	return img;
+}
+
+static void
+cow_free(struct cow_image *img)
+{
+	int i;
+
+	if (img->backing)
+		cow_free(img->backing);
+	for (i = 0; i < COW_L2_CACHE_SIZE; i++)
+		free(img->l2_cache[i].table);
+	free(img->l1);
+	free(img->buf);
+	if (img->own_fd)
+		close(img->fd);
+	pthread_mutex_destroy(&img->mtx);
+	free(img);
+}
+
+/*
+ * Open a backing image read-only, fmt is recorded in the header of the
+ * image on top of it.
+ */
+static struct cow_image *
+cow_open_backing(const char *path, uint32_t fmt, int depth)
+{
+	struct cow_image *img;
+	int fd;
+
+	if (depth >= COW_MAX_CHAIN) {
+		pr_err("cow: backing chain of %s is too long\n", path);
+		return NULL;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_err("cow: could not open backing image %s\n", path);
+		return NULL;
+	}
+
+	if (fmt == COW_BACKING_COW) {
+		img = cow_load(fd, 1, NULL, NULL, depth + 1);
+	} else {
+		img = cow_alloc(fd, 1);
+		if (img) {
+			img->raw = 1;
+			img->size = lseek(fd, 0, SEEK_END);
+		}
+	}
+
+	if (img == NULL)
+		close(fd);
+	else
+		img->own_fd = 1;
+	return img;
+}
+
+/*
+ * Format the empty file fd as an overlay of the image at backing, of the
+ * same size. The L1 table is left as a hole in the file. The format of the
+ * backing image is given by the user, never probed: a raw image written by
+ * a guest could pass for a COW one and reference any host file.
+ */
+static int
+cow_create(int fd, const char *backing, const char *backing_fmt)
+{
+	struct cow_header hdr;
+	struct cow_image *base;
+	uint64_t cluster_size, span, l1_bytes;
+	size_t len;
+	char *buf;
+	int err;
+
+	cluster_size = 1UL << COW_CLUSTER_BITS;
+	len = strnlen(backing, PATH_MAX);
+	if (len >= PATH_MAX || sizeof(hdr) + len > cluster_size)
+		return ENAMETOOLONG;
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (backing_fmt == NULL)
+		return EINVAL;
+	else if (!strcmp(backing_fmt, "raw"))
+		hdr.backing_fmt = COW_BACKING_RAW;
+	else if (!strcmp(backing_fmt, "cow"))
+		hdr.backing_fmt = COW_BACKING_COW;
+	else
+		return EINVAL;
+
+	base = cow_open_backing(backing, hdr.backing_fmt, 0);
+	if (base == NULL)
+		return EINVAL;
+	hdr.size = cow_size(base);
+	cow_free(base);
+
+	span = 1UL << (2 * COW_CLUSTER_BITS - 3);
+	hdr.magic = COW_MAGIC;
+	hdr.version = COW_VERSION;
+	hdr.cluster_bits = COW_CLUSTER_BITS;
+	hdr.l1_offset = cluster_size;
+	hdr.l1_entries = (hdr.size + span - 1) / span;
+	hdr.backing_len = len;
+	l1_bytes = roundup(hdr.l1_entries * sizeof(uint64_t), cluster_size);
+
+	buf = calloc(1, cluster_size);
+	if (buf == NULL)
+		return ENOMEM;
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), backing, len);
+	err = cow_pwrite(fd, buf, cluster_size, 0);
+	free(buf);
+
+	if (!err && ftruncate(fd, hdr.l1_offset + l1_bytes))
+		err = errno;
+	if (!err && fsync(fd))
+		err = errno;
+	return err;
+}
+
+static struct cow_image *
+cow_load(int fd, int ro, const char *backing, const char *backing_fmt,
+	 int depth)
+{
+	struct cow_header hdr;
+	struct cow_image *img;
+	struct stat sbuf;
+	char path[PATH_MAX];
+	uint64_t cluster_size, span, l1_bytes;
+	uint32_t i;
+	int err;
+
+	if (fstat(fd, &sbuf) < 0) {
+		pr_err("cow: could not stat the image\n");
+		return NULL;
+	}
+
+	if (sbuf.st_size == 0) {
+		if (backing == NULL || backing_fmt == NULL || ro) {
+			pr_err("cow: an empty image needs a writable file, a backing image and its format\n");
+			return NULL;
+		}
+		err = cow_create(fd, backing, backing_fmt);
+		if (err || fstat(fd, &sbuf) < 0) {
+			pr_err("cow: failed to create the overlay of %s, error %d\n",
+				backing, err);
+			return NULL;
+		}
+		pr_info("cow: created an overlay of %s\n", backing);
+	}
+
+	if (cow_pread(fd, &hdr, sizeof(hdr), 0) || hdr.magic != COW_MAGIC ||
+			hdr.version != COW_VERSION) {
+		pr_err("cow: not a COW image\n");
+		return NULL;
+	}
+
+	if (hdr.cluster_bits < COW_CLUSTER_BITS_MIN ||
+			hdr.cluster_bits > COW_CLUSTER_BITS_MAX) {
+		pr_err("cow: invalid cluster size\n");
+		return NULL;
+	}
+	cluster_size = 1UL << hdr.cluster_bits;
+	span = 1UL << (2 * hdr.cluster_bits - 3);
+	if (hdr.size == 0 || hdr.l1_entries != (hdr.size + span - 1) / span ||
+			hdr.l1_offset < cluster_size ||
+			(hdr.l1_offset & (cluster_size - 1)) ||
+			hdr.backing_len >= PATH_MAX ||
+			sizeof(hdr) + hdr.backing_len > cluster_size ||
+			hdr.backing_fmt > COW_BACKING_COW) {
+		pr_err("cow: invalid header\n");
+		return NULL;
+	}
+
+	img = cow_alloc(fd, ro);
+	if (img == NULL)
+		return NULL;
+	img->size = hdr.size;
+	img->cluster_bits = hdr.cluster_bits;
+	img->cluster_size = cluster_size;
+	img->l2_bits = hdr.cluster_bits - 3;
+	img->l1_entries = hdr.l1_entries;
+	img->l1_offset = hdr.l1_offset;
+	l1_bytes = roundup(hdr.l1_entries * sizeof(uint64_t), cluster_size);
+	img->data_offset = hdr.l1_offset + l1_bytes;
+	img->end = MAX(roundup(sbuf.st_size, cluster_size), img->data_offset);
+
+	img->l1 = malloc(hdr.l1_entries * sizeof(uint64_t));
+	if (!ro)
+		img->buf = malloc(cluster_size);
+	if (img->l1 == NULL || (!ro && img->buf == NULL)) {
+		pr_err("cow: malloc failed\n");
+		goto fail;
+	}
+	if (cow_pread(fd, img->l1, hdr.l1_entries * sizeof(uint64_t), hdr.l1_offset)) {
+		pr_err("cow: could not read the L1 table\n");
+		goto fail;
+	}
+	for (i = 0; i < hdr.l1_entries; i++) {
+		if (img->l1[i] != 0 && !cow_cluster_valid(img, img->l1[i])) {
+			pr_err("cow: L1 entry out of the image\n");
+			goto fail;
+		}
+	}
+
+	if (hdr.backing_fmt != COW_BACKING_NONE) {
+		if (cow_pread(fd, path, hdr.backing_len, sizeof(hdr)))
+			goto fail;
+		path[hdr.backing_len] = '\0';
+		img->backing = cow_open_backing(path, hdr.backing_fmt, depth);
+		if (img->backing == NULL)
+			goto fail;
+	}
+
+	return img;
+
+fail:
+	cow_free(img);
+	return NULL;
+}
+
+/*
+ * Open the COW image fd, which stays owned by the caller. An empty file is
+ * formatted as an overlay of backing, a backing_fmt ("raw" or "cow") image,
+ * first. Both are ignored otherwise.
+ */
+struct cow_image *
+cow_open(int fd, int ro, const char *backing, const char *backing_fmt)
+{
+	return cow_load(fd, ro, backing, backing_fmt, 0);
+}
+
+void
+cow_close(struct cow_image *img)
+{
+	cow_free(img);
+}
+
+off_t
+cow_size(struct cow_image *img)
+{
+	return img->size;
+}
@@ -30,23 +30,30 @@
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <linux/falloc.h>
 #include <linux/fs.h>
 #include <errno.h>
 #include <err.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #include "dm.h"
 #include "block_if.h"
+#include "block_cow.h"
 #include "ahci.h"
 #include "dm_string.h"
 #include "log.h"
+#include "iothread.h"
 
 /*
  * Notes:
@@ -66,6 +73,16 @@
 #define BLOCKIF_MAXREQ	(64 + BLOCKIF_NUMTHR)
 #define MAX_DISCARD_SEGMENT	256
 
+/* io_uring depth, enough to hold all the request elements */
+#define BLOCKIF_IOU_ENTRIES	128
+
+/* how long a write-through flush waits for the writes still in flight */
+#define BLOCKIF_SYNC_WINDOW_NS	200000L
+
+/* limits of the adjacent requests merged into one preadv/pwritev */
+#define BLOCKIF_MERGE_IOV_MAX	IOV_MAX
+#define BLOCKIF_MERGE_MAX_BYTES	(1024 * 1024)
+
 /*
  * Debug printf
  */
@@ -80,6 +97,11 @@ enum blockop {
 	BOP_DISCARD
 };
 
+enum blockif_aio_mode {
+	BLOCKIF_AIO_THREADS,	/* blocking I/O from a pool of worker threads */
+	BLOCKIF_AIO_IO_URING	/* asynchronous I/O through io_uring */
+};
+
 enum blockstat {
 	BST_FREE,
 	BST_BLOCK,
@@ -95,6 +117,36 @@ struct blockif_elem {
 	enum blockstat	     status;
 	pthread_t            tid;
 	off_t		     block;
+	struct blockif_elem  *merged;	/* next request issued along with this one */
+};
+
+struct blockif_ctxt;
+
+/*
+ * Each queue has its own request elements, lock and worker threads (or
+ * io_uring instance), so the requests submitted on different queues never
+ * contend with each other.
+ */
+struct blockif_queue {
+	struct blockif_ctxt	*bc;
+	int			idx;
+	pthread_t		btid[BLOCKIF_NUMTHR];
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+
+	/* Request elements and free/pending/busy queues */
+	TAILQ_HEAD(, blockif_elem) freeq;
+	TAILQ_HEAD(, blockif_elem) pendq;
+	TAILQ_HEAD(, blockif_elem) busyq;
+	struct blockif_elem	reqs[BLOCKIF_MAXREQ];
+
+#ifdef HAVE_LIBURING
+	struct io_uring		ring;
+	int			ring_efd;	/* signaled on io_uring completions */
+	struct iothread_mevent	ring_mevt;
+	int			ring_queued;	/* SQEs prepared but not submitted */
+#endif
+	int			plugged;	/* hold the SQEs until blockif_unplug */
 };
 
 struct blockif_ctxt {
@@ -113,18 +165,29 @@ struct blockif_ctxt {
 	int			max_discard_seg;
 	int			discard_sector_alignment;
 	int			closing;
-	pthread_t		btid[BLOCKIF_NUMTHR];
-	pthread_mutex_t		mtx;
-	pthread_cond_t		cond;
-
-	/* Request elements and free/pending/busy queues */
-	TAILQ_HEAD(, blockif_elem) freeq;
-	TAILQ_HEAD(, blockif_elem) pendq;
-	TAILQ_HEAD(, blockif_elem) busyq;
-	struct blockif_elem	reqs[BLOCKIF_MAXREQ];
 
 	/* write cache enable */
 	uint8_t			wce;
+
+	struct cow_image	*cow;	/* NULL for the raw images */
+
+	/*
+	 * Group commit of the write-through writes: the writes which complete
+	 * while no fdatasync is running share the next one.
+	 */
+	pthread_mutex_t		sync_mtx;
+	pthread_cond_t		sync_cond;
+	uint64_t		sync_started;	/* generation of the last fdatasync started */
+	uint64_t		sync_done;	/* generation of the last fdatasync completed */
+	uint64_t		sync_failed;	/* generation of the last fdatasync failed */
+	int			sync_err;
+	int			sync_busy;	/* a writer leads the next generation */
+	int			sync_writers;	/* write-through writes in pwritev */
+
+	enum blockif_aio_mode	aio_mode;
+
+	int			queue_num;
+	struct blockif_queue	*queues;
 };
 
 static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
@@ -144,33 +207,89 @@ struct discard_range {
 
 static struct blockif_sig_elem *blockif_bse_head;
 
+static void
+blockif_sync_enter(struct blockif_ctxt *bc)
+{
+	pthread_mutex_lock(&bc->sync_mtx);
+	bc->sync_writers++;
+	pthread_mutex_unlock(&bc->sync_mtx);
+}
+
+/*
+ * Make a write-through write durable before it is completed. Only a
+ * fdatasync that starts after the write covers it, so the write waits for
+ * the next generation. The first writer to find no flush running leads the
+ * generation: it waits up to BLOCKIF_SYNC_WINDOW_NS for the other writes
+ * in pwritev, then issues a single fdatasync for all of them.
+ *
+ * @err: the error of the write, nothing is flushed if it failed.
+ */
 static int
-blockif_flush_cache(struct blockif_ctxt *bc)
+blockif_sync_leave(struct blockif_ctxt *bc, int err)
 {
-	int err;
+	struct timespec ts;
+	uint64_t target, gen;
+	int ret;
+
+	pthread_mutex_lock(&bc->sync_mtx);
+	bc->sync_writers--;
+	if (bc->sync_busy && bc->sync_writers == 0)
+		pthread_cond_broadcast(&bc->sync_cond);
+
+	target = bc->sync_started + 1;
+	while (!err && bc->sync_done < target) {
+		if (bc->sync_busy) {
+			pthread_cond_wait(&bc->sync_cond, &bc->sync_mtx);
+			continue;
+		}
 
-	err = 0;
-	if (!bc->wce) {
-		if (fsync(bc->fd))
-			err = errno;
+		bc->sync_busy = 1;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += BLOCKIF_SYNC_WINDOW_NS;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		while (bc->sync_writers > 0) {
+			if (pthread_cond_timedwait(&bc->sync_cond, &bc->sync_mtx, &ts))
+				break;
+		}
+
+		gen = ++bc->sync_started;
+		pthread_mutex_unlock(&bc->sync_mtx);
+		ret = fdatasync(bc->fd) ? errno : 0;
+		pthread_mutex_lock(&bc->sync_mtx);
+
+		bc->sync_done = gen;
+		if (ret) {
+			bc->sync_failed = gen;
+			bc->sync_err = ret;
+		}
+		bc->sync_busy = 0;
+		pthread_cond_broadcast(&bc->sync_cond);
 	}
+
+	if (!err && bc->sync_failed >= target)
+		err = bc->sync_err;
+	pthread_mutex_unlock(&bc->sync_mtx);
+
 	return err;
 }
 
 static int
-blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
+blockif_enqueue(struct blockif_queue *bq, struct blockif_req *breq,
 		enum blockop op)
 {
 	struct blockif_elem *be, *tbe;
 	off_t off;
 	int i;
 
-	be = TAILQ_FIRST(&bc->freeq);
+	be = TAILQ_FIRST(&bq->freeq);
 	if (be == NULL || be->status != BST_FREE) {
 		WPRINTF(("%s: failed to get element from freeq\n", __func__));
 		return 0;
 	}
-	TAILQ_REMOVE(&bc->freeq, be, link);
+	TAILQ_REMOVE(&bq->freeq, be, link);
 	be->req = breq;
 	be->op = op;
 	switch (op) {
@@ -186,12 +305,12 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		off = 1 << (sizeof(off_t) - 1);
 	}
 	be->block = off;
-	TAILQ_FOREACH(tbe, &bc->pendq, link) {
+	TAILQ_FOREACH(tbe, &bq->pendq, link) {
 		if (tbe->block == breq->offset)
 			break;
 	}
 	if (tbe == NULL) {
-		TAILQ_FOREACH(tbe, &bc->busyq, link) {
+		TAILQ_FOREACH(tbe, &bq->busyq, link) {
 			if (tbe->block == breq->offset)
 				break;
 		}
@@ -200,46 +319,129 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		be->status = BST_PEND;
 	else
 		be->status = BST_BLOCK;
-	TAILQ_INSERT_TAIL(&bc->pendq, be, link);
+	TAILQ_INSERT_TAIL(&bq->pendq, be, link);
 	return (be->status == BST_PEND);
 }
 
 static int
-blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
+blockif_dequeue(struct blockif_queue *bq, pthread_t t, struct blockif_elem **bep)
 {
 	struct blockif_elem *be;
 
-	TAILQ_FOREACH(be, &bc->pendq, link) {
+	TAILQ_FOREACH(be, &bq->pendq, link) {
 		if (be->status == BST_PEND)
 			break;
 	}
 	if (be == NULL)
 		return 0;
-	TAILQ_REMOVE(&bc->pendq, be, link);
+	TAILQ_REMOVE(&bq->pendq, be, link);
 	be->status = BST_BUSY;
 	be->tid = t;
-	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
+	TAILQ_INSERT_TAIL(&bq->busyq, be, link);
 	*bep = be;
 	return 1;
 }
 
 static void
-blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
+blockif_complete(struct blockif_queue *bq, struct blockif_elem *be)
 {
 	struct blockif_elem *tbe;
 
 	if (be->status == BST_DONE || be->status == BST_BUSY)
-		TAILQ_REMOVE(&bc->busyq, be, link);
+		TAILQ_REMOVE(&bq->busyq, be, link);
 	else
-		TAILQ_REMOVE(&bc->pendq, be, link);
-	TAILQ_FOREACH(tbe, &bc->pendq, link) {
+		TAILQ_REMOVE(&bq->pendq, be, link);
+	TAILQ_FOREACH(tbe, &bq->pendq, link) {
 		if (tbe->req->offset == be->block)
 			tbe->status = BST_PEND;
 	}
 	be->tid = 0;
 	be->status = BST_FREE;
 	be->req = NULL;
-	TAILQ_INSERT_TAIL(&bc->freeq, be, link);
+	be->merged = NULL;
+	TAILQ_INSERT_TAIL(&bq->freeq, be, link);
+}
+
+/*
+ * Chain the pending reads or writes that start where be ends, so that they
+ * are issued with be in a single syscall. A request that starts right
+ * where another one ends is blocked behind it by blockif_enqueue(), so the
+ * merged ones are found in pendq whatever their status.
+ *
+ * Called with bq->mtx held.
+ */
+static void
+blockif_merge(struct blockif_queue *bq, struct blockif_elem *be)
+{
+	struct blockif_elem *tail, *tbe;
+	off_t bytes;
+	int iovcnt;
+
+	if (be->op != BOP_READ && be->op != BOP_WRITE)
+		return;
+
+	tail = be;
+	iovcnt = be->req->iovcnt;
+	bytes = be->block - be->req->offset;
+	for (;;) {
+		TAILQ_FOREACH(tbe, &bq->pendq, link) {
+			if (tbe->op == be->op && tbe->req->offset == tail->block)
+				break;
+		}
+		if (tbe == NULL ||
+		    iovcnt + tbe->req->iovcnt > BLOCKIF_MERGE_IOV_MAX ||
+		    bytes + (tbe->block - tbe->req->offset) > BLOCKIF_MERGE_MAX_BYTES)
+			break;
+
+		TAILQ_REMOVE(&bq->pendq, tbe, link);
+		tbe->status = BST_BUSY;
+		tbe->tid = be->tid;
+		TAILQ_INSERT_TAIL(&bq->busyq, tbe, link);
+
+		tail->merged = tbe;
+		tail = tbe;
+		iovcnt += tbe->req->iovcnt;
+		bytes += tbe->block - tbe->req->offset;
+	}
+}
+
+/*
+ * Gather the iovecs of be and the requests merged into it.
+ */
+static struct iovec *
+blockif_merged_iov(struct blockif_elem *be, struct iovec *iov, int *iovcnt)
+{
+	struct blockif_elem *tbe;
+	int n;
+
+	if (be->merged == NULL) {
+		*iovcnt = be->req->iovcnt;
+		return be->req->iov;
+	}
+
+	n = 0;
+	for (tbe = be; tbe != NULL; tbe = tbe->merged) {
+		memcpy(&iov[n], tbe->req->iov, tbe->req->iovcnt * sizeof(*iov));
+		n += tbe->req->iovcnt;
+	}
+	*iovcnt = n;
+	return iov;
+}
+
+/*
+ * Split the bytes transferred by a merged syscall back over its requests.
+ */
+static void
+blockif_merged_resid(struct blockif_elem *be, ssize_t len)
+{
+	struct blockif_elem *tbe;
+	ssize_t n;
+
+	for (tbe = be; tbe != NULL; tbe = tbe->merged) {
+		n = MIN(len, tbe->block - tbe->req->offset);
+		tbe->req->resid -= n;
+		len -= n;
+	}
 }
 
 static int
@@ -302,6 +504,8 @@ blockif_process_discard(struct blockif_ctxt *bc, struct blockif_req *br)
 	for (i = 0; i < segment; i++) {
 		if (bc->isblk) {
 			err = ioctl(bc->fd, BLKDISCARD, arg[i]);
+		} else if (bc->cow) {
+			err = cow_discard(bc->cow, arg[i][0], arg[i][1]);
 		} else {
 			/* FALLOC_FL_PUNCH_HOLE:
 			 *	Deallocates space in the byte range starting at offset and
@@ -329,20 +533,26 @@ blockif_process_discard(struct blockif_ctxt *bc, struct blockif_req *br)
 static void
 blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 {
+	struct iovec iovbuf[BLOCKIF_MERGE_IOV_MAX], *iov;
+	struct blockif_elem *tbe;
 	struct blockif_req *br;
 	ssize_t len;
-	int err;
+	int err, sync, iovcnt;
 
 	br = be->req;
 	err = 0;
 	switch (be->op) {
 	case BOP_READ:
-		len = preadv(bc->fd, br->iov, br->iovcnt,
-				 br->offset + bc->sub_file_start_lba);
+		iov = blockif_merged_iov(be, iovbuf, &iovcnt);
+		if (bc->cow)
+			len = cow_preadv(bc->cow, iov, iovcnt, br->offset);
+		else
+			len = preadv(bc->fd, iov, iovcnt,
+					 br->offset + bc->sub_file_start_lba);
 		if (len < 0)
 			err = errno;
 		else
-			br->resid -= len;
+			blockif_merged_resid(be, len);
 		break;
 	case BOP_WRITE:
 		if (bc->rdonly) {
@@ -350,14 +560,21 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 			break;
 		}
 
-		len = pwritev(bc->fd, br->iov, br->iovcnt,
-				  br->offset + bc->sub_file_start_lba);
+		sync = !bc->wce;
+		if (sync)
+			blockif_sync_enter(bc);
+		iov = blockif_merged_iov(be, iovbuf, &iovcnt);
+		if (bc->cow)
+			len = cow_pwritev(bc->cow, iov, iovcnt, br->offset);
+		else
+			len = pwritev(bc->fd, iov, iovcnt,
+					  br->offset + bc->sub_file_start_lba);
 		if (len < 0)
 			err = errno;
-		else {
-			br->resid -= len;
-			err = blockif_flush_cache(bc);
-		}
+		else
+			blockif_merged_resid(be, len);
+		if (sync)
+			err = blockif_sync_leave(bc, err);
 		break;
 	case BOP_FLUSH:
 		if (fsync(bc->fd))
@@ -371,41 +588,264 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be)
 		break;
 	}
 
-	be->status = BST_DONE;
-
-	(*br->callback)(br, err);
+	for (tbe = be; tbe != NULL; tbe = tbe->merged) {
+		tbe->status = BST_DONE;
+		(*tbe->req->callback)(tbe->req, err);
+	}
 }
 
 static void *
 blockif_thr(void *arg)
 {
+	struct blockif_queue *bq;
 	struct blockif_ctxt *bc;
-	struct blockif_elem *be;
+	struct blockif_elem *be, *next;
 	pthread_t t;
 
-	bc = arg;
+	bq = arg;
+	bc = bq->bc;
 	t = pthread_self();
 
-	pthread_mutex_lock(&bc->mtx);
+	pthread_mutex_lock(&bq->mtx);
 
 	for (;;) {
-		while (blockif_dequeue(bc, t, &be)) {
-			pthread_mutex_unlock(&bc->mtx);
+		while (blockif_dequeue(bq, t, &be)) {
+			blockif_merge(bq, be);
+			pthread_mutex_unlock(&bq->mtx);
 			blockif_proc(bc, be);
-			pthread_mutex_lock(&bc->mtx);
-			blockif_complete(bc, be);
+			pthread_mutex_lock(&bq->mtx);
+			for (; be != NULL; be = next) {
+				next = be->merged;
+				blockif_complete(bq, be);
+			}
 		}
 		/* Check ctxt status here to see if exit requested */
 		if (bc->closing)
 			break;
-		pthread_cond_wait(&bc->cond, &bc->mtx);
+		pthread_cond_wait(&bq->cond, &bq->mtx);
 	}
 
-	pthread_mutex_unlock(&bc->mtx);
+	pthread_mutex_unlock(&bq->mtx);
 	pthread_exit(NULL);
 	return NULL;
 }
 
+#ifdef HAVE_LIBURING
+static void
+blockif_iou_submit(struct blockif_queue *bq)
+{
+	int ret;
+
+	ret = io_uring_submit(&bq->ring);
+	if (ret < 0)
+		WPRINTF(("%s: io_uring_submit failed %d\n", __func__, ret));
+	else
+		bq->ring_queued -= ret;
+}
+
+/*
+ * Turn the runnable pending elements into SQEs. Discards and the requests
+ * which fail early have no ring counterpart and are processed inline.
+ *
+ * Called with bq->mtx held.
+ */
+static void
+blockif_iou_queue(struct blockif_queue *bq)
+{
+	struct blockif_ctxt *bc = bq->bc;
+	struct blockif_elem *be;
+	struct blockif_req *br;
+	struct io_uring_sqe *sqe;
+
+	while (!bc->closing && blockif_dequeue(bq, 0, &be)) {
+		br = be->req;
+		if ((be->op == BOP_DISCARD) || (be->op == BOP_WRITE && bc->rdonly) ||
+				(be->op != BOP_READ && be->op != BOP_WRITE && be->op != BOP_FLUSH)) {
+			pthread_mutex_unlock(&bq->mtx);
+			blockif_proc(bc, be);
+			pthread_mutex_lock(&bq->mtx);
+			blockif_complete(bq, be);
+			continue;
+		}
+
+		sqe = io_uring_get_sqe(&bq->ring);
+		if (sqe == NULL) {
+			/* The SQ is full, push it to the kernel and retry */
+			blockif_iou_submit(bq);
+			sqe = io_uring_get_sqe(&bq->ring);
+		}
+		if (sqe == NULL) {
+			WPRINTF(("%s: no SQE available\n", __func__));
+			be->status = BST_DONE;
+			pthread_mutex_unlock(&bq->mtx);
+			(*br->callback)(br, EAGAIN);
+			pthread_mutex_lock(&bq->mtx);
+			blockif_complete(bq, be);
+			continue;
+		}
+
+		switch (be->op) {
+		case BOP_READ:
+			io_uring_prep_readv(sqe, bc->fd, br->iov, br->iovcnt,
+					br->offset + bc->sub_file_start_lba);
+			break;
+		case BOP_WRITE:
+			io_uring_prep_writev(sqe, bc->fd, br->iov, br->iovcnt,
+					br->offset + bc->sub_file_start_lba);
+			/* write-through: make the data durable as part of the write */
+			if (!bc->wce)
+				sqe->rw_flags = RWF_DSYNC;
+			break;
+		default:
+			io_uring_prep_fsync(sqe, bc->fd, 0);
+			break;
+		}
+		io_uring_sqe_set_data(sqe, be);
+		bq->ring_queued++;
+	}
+
+	if (!bq->plugged && bq->ring_queued > 0)
+		blockif_iou_submit(bq);
+}
+
+/*
+ * Reap the io_uring completions. Runs in the iothread when the ring
+ * eventfd is signaled.
+ */
+static void
+blockif_iou_complete(void *arg)
+{
+	struct blockif_queue *bq = arg;
+	struct blockif_elem *done[BLOCKIF_MAXREQ];
+	int res[BLOCKIF_MAXREQ];
+	struct io_uring_cqe *cqe;
+	struct blockif_elem *be;
+	struct blockif_req *br;
+	int i, n, err;
+
+	pthread_mutex_lock(&bq->mtx);
+	n = 0;
+	while (n < BLOCKIF_MAXREQ && io_uring_peek_cqe(&bq->ring, &cqe) == 0) {
+		done[n] = io_uring_cqe_get_data(cqe);
+		res[n] = cqe->res;
+		io_uring_cqe_seen(&bq->ring, cqe);
+		/* the completions of the cancel requests carry no element */
+		if (done[n] != NULL)
+			n++;
+	}
+	pthread_mutex_unlock(&bq->mtx);
+
+	for (i = 0; i < n; i++) {
+		be = done[i];
+		br = be->req;
+		err = 0;
+		if (res[i] < 0)
+			err = -res[i];
+		else if (be->op != BOP_FLUSH)
+			br->resid -= res[i];
+		be->status = BST_DONE;
+		(*br->callback)(br, err);
+	}
+
+	pthread_mutex_lock(&bq->mtx);
+	for (i = 0; i < n; i++)
+		blockif_complete(bq, done[i]);
+	/* the completed ones may unblock some pending elements */
+	blockif_iou_queue(bq);
+	pthread_mutex_unlock(&bq->mtx);
+}
+
+static int
+blockif_iou_init(struct blockif_queue *bq)
+{
+	int err;
+
+	err = io_uring_queue_init(BLOCKIF_IOU_ENTRIES, &bq->ring, 0);
+	if (err < 0) {
+		WPRINTF(("%s: io_uring_queue_init failed %d\n", __func__, err));
+		return -1;
+	}
+
+	bq->ring_efd = eventfd(0, EFD_NONBLOCK);
+	if (bq->ring_efd < 0) {
+		WPRINTF(("%s: eventfd failed %d\n", __func__, errno));
+		goto fail;
+	}
+
+	if (io_uring_register_eventfd(&bq->ring, bq->ring_efd) < 0) {
+		WPRINTF(("%s: io_uring_register_eventfd failed\n", __func__));
+		goto fail;
+	}
+
+	bq->ring_mevt.run = blockif_iou_complete;
+	bq->ring_mevt.poll = NULL;
+	bq->ring_mevt.arg = bq;
+	bq->ring_mevt.fd = bq->ring_efd;
+	if (iothread_add(-1, bq->ring_efd, &bq->ring_mevt) < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	if (bq->ring_efd >= 0)
+		close(bq->ring_efd);
+	bq->ring_efd = -1;
+	io_uring_queue_exit(&bq->ring);
+	return -1;
+}
+
+static void
+blockif_iou_deinit(struct blockif_queue *bq)
+{
+	struct io_uring_cqe *cqe;
+
+	iothread_del(bq->ring_efd, &bq->ring_mevt);
+
+	/* The kernel may still reference the request buffers, wait for them */
+	pthread_mutex_lock(&bq->mtx);
+	if (bq->ring_queued > 0)
+		blockif_iou_submit(bq);
+	while (!TAILQ_EMPTY(&bq->busyq)) {
+		pthread_mutex_unlock(&bq->mtx);
+		if (io_uring_wait_cqe(&bq->ring, &cqe) == 0)
+			blockif_iou_complete(bq);
+		pthread_mutex_lock(&bq->mtx);
+	}
+	pthread_mutex_unlock(&bq->mtx);
+
+	close(bq->ring_efd);
+	bq->ring_efd = -1;
+	io_uring_queue_exit(&bq->ring);
+}
+
+/*
+ * Ask the kernel to stop an in-flight request. The request completes through
+ * the ring as usual, with ECANCELED if it was stopped in time.
+ *
+ * Called with bq->mtx held.
+ */
+static void
+blockif_iou_cancel(struct blockif_queue *bq, struct blockif_elem *be)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&bq->ring);
+	if (sqe == NULL) {
+		blockif_iou_submit(bq);
+		sqe = io_uring_get_sqe(&bq->ring);
+	}
+	if (sqe == NULL) {
+		WPRINTF(("%s: no SQE available\n", __func__));
+		return;
+	}
+
+	io_uring_prep_cancel(sqe, be, 0);
+	io_uring_sqe_set_data(sqe, NULL);
+	bq->ring_queued++;
+	blockif_iou_submit(bq);
+}
+#endif
+
 static void
 blockif_sigcont_handler(int signal)
 {
@@ -488,27 +928,35 @@ sub_file_unlock(struct blockif_ctxt *bc)
 
 
 struct blockif_ctxt *
-blockif_open(const char *optstr, const char *ident)
+blockif_open(const char *optstr, const char *ident, int queue_num)
 {
 	char tname[MAXCOMLEN + 1];
 	/* char name[MAXPATHLEN]; */
-	char *nopt, *xopts, *cp;
+	char *nopt, *xopts, *cp, *backing, *backing_fmt;
 	struct blockif_ctxt *bc;
+	struct cow_image *cow;
+	struct blockif_queue *bq;
 	struct stat sbuf;
 	/* struct diocgattr_arg arg; */
 	off_t size, psectsz, psectoff;
-	int fd, i, sectsz;
-	int writeback, ro, candiscard, ssopt, pssopt;
+	int fd, i, j, sectsz;
+	int writeback, ro, candiscard, ssopt, pssopt, format_cow;
 	long sz;
 	long long b;
 	int err_code = -1;
 	off_t sub_file_start_lba, sub_file_size;
 	int sub_file_assign;
+	enum blockif_aio_mode aio_mode;
 	int max_discard_sectors, max_discard_seg, discard_sector_alignment;
 	off_t probe_arg[] = {0, 0};
 
 	pthread_once(&blockif_once, blockif_init);
 
+	if (queue_num < 1) {
+		pr_err("blockif: invalid queue number %d\n", queue_num);
+		return NULL;
+	}
+
 	fd = -1;
 	ssopt = 0;
 	pssopt = 0;
@@ -524,8 +972,15 @@ blockif_open(const char *optstr, const char *ident)
 	/* writethru is on by default */
 	writeback = 0;
 
+	aio_mode = BLOCKIF_AIO_THREADS;
+
 	candiscard = 0;
 
+	format_cow = 0;
+	backing = NULL;
+	backing_fmt = NULL;
+	cow = NULL;
+
 	/*
 	 * The first element in the optstring is always a pathname.
 	 * Optional elements follow
@@ -545,6 +1000,23 @@ blockif_open(const char *optstr, const char *ident)
 			writeback = 0;
 		else if (!strcmp(cp, "ro"))
 			ro = 1;
+		else if (!strcmp(cp, "aio=threads"))
+			aio_mode = BLOCKIF_AIO_THREADS;
+		else if (!strcmp(cp, "aio=io_uring")) {
+#ifdef HAVE_LIBURING
+			aio_mode = BLOCKIF_AIO_IO_URING;
+#else
+			pr_err("blockif: built without io_uring, use threads\n");
+#endif
+		}
+		else if (!strcmp(cp, "format=raw"))
+			format_cow = 0;
+		else if (!strcmp(cp, "format=cow"))
+			format_cow = 1;
+		else if (!strncmp(cp, "backing=", strlen("backing=")))
+			backing = cp + strlen("backing=");
+		else if (!strncmp(cp, "backing_fmt=", strlen("backing_fmt=")))
+			backing_fmt = cp + strlen("backing_fmt=");
 		else if (!strncmp(cp, "discard", strlen("discard"))) {
 			strsep(&cp, "=");
 			if (cp != NULL) {
@@ -609,10 +1081,26 @@ blockif_open(const char *optstr, const char *ident)
 		goto err;
 	}
 
+	if (format_cow) {
+		if (!S_ISREG(sbuf.st_mode) || sub_file_assign) {
+			pr_err("format=cow needs a regular file without range\n");
+			goto err;
+		}
+		cow = cow_open(fd, ro, backing, backing_fmt);
+		if (cow == NULL) {
+			pr_err("Could not open COW image %s\n", nopt);
+			goto err;
+		}
+		if (aio_mode == BLOCKIF_AIO_IO_URING) {
+			pr_err("blockif: io_uring doesn't support COW images, use threads\n");
+			aio_mode = BLOCKIF_AIO_THREADS;
+		}
+	}
+
 	/*
 	 * Deal with raw devices
 	 */
-	size = sbuf.st_size;
+	size = cow ? cow_size(cow) : sbuf.st_size;
 	sectsz = DEV_BSIZE;
 	psectsz = psectoff = 0;
 
@@ -700,6 +1188,13 @@ blockif_open(const char *optstr, const char *ident)
 		goto err;
 	}
 
+	bc->queues = calloc(queue_num, sizeof(struct blockif_queue));
+	if (bc->queues == NULL) {
+		pr_err("calloc");
+		free(bc);
+		goto err;
+	}
+
 	if (sub_file_assign) {
 		DPRINTF(("sector size is %d\n", sectsz));
 		bc->sub_file_assign = 1;
@@ -737,23 +1232,54 @@ blockif_open(const char *optstr, const char *ident)
 	bc->psectsz = psectsz;
 	bc->psectoff = psectoff;
 	bc->wce = writeback;
-	pthread_mutex_init(&bc->mtx, NULL);
-	pthread_cond_init(&bc->cond, NULL);
-	TAILQ_INIT(&bc->freeq);
-	TAILQ_INIT(&bc->pendq);
-	TAILQ_INIT(&bc->busyq);
-	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
-		bc->reqs[i].status = BST_FREE;
-		TAILQ_INSERT_HEAD(&bc->freeq, &bc->reqs[i], link);
+	bc->cow = cow;
+	pthread_mutex_init(&bc->sync_mtx, NULL);
+	pthread_cond_init(&bc->sync_cond, NULL);
+	bc->queue_num = queue_num;
+	for (i = 0; i < queue_num; i++) {
+		bq = &bc->queues[i];
+		bq->bc = bc;
+		bq->idx = i;
+#ifdef HAVE_LIBURING
+		bq->ring_efd = -1;
+#endif
+		pthread_mutex_init(&bq->mtx, NULL);
+		pthread_cond_init(&bq->cond, NULL);
+		TAILQ_INIT(&bq->freeq);
+		TAILQ_INIT(&bq->pendq);
+		TAILQ_INIT(&bq->busyq);
+		for (j = 0; j < BLOCKIF_MAXREQ; j++) {
+			bq->reqs[j].status = BST_FREE;
+			TAILQ_INSERT_HEAD(&bq->freeq, &bq->reqs[j], link);
+		}
 	}
 
-	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
-		if (snprintf(tname, sizeof(tname), "blk-%s-%d",
-					ident, i) >= sizeof(tname)) {
-			pr_err("blk thread name too long");
+	bc->aio_mode = aio_mode;
+#ifdef HAVE_LIBURING
+	if (bc->aio_mode == BLOCKIF_AIO_IO_URING) {
+		for (i = 0; i < queue_num; i++) {
+			if (blockif_iou_init(&bc->queues[i]) < 0)
+				break;
+		}
+		if (i < queue_num) {
+			pr_err("blockif: io_uring is not available, fall back to threads\n");
+			while (--i >= 0)
+				blockif_iou_deinit(&bc->queues[i]);
+			bc->aio_mode = BLOCKIF_AIO_THREADS;
+		}
+	}
+#endif
+
+	for (i = 0; bc->aio_mode == BLOCKIF_AIO_THREADS && i < queue_num; i++) {
+		bq = &bc->queues[i];
+		for (j = 0; j < BLOCKIF_NUMTHR; j++) {
+			if (snprintf(tname, sizeof(tname), "blk-%s-%d",
+					ident, i * BLOCKIF_NUMTHR + j) >= sizeof(tname)) {
+				pr_err("blk thread name too long");
+			}
+			pthread_create(&bq->btid[j], NULL, blockif_thr, bq);
+			pthread_setname_np(bq->btid[j], tname);
 		}
-		pthread_create(&bc->btid[i], NULL, blockif_thr, bc);
-		pthread_setname_np(bc->btid[i], tname);
 	}
 
 	/* free strdup memory */
@@ -768,6 +1294,9 @@ err:
 	if (nopt)
 		free(nopt);
 
+	if (cow)
+		cow_close(cow);
+
 	if (fd >= 0)
 		close(fd);
 	return NULL;
@@ -777,18 +1306,31 @@ static int
 blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
 {
+	struct blockif_queue *bq;
 	int err;
 
 	err = 0;
 
-	pthread_mutex_lock(&bc->mtx);
-	if (!TAILQ_EMPTY(&bc->freeq)) {
+	if (breq->qidx < 0 || breq->qidx >= bc->queue_num) {
+		WPRINTF(("%s: invalid queue index %d\n", __func__, breq->qidx));
+		return EINVAL;
+	}
+	bq = &bc->queues[breq->qidx];
+
+	pthread_mutex_lock(&bq->mtx);
+	if (!TAILQ_EMPTY(&bq->freeq)) {
 		/*
 		 * Enqueue and inform the block i/o thread
 		 * that there is work available
 		 */
-		if (blockif_enqueue(bc, breq, op))
-			pthread_cond_signal(&bc->cond);
+		if (blockif_enqueue(bq, breq, op)) {
+#ifdef HAVE_LIBURING
+			if (bc->aio_mode == BLOCKIF_AIO_IO_URING)
+				blockif_iou_queue(bq);
+			else
+#endif
+				pthread_cond_signal(&bq->cond);
+		}
 	} else {
 		/*
 		 * Callers are not allowed to enqueue more than
@@ -798,7 +1340,7 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		 */
 		err = E2BIG;
 	}
-	pthread_mutex_unlock(&bc->mtx);
+	pthread_mutex_unlock(&bq->mtx);
 
 	return err;
 }
@@ -827,16 +1369,51 @@ blockif_discard(struct blockif_ctxt *bc, struct blockif_req *breq)
 	return blockif_request(bc, breq, BOP_DISCARD);
 }
 
+/*
+ * Batch the requests issued on queue qidx until blockif_unplug() into a
+ * single submission, e.g. all the requests found on one virtqueue kick.
+ * Only the io_uring engine makes use of it.
+ */
+void
+blockif_plug(struct blockif_ctxt *bc, int qidx)
+{
+	struct blockif_queue *bq = &bc->queues[qidx];
+
+	pthread_mutex_lock(&bq->mtx);
+	bq->plugged++;
+	pthread_mutex_unlock(&bq->mtx);
+}
+
+void
+blockif_unplug(struct blockif_ctxt *bc, int qidx)
+{
+	struct blockif_queue *bq = &bc->queues[qidx];
+
+	pthread_mutex_lock(&bq->mtx);
+	bq->plugged--;
+#ifdef HAVE_LIBURING
+	if (bq->plugged == 0 && bc->aio_mode == BLOCKIF_AIO_IO_URING &&
+			bq->ring_queued > 0)
+		blockif_iou_submit(bq);
+#endif
+	pthread_mutex_unlock(&bq->mtx);
+}
+
 int
 blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 {
+	struct blockif_queue *bq;
 	struct blockif_elem *be;
 
-	pthread_mutex_lock(&bc->mtx);
+	if (breq->qidx < 0 || breq->qidx >= bc->queue_num)
+		return -1;
+	bq = &bc->queues[breq->qidx];
+
+	pthread_mutex_lock(&bq->mtx);
 	/*
 	 * Check pending requests.
 	 */
-	TAILQ_FOREACH(be, &bc->pendq, link) {
+	TAILQ_FOREACH(be, &bq->pendq, link) {
 		if (be->req == breq)
 			break;
 	}
@@ -844,8 +1421,8 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		/*
 		 * Found it.
 		 */
-		blockif_complete(bc, be);
-		pthread_mutex_unlock(&bc->mtx);
+		blockif_complete(bq, be);
+		pthread_mutex_unlock(&bq->mtx);
 
 		return 0;
 	}
@@ -853,7 +1430,7 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 	/*
 	 * Check in-flight requests.
 	 */
-	TAILQ_FOREACH(be, &bc->busyq, link) {
+	TAILQ_FOREACH(be, &bq->busyq, link) {
 		if (be->req == breq)
 			break;
 	}
@@ -861,10 +1438,22 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		/*
 		 * Didn't find it.
 		 */
-		pthread_mutex_unlock(&bc->mtx);
+		pthread_mutex_unlock(&bq->mtx);
 		return -1;
 	}
 
+#ifdef HAVE_LIBURING
+	/*
+	 * Same as for the threads below: the request is stopped, and its
+	 * callback is invoked when the completion is reaped.
+	 */
+	if (bc->aio_mode == BLOCKIF_AIO_IO_URING) {
+		blockif_iou_cancel(bq, be);
+		pthread_mutex_unlock(&bq->mtx);
+		return -EBUSY;
+	}
+#endif
+
 	/*
 	 * Interrupt the processing thread to force it return
 	 * prematurely via it's normal callback path.
@@ -893,7 +1482,7 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 		pthread_mutex_unlock(&bse.mtx);
 	}
 
-	pthread_mutex_unlock(&bc->mtx);
+	pthread_mutex_unlock(&bq->mtx);
 
 	/*
 	 * The processing thread has been interrupted.  Since it's not
@@ -905,28 +1494,47 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 int
 blockif_close(struct blockif_ctxt *bc)
 {
+	struct blockif_queue *bq;
 	void *jval;
-	int i;
+	int i, j;
 
 	sub_file_unlock(bc);
 
 	/*
-	 * Stop the block i/o thread
+	 * Stop the block i/o threads
 	 */
-	pthread_mutex_lock(&bc->mtx);
-	bc->closing = 1;
-	pthread_cond_broadcast(&bc->cond);
-	pthread_mutex_unlock(&bc->mtx);
+	for (i = 0; i < bc->queue_num; i++) {
+		bq = &bc->queues[i];
+		pthread_mutex_lock(&bq->mtx);
+		bc->closing = 1;
+		pthread_cond_broadcast(&bq->cond);
+		pthread_mutex_unlock(&bq->mtx);
+	}
 
-	for (i = 0; i < BLOCKIF_NUMTHR; i++)
-		pthread_join(bc->btid[i], &jval);
+	for (i = 0; i < bc->queue_num; i++) {
+		bq = &bc->queues[i];
+#ifdef HAVE_LIBURING
+		if (bc->aio_mode == BLOCKIF_AIO_IO_URING)
+			blockif_iou_deinit(bq);
+		else
+#endif
+		{
+			for (j = 0; j < BLOCKIF_NUMTHR; j++)
+				pthread_join(bq->btid[j], &jval);
+		}
+	}
 
 	/* XXX Cancel queued i/o's ??? */
 
 	/*
 	 * Release resources
 	 */
+	if (bc->cow)
+		cow_close(bc->cow);
 	close(bc->fd);
+	pthread_cond_destroy(&bc->sync_cond);
+	pthread_mutex_destroy(&bc->sync_mtx);
+	free(bc->queues);
 	free(bc);
 
 	return 0;
@@ -1007,6 +1615,12 @@ blockif_queuesz(struct blockif_ctxt *bc)
 	return (BLOCKIF_MAXREQ - 1);
 }
 
+int
+blockif_queue_num(struct blockif_ctxt *bc)
+{
+	return bc->queue_num;
+}
+
 int
 blockif_is_ro(struct blockif_ctxt *bc)
 {
@@ -629,6 +629,8 @@ modify_bar_registration(struct pci_vdev *dev, int idx, int registration)
 		iop.size = dev->bar[idx].size;
 		if (registration) {
 			iop.flags = IOPORT_F_INOUT;
+			if (dev->dev_ops->vdev_mt_safe)
+				iop.flags |= IOPORT_F_MT_SAFE;
 			iop.handler = pci_emul_io_handler;
 			iop.arg = dev;
 			error = register_inout(&iop);
@@ -643,6 +645,8 @@ modify_bar_registration(struct pci_vdev *dev, int idx, int registration)
 		mr.size = dev->bar[idx].size;
 		if (registration) {
 			mr.flags = MEM_F_RW;
+			if (dev->dev_ops->vdev_mt_safe)
+				mr.flags |= MEM_F_MT_SAFE;
 			mr.handler = pci_emul_mem_handler;
 			mr.arg1 = dev;
 			mr.arg2 = idx;
@@ -67,13 +67,37 @@ void iothread_handler(void *arg)
 	int idx = viothrd->idx;
 	struct virtio_vq_info *vq = &base->queues[idx];
 
-	if (viothrd->iothread_run) {
-		if (base->mtx)
-			pthread_mutex_lock(base->mtx);
+	if (base->mtx)
+		pthread_mutex_lock(base->mtx);
+	/* a kick may still be delivered after a reset stopped the iothread */
+	if (viothrd->ioevent_started && viothrd->iothread_run)
+		(*viothrd->iothread_run)(base, vq);
+	if (base->mtx)
+		pthread_mutex_unlock(base->mtx);
+}
+
+/*
+ * Called from the iothread poll loop. The queue is only looked at under the
+ * device lock, and a busy lock is taken as no work: the holder may be
+ * waiting in iothread_del() for this very poll pass.
+ */
+static bool
+iothread_poll_handler(void *arg)
+{
+	struct virtio_iothread *viothrd = arg;
+	struct virtio_base *base = viothrd->base;
+	struct virtio_vq_info *vq = &base->queues[viothrd->idx];
+	bool found = false;
+
+	if (base->mtx && pthread_mutex_trylock(base->mtx) != 0)
+		return false;
+	if (viothrd->ioevent_started && viothrd->iothread_run && vq_has_descs(vq)) {
 		(*viothrd->iothread_run)(base, vq);
-		if (base->mtx)
-			pthread_mutex_unlock(base->mtx);
+		found = true;
 	}
+	if (base->mtx)
+		pthread_mutex_unlock(base->mtx);
+	return found;
 }
 
 void
@@ -104,14 +128,17 @@ virtio_set_iothread(struct virtio_base *base,
 			vq->viothrd.idx = idx;
 			vq->viothrd.iomvt.arg = &vq->viothrd;
 			vq->viothrd.iomvt.run = iothread_handler;
+			vq->viothrd.iomvt.poll = iothread_poll_handler;
 			vq->viothrd.iomvt.fd = vq->viothrd.kick_fd;
 
-			if (!iothread_add(vq->viothrd.kick_fd, &vq->viothrd.iomvt))
+			/* queue idx of a device pinned to iothread n goes to iothread n + idx */
+			if (!iothread_add(base->iothread_idx < 0 ? -1 : base->iothread_idx + idx,
+					vq->viothrd.kick_fd, &vq->viothrd.iomvt))
 				if (!virtio_register_ioeventfd(base, idx, true, vq->viothrd.kick_fd))
 					vq->viothrd.ioevent_started = true;
 		} else {
 			if (!virtio_register_ioeventfd(base, idx, false, vq->viothrd.kick_fd))
-				if (!iothread_del(vq->viothrd.kick_fd)) {
+				if (!iothread_del(vq->viothrd.kick_fd, &vq->viothrd.iomvt)) {
 					vq->viothrd.ioevent_started = false;
 					if (vq->viothrd.kick_fd) {
 						close(vq->viothrd.kick_fd);
@@ -161,7 +188,7 @@ virtio_poll_timer(void *arg, uint64_t nexp)
 		vq = &base->queues[i];
 		if(!vq_ring_ready(vq))
 			continue;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_set_used_ring_flags(vq);
 		/* TODO: call notify when necessary */
 		if (vq->notify)
 			(*vq->notify)(DEV_STRUCT(base), vq);
@@ -205,6 +232,7 @@ virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
 	base->dev = dev;
 	dev->arg = base;
 	base->backend_type = backend_type;
+	base->iothread_idx = -1;
 
 	base->queues = queues;
 	for (i = 0; i < vops->nvq; i++) {
@@ -253,6 +281,9 @@ virtio_reset_dev(struct virtio_base *base)
 		vq->gpa_used[0] = 0;
 		vq->gpa_used[1] = 0;
 		vq->enabled = 0;
+		free(vq->chain_len);
+		vq->chain_len = NULL;
+		vq->chain_heads = NULL;
 	}
 	base->negotiated_caps = 0;
 	base->curq = 0;
@@ -394,6 +425,83 @@ error:
 	pr_err("%s: vq enable failed\n", __func__);
 }
 
+/*
+ * Initialize the currently-selected packed virtqueue (base->curq).
+ * The desc, avail and used addresses give the descriptor ring, the
+ * driver event suppression and the device event suppression areas.
+ */
+static void
+virtio_vq_enable_packed(struct virtio_base *base)
+{
+	struct virtio_vq_info *vq;
+	uint16_t qsz;
+	uint64_t phys;
+	size_t size;
+	char *vb;
+
+	vq = &base->queues[base->curq];
+	qsz = vq->qsize;
+	if (qsz == 0 || qsz > 32768)
+		goto error;
+
+	/* descriptor ring */
+	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
+	size = qsz * sizeof(struct vring_packed_desc);
+	vb = paddr_guest2host(base->dev->vmctx, phys, size);
+	if (!vb)
+		goto error;
+	vq->packed_desc = (struct vring_packed_desc *)vb;
+
+	/* driver event suppression */
+	phys = (((uint64_t)vq->gpa_avail[1]) << 32) | vq->gpa_avail[0];
+	size = sizeof(struct vring_packed_desc_event);
+	vb = paddr_guest2host(base->dev->vmctx, phys, size);
+	if (!vb)
+		goto error;
+	vq->driver_event = (struct vring_packed_desc_event *)vb;
+
+	/* device event suppression */
+	phys = (((uint64_t)vq->gpa_used[1]) << 32) | vq->gpa_used[0];
+	vb = paddr_guest2host(base->dev->vmctx, phys, size);
+	if (!vb)
+		goto error;
+	vq->device_event = (struct vring_packed_desc_event *)vb;
+
+	/*
+	 * Chain length of each buffer id, then the heads of the
+	 * chains taken last, both qsz entries.
+	 */
+	free(vq->chain_len);
+	vq->chain_len = calloc(2 * qsz, sizeof(uint16_t));
+	if (!vq->chain_len)
+		goto error;
+	vq->chain_heads = vq->chain_len + qsz;
+	vq->head_pos = 0;
+
+	vq->desc = NULL;
+	vq->avail = NULL;
+	vq->used = NULL;
+
+	/* Both wrap counters start at 1. */
+	vq->last_avail = 0;
+	vq->avail_wrap = true;
+	vq->used_idx = 0;
+	vq->used_wrap = true;
+	vq->used_moved = false;
+	vq->save_used = 0;
+
+	/* Mark queue as enabled. */
+	vq->enabled = true;
+
+	/* Mark queue as allocated after initialization is complete. */
+	mb();
+	vq->flags = VQ_ALLOC | VQ_PACKED;
+	return;
+ error:
+	vq->flags = 0;
+	pr_err("%s: packed vq enable failed\n", __func__);
+}
+
 /*
  * Initialize the currently-selected virtio queue (base->curq).
  * The guest just gave us the gpa of desc array, avail ring and
@@ -409,8 +517,14 @@ virtio_vq_enable(struct virtio_base *base)
 	size_t size;
 	char *vb;
 
+	if (base->negotiated_caps & (1UL << VIRTIO_F_RING_PACKED)) {
+		virtio_vq_enable_packed(base);
+		return;
+	}
+
 	vq = &base->queues[base->curq];
 	qsz = vq->qsize;
+	vq->packed_desc = NULL;
 
 	/* descriptors */
 	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
@@ -478,6 +592,155 @@ _vq_record(int i, volatile struct vring_desc *vd, struct vmctx *ctx,
 }
 #define	VQ_MAX_DESCRIPTORS	512	/* see below */
 
+/*
+ * Helper inline for vq_getchain_packed(): record the i'th "real"
+ * packed descriptor.
+ * Return 0 on success and -1 when i is out of range  or mapping
+ *        fails.
+ */
+static inline int
+_vq_record_packed(int i, volatile struct vring_packed_desc *vd,
+		  struct vmctx *ctx, struct iovec *iov, int n_iov,
+		  uint16_t *flags) {
+
+	void *host_addr;
+
+	if (i >= n_iov)
+		return -1;
+	host_addr = paddr_guest2host(ctx, vd->addr, vd->len);
+	if (!host_addr)
+		return -1;
+	iov[i].iov_base = host_addr;
+	iov[i].iov_len = vd->len;
+	if (flags != NULL)
+		flags[i] = vd->flags;
+	return 0;
+}
+
+/*
+ * vq_getchain() for packed rings.  The chain is the run of ring
+ * descriptors starting at last_avail that have NEXT set, plus the
+ * one that ends it; any of them may point to a table of indirect
+ * descriptors, all of which are used.  The buffer id of the last
+ * descriptor is returned in *pidx, and the chain length is recorded
+ * under it so that vq_relchain() knows how many slots to skip.
+ */
+static int
+vq_getchain_packed(struct virtio_vq_info *vq, uint16_t *pidx,
+		   struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	int i;
+	u_int ndesc, n_indir, j;
+	uint16_t idx, id, dflags;
+	bool wrap;
+
+	volatile struct vring_packed_desc *vdir, *vindir;
+	struct vmctx *ctx;
+	struct virtio_base *base;
+	const char *name;
+
+	base = vq->base;
+	name = base->vops->name;
+
+	if (!vq_packed_desc_avail(vq))
+		return 0;
+
+	/*
+	 * Read the rest of the descriptors only after the flags of
+	 * the head said they are available.
+	 */
+	atomic_thread_fence();
+
+	ctx = base->dev->vmctx;
+	idx = vq->last_avail;
+	wrap = vq->avail_wrap;
+	i = 0;
+	for (ndesc = 1; ; ndesc++) {
+		vdir = &vq->packed_desc[idx];
+		dflags = vdir->flags;
+		id = vdir->id;
+		if (++idx == vq->qsize) {
+			idx = 0;
+			wrap = !wrap;
+		}
+
+		if ((dflags & VRING_DESC_F_INDIRECT) == 0) {
+			if (_vq_record_packed(i, vdir, ctx, iov, n_iov, flags)) {
+				pr_err("%s: mapping to host failed\r\n", name);
+				goto bad;
+			}
+			i++;
+		} else if ((base->device_caps &
+		    (1 << VIRTIO_RING_F_INDIRECT_DESC)) == 0) {
+			pr_err("%s: descriptor has forbidden INDIRECT flag, "
+			    "driver confused?\r\n",
+			    name);
+			goto bad;
+		} else {
+			n_indir = vdir->len / 16;
+			if ((vdir->len & 0xf) || n_indir == 0) {
+				pr_err("%s: invalid indir len 0x%x, "
+				    "driver confused?\r\n",
+				    name, (u_int)vdir->len);
+				goto bad;
+			}
+			vindir = paddr_guest2host(ctx,
+			    vdir->addr, vdir->len);
+			if (!vindir) {
+				pr_err("%s cannot get host memory\r\n", name);
+				goto bad;
+			}
+			/*
+			 * Indirect descriptors of a packed ring are
+			 * used in order, with no NEXT or INDIRECT.
+			 */
+			for (j = 0; j < n_indir; j++) {
+				if (_vq_record_packed(i, &vindir[j], ctx, iov,
+				    n_iov, flags)) {
+					pr_err("%s: mapping to host failed\r\n",
+					    name);
+					goto bad;
+				}
+				if (++i > VQ_MAX_DESCRIPTORS)
+					goto loopy;
+			}
+		}
+
+		if ((dflags & VRING_DESC_F_NEXT) == 0)
+			break;
+		if (ndesc == vq->qsize || i > VQ_MAX_DESCRIPTORS)
+			goto loopy;
+	}
+
+	if (id >= vq->qsize) {
+		pr_err("%s: buffer id %u out of range, "
+		    "driver confused?\r\n",
+		    name, (u_int)id);
+		goto bad;
+	}
+	vq->chain_len[id] = ndesc;
+
+	/* remember where this chain started for vq_retchain() */
+	vq->chain_heads[vq->head_pos] = vq->last_avail |
+		(vq->avail_wrap << VRING_PACKED_EVENT_F_WRAP_CTR);
+	if (++vq->head_pos == vq->qsize)
+		vq->head_pos = 0;
+
+	vq->last_avail = idx;
+	vq->avail_wrap = wrap;
+	*pidx = id;
+	return i;
+
+loopy:
+	pr_err("%s: descriptor loop? count > %d - driver confused?\r\n",
+	    name, i);
+bad:
+	/* skip what was walked, as the split ring does */
+	vq->last_avail = idx;
+	vq->avail_wrap = wrap;
+	return -1;
+}
+
 /*
  * Examine the chain of descriptors starting at the "next one" to
  * make sure that they describe a sensible request.  If so, return
@@ -530,6 +793,9 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	struct virtio_base *base;
 	const char *name;
 
+	if (vq_is_packed(vq))
+		return vq_getchain_packed(vq, pidx, iov, n_iov, flags);
+
 	base = vq->base;
 	name = base->vops->name;
 
@@ -654,9 +920,58 @@ loopy:
 void
 vq_retchain(struct virtio_vq_info *vq)
 {
+	uint16_t head;
+
+	if (vq_is_packed(vq)) {
+		vq->head_pos = vq->head_pos ? vq->head_pos - 1 : vq->qsize - 1;
+		head = vq->chain_heads[vq->head_pos];
+		vq->last_avail = head & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+		vq->avail_wrap = !!(head >> VRING_PACKED_EVENT_F_WRAP_CTR);
+		return;
+	}
+
 	vq->last_avail--;
 }
 
+/*
+ * vq_relchain() for packed rings.  The used descriptor goes to the
+ * next used slot whatever order the buffers complete in; the driver
+ * finds the buffer by its id and skips the slots of its chain, and
+ * so does the device.
+ */
+static void
+vq_relchain_packed(struct virtio_vq_info *vq, uint16_t id, uint32_t iolen)
+{
+	volatile struct vring_packed_desc *vd;
+	uint16_t flags;
+
+	if (id >= vq->qsize) {
+		pr_err("%s: bad buffer id %u\r\n", vq->base->vops->name,
+		    (u_int)id);
+		return;
+	}
+
+	vd = &vq->packed_desc[vq->used_idx];
+	vd->id = id;
+	vd->len = iolen;
+
+	flags = iolen ? VRING_DESC_F_WRITE : 0;
+	if (vq->used_wrap)
+		flags |= (1 << VRING_PACKED_DESC_F_AVAIL) |
+			 (1 << VRING_PACKED_DESC_F_USED);
+
+	/* id and len must be visible before the flags hand the slot over */
+	atomic_thread_fence();
+	vd->flags = flags;
+
+	vq->used_idx += vq->chain_len[id];
+	if (vq->used_idx >= vq->qsize) {
+		vq->used_idx -= vq->qsize;
+		vq->used_wrap = !vq->used_wrap;
+	}
+	__atomic_store_n(&vq->used_moved, true, __ATOMIC_RELEASE);
+}
+
 /*
  * Return specified request chain to the guest, setting its I/O length
  * to the provided value.
@@ -681,6 +996,11 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	 * (I apologize for the two fields named idx; the
 	 * virtio spec calls the one that vue points to, "id"...)
 	 */
+	if (vq_is_packed(vq)) {
+		vq_relchain_packed(vq, idx, iolen);
+		return;
+	}
+
 	mask = vq->qsize - 1;
 	vuh = vq->used;
 
@@ -706,6 +1026,53 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
  * processing -- it's possible that descriptors became available after
  * that point.  (It's also typically a constant 1/True as well.)
  */
+/*
+ * vq_endchains() for packed rings.  The driver event suppression
+ * structure either enables, disables, or (with EVENT_IDX) asks for an
+ * interrupt once the used slots pass a given ring position.
+ */
+static void
+vq_endchains_packed(struct virtio_vq_info *vq, int used_all_avail)
+{
+	struct virtio_base *base;
+	uint16_t event_idx, new_idx, old_idx, off_wrap;
+	bool moved;
+	int intr;
+
+	atomic_thread_fence();
+
+	base = vq->base;
+	old_idx = vq->save_used;
+	vq->save_used = new_idx = vq->used_idx;
+	moved = __atomic_exchange_n(&vq->used_moved, false, __ATOMIC_ACQ_REL);
+
+	if (used_all_avail &&
+	    (base->negotiated_caps & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)))
+		intr = 1;
+	else if (!moved ||
+	    vq->driver_event->flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+		intr = 0;
+	else if (vq->driver_event->flags == VRING_PACKED_EVENT_FLAG_DESC &&
+	    (base->negotiated_caps & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+		/*
+		 * Put old, new and the event position on one line
+		 * with the previous lap below 0, then it's the same
+		 * check as for split rings.
+		 */
+		off_wrap = vq->driver_event->off_wrap;
+		event_idx = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+		if (new_idx <= old_idx)
+			old_idx -= vq->qsize;
+		if (vq->used_wrap != !!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR))
+			event_idx -= vq->qsize;
+		intr = (uint16_t)(new_idx - event_idx - 1) <
+			(uint16_t)(new_idx - old_idx);
+	} else
+		intr = 1;
+	if (intr)
+		vq_interrupt(base, vq);
+}
+
 void
 vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 {
@@ -713,6 +1080,11 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 	uint16_t event_idx, new_idx, old_idx;
 	int intr;
 
+	if (vq && vq_is_packed(vq)) {
+		vq_endchains_packed(vq, used_all_avail);
+		return;
+	}
+
 	if (!vq || !vq->used)
 		return;
 
@@ -769,7 +1141,25 @@ void vq_clear_used_ring_flags(struct virtio_base *base, struct virtio_vq_info *v
 	if (virtio_poll_enabled && backend_type == BACKEND_VBSU && polling_in_progress == 1)
 		return;
 
-	vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	if (vq_is_packed(vq))
+		vq->device_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+	else
+		vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+}
+
+/**
+ * @brief Helper function for setting used ring flags.
+ *
+ * Tell the guest not to notify on this virtqueue.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ */
+void vq_set_used_ring_flags(struct virtio_vq_info *vq)
+{
+	if (vq_is_packed(vq))
+		vq->device_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+	else if (vq->used != NULL)
+		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
 }
 
 struct config_reg {
@@ -1322,6 +1712,22 @@ static struct cap_region {
 		VIRTIO_PCI_CAP_NOTIFY_CFG},
 };
 
+/*
+ * Features offered on top of device_caps by the common layer. Packed
+ * rings are handled here for every modern device; vhost backends keep
+ * the split ring the kernel side implements.
+ */
+static inline uint64_t
+virtio_device_caps(struct virtio_base *base)
+{
+	uint64_t caps = base->device_caps;
+
+	if ((caps & (1UL << VIRTIO_F_VERSION_1)) &&
+	    base->backend_type == BACKEND_VBSU)
+		caps |= (1UL << VIRTIO_F_RING_PACKED);
+	return caps;
+}
+
 static inline int
 virtio_get_cap_id(uint64_t offset, int size)
 {
@@ -1370,9 +1776,9 @@ virtio_common_cfg_read(struct pci_vdev *dev, uint64_t offset, int size)
 		break;
 	case VIRTIO_PCI_COMMON_DF:
 		if (base->device_feature_select == 0)
-			value = base->device_caps & 0xffffffff;
+			value = virtio_device_caps(base) & 0xffffffff;
 		else if (base->device_feature_select == 1)
-			value = (base->device_caps >> 32) & 0xffffffff;
+			value = (virtio_device_caps(base) >> 32) & 0xffffffff;
 		else /* present 0, see 4.1.4.3.1 */
 			value = 0;
 		break;
@@ -1496,11 +1902,11 @@ virtio_common_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 		if (base->driver_feature_select < 2) {
 			value &= 0xffffffff;
 			if (base->driver_feature_select == 0) {
-				features = base->device_caps & value;
+				features = virtio_device_caps(base) & value;
 				base->negotiated_caps &= ~0xffffffffULL;
 			} else {
 				features = (value << 32)
-					& base->device_caps;
+					& virtio_device_caps(base);
 				base->negotiated_caps &= 0xffffffffULL;
 			}
 			base->negotiated_caps |= features;
@@ -1883,11 +2289,17 @@ virtio_pci_read(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		int baridx, uint64_t offset, int size)
 {
 	struct virtio_base *base = dev->arg;
+	uint64_t value;
 
 	if (base->flags & VIRTIO_USE_MSIX) {
 		if (baridx == pci_msix_table_bar(dev) ||
 		    baridx == pci_msix_pba_bar(dev)) {
-			return pci_emul_msix_tread(dev, offset, size);
+			if (base->mtx)
+				pthread_mutex_lock(base->mtx);
+			value = pci_emul_msix_tread(dev, offset, size);
+			if (base->mtx)
+				pthread_mutex_unlock(base->mtx);
+			return value;
 		}
 	}
 
@@ -1914,6 +2326,9 @@ virtio_pci_read(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
  * Handle virtio standard register writes, and dispatch other writes to
  * actual virtio device driver.
  *
+ * Reads and writes of all the virtio BARs run under base->mtx if the
+ * device has one, so such a device may set vdev_mt_safe.
+ *
  * @param ctx Pointer to struct vmctx representing VM context.
  * @param vcpu VCPU ID.
  * @param dev Pointer to struct pci_vdev which emulates a PCI device.
@@ -1931,7 +2346,11 @@ virtio_pci_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 	if (base->flags & VIRTIO_USE_MSIX) {
 		if (baridx == pci_msix_table_bar(dev) ||
 		    baridx == pci_msix_pba_bar(dev)) {
+			if (base->mtx)
+				pthread_mutex_lock(base->mtx);
 			pci_emul_msix_twrite(dev, offset, size, value);
+			if (base->mtx)
+				pthread_mutex_unlock(base->mtx);
 			return;
 		}
 	}
@@ -42,8 +42,10 @@
 #include "virtio.h"
 #include "block_if.h"
 #include "monitor.h"
+#include "dm_string.h"
 
 #define VIRTIO_BLK_RINGSZ	64
+#define VIRTIO_BLK_MAX_QUEUES	16
 #define VIRTIO_BLK_MAX_OPTS_LEN	256
 
 #define VIRTIO_BLK_S_OK	0
@@ -62,6 +64,8 @@
 /* Device can toggle its cache between writeback and writethrough modes */
 #define	VIRTIO_BLK_F_CONFIG_WCE	(1 << 11)
 
+#define	VIRTIO_BLK_F_MQ		(1 << 12)	/* Support more than one vq */
+
 #define	VIRTIO_BLK_F_DISCARD	(1 << 13)
 
 /*
@@ -101,8 +105,8 @@ struct virtio_blk_config {
 	} topology;
 	uint8_t	writeback;
 	uint8_t unused;
-	/* Reserve for num_queues when VIRTIO_BLK_F_MQ is support*/
-	uint16_t reserve;
+	/* The number of request vqs, valid when VIRTIO_BLK_F_MQ is negotiated */
+	uint16_t num_queues;
 	/* The maximum discard sectors (in 512-byte sectors) for one segment */
 	uint32_t max_discard_sectors;
 	/* The maximum number of discard segments */
@@ -156,12 +160,20 @@ struct virtio_blk_ioreq {
 struct virtio_blk {
 	struct virtio_base base;
 	pthread_mutex_t mtx;
-	struct virtio_vq_info vq;
+	struct virtio_ops ops;	/* per-device copy, nvq is num_vqs */
+	int num_vqs;
+	struct virtio_vq_info vqs[VIRTIO_BLK_MAX_QUEUES];
+	/*
+	 * Protects the rings of each vq. The requests of one vq are submitted
+	 * to and completed by the blockif queue of the same index, so the
+	 * vqs don't contend with each other on completion.
+	 */
+	pthread_mutex_t vq_mtx[VIRTIO_BLK_MAX_QUEUES];
 	struct virtio_blk_config cfg;
 	bool dummy_bctxt; /* Used in blockrescan. Indicate if the bctxt can be used */
 	struct blockif_ctxt *bc;
 	char ident[VIRTIO_BLK_BLK_ID_BYTES + 1];
-	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
+	struct virtio_blk_ioreq *ios;	/* VIRTIO_BLK_RINGSZ per vq */
 	uint8_t original_wce;
 };
 
@@ -172,7 +184,7 @@ static int virtio_blk_cfgwrite(void *, int, int, uint32_t);
 
 static struct virtio_ops virtio_blk_ops = {
 	"virtio_blk",		/* our name */
-	1,			/* we support 1 virtqueue */
+	1,			/* 1 virtqueue, more with VIRTIO_BLK_F_MQ */
 	sizeof(struct virtio_blk_config), /* config reg size */
 	virtio_blk_reset,	/* reset */
 	virtio_blk_notify,	/* device-wide qnotify */
@@ -186,9 +198,15 @@ static void
 virtio_blk_reset(void *vdev)
 {
 	struct virtio_blk *blk = vdev;
+	int i;
 
 	DPRINTF(("virtio_blk: device reset requested !\n"));
+	/* Keep the in-flight completions off the rings being reset */
+	for (i = 0; i < blk->num_vqs; i++)
+		pthread_mutex_lock(&blk->vq_mtx[i]);
 	virtio_reset_dev(&blk->base);
+	for (i = blk->num_vqs - 1; i >= 0; i--)
+		pthread_mutex_unlock(&blk->vq_mtx[i]);
 	/* Reset virtio-blk device only on valid bctxt*/
 	if (!blk->dummy_bctxt)
 		blockif_set_wce(blk->bc, blk->original_wce);
@@ -199,6 +217,8 @@ virtio_blk_done(struct blockif_req *br, int err)
 {
 	struct virtio_blk_ioreq *io = br->param;
 	struct virtio_blk *blk = io->blk;
+	struct virtio_vq_info *vq = &blk->vqs[br->qidx];
+	bool msix = pci_msix_enabled(blk->base.dev);
 
 	if (err)
 		DPRINTF(("virtio_blk: done with error = %d\n\r", err));
@@ -215,10 +235,18 @@ virtio_blk_done(struct blockif_req *br, int err)
 	 * Return the descriptor back to the host.
 	 * We wrote 1 byte (our status) to host.
 	 */
-	pthread_mutex_lock(&blk->mtx);
-	vq_relchain(&blk->vq, io->idx, 1);
-	vq_endchains(&blk->vq, !vq_has_descs(&blk->vq));
-	pthread_mutex_unlock(&blk->mtx);
+	/*
+	 * Without MSI-X the interrupt is raised under the device lock,
+	 * take it first to keep the lock order of the notify path.
+	 */
+	if (!msix)
+		pthread_mutex_lock(&blk->mtx);
+	pthread_mutex_lock(&blk->vq_mtx[br->qidx]);
+	vq_relchain(vq, io->idx, 1);
+	vq_endchains(vq, !vq_has_descs(vq));
+	pthread_mutex_unlock(&blk->vq_mtx[br->qidx]);
+	if (!msix)
+		pthread_mutex_unlock(&blk->mtx);
 }
 
 static void
@@ -259,7 +287,7 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 		return;
 	}
 
-	io = &blk->ios[idx];
+	io = &blk->ios[vq->num * VIRTIO_BLK_RINGSZ + idx];
 	if ((flags[0] & VRING_DESC_F_WRITE) != 0) {
 		WPRINTF(("%s: the type for hdr should not be VRING_DESC_F_WRITE\n", __func__));
 		virtio_blk_abort(vq, idx);
@@ -379,6 +407,7 @@ static void
 virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_blk *blk = vdev;
+	int qidx = vq->num;
 
 	if (!vq_has_descs(vq))
 		return;
@@ -393,8 +422,11 @@ virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 	 * So, after enable NOTIFY, need to check the queue again to dry the
 	 * requests in virtqueue.
 	 * */
+	pthread_mutex_lock(&blk->vq_mtx[qidx]);
+	if (!blk->dummy_bctxt)
+		blockif_plug(blk->bc, qidx);
 	do {
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_set_used_ring_flags(vq);
 		mb();
 		do {
 			virtio_blk_proc(blk, vq);
@@ -403,6 +435,9 @@ virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 		vq_clear_used_ring_flags(&blk->base, vq);
 		mb();
 	} while (vq_has_descs(vq));
+	if (!blk->dummy_bctxt)
+		blockif_unplug(blk->bc, qidx);
+	pthread_mutex_unlock(&blk->vq_mtx[qidx]);
 }
 
 static uint64_t
@@ -420,6 +455,9 @@ virtio_blk_get_caps(struct virtio_blk *blk, bool wb)
 	if (blockif_is_ro(blk->bc))
 		caps |= VIRTIO_BLK_F_RO;
 
+	if (blk->num_vqs > 1)
+		caps |= VIRTIO_BLK_F_MQ;
+
 	return caps;
 }
 
@@ -446,6 +484,7 @@ virtio_blk_update_config_space(struct virtio_blk *blk)
 	blk->cfg.topology.alignment_offset =
 	    (sto != 0) ? ((sts - sto) / sectsz) : 0;
 	blk->cfg.topology.min_io_size = 0;
+	blk->cfg.num_queues = blk->num_vqs;
 	blk->cfg.writeback = blockif_get_wce(blk->bc);
 	blk->original_wce = blk->cfg.writeback; /* save for reset */
 	if (blockif_candiscard(blk->bc)) {
@@ -465,9 +504,12 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	char *opts_tmp = NULL;
 	char *opts_start = NULL;
 	char *opt = NULL;
+	char *bpath = NULL;
 	u_char digest[16];
 	struct virtio_blk *blk;
 	bool use_iothread;
+	int iothread_idx;
+	int num_vqs;
 	int i;
 	pthread_mutexattr_t attr;
 	int rc;
@@ -476,6 +518,8 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	/* Assume the bctxt is valid, until identified otherwise */
 	dummy_bctxt = false;
 	use_iothread = false;
+	iothread_idx = -1;
+	num_vqs = 1;
 
 	if (opts == NULL) {
 		pr_err("virtio_blk: backing device required\n");
@@ -500,18 +544,45 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		WPRINTF(("%s: strdup failed\n", __func__));
 		return -1;
 	}
-	if (strstr(opts, "nodisk") == NULL) {
+
+	/* The device keywords "iothread[=<idx>]" and "mq=<num>" precede the path */
+	while (opts_tmp != NULL) {
 		opt = strsep(&opts_tmp, ",");
 		if (strcmp("iothread", opt) == 0) {
 			use_iothread = true;
+		} else if (strncmp("iothread=", opt, strlen("iothread=")) == 0) {
+			if (dm_strtoi(opt + strlen("iothread="), &opt, 10, &iothread_idx) ||
+					iothread_idx < 0 || iothread_idx >= IOTHREAD_MAX) {
+				pr_err("virtio_blk: invalid iothread, should be 0 ~ %d\n",
+						IOTHREAD_MAX - 1);
+				free(opts_start);
+				return -1;
+			}
+			use_iothread = true;
+		} else if (strncmp("mq=", opt, strlen("mq=")) == 0) {
+			if (dm_strtoi(opt + strlen("mq="), &opt, 10, &num_vqs) ||
+					num_vqs < 1 || num_vqs > VIRTIO_BLK_MAX_QUEUES) {
+				pr_err("virtio_blk: invalid mq, should be 1 ~ %d\n",
+						VIRTIO_BLK_MAX_QUEUES);
+				free(opts_start);
+				return -1;
+			}
 		} else {
-			/* The opts_start is truncated by strsep, opts_tmp is also
-			 * changed by strsetp, so use opts which points to the
-			 * original parameter string
+			/* The opts_start is truncated by strsep, so use opts
+			 * which points to the original parameter string
 			 */
-			opts_tmp = opts;
+			bpath = opts + (opt - opts_start);
+			break;
 		}
-		bctxt = blockif_open(opts_tmp, bident);
+	}
+	if (bpath == NULL) {
+		pr_err("virtio_blk: backing device required\n");
+		free(opts_start);
+		return -1;
+	}
+
+	if (strstr(bpath, "nodisk") == NULL) {
+		bctxt = blockif_open(bpath, bident, num_vqs);
 		if (bctxt == NULL) {
 			pr_err("Could not open backing file");
 			free(opts_start);
@@ -530,17 +601,29 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		return -1;
 	}
 
+	blk->ios = calloc(num_vqs * VIRTIO_BLK_RINGSZ,
+			sizeof(struct virtio_blk_ioreq));
+	if (!blk->ios) {
+		WPRINTF(("virtio_blk: calloc returns NULL\n"));
+		if (bctxt)
+			blockif_close(bctxt);
+		free(blk);
+		return -1;
+	}
+
 	blk->bc = bctxt;
 	/* Update virtio-blk device struct of dummy ctxt*/
 	blk->dummy_bctxt = dummy_bctxt;
+	blk->num_vqs = num_vqs;
 
-	for (i = 0; i < VIRTIO_BLK_RINGSZ; i++) {
+	for (i = 0; i < num_vqs * VIRTIO_BLK_RINGSZ; i++) {
 		struct virtio_blk_ioreq *io = &blk->ios[i];
 
 		io->req.callback = virtio_blk_done;
 		io->req.param = io;
+		io->req.qidx = i / VIRTIO_BLK_RINGSZ;
 		io->blk = blk;
-		io->idx = i;
+		io->idx = i % VIRTIO_BLK_RINGSZ;
 	}
 
 	/* init mutex attribute properly to avoid deadlock */
@@ -557,12 +640,23 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		DPRINTF(("virtio_blk: pthread_mutex_init failed with "
 					"error %d!\n", rc));
 
+	for (i = 0; i < num_vqs; i++) {
+		rc = pthread_mutex_init(&blk->vq_mtx[i], &attr);
+		if (rc)
+			DPRINTF(("virtio_blk: pthread_mutex_init failed with "
+						"error %d!\n", rc));
+	}
+
 	/* init virtio struct and virtqueues */
-	virtio_linkup(&blk->base, &virtio_blk_ops, blk, dev, &blk->vq, BACKEND_VBSU);
+	blk->ops = virtio_blk_ops;
+	blk->ops.nvq = num_vqs;
+	virtio_linkup(&blk->base, &blk->ops, blk, dev, blk->vqs, BACKEND_VBSU);
 	blk->base.iothread = use_iothread;
+	blk->base.iothread_idx = iothread_idx;
 	blk->base.mtx = &blk->mtx;
 
-	blk->vq.qsize = VIRTIO_BLK_RINGSZ;
+	for (i = 0; i < num_vqs; i++)
+		blk->vqs[i].qsize = VIRTIO_BLK_RINGSZ;
 	/* blk->vq.vq_notify = we have no per-queue notify */
 
 	/*
@@ -605,10 +699,15 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	else
 		pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
+	/*
+	 * Each vq gets its own MSI-X vector, so the guest can bind the
+	 * vqs to different vCPUs.
+	 */
 	if (virtio_interrupt_init(&blk->base, virtio_uses_msix())) {
 		/* call close only for valid bctxt */
 		if (!blk->dummy_bctxt)
 			blockif_close(blk->bc);
+		free(blk->ios);
 		free(blk);
 		return -1;
 	}
@@ -645,6 +744,7 @@ virtio_blk_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			blockif_close(bctxt);
 		}
 		virtio_reset_dev(&blk->base);
+		free(blk->ios);
 		free(blk);
 	}
 }
@@ -744,7 +844,7 @@ virtio_blk_rescan(struct vmctx *ctx, struct pci_vdev *dev, char *newpath)
 
 	pr_err("name=%s, Path=%s, ident=%s\n", dev->name, newpath, bident);
 	/* update the bctxt for the virtio-blk device */
-	bctxt = blockif_open(newpath, bident);
+	bctxt = blockif_open(newpath, bident, blk->num_vqs);
 	if (bctxt == NULL) {
 		pr_err("Error opening backing file\n");
 		goto end;
@@ -817,6 +917,7 @@ end:
 
 struct pci_vdev_ops pci_ops_virtio_blk = {
 	.class_name	= "virtio-blk",
+	.vdev_mt_safe	= true,
 	.vdev_init	= virtio_blk_init,
 	.vdev_deinit	= virtio_blk_deinit,
 	.vdev_barwrite	= virtio_pci_write,
@@ -419,7 +419,7 @@ virtio_console_notify_rx(void *vdev, struct virtio_vq_info *vq)
 	if (!port->rx_ready) {
 		port->rx_ready = 1;
 		if (vq_has_descs(vq)) {
-			vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+			vq_set_used_ring_flags(vq);
 		}
 	}
 }
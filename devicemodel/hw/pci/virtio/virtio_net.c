@@ -44,6 +44,8 @@
 #include <linux/if_tun.h>
 #include <sys/socket.h>
 #include <linux/vhost.h>
+#include <linux/if_packet.h>
+#include <arpa/inet.h>
 
 #include "dm.h"
 #include "pci_core.h"
@@ -51,9 +53,15 @@
 #include "virtio.h"
 #include "vhost.h"
 #include "dm_string.h"
+#include "timer.h"
 
 #define VIRTIO_NET_RINGSZ	1024
 #define VIRTIO_NET_MAXSEGS	256
+#define VIRTIO_NET_BATCH	32	/* max chains handed to the backend at once */
+
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING	23
+#endif
 
 /*
  * Host capabilities.  Note that we only offer a few of these.
@@ -77,6 +85,10 @@
 #define	VIRTIO_NET_F_CTRL_VLAN	(1 << 19) /* control channel VLAN filtering */
 #define	VIRTIO_NET_F_GUEST_ANNOUNCE \
 				(1 << 21) /* guest can send gratuitous pkts */
+#define	VIRTIO_NET_F_MQ		(1 << 22) /* host supports multiple queues */
+
+/* offered only with more than one queue pair */
+#define VIRTIO_NET_S_MQCAPS	(VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ)
 
 #define VIRTIO_NET_S_HOSTCAPS      \
 	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | \
@@ -96,16 +108,37 @@
 struct virtio_net_config {
 	uint8_t  mac[6];
 	uint16_t status;
+	uint16_t max_virtqueue_pairs;
 } __attribute__((packed));
 
 /*
  * Queue definitions.
+ *
+ * Queue pair n uses vq 2n for rx and vq 2n + 1 for tx. The control
+ * queue follows the last pair, it only exists with more than one pair.
  */
 #define VIRTIO_NET_RXQ	0
 #define VIRTIO_NET_TXQ	1
-#define VIRTIO_NET_CTLQ	2	/* NB: not yet supported */
+#define VIRTIO_NET_CTLQ	2	/* control queue without VIRTIO_NET_F_MQ */
+
+#define VIRTIO_NET_MAX_QPAIRS	16
+#define VIRTIO_NET_MAXQ		(VIRTIO_NET_MAX_QPAIRS * 2 + 1)
+
+/*
+ * Control queue commands
+ */
+struct virtio_net_ctrl_hdr {
+	uint8_t		class;
+	uint8_t		cmd;
+} __attribute__((packed));
+
+#define VIRTIO_NET_OK	0
+#define VIRTIO_NET_ERR	1
 
-#define VIRTIO_NET_MAXQ	3
+#define VIRTIO_NET_CTRL_MQ			4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET		0
+
+#define VIRTIO_NET_CTRL_MAXLEN	64	/* largest command we accept */
 
 /*
  * Fixed network header size
@@ -132,23 +165,85 @@ static int virtio_net_debug;
  */
 struct vhost_net {
 	struct vhost_dev vdev;
-	struct vhost_vq vqs[VIRTIO_NET_MAXQ - 1];
+	struct vhost_vq vqs[2];		/* rx and tx of the only queue pair */
 	int tapfd;
 	bool vhost_started;
 };
 
+struct virtio_net;
+
+enum virtio_net_backend {
+	VIRTIO_NET_BE_NONE,
+	VIRTIO_NET_BE_TAP,	/* TAP or MacVTap device, one frame per syscall */
+	VIRTIO_NET_BE_PACKET	/* AF_PACKET socket, batched with {recv,send}mmsg */
+};
+
+/*
+ * One descriptor chain handed to the backend. For tx, iov[0] is the
+ * virtio-net header and there is a spare iov for the padding.
+ */
+struct virtio_net_pkt {
+	struct iovec	iov[VIRTIO_NET_MAXSEGS + 1];
+	int		iovcnt;
+	int		len;		/* frame length */
+	uint32_t	tlen;		/* length returned to the used ring */
+	uint16_t	idx;
+	void		*hdr;		/* rx header */
+};
+
+/*
+ * Interrupt coalescing state of one vq. The used chains are signaled once
+ * coalesce_frames of them are pending or coalesce_usecs have passed, or
+ * once they hold half the descriptors of the ring. Protected by mtx, which
+ * also covers putting chains on the used ring.
+ */
+struct virtio_net_coalesce {
+	struct virtio_vq_info *vq;
+	pthread_mutex_t	*mtx;		/* rx_mtx or tx_mtx of the pair */
+	struct acrn_timer timer;
+	int		pending;
+	int		pending_descs;
+	bool		armed;
+};
+
+/*
+ * Per-queue-pair struct. Each pair has its own TAP queue, rx event and
+ * tx thread, so the pairs are processed in parallel.
+ */
+struct virtio_net_qpair {
+	struct virtio_net *net;
+	int		idx;
+
+	int		fd;		/* TAP queue or packet socket */
+	struct mevent	*mevp;
+
+	int		rx_ready;
+	pthread_mutex_t	rx_mtx;
+	int		rx_in_progress;
+	struct virtio_net_coalesce rx_coal;
+	struct virtio_net_pkt *rx_pkts;	/* VIRTIO_NET_BATCH, packet backend */
+
+	pthread_t	tx_tid;
+	pthread_mutex_t	tx_mtx;
+	pthread_cond_t	tx_cond;
+	int		tx_in_progress;
+	struct virtio_net_coalesce tx_coal;
+	struct virtio_net_pkt *tx_pkts;	/* VIRTIO_NET_BATCH */
+};
+
 /*
  * Per-device struct
  */
 struct virtio_net {
 	struct virtio_base base;
-	struct virtio_vq_info queues[VIRTIO_NET_MAXQ - 1];
+	struct virtio_ops ops;	/* per-device copy, nvq depends on max_qpairs */
+	struct virtio_vq_info queues[VIRTIO_NET_MAXQ];
 	pthread_mutex_t mtx;
-	struct mevent	*mevp;
 
-	int		tapfd;
-
-	int		rx_ready;
+	struct virtio_net_qpair qpairs[VIRTIO_NET_MAX_QPAIRS];
+	int		max_qpairs;
+	int		curr_qpairs;	/* enabled by the guest */
+	int		teardown_cnt;	/* rx events not yet torn down */
 
 	volatile int	resetting;	/* set and checked outside lock */
 	volatile int	closing;	/* stop the tx i/o thread */
@@ -157,18 +252,16 @@ struct virtio_net {
 
 	struct virtio_net_config config;
 
-	pthread_mutex_t	rx_mtx;
-	int		rx_in_progress;
 	int		rx_vhdrlen;
 	int		rx_merge;	/* merged rx bufs in use */
-	pthread_t	tx_tid;
-	pthread_mutex_t	tx_mtx;
-	pthread_cond_t	tx_cond;
-	int		tx_in_progress;
 
-	void (*virtio_net_rx)(struct virtio_net *net);
-	void (*virtio_net_tx)(struct virtio_net *net, struct iovec *iov,
-			     int iovcnt, int len);
+	enum virtio_net_backend backend;
+	int		coalesce_frames;	/* 0: interrupt on every burst */
+	int		coalesce_usecs;
+
+	void (*virtio_net_rx)(struct virtio_net_qpair *qp);
+	void (*virtio_net_tx)(struct virtio_net_qpair *qp,
+			     struct virtio_net_pkt *pkts, int n);
 
 	struct vhost_net *vhost_net;
 	bool		use_vhost;
@@ -176,6 +269,8 @@ struct virtio_net {
 
 static void virtio_net_reset(void *vdev);
 static void virtio_net_tx_stop(struct virtio_net *net);
+static void virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq);
+static void virtio_net_ping_ctlq(void *vdev, struct virtio_vq_info *vq);
 static int virtio_net_cfgread(void *vdev, int offset, int size,
 	uint32_t *retval);
 static int virtio_net_cfgwrite(void *vdev, int offset, int size,
@@ -183,6 +278,7 @@ static int virtio_net_cfgwrite(void *vdev, int offset, int size,
 static void virtio_net_neg_features(void *vdev, uint64_t negotiated_features);
 static void virtio_net_set_status(void *vdev, uint64_t status);
 static void virtio_net_teardown(void *param);
+static void virtio_net_coalesce_reset(struct virtio_net_coalesce *coal);
 static struct vhost_net *vhost_net_init(struct virtio_base *base, int vhostfd,
 	int tapfd, int vq_idx);
 static int vhost_net_deinit(struct vhost_net *vhost_net);
@@ -191,7 +287,7 @@ static int vhost_net_stop(struct vhost_net *vhost_net);
 
 static struct virtio_ops virtio_net_ops = {
 	"vtnet",			/* our name */
-	VIRTIO_NET_MAXQ - 1,		/* we currently support 2 virtqueues */
+	2,				/* 1 queue pair, 2N + 1 vqs with MQ */
 	sizeof(struct virtio_net_config), /* config reg size */
 	virtio_net_reset,		/* reset */
 	NULL,				/* device-wide qnotify -- not used */
@@ -270,13 +366,19 @@ ether_aton(const char *a, struct ether_addr *e)
 static void
 virtio_net_txwait(struct virtio_net *net)
 {
-	pthread_mutex_lock(&net->tx_mtx);
-	while (net->tx_in_progress) {
-		pthread_mutex_unlock(&net->tx_mtx);
-		usleep(10000);
-		pthread_mutex_lock(&net->tx_mtx);
+	struct virtio_net_qpair *qp;
+	int i;
+
+	for (i = 0; i < net->max_qpairs; i++) {
+		qp = &net->qpairs[i];
+		pthread_mutex_lock(&qp->tx_mtx);
+		while (qp->tx_in_progress) {
+			pthread_mutex_unlock(&qp->tx_mtx);
+			usleep(10000);
+			pthread_mutex_lock(&qp->tx_mtx);
+		}
+		pthread_mutex_unlock(&qp->tx_mtx);
 	}
-	pthread_mutex_unlock(&net->tx_mtx);
 }
 
 /*
@@ -285,19 +387,51 @@ virtio_net_txwait(struct virtio_net *net)
 static void
 virtio_net_rxwait(struct virtio_net *net)
 {
-	pthread_mutex_lock(&net->rx_mtx);
-	while (net->rx_in_progress) {
-		pthread_mutex_unlock(&net->rx_mtx);
-		usleep(10000);
-		pthread_mutex_lock(&net->rx_mtx);
+	struct virtio_net_qpair *qp;
+	int i;
+
+	for (i = 0; i < net->max_qpairs; i++) {
+		qp = &net->qpairs[i];
+		pthread_mutex_lock(&qp->rx_mtx);
+		while (qp->rx_in_progress) {
+			pthread_mutex_unlock(&qp->rx_mtx);
+			usleep(10000);
+			pthread_mutex_lock(&qp->rx_mtx);
+		}
+		pthread_mutex_unlock(&qp->rx_mtx);
+	}
+}
+
+/*
+ * Only the TAP queues of the enabled pairs receive packets, the kernel
+ * stops steering packets to the detached ones.
+ */
+static void
+virtio_net_set_qpairs(struct virtio_net *net, int qpairs)
+{
+	struct ifreq ifr;
+	int i;
+
+	net->curr_qpairs = qpairs;
+	if (net->max_qpairs == 1)
+		return;
+
+	for (i = 0; i < net->max_qpairs; i++) {
+		if (net->qpairs[i].fd == -1)
+			continue;
+		memset(&ifr, 0, sizeof(ifr));
+		ifr.ifr_flags = (i < qpairs) ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+		if (ioctl(net->qpairs[i].fd, TUNSETQUEUE, (void *)&ifr) < 0)
+			DPRINTF(("vtnet: failed to set tap queue %d: %d\n",
+				i, errno));
 	}
-	pthread_mutex_unlock(&net->rx_mtx);
 }
 
 static void
 virtio_net_reset(void *vdev)
 {
 	struct virtio_net *net = vdev;
+	int i;
 
 	DPRINTF(("vtnet: device reset requested !\n"));
 
@@ -310,7 +444,12 @@ virtio_net_reset(void *vdev)
 	virtio_net_txwait(net);
 	virtio_net_rxwait(net);
 
-	net->rx_ready = 0;
+	for (i = 0; i < net->max_qpairs; i++) {
+		net->qpairs[i].rx_ready = 0;
+		virtio_net_coalesce_reset(&net->qpairs[i].rx_coal);
+		virtio_net_coalesce_reset(&net->qpairs[i].tx_coal);
+	}
+	virtio_net_set_qpairs(net, 1);
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
 
@@ -327,41 +466,164 @@ virtio_net_reset(void *vdev)
 static void
 virtio_net_tx_stop(struct virtio_net *net)
 {
+	struct virtio_net_qpair *qp;
 	void *jval;
+	int i;
+
+	for (i = 0; i < net->max_qpairs; i++) {
+		qp = &net->qpairs[i];
+		pthread_mutex_lock(&qp->tx_mtx);
+		net->closing = 1;
+		pthread_cond_broadcast(&qp->tx_cond);
+		pthread_mutex_unlock(&qp->tx_mtx);
+	}
 
-	pthread_mutex_lock(&net->tx_mtx);
-	net->closing = 1;
-	pthread_cond_broadcast(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
-
-	pthread_join(net->tx_tid, &jval);
+	for (i = 0; i < net->max_qpairs; i++)
+		pthread_join(net->qpairs[i].tx_tid, &jval);
 }
 
 /*
- * Called to send a buffer chain out to the tap device
+ * If the length is < 60, pad out to that and add the
+ * extra zero'd segment to the iov. There is always an
+ * extra iov available in the virtio_net_pkt.
  */
 static void
-virtio_net_tap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
-		  int len)
+virtio_net_tx_pad(struct virtio_net_pkt *pkt)
 {
 	static char pad[60]; /* all zero bytes */
+
+	if (pkt->len < 60) {
+		pkt->iov[pkt->iovcnt].iov_base = pad;
+		pkt->iov[pkt->iovcnt].iov_len = 60 - pkt->len;
+		pkt->iovcnt++;
+	}
+}
+
+/*
+ * Called to send buffer chains out to the tap device. iov[0] of each
+ * chain is the virtio-net header, which the tap device doesn't take.
+ */
+static void
+virtio_net_tap_tx(struct virtio_net_qpair *qp, struct virtio_net_pkt *pkts,
+		  int n)
+{
 	ssize_t ret;
+	int i;
 
-	if (net->tapfd == -1)
+	if (qp->fd == -1)
 		return;
 
-	/*
-	 * If the length is < 60, pad out to that and add the
-	 * extra zero'd segment to the iov. It is guaranteed that
-	 * there is always an extra iov available by the caller.
-	 */
-	if (len < 60) {
-		iov[iovcnt].iov_base = pad;
-		iov[iovcnt].iov_len = 60 - len;
-		iovcnt++;
+	/* the tap device takes one frame per write */
+	for (i = 0; i < n; i++) {
+		virtio_net_tx_pad(&pkts[i]);
+		ret = writev(qp->fd, &pkts[i].iov[1], pkts[i].iovcnt - 1);
+		(void)ret; /*avoid compiler warning*/
+	}
+}
+
+/*
+ * Called to send buffer chains out to the packet socket, all of them
+ * with a single sendmmsg() when the socket has room.
+ */
+static void
+virtio_net_packet_tx(struct virtio_net_qpair *qp, struct virtio_net_pkt *pkts,
+		     int n)
+{
+	struct mmsghdr msgs[VIRTIO_NET_BATCH];
+	int i, sent, ret;
+
+	if (qp->fd == -1)
+		return;
+
+	memset(msgs, 0, sizeof(msgs[0]) * n);
+	for (i = 0; i < n; i++) {
+		virtio_net_tx_pad(&pkts[i]);
+		msgs[i].msg_hdr.msg_iov = &pkts[i].iov[1];
+		msgs[i].msg_hdr.msg_iovlen = pkts[i].iovcnt - 1;
+	}
+
+	sent = 0;
+	while (sent < n) {
+		ret = sendmmsg(qp->fd, &msgs[sent], n - sent, 0);
+		if (ret <= 0) {
+			/*
+			 * The frame at msgs[sent] failed. Drop it like a
+			 * failed write to the tap device and go on.
+			 */
+			DPRINTF(("vtnet: sendmmsg failed: %d\n", errno));
+			sent++;
+			continue;
+		}
+		sent += ret;
+	}
+}
+
+/*
+ * Raise the interrupt of the coalesced chains once the timer expires.
+ */
+static void
+virtio_net_coalesce_timer(void *param, uint64_t nexp)
+{
+	struct virtio_net_coalesce *coal = param;
+
+	pthread_mutex_lock(coal->mtx);
+	coal->armed = false;
+	if (coal->pending > 0) {
+		coal->pending = 0;
+		coal->pending_descs = 0;
+		vq_endchains(coal->vq, !vq_has_descs(coal->vq));
+	}
+	pthread_mutex_unlock(coal->mtx);
+}
+
+/*
+ * Account the chains just put on the used ring, descs descriptors in all,
+ * and interrupt the guest if needed. With coalescing, the interrupt is held
+ * until coalesce_frames chains are pending or the timer expires. It is
+ * raised right away if flush is set because the guest has to refill the
+ * ring, or if the pending chains hold half the ring and the guest may run
+ * out of descriptors. Called with coal->mtx held.
+ */
+static void
+virtio_net_coalesce_used(struct virtio_net *net,
+			 struct virtio_net_coalesce *coal,
+			 int used, int descs, int used_all_avail, bool flush)
+{
+	struct itimerspec ts;
+
+	coal->pending += used;
+	coal->pending_descs += descs;
+	if (net->coalesce_frames == 0 || flush ||
+	    coal->pending >= net->coalesce_frames ||
+	    coal->pending_descs >= coal->vq->qsize / 2) {
+		coal->pending = 0;
+		coal->pending_descs = 0;
+		vq_endchains(coal->vq, used_all_avail);
+		return;
+	}
+
+	if (coal->pending == 0 || coal->armed)
+		return;
+
+	memset(&ts, 0, sizeof(ts));
+	ts.it_value.tv_sec = net->coalesce_usecs / 1000000;
+	ts.it_value.tv_nsec = (net->coalesce_usecs % 1000000) * 1000;
+	if (acrn_timer_settime(&coal->timer, &ts) == 0) {
+		coal->armed = true;
+	} else {
+		coal->pending = 0;
+		coal->pending_descs = 0;
+		vq_endchains(coal->vq, used_all_avail);
 	}
-	ret = writev(net->tapfd, iov, iovcnt);
-	(void)ret; /*avoid compiler warning*/
+}
+
+static void
+virtio_net_coalesce_reset(struct virtio_net_coalesce *coal)
+{
+	pthread_mutex_lock(coal->mtx);
+	coal->pending = 0;
+	coal->pending_descs = 0;
+	pthread_mutex_unlock(coal->mtx);
 }
 
 /*
@@ -400,54 +662,90 @@ rx_iov_trim(struct iovec *iov, int *niov, int tlen)
 	return riov;
 }
 
-static void
-virtio_net_tap_rx(struct virtio_net *net)
+/*
+ * Returns the rx vq when it can take frames. Otherwise a frame is
+ * dropped to be tried later and NULL is returned.
+ */
+static struct virtio_vq_info *
+virtio_net_rx_vq(struct virtio_net_qpair *qp)
 {
-	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	struct virtio_net *net = qp->net;
 	struct virtio_vq_info *vq;
-	void *vrx;
-	int len, n;
-	uint16_t idx;
 	ssize_t ret;
 
 	/*
 	 * Should never be called without a valid tap fd
 	 */
-	if (net->tapfd == -1) {
+	if (qp->fd == -1) {
 		WPRINTF(("vtnet: tapfd == -1\n"));
-		return;
+		return NULL;
 	}
 
 	/*
 	 * But, will be called when the rx ring hasn't yet
 	 * been set up or the guest is resetting the device.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!qp->rx_ready || net->resetting) {
 		/*
 		 * Drop the packet and try later.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
+		ret = read(qp->fd, dummybuf, sizeof(dummybuf));
 		(void)ret; /*avoid compiler warning*/
 
-		return;
+		return NULL;
 	}
 
 	/*
 	 * Check for available rx buffers
 	 */
-	vq = &net->queues[VIRTIO_NET_RXQ];
+	vq = &net->queues[qp->idx * 2 + VIRTIO_NET_RXQ];
 	if (!vq_has_descs(vq)) {
 		/*
 		 * Drop the packet and try later.  Interrupt on
 		 * empty, if that's negotiated.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
+		ret = read(qp->fd, dummybuf, sizeof(dummybuf));
 		(void)ret; /*avoid compiler warning*/
 
-		vq_endchains(vq, 1);
-		return;
+		virtio_net_coalesce_used(net, &qp->rx_coal, 0, 0, 1, true);
+		return NULL;
+	}
+
+	return vq;
+}
+
+/*
+ * The only valid field in the rx packet header is the
+ * number of buffers if merged rx bufs were negotiated.
+ */
+static inline void
+virtio_net_rx_hdr(struct virtio_net *net, void *vrx)
+{
+	memset(vrx, 0, net->rx_vhdrlen);
+
+	if (net->rx_merge) {
+		struct virtio_net_rxhdr *vrxh;
+
+		vrxh = vrx;
+		vrxh->vrh_bufs = 1;
 	}
+}
+
+static void
+virtio_net_tap_rx(struct virtio_net_qpair *qp)
+{
+	struct virtio_net *net = qp->net;
+	struct iovec iov[VIRTIO_NET_MAXSEGS], *riov;
+	struct virtio_vq_info *vq;
+	void *vrx;
+	int len, n, used;
+	uint16_t idx;
+
+	vq = virtio_net_rx_vq(qp);
+	if (vq == NULL)
+		return;
 
+	used = 0;
 	do {
 		/*
 		 * Get descriptor chain.
@@ -466,7 +764,7 @@ virtio_net_tap_rx(struct virtio_net *net)
 		if (riov == NULL)
 			return;
 
-		len = readv(net->tapfd, riov, n);
+		len = readv(qp->fd, riov, n);
 
 		if (len < 0 && errno == EWOULDBLOCK) {
 			/*
@@ -474,43 +772,103 @@ virtio_net_tap_rx(struct virtio_net *net)
 			 * entries.  Interrupt if needed/appropriate.
 			 */
 			vq_retchain(vq);
-			vq_endchains(vq, 0);
+			virtio_net_coalesce_used(net, &qp->rx_coal, used, 0, 0,
+						 false);
 			return;
 		}
 
+		virtio_net_rx_hdr(net, vrx);
+
 		/*
-		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
+		 * Release this chain and handle more chains.
 		 */
-		memset(vrx, 0, net->rx_vhdrlen);
+		vq_relchain(vq, idx, len + net->rx_vhdrlen);
+		used++;
+	} while (vq_has_descs(vq));
+
+	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
+	virtio_net_coalesce_used(net, &qp->rx_coal, used, 0, 1, true);
+}
+
+/*
+ * Fill up to VIRTIO_NET_BATCH rx chains with one recvmmsg() on the
+ * packet socket.
+ */
+static void
+virtio_net_packet_rx(struct virtio_net_qpair *qp)
+{
+	struct virtio_net *net = qp->net;
+	struct mmsghdr msgs[VIRTIO_NET_BATCH];
+	struct virtio_net_pkt *pkt;
+	struct virtio_vq_info *vq;
+	struct iovec *riov;
+	int i, n, cnt, got, used;
 
-		if (net->rx_merge) {
-			struct virtio_net_rxhdr *vrxh;
+	vq = virtio_net_rx_vq(qp);
+	if (vq == NULL)
+		return;
 
-			vrxh = vrx;
-			vrxh->vrh_bufs = 1;
+	used = 0;
+	do {
+		memset(msgs, 0, sizeof(msgs));
+		for (n = 0; n < VIRTIO_NET_BATCH && vq_has_descs(vq); n++) {
+			pkt = &qp->rx_pkts[n];
+			cnt = vq_getchain(vq, &pkt->idx, pkt->iov,
+					  VIRTIO_NET_MAXSEGS, NULL);
+			if (cnt < 1 || cnt > VIRTIO_NET_MAXSEGS) {
+				WPRINTF(("vtnet: virtio_net_packet_rx: vq_getchain = %d\n",
+					cnt));
+				break;
+			}
+			pkt->hdr = pkt->iov[0].iov_base;
+			riov = rx_iov_trim(pkt->iov, &cnt, net->rx_vhdrlen);
+			if (riov == NULL)
+				break;
+			msgs[n].msg_hdr.msg_iov = riov;
+			msgs[n].msg_hdr.msg_iovlen = cnt;
 		}
+		if (n == 0)
+			break;
+
+		got = recvmmsg(qp->fd, msgs, n, MSG_DONTWAIT, NULL);
+		if (got < 0)
+			got = 0;
+
+		for (i = 0; i < got; i++) {
+			pkt = &qp->rx_pkts[i];
+			virtio_net_rx_hdr(net, pkt->hdr);
+			vq_relchain(vq, pkt->idx,
+				    msgs[i].msg_len + net->rx_vhdrlen);
+		}
+		used += got;
 
-		/*
-		 * Release this chain and handle more chains.
-		 */
-		vq_relchain(vq, idx, len + net->rx_vhdrlen);
+		if (got < n) {
+			/*
+			 * No more packets, return the chains that are
+			 * left in reverse order of vq_getchain().
+			 */
+			for (i = got; i < n; i++)
+				vq_retchain(vq);
+			virtio_net_coalesce_used(net, &qp->rx_coal, used, 0, 0,
+						 false);
+			return;
+		}
 	} while (vq_has_descs(vq));
 
 	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
-	vq_endchains(vq, 1);
+	virtio_net_coalesce_used(net, &qp->rx_coal, used, 0, 1, true);
 }
 
 static void
 virtio_net_rx_callback(int fd, enum ev_type type, void *param)
 {
-	struct virtio_net *net = param;
+	struct virtio_net_qpair *qp = param;
 
-	pthread_mutex_lock(&net->rx_mtx);
-	net->rx_in_progress = 1;
-	net->virtio_net_rx(net);
-	net->rx_in_progress = 0;
-	pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_lock(&qp->rx_mtx);
+	qp->rx_in_progress = 1;
+	qp->net->virtio_net_rx(qp);
+	qp->rx_in_progress = 0;
+	pthread_mutex_unlock(&qp->rx_mtx);
 
 }
 
@@ -518,54 +876,78 @@ static void
 virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_net *net = vdev;
+	struct virtio_net_qpair *qp = &net->qpairs[vq->num / 2];
 
 	/*
 	 * A qnotify means that the rx process can now begin
 	 */
-	if (net->rx_ready == 0) {
-		net->rx_ready = 1;
-		if (vq->used != NULL) {
-			vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		}
+	if (qp->rx_ready == 0) {
+		qp->rx_ready = 1;
+		vq_set_used_ring_flags(vq);
 	}
 }
 
-static void
-virtio_net_proctx(struct virtio_net *net, struct virtio_vq_info *vq)
+/*
+ * Gather up to VIRTIO_NET_BATCH chains, hand them to the backend at once
+ * and release them. Returns the number of chains used, and adds the number
+ * of their descriptors to *descs.
+ */
+static int
+virtio_net_proctx(struct virtio_net_qpair *qp, struct virtio_vq_info *vq, int *descs)
 {
-	struct iovec iov[VIRTIO_NET_MAXSEGS + 1];
-	int i, n;
-	int plen, tlen;
-	uint16_t idx;
+	struct virtio_net_pkt *pkt;
+	int i, n, cnt;
+
+	for (n = 0; n < VIRTIO_NET_BATCH && vq_has_descs(vq); n++) {
+		pkt = &qp->tx_pkts[n];
+
+		/*
+		 * Obtain chain of descriptors.  The first one is
+		 * really the header descriptor, so we need to sum
+		 * up two lengths: packet length and transfer length.
+		 */
+		cnt = vq_getchain(vq, &pkt->idx, pkt->iov, VIRTIO_NET_MAXSEGS,
+				  NULL);
+		if (cnt < 1 || cnt > VIRTIO_NET_MAXSEGS) {
+			WPRINTF(("vtnet: virtio_net_proctx: vq_getchain = %d\n", cnt));
+			break;
+		}
+		pkt->iovcnt = cnt;
+		pkt->len = 0;
+		pkt->tlen = pkt->iov[0].iov_len;
+		for (i = 1; i < cnt; i++) {
+			pkt->len += pkt->iov[i].iov_len;
+			pkt->tlen += pkt->iov[i].iov_len;
+		}
+
+		DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r",
+			pkt->len, cnt));
+	}
+
+	if (n == 0)
+		return 0;
+
+	qp->net->virtio_net_tx(qp, qp->tx_pkts, n);
 
 	/*
-	 * Obtain chain of descriptors.  The first one is
-	 * really the header descriptor, so we need to sum
-	 * up two lengths: packet length and transfer length.
+	 * chains are processed, release them and set tlen. The coalesce timer
+	 * signals the used ring under tx_mtx, so it is updated under it too.
 	 */
-	n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-	if (n < 1 || n > VIRTIO_NET_MAXSEGS) {
-		WPRINTF(("vtnet: virtio_net_proctx: vq_getchain = %d\n", n));
-		return;
-	}
-	plen = 0;
-	tlen = iov[0].iov_len;
-	for (i = 1; i < n; i++) {
-		plen += iov[i].iov_len;
-		tlen += iov[i].iov_len;
+	pthread_mutex_lock(&qp->tx_mtx);
+	for (i = 0; i < n; i++) {
+		vq_relchain(vq, qp->tx_pkts[i].idx, qp->tx_pkts[i].tlen);
+		*descs += qp->tx_pkts[i].iovcnt;
 	}
+	pthread_mutex_unlock(&qp->tx_mtx);
 
-	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	net->virtio_net_tx(net, &iov[1], n - 1, plen);
-
-	/* chain is processed, release it and set tlen */
-	vq_relchain(vq, idx, tlen);
+	return n;
 }
 
 static void
 virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_net *net = vdev;
+	struct virtio_net_qpair *qp = &net->qpairs[vq->num / 2];
 
 	/*
 	 * Any ring entries to process?
@@ -574,11 +956,11 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 		return;
 
 	/* Signal the tx thread for processing */
-	pthread_mutex_lock(&net->tx_mtx);
-	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-	if (net->tx_in_progress == 0)
-		pthread_cond_signal(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_lock(&qp->tx_mtx);
+	vq_set_used_ring_flags(vq);
+	if (qp->tx_in_progress == 0)
+		pthread_cond_signal(&qp->tx_cond);
+	pthread_mutex_unlock(&qp->tx_mtx);
 }
 
 /*
@@ -587,27 +969,29 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 static void *
 virtio_net_tx_thread(void *param)
 {
-	struct virtio_net *net = param;
-	struct virtio_vq_info *vq = &net->queues[VIRTIO_NET_TXQ];
+	struct virtio_net_qpair *qp = param;
+	struct virtio_net *net = qp->net;
+	struct virtio_vq_info *vq = &net->queues[qp->idx * 2 + VIRTIO_NET_TXQ];
+	int n, used, descs;
 
 	/*
 	 * Let us wait till the tx queue pointers get initialised &
 	 * first tx signaled
 	 */
-	pthread_mutex_lock(&net->tx_mtx);
+	pthread_mutex_lock(&qp->tx_mtx);
 
 	while (!net->closing && !vq_ring_ready(vq))
-		pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+		pthread_cond_wait(&qp->tx_cond, &qp->tx_mtx);
 
 	if (net->closing) {
 		WPRINTF(("vtnet tx thread closing...\n"));
-		pthread_mutex_unlock(&net->tx_mtx);
+		pthread_mutex_unlock(&qp->tx_mtx);
 		return NULL;
 	}
 
 	for (;;) {
 		/* note - tx mutex is locked here */
-		net->tx_in_progress = 0;
+		qp->tx_in_progress = 0;
 
 		/*
 		 * Checking the avail ring here serves two purposes:
@@ -621,44 +1005,112 @@ virtio_net_tx_thread(void *param)
 			if (!net->resetting && vq_has_descs(vq))
 				break;
 
-			pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+			pthread_cond_wait(&qp->tx_cond, &qp->tx_mtx);
 
 			if (net->closing) {
 				WPRINTF(("vtnet tx thread closing...\n"));
-				pthread_mutex_unlock(&net->tx_mtx);
+				pthread_mutex_unlock(&qp->tx_mtx);
 				return NULL;
 			}
 		}
 
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-		net->tx_in_progress = 1;
-		pthread_mutex_unlock(&net->tx_mtx);
+		vq_set_used_ring_flags(vq);
+		qp->tx_in_progress = 1;
+		pthread_mutex_unlock(&qp->tx_mtx);
 
+		used = 0;
+		descs = 0;
 		do {
 			/*
 			 * Run through entries, placing them into
-			 * iovecs and sending when an end-of-packet
-			 * is found
+			 * iovecs and sending them in batches
 			 */
-			virtio_net_proctx(net, vq);
-		} while (vq_has_descs(vq));
+			n = virtio_net_proctx(qp, vq, &descs);
+			used += n;
+		} while (n > 0 && vq_has_descs(vq));
+
+		pthread_mutex_lock(&qp->tx_mtx);
 
 		/*
 		 * Generate an interrupt if needed.
 		 */
-		vq_endchains(vq, 1);
+		virtio_net_coalesce_used(net, &qp->tx_coal, used, descs, 1, false);
+	}
+}
+
+static uint8_t
+virtio_net_ctrl_mq(struct virtio_net *net, uint8_t cmd, uint8_t *data, int len)
+{
+	uint16_t qpairs;
+
+	if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET || len < sizeof(qpairs))
+		return VIRTIO_NET_ERR;
 
-		pthread_mutex_lock(&net->tx_mtx);
+	memcpy(&qpairs, data, sizeof(qpairs));
+	if (qpairs < 1 || qpairs > net->max_qpairs) {
+		WPRINTF(("vtnet: invalid queue pairs %d\n", qpairs));
+		return VIRTIO_NET_ERR;
 	}
+
+	DPRINTF(("vtnet: %d queue pairs enabled\n", qpairs));
+	virtio_net_set_qpairs(net, qpairs);
+	return VIRTIO_NET_OK;
 }
 
-#ifdef notyet
+/*
+ * Each control command is a chain of the readable class/cmd header and
+ * command data, followed by a writable ack byte.
+ */
 static void
 virtio_net_ping_ctlq(void *vdev, struct virtio_vq_info *vq)
 {
-	DPRINTF(("vtnet: control qnotify!\n\r"));
+	struct virtio_net *net = vdev;
+	struct virtio_net_ctrl_hdr *hdr;
+	struct iovec iov[VIRTIO_NET_MAXSEGS];
+	uint16_t flags[VIRTIO_NET_MAXSEGS];
+	uint8_t buf[VIRTIO_NET_CTRL_MAXLEN];
+	uint8_t *ack;
+	uint16_t idx;
+	int i, n, len, seg;
+
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, flags);
+		if (n < 2 || n > VIRTIO_NET_MAXSEGS) {
+			WPRINTF(("vtnet: virtio_net_ping_ctlq: vq_getchain = %d\n", n));
+			if (n <= 0)
+				break;
+			vq_relchain(vq, idx, 0);
+			continue;
+		}
+
+		if (iov[n - 1].iov_len < 1 ||
+				(flags[n - 1] & VRING_DESC_F_WRITE) == 0) {
+			WPRINTF(("vtnet: control ack is invalid\n"));
+			vq_relchain(vq, idx, 0);
+			continue;
+		}
+		ack = iov[n - 1].iov_base;
+
+		len = 0;
+		for (i = 0; i < n - 1 && len < sizeof(buf); i++) {
+			seg = MIN(iov[i].iov_len, sizeof(buf) - len);
+			memcpy(buf + len, iov[i].iov_base, seg);
+			len += seg;
+		}
+
+		*ack = VIRTIO_NET_ERR;
+		hdr = (struct virtio_net_ctrl_hdr *)buf;
+		if (len >= sizeof(*hdr) && hdr->class == VIRTIO_NET_CTRL_MQ)
+			*ack = virtio_net_ctrl_mq(net, hdr->cmd, buf + sizeof(*hdr),
+					len - sizeof(*hdr));
+		else
+			DPRINTF(("vtnet: unsupported control command\n"));
+
+		vq_relchain(vq, idx, 1);
+	}
+
+	vq_endchains(vq, 1);
 }
-#endif
 
 static int
 virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
@@ -738,7 +1190,7 @@ virtio_net_is_macvtap(char *devname, int *ifindex)
 }
 
 static int
-virtio_net_tap_open(char *devname)
+virtio_net_tap_open(char *devname, bool mq)
 {
 	char tbuf[IFNAMSIZ];
 	int tunfd, rc, macvtap_index;
@@ -764,6 +1216,8 @@ virtio_net_tap_open(char *devname)
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	if (mq)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
 
 	if (*devname) {
 		strncpy(ifr.ifr_name, devname, IFNAMSIZ);
@@ -782,12 +1236,16 @@ virtio_net_tap_open(char *devname)
 	return tunfd;
 }
 
+/*
+ * Open one TAP queue per queue pair. If the TAP device can't do multiple
+ * queues, fall back to a single queue pair.
+ */
 static void
-virtio_net_tap_setup(struct virtio_net *net, char *devname)
+virtio_net_tap_open_queues(struct virtio_net *net, char *devname)
 {
 	char tbuf[IFNAMSIZ];
-	int vhost_fd = -1;
-	int rc;
+	struct virtio_net_qpair *qp;
+	int opt, rc, i;
 
 	rc = snprintf(tbuf, IFNAMSIZ, "%s", devname);
 	if (rc < 0 || rc >= IFNAMSIZ) /* give warning if error or truncation happens */
@@ -796,32 +1254,116 @@ virtio_net_tap_setup(struct virtio_net *net, char *devname)
 	net->virtio_net_rx = virtio_net_tap_rx;
 	net->virtio_net_tx = virtio_net_tap_tx;
 
-	net->tapfd = virtio_net_tap_open(tbuf);
-	if (net->tapfd == -1) {
-		WPRINTF(("open of tap device %s failed\n", tbuf));
+	for (i = 0; i < net->max_qpairs; i++) {
+		qp = &net->qpairs[i];
+		qp->fd = virtio_net_tap_open(tbuf, net->max_qpairs > 1);
+		if (qp->fd == -1) {
+			WPRINTF(("open of tap device %s queue %d failed\n", tbuf, i));
+			break;
+		}
+
+		/*
+		 * Set non-blocking and register for read
+		 * notifications with the event loop
+		 */
+		opt = 1;
+		if (ioctl(qp->fd, FIONBIO, &opt) < 0) {
+			WPRINTF(("tap device O_NONBLOCK failed\n"));
+			close(qp->fd);
+			qp->fd = -1;
+			break;
+		}
+	}
+	DPRINTF(("open of tap device %s, %d queues\n", tbuf, i));
+
+	if (i == 0 && net->max_qpairs > 1) {
+		WPRINTF(("tap device %s has no multiple queues, use 1 queue pair\n",
+			tbuf));
+		net->max_qpairs = 1;
+		virtio_net_tap_open_queues(net, devname);
+	} else if (i > 0 && i < net->max_qpairs) {
+		net->max_qpairs = i;
+	}
+}
+
+/*
+ * Bind a packet socket to an existing host interface. The frames are
+ * moved with recvmmsg()/sendmmsg() in batches, but the socket has no
+ * queues to steer the flows to, so only one queue pair is used.
+ */
+static void
+virtio_net_packet_open(struct virtio_net *net, char *devname)
+{
+	struct virtio_net_qpair *qp = &net->qpairs[0];
+	struct sockaddr_ll sll;
+	struct packet_mreq mreq;
+	int fd, ifindex, opt;
+
+	net->virtio_net_rx = virtio_net_packet_rx;
+	net->virtio_net_tx = virtio_net_packet_tx;
+
+	if (net->max_qpairs > 1) {
+		WPRINTF(("vtnet: packet backend supports 1 queue pair only\n"));
+		net->max_qpairs = 1;
+	}
+
+	ifindex = virtio_net_get_ifindex(devname);
+	if (ifindex < 0) {
+		WPRINTF(("vtnet: no such interface %s\n", devname));
 		return;
 	}
-	DPRINTF(("open of tap device %s success!\n", tbuf));
 
-	/*
-	 * Set non-blocking and register for read
-	 * notifications with the event loop
-	 */
-	int opt = 1;
+	fd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK, htons(ETH_P_ALL));
+	if (fd < 0) {
+		WPRINTF(("vtnet: packet socket failed: %d\n", errno));
+		return;
+	}
 
-	if (ioctl(net->tapfd, FIONBIO, &opt) < 0) {
-		WPRINTF(("tap device O_NONBLOCK failed\n"));
-		close(net->tapfd);
-		net->tapfd = -1;
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+		WPRINTF(("vtnet: bind to %s failed: %d\n", devname, errno));
+		close(fd);
+		return;
 	}
 
+	/* don't loop the frames sent by the guest back to it */
+	opt = 1;
+	if (setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &opt,
+		       sizeof(opt)) < 0)
+		DPRINTF(("vtnet: PACKET_IGNORE_OUTGOING failed: %d\n", errno));
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.mr_ifindex = ifindex;
+	mreq.mr_type = PACKET_MR_PROMISC;
+	if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+		       sizeof(mreq)) < 0)
+		WPRINTF(("vtnet: promiscuous mode on %s failed: %d\n",
+			devname, errno));
+
+	qp->fd = fd;
+	DPRINTF(("open of packet socket on %s\n", devname));
+}
+
+static void
+virtio_net_tap_setup(struct virtio_net *net)
+{
+	struct virtio_net_qpair *qp;
+	int vhost_fd = -1;
+	int i;
+
+	if (net->qpairs[0].fd == -1)
+		return;
+
 	if (net->use_vhost) {
 		vhost_fd = open("/dev/vhost-net", O_RDWR);
 		if (vhost_fd < 0)
 			WPRINTF(("open of vhost-net failed\n"));
 		else {
 			net->vhost_net = vhost_net_init(&net->base, vhost_fd,
-				net->tapfd, 0);
+				net->qpairs[0].fd, 0);
 			if (!net->vhost_net) {
 				WPRINTF(("vhost_net_init failed, fallback "
 					"to userspace virtio\n"));
@@ -832,13 +1374,16 @@ virtio_net_tap_setup(struct virtio_net *net, char *devname)
 	}
 
 	if (vhost_fd < 0) {
-		net->mevp = mevent_add(net->tapfd, EVF_READ,
-				       virtio_net_rx_callback, net,
-				       virtio_net_teardown, net);
-		if (net->mevp == NULL) {
-			WPRINTF(("Could not register event\n"));
-			close(net->tapfd);
-			net->tapfd = -1;
+		for (i = 0; i < net->max_qpairs; i++) {
+			qp = &net->qpairs[i];
+			qp->mevp = mevent_add(qp->fd, EVF_READ,
+					      virtio_net_rx_callback, qp,
+					      virtio_net_teardown, qp);
+			if (qp->mevp == NULL) {
+				WPRINTF(("Could not register event\n"));
+				close(qp->fd);
+				qp->fd = -1;
+			}
 		}
 	}
 }
@@ -859,8 +1404,9 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	char *vtopts = NULL;
 	char *opt = NULL;
 	int mac_provided;
+	struct virtio_net_qpair *qp;
 	pthread_mutexattr_t attr;
-	int rc;
+	int i, rc;
 
 	net = calloc(1, sizeof(struct virtio_net));
 	if (!net) {
@@ -887,6 +1433,7 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	 */
 	mac_provided = 0;
 	net->vhost_net = NULL;
+	net->max_qpairs = 1;
 	if (opts != NULL) {
 		int err;
 
@@ -911,29 +1458,52 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 					return err;
 				}
 				mac_provided = 1;
+			} else if (!strncmp(opt, "coalesce=", 9)) {
+				opt += 9;
+				if (dm_strtoi(opt, &opt, 10, &net->coalesce_frames) ||
+						*opt != ':' ||
+						dm_strtoi(opt + 1, &opt, 10,
+							  &net->coalesce_usecs) ||
+						net->coalesce_frames < 0 ||
+						net->coalesce_frames > VIRTIO_NET_RINGSZ ||
+						net->coalesce_usecs < 1) {
+					pr_err("Invalid coalesce, should be <frames>:<usecs>\n");
+					free(devopts);
+					free(net);
+					return -1;
+				}
+			} else if (!strncmp(opt, "mq=", 3)) {
+				if (dm_strtoi(opt + 3, &opt, 10, &net->max_qpairs) ||
+						net->max_qpairs < 1 ||
+						net->max_qpairs > VIRTIO_NET_MAX_QPAIRS) {
+					pr_err("Invalid mq, should be 1 ~ %d\n",
+						VIRTIO_NET_MAX_QPAIRS);
+					free(devopts);
+					free(net);
+					return -1;
+				}
 			}
 		}
 	}
 
-	virtio_linkup(&net->base, &virtio_net_ops, net, dev, net->queues,
-		      net->use_vhost ? BACKEND_VHOST : BACKEND_VBSU);
-	net->base.mtx = &net->mtx;
-	net->base.device_caps = VIRTIO_NET_S_HOSTCAPS;
+	if (net->use_vhost && net->max_qpairs > 1) {
+		WPRINTF(("vtnet: vhost supports 1 queue pair only\n"));
+		net->max_qpairs = 1;
+	}
 
-	net->queues[VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
-	net->queues[VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_TXQ].notify = virtio_net_ping_txq;
-#ifdef notyet
-	net->queues[VIRTIO_NET_CTLQ].qsize = VIRTIO_NET_RINGSZ;
-	net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_ctlq;
-#endif
+	for (i = 0; i < VIRTIO_NET_MAX_QPAIRS; i++) {
+		qp = &net->qpairs[i];
+		qp->net = net;
+		qp->idx = i;
+		qp->fd = -1;
+		pthread_mutex_init(&qp->rx_mtx, NULL);
+		pthread_mutex_init(&qp->tx_mtx, NULL);
+		pthread_cond_init(&qp->tx_cond, NULL);
+	}
 
 	/*
 	 * Attempt to open the tap device
 	 */
-	net->tapfd = -1;
-
 	if (!devopts) {
 		WPRINTF(("virtio_net: invalid optional argument\n"));
 		free(net);
@@ -944,7 +1514,8 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		vtopts = tmp = strdup(opts);
 	}
 
-	if ((tmp != NULL) && (strncmp(tmp, "tap", 3) == 0)) {
+	if ((tmp != NULL) && ((strncmp(tmp, "tap", 3) == 0) ||
+			      (strncmp(tmp, "packet", 6) == 0))) {
 		type = strsep(&tmp, "=");
 		name = strsep(&tmp, ",");
 	}
@@ -957,10 +1528,89 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	if ((type != NULL) && (name != NULL)) {
 
 		if (strcmp(type, "tap") == 0) {
-			virtio_net_tap_setup(net, name);
+			net->backend = VIRTIO_NET_BE_TAP;
+			virtio_net_tap_open_queues(net, name);
+		} else if (strcmp(type, "packet") == 0) {
+			net->backend = VIRTIO_NET_BE_PACKET;
+			if (net->use_vhost) {
+				WPRINTF(("vtnet: vhost needs a tap device\n"));
+				net->use_vhost = false;
+			}
+			virtio_net_packet_open(net, name);
+		}
+	}
+
+	for (i = 0; i < net->max_qpairs; i++) {
+		qp = &net->qpairs[i];
+		qp->tx_pkts = calloc(VIRTIO_NET_BATCH, sizeof(*qp->tx_pkts));
+		if (net->backend == VIRTIO_NET_BE_PACKET)
+			qp->rx_pkts = calloc(VIRTIO_NET_BATCH,
+					     sizeof(*qp->rx_pkts));
+		if (!qp->tx_pkts || (net->backend == VIRTIO_NET_BE_PACKET &&
+				     !qp->rx_pkts)) {
+			WPRINTF(("virtio_net: calloc returns NULL\n"));
+			for (i = 0; i < net->max_qpairs; i++) {
+				if (net->qpairs[i].fd >= 0)
+					close(net->qpairs[i].fd);
+				free(net->qpairs[i].tx_pkts);
+				free(net->qpairs[i].rx_pkts);
+			}
+			free(vtopts);
+			free(devopts);
+			free(net);
+			return -1;
 		}
 	}
 
+	/*
+	 * With more than one queue pair, the vqs are rx0, tx0, rx1, tx1, ...
+	 * and the control queue.
+	 */
+	net->ops = virtio_net_ops;
+	if (net->max_qpairs > 1)
+		net->ops.nvq = net->max_qpairs * 2 + 1;
+	virtio_linkup(&net->base, &net->ops, net, dev, net->queues,
+		      net->use_vhost ? BACKEND_VHOST : BACKEND_VBSU);
+	net->base.mtx = &net->mtx;
+	net->base.device_caps = VIRTIO_NET_S_HOSTCAPS;
+	if (net->max_qpairs > 1)
+		net->base.device_caps |= VIRTIO_NET_S_MQCAPS;
+
+	for (i = 0; i < net->max_qpairs; i++) {
+		net->queues[i * 2 + VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
+		net->queues[i * 2 + VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
+		net->queues[i * 2 + VIRTIO_NET_TXQ].qsize = VIRTIO_NET_RINGSZ;
+		net->queues[i * 2 + VIRTIO_NET_TXQ].notify = virtio_net_ping_txq;
+	}
+	if (net->max_qpairs > 1) {
+		net->queues[net->max_qpairs * 2].qsize = VIRTIO_NET_RINGSZ;
+		net->queues[net->max_qpairs * 2].notify = virtio_net_ping_ctlq;
+	}
+	net->config.max_virtqueue_pairs = net->max_qpairs;
+	virtio_net_set_qpairs(net, 1);
+
+	for (i = 0; i < net->max_qpairs; i++) {
+		qp = &net->qpairs[i];
+		qp->rx_coal.vq = &net->queues[i * 2 + VIRTIO_NET_RXQ];
+		qp->rx_coal.mtx = &qp->rx_mtx;
+		qp->tx_coal.vq = &net->queues[i * 2 + VIRTIO_NET_TXQ];
+		qp->tx_coal.mtx = &qp->tx_mtx;
+		if (net->coalesce_frames == 0)
+			continue;
+
+		qp->rx_coal.timer.clockid = CLOCK_MONOTONIC;
+		qp->tx_coal.timer.clockid = CLOCK_MONOTONIC;
+		if (acrn_timer_init(&qp->rx_coal.timer,
+				    virtio_net_coalesce_timer, &qp->rx_coal) ||
+		    acrn_timer_init(&qp->tx_coal.timer,
+				    virtio_net_coalesce_timer, &qp->tx_coal)) {
+			WPRINTF(("vtnet: coalescing timer failed, disabled\n"));
+			net->coalesce_frames = 0;
+		}
+	}
+
+	virtio_net_tap_setup(net);
+
 	/*
 	 * The default MAC address is the standard NetApp OUI of 00-a0-98,
 	 * followed by an MD5 of the PCI slot/func number and dev name
@@ -1008,7 +1658,7 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
 	/* Link is up if we managed to open tap device */
-	net->config.status = (opts == NULL || net->tapfd >= 0);
+	net->config.status = (opts == NULL || net->qpairs[0].fd >= 0);
 
 	/* use BAR 1 to map MSI-X table and PBA, if we're using MSI-X */
 	if (virtio_interrupt_init(&net->base, virtio_uses_msix())) {
@@ -1025,22 +1675,18 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
-	net->rx_in_progress = 0;
-	pthread_mutex_init(&net->rx_mtx, NULL);
 
 	/*
-	 * Initialize tx semaphore & spawn TX processing thread.
-	 * As of now, only one thread for TX desc processing is
-	 * spawned.
+	 * Spawn one TX processing thread per queue pair.
 	 */
-	net->tx_in_progress = 0;
-	pthread_mutex_init(&net->tx_mtx, NULL);
-	pthread_cond_init(&net->tx_cond, NULL);
-	pthread_create(&net->tx_tid, NULL, virtio_net_tx_thread,
-		       (void *)net);
-	snprintf(tname, sizeof(tname), "vtnet-%d:%d tx", dev->slot,
-		 dev->func);
-	pthread_setname_np(net->tx_tid, tname);
+	for (i = 0; i < net->max_qpairs; i++) {
+		qp = &net->qpairs[i];
+		pthread_create(&qp->tx_tid, NULL, virtio_net_tx_thread,
+			       (void *)qp);
+		snprintf(tname, sizeof(tname), "vtnet-%d:%d tx%d", dev->slot,
+			 dev->func, i);
+		pthread_setname_np(qp->tx_tid, tname);
+	}
 
 	return 0;
 }
@@ -1087,6 +1733,17 @@ virtio_net_neg_features(void *vdev, uint64_t negotiated_features)
 
 	net->features = negotiated_features;
 
+	/*
+	 * Without VIRTIO_NET_F_MQ the guest drives only the first pair and
+	 * expects the control queue right after it.
+	 */
+	if (net->max_qpairs > 1) {
+		if (net->features & VIRTIO_NET_F_MQ)
+			net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_rxq;
+		else
+			net->queues[VIRTIO_NET_CTLQ].notify = virtio_net_ping_ctlq;
+	}
+
 	if (!(net->features & VIRTIO_NET_F_MRG_RXBUF)) {
 		net->rx_merge = 0;
 		/* non-merge rx header is 2 bytes shorter */
@@ -1105,8 +1762,8 @@ virtio_net_set_status(void *vdev, uint64_t status)
 
 	if (!net->vhost_net->vhost_started &&
 		(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
-		if (net->mevp)
-			mevent_disable(net->mevp);
+		if (net->qpairs[0].mevp)
+			mevent_disable(net->qpairs[0].mevp);
 
 		rc = vhost_net_start(net->vhost_net);
 		if (rc < 0) {
@@ -1121,35 +1778,68 @@ virtio_net_set_status(void *vdev, uint64_t status)
 	}
 }
 
+static void
+virtio_net_free(struct virtio_net *net)
+{
+	int i;
+
+	for (i = 0; i < net->max_qpairs; i++) {
+		if (net->qpairs[i].fd >= 0) {
+			close(net->qpairs[i].fd);
+			net->qpairs[i].fd = -1;
+		}
+		free(net->qpairs[i].tx_pkts);
+		free(net->qpairs[i].rx_pkts);
+	}
+
+	virtio_reset_dev(&net->base);
+	free(net);
+}
+
+/*
+ * Called for the rx event of each queue pair, the device is released
+ * with the last one.
+ */
 static void
 virtio_net_teardown(void *param)
 {
+	struct virtio_net_qpair *qp;
 	struct virtio_net *net;
 
-	net = (struct virtio_net *)param;
-	if (!net)
+	qp = (struct virtio_net_qpair *)param;
+	if (!qp)
 		return;
+	net = qp->net;
 
-	if (net->tapfd >= 0) {
-		close(net->tapfd);
-		net->tapfd = -1;
+	if (qp->fd >= 0) {
+		close(qp->fd);
+		qp->fd = -1;
 	} else
-		pr_err("net->tapfd is -1!\n");
+		pr_err("qp->fd is -1!\n");
 
-	virtio_reset_dev(&net->base);
-	free(net);
+	if (--net->teardown_cnt > 0)
+		return;
+
+	virtio_net_free(net);
 }
 
 static void
 virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
+	struct mevent *mevp[VIRTIO_NET_MAX_QPAIRS];
 	struct virtio_net *net;
+	int i, n;
 
 	if (dev->arg) {
 		net = (struct virtio_net *) dev->arg;
 
 		virtio_net_tx_stop(net);
 
+		for (i = 0; i < net->max_qpairs; i++) {
+			acrn_timer_deinit(&net->qpairs[i].rx_coal.timer);
+			acrn_timer_deinit(&net->qpairs[i].tx_coal.timer);
+		}
+
 		if (net->vhost_net) {
 			vhost_net_stop(net->vhost_net);
 			vhost_net_deinit(net->vhost_net);
@@ -1157,10 +1847,21 @@ virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			net->vhost_net = NULL;
 		}
 
-		if (net->mevp != NULL)
-			mevent_delete(net->mevp);
-		else
-			virtio_net_teardown(net);
+		/* net is freed by the teardown of the last rx event */
+		n = 0;
+		for (i = 0; i < net->max_qpairs; i++) {
+			if (net->qpairs[i].mevp != NULL)
+				mevp[n++] = net->qpairs[i].mevp;
+		}
+		net->teardown_cnt = n;
+
+		if (n == 0) {
+			if (net->qpairs[0].fd < 0)
+				pr_err("net->tapfd is -1!\n");
+			virtio_net_free(net);
+		}
+		for (i = 0; i < n; i++)
+			mevent_delete(mevp[i]);
 
 		DPRINTF(("%s: done\n", __func__));
 	} else
@@ -1266,6 +1967,7 @@ vhost_net_stop(struct vhost_net *vhost_net)
 
 struct pci_vdev_ops pci_ops_virtio_net = {
 	.class_name	= "virtio-net",
+	.vdev_mt_safe	= true,
 	.vdev_init	= virtio_net_init,
 	.vdev_deinit	= virtio_net_deinit,
 	.vdev_barwrite	= virtio_pci_write,
@@ -337,7 +337,6 @@ vhpet_timer_handler(void *a, uint64_t nexp)
 	struct vhpet_timer_arg *arg;
 	struct timespec now;
 	struct itimerspec tmrts;
-	uint64_t newexp;
 
 	arg = a;
 	vhpet = arg->vhpet;
@@ -389,8 +388,7 @@ vhpet_timer_handler(void *a, uint64_t nexp)
 	 * Catch any remaining expirations that happened after being
 	 * last consumed by the mevent_dispatch thread.
 	 */
-	if (read(vhpet_tmr(vhpet, n)->fd, &newexp, sizeof(newexp)) > 0)
-		nexp += newexp;
+	nexp += acrn_timer_pending(vhpet_tmr(vhpet, n));
 
 	/*
 	 * Periodic timer updates 'compval' upon expiration.
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2024 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _BLOCK_COW_H_
+#define _BLOCK_COW_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Thin provisioned copy-on-write images for blockif. The routines are
+ * thread safe, the I/O ones follow preadv()/pwritev(): they return the
+ * number of bytes transferred, or -1 with errno set.
+ */
+struct cow_image;
+
+struct cow_image *cow_open(int fd, int ro, const char *backing,
+			   const char *backing_fmt);
+void	cow_close(struct cow_image *img);
+off_t	cow_size(struct cow_image *img);
+ssize_t	cow_preadv(struct cow_image *img, const struct iovec *iov, int iovcnt,
+		   off_t offset);
+ssize_t	cow_pwritev(struct cow_image *img, const struct iovec *iov, int iovcnt,
+		    off_t offset);
+int	cow_discard(struct cow_image *img, off_t offset, off_t len);
+
+#endif /* _BLOCK_COW_H_ */
@@ -66,4 +66,11 @@ int  virtio_uses_msix(void);
 size_t high_bios_size(void);
 void init_debugexit(void);
 void deinit_debugexit(void);
+
+/*
+ * Serialize an I/O handler which is not declared thread-safe against the
+ * other ioreq threads. No-op unless --ioreq_threads is in use.
+ */
+void ioreq_serial_lock(void);
+void ioreq_serial_unlock(void);
 #endif
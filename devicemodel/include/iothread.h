@@ -7,13 +7,28 @@
 #ifndef	_iothread_CTX_H_
 #define	_iothread_CTX_H_
 
+#include <stdbool.h>
+
+#define IOTHREAD_MAX	16
+
+struct iothread_ctx;
 struct iothread_mevent {
 	void (*run)(void *);
+	/*
+	 * Optional, does the work of run if there is any and returns whether
+	 * it did. The iothread calls it for a while after each wakeup when
+	 * iothread polling is enabled. It must not block on a lock that is
+	 * held around iothread_del(), it should skip the work instead.
+	 */
+	bool (*poll)(void *);
 	void *arg;
 	int fd;
+	struct iothread_ctx *ioctx;	/* set by iothread_add() */
 };
-int iothread_add(int fd, struct iothread_mevent *aevt);
-int iothread_del(int fd);
+int iothread_add(int idx, int fd, struct iothread_mevent *aevt);
+int iothread_del(int fd, struct iothread_mevent *aevt);
+int iothread_parse_options(char *opt);
+int iothread_parse_poll(char *opt);
 int iothread_init(void);
 void iothread_deinit(void);
 
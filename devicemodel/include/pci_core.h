@@ -61,6 +61,9 @@ struct memory_region;
 struct pci_vdev_ops {
 	char	*class_name;		/* Name of device class */
 
+	/* BAR handlers may run on several ioreq threads at once */
+	bool	vdev_mt_safe;
+
 	/* instance creation */
 	int	(*vdev_init)(struct vmctx *, struct pci_vdev *,
 			     char *opts);
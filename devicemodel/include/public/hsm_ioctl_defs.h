@@ -107,6 +107,8 @@
 	_IOW(ACRN_IOCTL_TYPE, 0x41, struct acrn_vm_memmap)
 #define ACRN_IOCTL_UNSET_MEMSEG		\
 	_IOW(ACRN_IOCTL_TYPE, 0x42, struct acrn_vm_memmap)
+#define ACRN_IOCTL_DIRTY_LOG		\
+	_IOW(ACRN_IOCTL_TYPE, 0x43, struct acrn_dirty_log)
 
 /* PCI assignment*/
 #define ACRN_IOCTL_SET_PTDEV_INTR	\
@@ -184,6 +186,36 @@ struct acrn_vm_memmap {
 	__u64	len;
 };
 
+/* Dirty page logging commands */
+#define ACRN_DIRTY_LOG_ENABLE		0U
+#define ACRN_DIRTY_LOG_DISABLE		1U
+#define ACRN_DIRTY_LOG_GET		2U
+
+/* ACRN_DIRTY_LOG_GET: start tracking the reported pages again */
+#define ACRN_DIRTY_LOG_CLEAR		(1U << 0U)
+
+/* gpa and size are aligned to the memory one bitmap word covers */
+#define ACRN_DIRTY_LOG_ALIGN		(64UL * 4096UL)
+
+/**
+ * @brief Dirty page logging of guest RAM
+ *
+ * Not available for VMs with passthrough devices, nested VMX or a secure
+ * world, ACRN_DIRTY_LOG_ENABLE fails with ENODEV for them.
+ */
+struct acrn_dirty_log {
+	/** ACRN_DIRTY_LOG_ENABLE, ACRN_DIRTY_LOG_DISABLE or ACRN_DIRTY_LOG_GET */
+	__u32	cmd;
+	/** ACRN_DIRTY_LOG_CLEAR for ACRN_DIRTY_LOG_GET */
+	__u32	flags;
+	/** user OS guest physical start address of the region */
+	__u64	gpa;
+	/** the length of the region */
+	__u64	size;
+	/** user virtual address of the bitmap, one bit per 4K page */
+	__u64	bitmap;
+};
+
 /* Type of interrupt of a passthrough device */
 #define ACRN_PTDEV_IRQ_INTX	0
 #define ACRN_PTDEV_IRQ_MSI	1
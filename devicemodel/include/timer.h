@@ -7,14 +7,24 @@
 #define _TIMER_H_
 
 #include <time.h>  // for struct itimerspec
+#include <stdbool.h>
 #include <sys/param.h>
 
+struct timer_mux;
+
 struct acrn_timer {
 	int32_t fd;
 	int32_t clockid;
 	struct mevent *mevp;
 	void (*callback)(void *, uint64_t);
 	void *callback_param;
+
+	/* set when the timer shares the timerfd of its clock */
+	struct timer_mux *mux;
+	int32_t heap_idx;	/* -1 if not armed */
+	uint64_t expire_ns;
+	uint64_t interval_ns;
+	uint32_t gen;		/* bumped on settime and deinit */
 };
 
 int32_t
@@ -28,6 +38,10 @@ acrn_timer_settime_abs(struct acrn_timer *timer,
 		const struct itimerspec *new_value);
 int32_t
 acrn_timer_gettime(struct acrn_timer *timer, struct itimerspec *cur_value);
+uint64_t
+acrn_timer_pending(struct acrn_timer *timer);
+void
+acrn_timer_set_mux(bool enable);
 
 #define NS_PER_SEC	(1000000000ULL)
 
@@ -124,6 +124,22 @@
  * notify, when descriptors are added to the corresponding ring.
  * (These are provided only for interrupt optimization and need
  * not be implemented.)
+ *
+ * With VIRTIO_F_RING_PACKED (modern devices only), the three areas
+ * are instead one ring of 16-byte packed descriptors plus two 4-byte
+ * event suppression structures.  A packed descriptor holds <addr>,
+ * <len>, a 16-bit buffer <id> and <flags>.  The driver makes a
+ * descriptor available by flipping its AVAIL flag to the driver's
+ * wrap counter, and the device marks a buffer used by writing <id>
+ * and <len> into the next used slot and setting both AVAIL and USED
+ * to the device's wrap counter.  Both counters toggle each time the
+ * ring wraps around, so the device touches a single cache line per
+ * descriptor and needs no separate avail/used index.  The chain of a
+ * buffer is the run of consecutive descriptors with NEXT set, and
+ * the device skips that many slots when it marks the buffer used.
+ * The driver (device) event suppression structure tells the device
+ * (driver) whether to interrupt (notify) always, never, or once a
+ * given ring position is reached (with EVENT_IDX).
  */
 
 #include <linux/virtio_ring.h>
@@ -347,6 +363,7 @@ struct virtio_base {
 	struct virtio_ops *vops;	/**< virtio operations */
 	int	flags;			/**< VIRTIO_* flags from above */
 	bool	iothread;
+	int	iothread_idx;		/**< first iothread of the queues, -1 for round-robin */
 	pthread_mutex_t *mtx;		/**< POSIX mutex, if any */
 	struct pci_vdev *dev;		/**< PCI device instance */
 	uint64_t negotiated_caps;	/**< negotiated capabilities */
@@ -403,6 +420,7 @@ struct virtio_ops {
 
 #define	VQ_ALLOC	0x01	/* set once we have a pfn */
 #define	VQ_BROKED	0x02	/* ??? */
+#define	VQ_PACKED	0x04	/* packed ring, see VIRTIO_F_RING_PACKED */
 /**
  * @brief Virtqueue data structure
  *
@@ -455,6 +473,20 @@ struct virtio_vq_info {
 	volatile struct vring_used *used;
 				/**< the "used" ring */
 
+	volatile struct vring_packed_desc *packed_desc;
+				/**< packed descriptor ring */
+	volatile struct vring_packed_desc_event *driver_event;
+				/**< driver event suppression, packed ring */
+	volatile struct vring_packed_desc_event *device_event;
+				/**< device event suppression, packed ring */
+	bool avail_wrap;	/**< wrap counter of last_avail, packed ring */
+	bool used_wrap;		/**< wrap counter of used_idx, packed ring */
+	bool used_moved;	/**< used descs written since vq_endchains */
+	uint16_t used_idx;	/**< next used slot, packed ring */
+	uint16_t head_pos;	/**< next entry of chain_heads */
+	uint16_t *chain_len;	/**< descs of each buffer id, packed ring */
+	uint16_t *chain_heads;	/**< recent chain heads, for vq_retchain */
+
 	uint32_t gpa_desc[2];	/**< gpa of descriptors */
 	uint32_t gpa_avail[2];	/**< gpa of avail_ring */
 	uint32_t gpa_used[2];	/**< gpa of used_ring */
@@ -480,6 +512,32 @@ vq_ring_ready(struct virtio_vq_info *vq)
 	return ((vq->flags & VQ_ALLOC) == VQ_ALLOC);
 }
 
+/**
+ * @brief Does this ring use the packed layout?
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return true if VIRTIO_F_RING_PACKED was negotiated for the ring.
+ */
+static inline bool
+vq_is_packed(struct virtio_vq_info *vq)
+{
+	return ((vq->flags & VQ_PACKED) == VQ_PACKED);
+}
+
+/*
+ * The packed descriptor at last_avail is available when its AVAIL
+ * flag matches the wrap counter and its USED flag does not.
+ */
+static inline bool
+vq_packed_desc_avail(struct virtio_vq_info *vq)
+{
+	uint16_t flags = vq->packed_desc[vq->last_avail].flags;
+
+	return (!!(flags & (1 << VRING_PACKED_DESC_F_AVAIL)) == vq->avail_wrap) &&
+		(!!(flags & (1 << VRING_PACKED_DESC_F_USED)) != vq->avail_wrap);
+}
+
 /**
  * @brief Are there "available" descriptors?
  *
@@ -493,6 +551,10 @@ static inline bool
 vq_has_descs(struct virtio_vq_info *vq)
 {
 	bool ret = false;
+
+	if (vq_ring_ready(vq) && vq_is_packed(vq))
+		return vq_packed_desc_avail(vq);
+
 	if (vq_ring_ready(vq) && vq->last_avail != vq->avail->idx) {
 		if ((uint16_t)((u_int)vq->avail->idx - vq->last_avail) > vq->qsize)
 			pr_err ("%s: no valid descriptor\n", vq->base->vops->name);
@@ -634,7 +696,8 @@ void virtio_set_io_bar(struct virtio_base *base, int barnum);
  * and put them into a given iov[] array.
  *
  * @param vq Pointer to struct virtio_vq_info.
- * @param pidx Pointer to available ring position.
+ * @param pidx Pointer to available ring position (the buffer id for
+ * packed rings).
  * @param iov Pointer to iov[] array prepared by caller.
  * @param n_iov Size of iov[] array.
  * @param flags Pointer to a uint16_t array which will contain flag of
@@ -668,6 +731,8 @@ void vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen);
  * vq_relchain on each one.
  *
  * If driver used all the available chains, used_all_avail need to be set to 1.
+ * The caller has to serialize it with vq_relchain() on the same queue, e.g.
+ * when it is called from a timer.
  *
  * @param vq Pointer to struct virtio_vq_info.
  * @param used_all_avail Flag indicating if driver used all available chains.
@@ -686,6 +751,18 @@ void vq_endchains(struct virtio_vq_info *vq, int used_all_avail);
  */
 void vq_clear_used_ring_flags(struct virtio_base *base, struct virtio_vq_info *vq);
 
+/**
+ * @brief Helper function for setting used ring flags.
+ *
+ * Tell the guest not to notify on this virtqueue, through the used ring
+ * flags or, for packed rings, the device event suppression structure.
+ * Driver should always use this helper function instead of writing the
+ * used ring flags itself.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ */
+void vq_set_used_ring_flags(struct virtio_vq_info *vq);
+
 /**
  * @brief Handle PCI configuration space reads.
  *
@@ -120,6 +120,10 @@ int	vm_parse_memsize(const char *optarg, size_t *memsize);
 int	vm_map_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
 	uint64_t vma, int prot);
 int	vm_setup_memory(struct vmctx *ctx, size_t len);
+int	vm_enable_dirty_log(struct vmctx *ctx);
+int	vm_disable_dirty_log(struct vmctx *ctx);
+int	vm_get_dirty_log(struct vmctx *ctx, vm_paddr_t gpa, size_t len,
+	uint64_t *bitmap, bool clear);
 void	vm_unsetup_memory(struct vmctx *ctx);
 bool	init_hugetlb(void);
 void	uninit_hugetlb(void);
@@ -68,12 +68,12 @@ void udelay(uint32_t us)
 
 void update_physical_timer(struct per_cpu_timers *cpu_timer)
 {
-	struct hv_timer *timer = NULL;
+	struct rb_node *first = rb_first(&cpu_timer->timer_tree);
+	struct hv_timer *timer;
 
 	/* find the next event timer */
-	if (!list_empty(&cpu_timer->timer_list)) {
-		timer = container_of((&cpu_timer->timer_list)->next,
-			struct hv_timer, node);
+	if (first != NULL) {
+		timer = rb_entry(first, struct hv_timer, node);
 
 		/* it is okay to program a expired time */
 		set_deadline(timer->timeout);
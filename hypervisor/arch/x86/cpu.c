@@ -11,6 +11,7 @@
 #include <asm/mmu.h>
 #include <asm/guest/ept.h>
 #include <asm/guest/vept.h>
+#include <asm/guest/dirty_log.h>
 #include <asm/vtd.h>
 #include <asm/lapic.h>
 #include <asm/irq.h>
@@ -289,6 +290,7 @@ void init_pcpu_post(uint16_t pcpu_id)
 		 * Reserve memory from platform E820 for EPT 4K pages for all VMs
 		 */
 		reserve_buffer_for_ept_pages();
+		reserve_buffer_for_dirty_log();
 
 		init_vept();
 
@@ -463,11 +465,15 @@ void stop_pcpus(void)
 void cpu_do_idle(void)
 {
 #ifdef CONFIG_KEEP_IRQ_DISABLED
-	asm_pause();
+	if (!prezero_pool_pages(get_pcpu_id())) {
+		asm_pause();
+	}
 #else
 	uint16_t pcpu_id = get_pcpu_id();
 
-	if (per_cpu(mode_to_idle, pcpu_id) == IDLE_MODE_HLT) {
+	if (prezero_pool_pages(pcpu_id)) {
+		/* back to the idle loop to check for pending work before zeroing another page */
+	} else if (per_cpu(mode_to_idle, pcpu_id) == IDLE_MODE_HLT) {
 		asm_safe_hlt();
 	} else {
 		struct acrn_vcpu *vcpu = get_ever_run_vcpu(pcpu_id);
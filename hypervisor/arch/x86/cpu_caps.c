@@ -34,6 +34,7 @@
 static struct cpu_capability {
 	uint8_t apicv_features;
 	uint8_t ept_features;
+	bool pml_supported;
 
 	uint64_t vmx_ept_vpid;
 	uint32_t core_caps;	/* value of MSR_IA32_CORE_CAPABLITIES */
@@ -236,6 +237,7 @@ static void detect_ept_cap(void)
 		if (is_ctrl_setting_allowed(msr_val, VMX_PROCBASED_CTLS2_EPT)) {
 			cpu_caps.ept_features = 1U;
 		}
+		cpu_caps.pml_supported = is_ctrl_setting_allowed(msr_val, VMX_PROCBASED_CTLS2_PML);
 	}
 }
 
@@ -410,6 +412,12 @@ bool pcpu_has_vmx_ept_vpid_cap(uint64_t bit_mask)
 	return ((cpu_caps.vmx_ept_vpid & bit_mask) != 0U);
 }
 
+/* Page-modification logging needs the EPT accessed and dirty flags as well */
+bool is_pml_supported(void)
+{
+	return (cpu_caps.pml_supported && pcpu_has_vmx_ept_vpid_cap(VMX_EPT_AD));
+}
+
 void init_pcpu_model_name(void)
 {
 	cpuid_subleaf(CPUID_EXTEND_FUNCTION_2, 0x0U,
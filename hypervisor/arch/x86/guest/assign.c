@@ -343,7 +343,8 @@ static struct ptirq_remapping_info *add_msix_remapping(struct acrn_vm *vm,
 
 /* deactive & remove mapping entry of vbdf:entry_nr for vm */
 static void
-remove_msix_remapping(const struct acrn_vm *vm, uint16_t phys_bdf, uint32_t entry_nr)
+remove_msix_remapping(const struct acrn_vm *vm, uint16_t phys_bdf, uint32_t entry_nr,
+		struct dmar_qi_batch *batch)
 {
 	struct ptirq_remapping_info *entry;
 	DEFINE_MSI_SID(phys_sid, phys_bdf, entry_nr);
@@ -358,7 +359,7 @@ remove_msix_remapping(const struct acrn_vm *vm, uint16_t phys_bdf, uint32_t entr
 
 		intr_src.is_msi = true;
 		intr_src.src.msi.value = entry->phys_sid.msi_id.bdf;
-		dmar_free_irte(&intr_src, entry->irte_idx);
+		dmar_free_irte_batch(&intr_src, entry->irte_idx, batch);
 
 		dev_dbg(DBG_LEVEL_IRQ, "VM%d MSIX remove vector mapping vbdf-pbdf:0x%x-0x%x idx=%d",
 			vm->vm_id, entry->virt_sid.msi_id.bdf, phys_bdf, entry_nr);
@@ -842,13 +843,17 @@ void ptirq_remove_intx_remapping(const struct acrn_vm *vm, uint32_t gsi, bool pi
 void ptirq_remove_msix_remapping(const struct acrn_vm *vm, uint16_t phys_bdf,
 		uint32_t vector_count)
 {
+	struct dmar_qi_batch batch;
 	uint32_t i;
 
+	/* all vectors sit behind the same DMAR unit, wait for their IEC invalidation once */
+	dmar_qi_batch_init(&batch);
 	for (i = 0U; i < vector_count; i++) {
 		spinlock_obtain(&ptdev_lock);
-		remove_msix_remapping(vm, phys_bdf, i);
+		remove_msix_remapping(vm, phys_bdf, i, &batch);
 		spinlock_release(&ptdev_lock);
 	}
+	dmar_qi_batch_flush(&batch);
 }
 
 /*
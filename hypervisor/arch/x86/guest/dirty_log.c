@@ -0,0 +1,466 @@
+/*
+ * Copyright (C) 2024 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <types.h>
+#include <errno.h>
+#include <asm/lib/bits.h>
+#include <asm/lib/atomic.h>
+#include <asm/cpu.h>
+#include <asm/cpu_caps.h>
+#include <asm/e820.h>
+#include <asm/mmu.h>
+#include <asm/notify.h>
+#include <asm/pgtable.h>
+#include <asm/vmx.h>
+#include <asm/vtd.h>
+#include <asm/guest/vm.h>
+#include <asm/guest/vcpu.h>
+#include <asm/guest/ept.h>
+#include <asm/guest/virq.h>
+#include <asm/guest/dirty_log.h>
+#include <acrn_hv_defs.h>
+#include <logmsg.h>
+
+#define DBG_LEVEL_DIRTY_LOG	6U
+
+/* bitmap words copied to the Service VM at a time */
+#define DIRTY_LOG_COPY_WORDS	32U
+
+static uint64_t *dirty_bitmaps[CONFIG_MAX_VM_NUM];
+
+/*
+ * Guest RAM ends below the host RAM size plus the 4G of low memory and MMIO
+ * hole. Round it up to a 1G page, so that a large page is always covered
+ * by the bitmap as a whole.
+ */
+static uint64_t get_dirty_log_gpa_limit(void)
+{
+	return roundup(get_e820_ram_size() + MEM_4G, PDPTE_SIZE);
+}
+
+static uint64_t get_dirty_bitmap_size(void)
+{
+	return (get_dirty_log_gpa_limit() >> (PAGE_SHIFT + 3U));
+}
+
+/*
+ * @brief Reserve the dirty bitmaps of the post-launched VMs from platform E820 table
+ *
+ * Only the Service VM asks for dirty logging, of the VMs it launched.
+ */
+void reserve_buffer_for_dirty_log(void)
+{
+	uint64_t bitmap_base, bitmap_size = get_dirty_bitmap_size();
+	uint16_t vm_id, nr_bitmaps = 0U;
+
+	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		if (get_vm_config(vm_id)->load_order == POST_LAUNCHED_VM) {
+			nr_bitmaps++;
+		}
+	}
+
+	if (nr_bitmaps != 0U) {
+		bitmap_base = e820_alloc_memory(bitmap_size * nr_bitmaps, MEM_SIZE_MAX);
+		set_paging_supervisor(bitmap_base, bitmap_size * nr_bitmaps);
+
+		nr_bitmaps = 0U;
+		for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+			if (get_vm_config(vm_id)->load_order == POST_LAUNCHED_VM) {
+				dirty_bitmaps[vm_id] = (uint64_t *)(void *)(bitmap_base + (bitmap_size * nr_bitmaps));
+				nr_bitmaps++;
+			}
+		}
+	}
+}
+
+void init_dirty_log(struct acrn_vm *vm)
+{
+	struct dirty_log *log = &vm->arch_vm.dirty_log;
+
+	log->enabled = false;
+	log->use_pml = false;
+	log->bitmap = dirty_bitmaps[vm->vm_id];
+	log->gpa_limit = get_dirty_log_gpa_limit();
+}
+
+static void dirty_log_mark_page(struct dirty_log *log, uint64_t gpa, uint64_t pg_size)
+{
+	uint64_t pfn, idx, end_idx;
+
+	if (gpa < log->gpa_limit) {
+		pfn = (gpa & ~(pg_size - 1UL)) >> PAGE_SHIFT;
+		if (pg_size == PAGE_SIZE) {
+			bitmap_set_lock((uint16_t)(pfn & 0x3fUL), log->bitmap + (pfn >> 6U));
+		} else {
+			end_idx = (pfn + (pg_size >> PAGE_SHIFT)) >> 6U;
+			for (idx = pfn >> 6U; idx < end_idx; idx++) {
+				(void)atomic_swap64(log->bitmap + idx, ~0UL);
+			}
+		}
+	}
+}
+
+/*
+ * With PML the CPU logs a write only when it sets the dirty flag of the
+ * EPT entry, so for a large page the whole page has to be reported. A large
+ * page split after the write was reported as a whole by
+ * dirty_log_prepare_split() already.
+ */
+static void dirty_log_mark(struct acrn_vm *vm, uint64_t gpa)
+{
+	uint64_t pg_size = PAGE_SIZE;
+
+	if (vm->arch_vm.dirty_log.use_pml && (pgtable_lookup_entry((uint64_t *)vm->arch_vm.nworld_eptp, gpa,
+			&pg_size, &vm->arch_vm.ept_pgtable) == NULL)) {
+		pg_size = PAGE_SIZE;
+	}
+	dirty_log_mark_page(&vm->arch_vm.dirty_log, gpa, pg_size);
+}
+
+/*
+ * A large page with its dirty flag set is split while PML is on: the CPU
+ * logged only the first write to it, so report it as a whole now, and give
+ * the new entries a clear dirty flag so that their next writes are logged.
+ *
+ * Called with the EPT lock held.
+ */
+void dirty_log_prepare_split(const struct pgtable *table, uint64_t gpa, uint64_t size, uint64_t *prot)
+{
+	struct acrn_vm *vm = container_of(table, struct acrn_vm, arch_vm.ept_pgtable);
+	struct dirty_log *log = &vm->arch_vm.dirty_log;
+
+	if (log->enabled && log->use_pml && ((*prot & EPT_DIRTY) != 0UL)) {
+		dirty_log_mark_page(log, gpa, size);
+		*prot &= ~EPT_DIRTY;
+	}
+}
+
+void dirty_log_drain_pml(struct acrn_vcpu *vcpu)
+{
+	uint64_t rflags;
+	uint16_t index, i;
+
+	/* also called from the notification IPI, keep the two from interleaving */
+	CPU_INT_ALL_DISABLE(&rflags);
+	index = exec_vmread16(VMX_GUEST_PML_INDEX);
+	if (index != (VMX_PML_ENTRY_NUM - 1U)) {
+		/* the CPU fills the log downwards from the last entry, index wraps past 0 when the log is full */
+		i = (index >= VMX_PML_ENTRY_NUM) ? 0U : (index + 1U);
+		for (; i < VMX_PML_ENTRY_NUM; i++) {
+			dirty_log_mark(vcpu->vm, vcpu->arch.pml_log[i]);
+		}
+		exec_vmwrite16(VMX_GUEST_PML_INDEX, VMX_PML_ENTRY_NUM - 1U);
+	}
+	CPU_INT_ALL_RESTORE(rflags);
+}
+
+/*
+ * @pre vcpu is the current vCPU of this pCPU, its VMCS is loaded
+ */
+void dirty_log_update_vmcs(struct acrn_vcpu *vcpu)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	const struct dirty_log *log = &vm->arch_vm.dirty_log;
+	bool use_pml = log->enabled && log->use_pml;
+	uint32_t value32;
+
+	if (vcpu->arch.pml_enabled) {
+		dirty_log_drain_pml(vcpu);
+	}
+
+	value32 = exec_vmread32(VMX_PROC_VM_EXEC_CONTROLS2);
+	if (use_pml) {
+		exec_vmwrite64(VMX_PML_ADDR_FULL, hva2hpa(vcpu->arch.pml_log));
+		exec_vmwrite16(VMX_GUEST_PML_INDEX, VMX_PML_ENTRY_NUM - 1U);
+		value32 |= VMX_PROCBASED_CTLS2_PML;
+	} else {
+		value32 &= ~VMX_PROCBASED_CTLS2_PML;
+	}
+	exec_vmwrite32(VMX_PROC_VM_EXEC_CONTROLS2, value32);
+	/* in the secure world, the switch back to the normal world loads it */
+	if (vcpu->arch.cur_context == NORMAL_WORLD) {
+		exec_vmwrite64(VMX_EPT_POINTER_FULL, get_nworld_eptp_value(vm));
+	}
+	vcpu->arch.pml_enabled = use_pml;
+}
+
+static void dirty_log_sync_pcpu(void *data)
+{
+	struct acrn_vm *vm = (struct acrn_vm *)data;
+	struct acrn_vcpu *vcpu = get_running_vcpu(get_pcpu_id());
+
+	if ((vcpu != NULL) && (vcpu->vm == vm) && vcpu->arch.pml_enabled) {
+		dirty_log_drain_pml(vcpu);
+	}
+}
+
+/*
+ * Interrupt every pCPU a vCPU of the VM runs on and wait for it. Once this
+ * returns, the PML logs are drained, and no vCPU runs guest code again
+ * before it has handled the requests made so far: the EPT flush of an
+ * ept_txn_commit() and ACRN_REQUEST_DIRTY_LOG.
+ */
+static void dirty_log_sync_vcpus(struct acrn_vm *vm)
+{
+	struct acrn_vcpu *vcpu;
+	uint64_t mask = 0UL;
+	uint16_t i;
+
+	foreach_vcpu(i, vm, vcpu) {
+		bitmap_set_nolock(pcpuid_from_vcpu(vcpu), &mask);
+	}
+
+	if (mask != 0UL) {
+		smp_call_function(mask, dirty_log_sync_pcpu, vm);
+	}
+}
+
+static void dirty_log_request_vcpus(struct acrn_vm *vm)
+{
+	struct acrn_vcpu *vcpu;
+	uint16_t i;
+
+	foreach_vcpu(i, vm, vcpu) {
+		vcpu_make_request(vcpu, ACRN_REQUEST_DIRTY_LOG);
+	}
+}
+
+/*
+ * Apply prot_set/prot_clr to the pages of [gpa, gpa + size) whose EPT entry
+ * has any bit of match set, one ept_txn_modify_mr() per run of such pages.
+ */
+static void dirty_log_modify_matching(struct ept_txn *txn, uint64_t gpa, uint64_t size,
+		uint64_t match, uint64_t prot_set, uint64_t prot_clr)
+{
+	struct pgtable_walk_cache cache;
+	const uint64_t *entry;
+	uint64_t pg_size = PAGE_SIZE;
+	uint64_t addr = gpa, end = gpa + size, run_start = end;
+
+	pgtable_walk_cache_init(&cache);
+	while (addr < end) {
+		entry = pgtable_lookup_entry_cached(txn->pml4_page, addr, &pg_size,
+				&txn->vm->arch_vm.ept_pgtable, &cache);
+		if ((entry != NULL) && ((*entry & match) != 0UL)) {
+			if (run_start == end) {
+				run_start = addr;
+			}
+		} else {
+			if (run_start != end) {
+				ept_txn_modify_mr(txn, run_start, addr - run_start, prot_set, prot_clr);
+				run_start = end;
+			}
+			if (entry == NULL) {
+				pg_size = PAGE_SIZE;
+			}
+		}
+		addr = min((addr & ~(pg_size - 1UL)) + pg_size, end);
+	}
+
+	if (run_start != end) {
+		ept_txn_modify_mr(txn, run_start, end - run_start, prot_set, prot_clr);
+	}
+}
+
+/* Make the next write to the pages of [gpa, gpa + size) show up in the bitmap */
+static void dirty_log_arm(struct ept_txn *txn, uint64_t gpa, uint64_t size)
+{
+	if (txn->vm->arch_vm.dirty_log.use_pml) {
+		dirty_log_modify_matching(txn, gpa, size, EPT_DIRTY, 0UL, EPT_DIRTY);
+	} else {
+		/* pages write protected by the Service VM keep being emulated */
+		dirty_log_modify_matching(txn, gpa, size, EPT_WR, EPT_DIRTY_LOG_WP, EPT_WR);
+	}
+}
+
+static void dirty_log_disarm(struct ept_txn *txn, uint64_t gpa, uint64_t size)
+{
+	if (txn->vm->arch_vm.dirty_log.use_pml) {
+		/* identical entries again, so that large pages can be restored */
+		dirty_log_modify_matching(txn, gpa, size, EPT_ACCESSED | EPT_DIRTY, 0UL, EPT_ACCESSED | EPT_DIRTY);
+	} else {
+		dirty_log_modify_matching(txn, gpa, size, EPT_DIRTY_LOG_WP, EPT_WR, EPT_DIRTY_LOG_WP);
+	}
+}
+
+static bool is_dirty_log_range_valid(struct acrn_vm *vm, uint64_t gpa, uint64_t size)
+{
+	return (mem_aligned_check(gpa, ACRN_DIRTY_LOG_ALIGN) && mem_aligned_check(size, ACRN_DIRTY_LOG_ALIGN) &&
+		(size != 0UL) && ((gpa + size) > gpa) && ((gpa + size) <= vm->arch_vm.dirty_log.gpa_limit) &&
+		ept_is_valid_mr(vm, gpa, size));
+}
+
+int32_t dirty_log_enable(struct acrn_vm *vm, uint64_t gpa, uint64_t size)
+{
+	struct dirty_log *log = &vm->arch_vm.dirty_log;
+	struct ept_txn txn;
+	int32_t ret = -EINVAL;
+
+	spinlock_obtain(&log->lock);
+	if (log->bitmap == NULL) {
+		/* not a post-launched VM */
+		ret = -ENODEV;
+	} else if ((vm->sworld_control.flag.supported != 0UL) || is_nvmx_configured(vm)) {
+		/* the secure world and nested guests load EPTPs of their own */
+		ret = -ENODEV;
+	} else if (iommu_domain_has_devices(vm->iommu)) {
+		/*
+		 * The IOMMU walks the same EPT for DMA: write protection would
+		 * fault the device writes, and PML doesn't see them at all.
+		 */
+		ret = -ENODEV;
+	} else if (is_dirty_log_range_valid(vm, gpa, size)) {
+		if (!log->enabled) {
+			(void)memset(log->bitmap, 0U, get_dirty_bitmap_size());
+			log->use_pml = is_pml_supported();
+			log->enabled = true;
+			dirty_log_request_vcpus(vm);
+			dev_dbg(DBG_LEVEL_DIRTY_LOG, "vm%hu: dirty logging on, %s", vm->vm_id,
+					log->use_pml ? "PML" : "write protection");
+		}
+
+		ept_txn_begin(&txn, vm, (uint64_t *)vm->arch_vm.nworld_eptp);
+		dirty_log_arm(&txn, gpa, size);
+		ept_txn_commit(&txn);
+		dirty_log_sync_vcpus(vm);
+		ret = 0;
+	} else {
+		pr_err("%s: vm%hu invalid region 0x%lx size 0x%lx", __func__, vm->vm_id, gpa, size);
+	}
+	spinlock_release(&log->lock);
+
+	return ret;
+}
+
+int32_t dirty_log_disable(struct acrn_vm *vm, uint64_t gpa, uint64_t size)
+{
+	struct dirty_log *log = &vm->arch_vm.dirty_log;
+	struct ept_txn txn;
+	int32_t ret = -EINVAL;
+
+	spinlock_obtain(&log->lock);
+	if (log->enabled) {
+		/* PML goes off before the dirty flags are cleared */
+		log->enabled = false;
+		dirty_log_request_vcpus(vm);
+		dirty_log_sync_vcpus(vm);
+	}
+
+	if (is_dirty_log_range_valid(vm, gpa, size)) {
+		ept_txn_begin(&txn, vm, (uint64_t *)vm->arch_vm.nworld_eptp);
+		dirty_log_disarm(&txn, gpa, size);
+		ept_txn_commit(&txn);
+		ret = 0;
+	}
+	spinlock_release(&log->lock);
+
+	return ret;
+}
+
+/*
+ * Read the bitmap words of [first, first + nr), clearing them and arming
+ * the reported pages again if txn is not NULL.
+ */
+static void dirty_log_collect(struct acrn_vm *vm, uint64_t first, uint32_t nr, uint64_t *words,
+		struct ept_txn *txn)
+{
+	uint64_t *bitmap = vm->arch_vm.dirty_log.bitmap;
+	uint64_t bits, pfn, run_start = 0UL, run_end = 0UL;
+	uint32_t i;
+	uint16_t bit;
+
+	for (i = 0U; i < nr; i++) {
+		if (txn == NULL) {
+			words[i] = *(bitmap + first + i);
+		} else {
+			words[i] = atomic_readandclear64(bitmap + first + i);
+			bits = words[i];
+			while (bits != 0UL) {
+				bit = ffs64(bits);
+				bitmap_clear_nolock(bit, &bits);
+				pfn = ((first + i) << 6U) + bit;
+				if (pfn != run_end) {
+					if (run_end != run_start) {
+						dirty_log_arm(txn, run_start << PAGE_SHIFT, (run_end - run_start) << PAGE_SHIFT);
+					}
+					run_start = pfn;
+				}
+				run_end = pfn + 1UL;
+			}
+		}
+	}
+
+	if (run_end != run_start) {
+		dirty_log_arm(txn, run_start << PAGE_SHIFT, (run_end - run_start) << PAGE_SHIFT);
+	}
+}
+
+int32_t dirty_log_get(struct acrn_vm *vm, uint64_t gpa, uint64_t size,
+		struct acrn_vm *service_vm, uint64_t bitmap_gpa, bool clear)
+{
+	struct dirty_log *log = &vm->arch_vm.dirty_log;
+	uint64_t words[DIRTY_LOG_COPY_WORDS];
+	uint64_t first = gpa >> (PAGE_SHIFT + 6U);
+	uint64_t nr_words = size >> (PAGE_SHIFT + 6U), done;
+	struct ept_txn txn;
+	uint32_t nr;
+	int32_t ret = -EINVAL;
+
+	spinlock_obtain(&log->lock);
+	if (log->enabled && is_dirty_log_range_valid(vm, gpa, size) &&
+			ept_is_valid_mr(service_vm, bitmap_gpa, nr_words * sizeof(uint64_t))) {
+		if (log->use_pml) {
+			/* pull in what the vCPUs logged up to now */
+			dirty_log_sync_vcpus(vm);
+		}
+		if (clear) {
+			ept_txn_begin(&txn, vm, (uint64_t *)vm->arch_vm.nworld_eptp);
+		}
+
+		for (done = 0UL; done < nr_words; done += nr) {
+			nr = (uint32_t)min(nr_words - done, DIRTY_LOG_COPY_WORDS);
+			dirty_log_collect(vm, first + done, nr, words, clear ? &txn : NULL);
+			(void)copy_to_gpa(service_vm, words, bitmap_gpa + (done * sizeof(uint64_t)),
+					nr * (uint32_t)sizeof(uint64_t));
+		}
+
+		if (clear) {
+			ept_txn_commit(&txn);
+			/* a write done after we return must not go through a stale TLB entry */
+			dirty_log_sync_vcpus(vm);
+		}
+		ret = 0;
+	}
+	spinlock_release(&log->lock);
+
+	return ret;
+}
+
+bool dirty_log_handle_wp_fault(struct acrn_vcpu *vcpu, uint64_t gpa)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	const struct dirty_log *log = &vm->arch_vm.dirty_log;
+	const uint64_t *pgentry;
+	uint64_t entry, pg_size = 0UL;
+	bool handled = false;
+
+	if (log->enabled && !log->use_pml && (gpa < log->gpa_limit)) {
+		pgentry = pgtable_lookup_entry((uint64_t *)vm->arch_vm.nworld_eptp, gpa, &pg_size,
+				&vm->arch_vm.ept_pgtable);
+		entry = (pgentry != NULL) ? *pgentry : 0UL;
+		/* with EPT_WR set already, another vCPU handled the same fault */
+		if ((entry & (EPT_DIRTY_LOG_WP | EPT_WR)) != 0UL) {
+			dirty_log_mark(vm, gpa);
+			if ((entry & EPT_DIRTY_LOG_WP) != 0UL) {
+				ept_modify_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp, gpa & PAGE_MASK, PAGE_SIZE,
+						EPT_WR, EPT_DIRTY_LOG_WP);
+			}
+			handled = true;
+		}
+	}
+
+	return handled;
+}
@@ -11,9 +11,12 @@
 #include <asm/pgtable.h>
 #include <asm/mmu.h>
 #include <asm/guest/ept.h>
+#include <asm/guest/dirty_log.h>
 #include <asm/vmx.h>
 #include <asm/vtd.h>
+#include <asm/notify.h>
 #include <logmsg.h>
+#include <sprintf.h>
 #include <trace.h>
 #include <asm/rtct.h>
 
@@ -171,21 +174,20 @@ static inline void ept_recover_exe_right(uint64_t *entry)
 void init_ept_pgtable(struct pgtable *table, uint16_t vm_id)
 {
 	struct acrn_vm *vm = get_vm_from_vmid(vm_id);
+	char pool_name[16];
 
-	ept_page_pool[vm_id].start_page = ept_pages[vm_id];
-	ept_page_pool[vm_id].bitmap_size = get_ept_page_num() / 64;
-	ept_page_pool[vm_id].bitmap = ept_page_bitmap[vm_id];
-	ept_page_pool[vm_id].dummy_page = &ept_dummy_pages[vm_id];
-
-	spinlock_init(&ept_page_pool[vm_id].lock);
-	memset((void *)ept_page_pool[vm_id].bitmap, 0, ept_page_pool[vm_id].bitmap_size * sizeof(uint64_t));
-	ept_page_pool[vm_id].last_hint_id = 0UL;
+	snprintf(pool_name, 16U, "ept_vm%hu", vm_id);
+	init_page_pool(&ept_page_pool[vm_id], pool_name, ept_pages[vm_id], ept_page_bitmap[vm_id],
+			get_ept_page_num(), &ept_dummy_pages[vm_id]);
 
 	table->pool = &ept_page_pool[vm_id];
 	table->default_access_right = EPT_RWX;
 	table->pgentry_present_mask = EPT_RWX;
 	table->clflush_pagewalk = ept_clflush_pagewalk;
 	table->large_page_support = ept_large_page_support;
+	table->prepare_split = dirty_log_prepare_split;
+	(void)memset(&vm->arch_vm.ept_stats, 0U, sizeof(vm->arch_vm.ept_stats));
+	table->stats = &vm->arch_vm.ept_stats;
 
 	/* Mitigation for issue "Machine Check Error on Page Size Change" */
 	if (is_ept_force_4k_ipage()) {
@@ -214,15 +216,19 @@ void init_ept_pgtable(struct pgtable *table, uint16_t vm_id)
 bool ept_is_valid_mr(struct acrn_vm *vm, uint64_t mr_base_gpa, uint64_t mr_size)
 {
 	bool present = true;
-	uint32_t sz;
+	uint64_t pg_size = 0UL;
 	uint64_t end = mr_base_gpa + mr_size, address = mr_base_gpa;
+	struct pgtable_walk_cache cache;
 
+	/* a region mapped with 4K pages is checked one PT page at a time, not one full walk per page */
+	pgtable_walk_cache_init(&cache);
 	while (address < end) {
-		if (local_gpa2hpa(vm, address, &sz) == INVALID_HPA) {
+		if (pgtable_lookup_entry_cached((uint64_t *)get_eptp(vm), address, &pg_size,
+				&vm->arch_vm.ept_pgtable, &cache) == NULL) {
 			present = false;
 			break;
 		}
-		address += sz;
+		address = (address & ~(pg_size - 1UL)) + pg_size;
 	}
 
 	return present;
@@ -314,21 +320,133 @@ static inline void ept_flush_guest(struct acrn_vm *vm)
 	}
 }
 
-void ept_add_mr(struct acrn_vm *vm, uint64_t *pml4_page,
-	uint64_t hpa, uint64_t gpa, uint64_t size, uint64_t prot_orig)
+static void ept_sync_flush_pcpu(void *data)
+{
+	struct acrn_vm *vm = (struct acrn_vm *)data;
+
+	invept(vm->arch_vm.nworld_eptp);
+	if (vm->arch_vm.sworld_eptp != NULL) {
+		invept(vm->arch_vm.sworld_eptp);
+	}
+}
+
+/*
+ * Flush the EPT paging-structure caches of the VM on every pCPU its vCPUs
+ * run on and wait for it. Once this returns, no vCPU walks a page unlinked
+ * before the call.
+ */
+static void ept_sync_flush_guest(struct acrn_vm *vm)
 {
-	uint64_t prot = prot_orig;
+	struct acrn_vcpu *vcpu;
+	uint64_t mask = 0UL;
+	uint16_t i;
+
+	foreach_vcpu(i, vm, vcpu) {
+		bitmap_set_nolock(pcpuid_from_vcpu(vcpu), &mask);
+	}
+
+	if (mask != 0UL) {
+		smp_call_function(mask, ept_sync_flush_pcpu, vm);
+	}
+}
+
+void ept_txn_begin(struct ept_txn *txn, struct acrn_vm *vm, uint64_t *pml4_page)
+{
+	txn->vm = vm;
+	txn->pml4_page = pml4_page;
+	txn->modified = false;
+	txn->iotlb_start = ~0UL;
+	txn->iotlb_end = 0UL;
+	txn->freed.count = 0U;
+
+	spinlock_obtain(&vm->ept_lock);
+}
+
+void ept_txn_add_mr(struct ept_txn *txn, uint64_t hpa, uint64_t gpa, uint64_t size, uint64_t prot)
+{
+	struct acrn_vm *vm = txn->vm;
 
 	dev_dbg(DBG_LEVEL_EPT, "%s, vm[%d] hpa: 0x%016lx gpa: 0x%016lx size: 0x%016lx prot: 0x%016x\n",
 			__func__, vm->vm_id, hpa, gpa, size, prot);
 
-	spinlock_obtain(&vm->ept_lock);
+	pgtable_add_map(txn->pml4_page, hpa, gpa, size, prot, &vm->arch_vm.ept_pgtable);
+	txn->modified = true;
+}
 
-	pgtable_add_map(pml4_page, hpa, gpa, size, prot, &vm->arch_vm.ept_pgtable);
+void ept_txn_modify_mr(struct ept_txn *txn, uint64_t gpa, uint64_t size, uint64_t prot_set, uint64_t prot_clr)
+{
+	struct acrn_vm *vm = txn->vm;
+
+	dev_dbg(DBG_LEVEL_EPT, "%s,vm[%d] gpa 0x%lx size 0x%lx\n", __func__, vm->vm_id, gpa, size);
+
+	pgtable_modify_or_del_map(txn->pml4_page, gpa, size, prot_set, prot_clr, &(vm->arch_vm.ept_pgtable), MR_MODIFY);
+	txn->modified = true;
+}
+
+/**
+ * @pre [gpa,gpa+size) has been mapped into host physical memory region
+ */
+void ept_txn_del_mr(struct ept_txn *txn, uint64_t gpa, uint64_t size)
+{
+	struct acrn_vm *vm = txn->vm;
+
+	dev_dbg(DBG_LEVEL_EPT, "%s,vm[%d] gpa 0x%lx size 0x%lx\n", __func__, vm->vm_id, gpa, size);
+
+	pgtable_modify_or_del_map(txn->pml4_page, gpa, size, 0UL, 0UL, &(vm->arch_vm.ept_pgtable), MR_DEL);
+	txn->modified = true;
+	txn->iotlb_start = min(txn->iotlb_start, gpa);
+	txn->iotlb_end = max(txn->iotlb_end, gpa + size);
+}
+
+void ept_txn_promote_mr(struct ept_txn *txn, uint64_t gpa, uint64_t size)
+{
+	struct acrn_vm *vm = txn->vm;
+	bool promote_1g = (vm->sworld_control.flag.supported == 0UL);
+
+	if (pgtable_promote_map(txn->pml4_page, gpa, size, &(vm->arch_vm.ept_pgtable), promote_1g,
+			&txn->freed) != 0UL) {
+		/* the freed PT/PD pages may still sit in the paging-structure caches */
+		txn->modified = true;
+		txn->iotlb_start = min(txn->iotlb_start, gpa);
+		txn->iotlb_end = max(txn->iotlb_end, gpa + size);
+	}
+}
+
+void ept_txn_commit(struct ept_txn *txn)
+{
+	struct acrn_vm *vm = txn->vm;
+	uint32_t i;
 
 	spinlock_release(&vm->ept_lock);
 
-	ept_flush_guest(vm);
+	if (txn->freed.count != 0U) {
+		ept_sync_flush_guest(vm);
+	}
+
+	if (txn->modified) {
+		ept_flush_guest(vm);
+	}
+
+	/* the normal world EPT is shared with the IOMMU, drop the stale DMA translations too */
+	if ((txn->iotlb_start < txn->iotlb_end) && (vm->iommu != NULL) &&
+			(txn->pml4_page == (uint64_t *)vm->arch_vm.nworld_eptp)) {
+		iommu_flush_iotlb_range(vm->iommu, txn->iotlb_start, txn->iotlb_end - txn->iotlb_start);
+	}
+
+	/* neither a vCPU nor DMA can walk the unlinked pages any more */
+	for (i = 0U; i < txn->freed.count; i++) {
+		free_page(vm->arch_vm.ept_pgtable.pool, (void *)txn->freed.pages[i]);
+	}
+}
+
+void ept_add_mr(struct acrn_vm *vm, uint64_t *pml4_page,
+	uint64_t hpa, uint64_t gpa, uint64_t size, uint64_t prot_orig)
+{
+	struct ept_txn txn;
+
+	ept_txn_begin(&txn, vm, pml4_page);
+	ept_txn_add_mr(&txn, hpa, gpa, size, prot_orig);
+	ept_txn_commit(&txn);
 }
 
 void ept_modify_mr(struct acrn_vm *vm, uint64_t *pml4_page,
@@ -352,15 +470,20 @@ void ept_modify_mr(struct acrn_vm *vm, uint64_t *pml4_page,
  */
 void ept_del_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa, uint64_t size)
 {
-	dev_dbg(DBG_LEVEL_EPT, "%s,vm[%d] gpa 0x%lx size 0x%lx\n", __func__, vm->vm_id, gpa, size);
-
-	spinlock_obtain(&vm->ept_lock);
+	struct ept_txn txn;
 
-	pgtable_modify_or_del_map(pml4_page, gpa, size, 0UL, 0UL, &(vm->arch_vm.ept_pgtable), MR_DEL);
+	ept_txn_begin(&txn, vm, pml4_page);
+	ept_txn_del_mr(&txn, gpa, size);
+	ept_txn_commit(&txn);
+}
 
-	spinlock_release(&vm->ept_lock);
+void ept_promote_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa, uint64_t size)
+{
+	struct ept_txn txn;
 
-	ept_flush_guest(vm);
+	ept_txn_begin(&txn, vm, pml4_page);
+	ept_txn_promote_mr(&txn, gpa, size);
+	ept_txn_commit(&txn);
 }
 
 /**
@@ -423,6 +546,18 @@ void *get_eptp(struct acrn_vm *vm)
 	return eptp;
 }
 
+uint64_t get_nworld_eptp_value(const struct acrn_vm *vm)
+{
+	const struct dirty_log *log = &vm->arch_vm.dirty_log;
+	uint64_t eptp = hva2hpa(vm->arch_vm.nworld_eptp) | (3UL << 3U) | 6UL;
+
+	if (log->enabled && log->use_pml) {
+		eptp |= VMX_EPTP_AD_ENABLE;
+	}
+
+	return eptp;
+}
+
 /**
  * @pre vm != NULL && cb != NULL.
  */
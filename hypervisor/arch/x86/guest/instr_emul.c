@@ -33,6 +33,7 @@
 #include <asm/vmx.h>
 #include <asm/guest/vmcs.h>
 #include <asm/mmu.h>
+#include <asm/guest/ept.h>
 #include <asm/per_cpu.h>
 #include <logmsg.h>
 #include <asm/guest/virq.h>
@@ -1675,14 +1676,11 @@ static __attribute__((noinline)) int32_t emulate_xchg_for_splitlock(struct acrn_
 	return ret;
 }
 
-static int32_t vie_init(struct instr_emul_vie *vie, struct acrn_vcpu *vcpu)
+static int32_t vie_init(struct instr_emul_vie *vie, struct acrn_vcpu *vcpu, uint64_t rip_gla, uint64_t *inst_gpa)
 {
 	uint32_t inst_len = vcpu->arch.inst_len;
-	enum vm_cpu_mode cpu_mode;
-	struct seg_desc desc;
-	uint64_t guest_rip_gva;
 	uint32_t err_code;
-	uint64_t fault_addr;
+	uint64_t fault_addr, gpa;
 	int32_t ret;
 
 	if ((inst_len > VIE_INST_SIZE) || (inst_len == 0U)) {
@@ -1696,15 +1694,19 @@ static int32_t vie_init(struct instr_emul_vie *vie, struct acrn_vcpu *vcpu)
 		vie->index_register = CPU_REG_LAST;
 		vie->segment_register = CPU_REG_LAST;
 
-		cpu_mode = get_vcpu_mode(vcpu);
-		vm_get_seg_desc(CPU_REG_CS, &desc);
-
-		/* VMX_GUEST_RIP is a natural-width field */
-		vie_calculate_gla(cpu_mode, CPU_REG_CS, &desc, vcpu_get_rip(vcpu),
-				8U, &guest_rip_gva);
-
 		err_code = PAGE_FAULT_ID_FLAG;
-		ret = copy_from_gva(vcpu, vie->inst, guest_rip_gva, inst_len, &err_code, &fault_addr);
+		if ((rip_gla & PAGE_MASK) == ((rip_gla + inst_len - 1UL) & PAGE_MASK)) {
+			/* within one page, remember where the bytes came from so the decode can be cached */
+			fault_addr = rip_gla;
+			ret = gva2gpa(vcpu, rip_gla, &gpa, &err_code);
+			if (ret >= 0) {
+				ret = copy_from_gpa(vcpu->vm, vie->inst, gpa, inst_len);
+				*inst_gpa = gpa;
+			}
+		} else {
+			ret = copy_from_gva(vcpu, vie->inst, rip_gla, inst_len, &err_code, &fault_addr);
+		}
+
 		if (ret < 0) {
 			if (ret == -EFAULT) {
 				vcpu_inject_pf(vcpu, fault_addr, err_code);
@@ -1718,6 +1720,92 @@ static int32_t vie_init(struct instr_emul_vie *vie, struct acrn_vcpu *vcpu)
 	return ret;
 }
 
+/*
+ * Decoded instructions are cached per vCPU, keyed by the linear address of
+ * the instruction, the guest CR3 and the decode mode. CR3 writes don't exit
+ * with EPT, so a new address space simply misses. A hit is only used if the
+ * linear address still translates to the guest physical address the
+ * instruction was fetched from, and the bytes there still match. This
+ * catches remapped and modified code; the page walk is still far cheaper
+ * than fetching and decoding the instruction again.
+ */
+static bool vie_cache_entry_valid(struct acrn_vcpu *vcpu, const struct instr_emul_vie_cache_entry *entry)
+{
+	const uint8_t *inst;
+	uint32_t err_code = PAGE_FAULT_ID_FLAG;
+	uint64_t gpa;
+	bool same = false;
+	uint8_t i;
+
+	/* a faulting walk is a miss, vie_init() then injects the fault */
+	if ((gva2gpa(vcpu, entry->rip_gla, &gpa, &err_code) >= 0) && (gpa == entry->inst_gpa)) {
+		inst = (const uint8_t *)gpa2hva(vcpu->vm, gpa);
+		if (inst != NULL) {
+			same = true;
+			stac();
+			for (i = 0U; i < entry->vie.num_valid; i++) {
+				if (inst[i] != entry->vie.inst[i]) {
+					same = false;
+					break;
+				}
+			}
+			clac();
+		}
+	}
+
+	return same;
+}
+
+static struct instr_emul_vie_cache_entry *vie_cache_lookup(struct acrn_vcpu *vcpu, enum vm_cpu_mode cpu_mode,
+		bool cs_d, uint64_t rip_gla, uint64_t cr3)
+{
+	struct instr_emul_vie_cache_entry *entry, *found = NULL;
+	uint8_t i;
+
+	for (i = 0U; i < VIE_CACHE_SIZE; i++) {
+		entry = &vcpu->inst_ctxt.cache[i];
+		if (entry->valid && (entry->rip_gla == rip_gla) && (entry->cr3 == cr3) &&
+				(entry->cpu_mode == (uint8_t)cpu_mode) && (entry->cs_d == cs_d) &&
+				(entry->vie.num_valid == vcpu->arch.inst_len)) {
+			if (vie_cache_entry_valid(vcpu, entry)) {
+				found = entry;
+			} else {
+				entry->valid = false;
+			}
+			break;
+		}
+	}
+
+	return found;
+}
+
+static void vie_cache_insert(struct acrn_vcpu *vcpu, enum vm_cpu_mode cpu_mode,
+		bool cs_d, uint64_t rip_gla, uint64_t cr3, uint64_t inst_gpa)
+{
+	struct instr_emul_ctxt *emul_ctxt = &vcpu->inst_ctxt;
+	struct instr_emul_vie_cache_entry *entry = &emul_ctxt->cache[emul_ctxt->cache_next];
+
+	entry->valid = true;
+	entry->cs_d = cs_d;
+	entry->cpu_mode = (uint8_t)cpu_mode;
+	entry->rip_gla = rip_gla;
+	entry->cr3 = cr3;
+	entry->inst_gpa = inst_gpa;
+	entry->vie = emul_ctxt->vie;
+
+	emul_ctxt->cache_next = (emul_ctxt->cache_next + 1U) % VIE_CACHE_SIZE;
+}
+
+/* Called when the translation of guest linear addresses may have changed. */
+void invalidate_instr_cache(struct acrn_vcpu *vcpu)
+{
+	uint8_t i;
+
+	for (i = 0U; i < VIE_CACHE_SIZE; i++) {
+		vcpu->inst_ctxt.cache[i].valid = false;
+	}
+}
+
 static int32_t vie_peek(const struct instr_emul_vie *vie, uint8_t *x)
 {
 	int32_t ret;
@@ -2346,56 +2434,76 @@ static int32_t instr_check_gva(struct acrn_vcpu *vcpu, enum vm_cpu_mode cpu_mode
 int32_t decode_instruction(struct acrn_vcpu *vcpu, bool full_decode)
 {
 	struct instr_emul_ctxt *emul_ctxt;
+	const struct instr_emul_vie_cache_entry *entry;
+	struct seg_desc desc;
 	uint32_t csar;
 	int32_t retval;
 	enum vm_cpu_mode cpu_mode;
+	uint64_t rip_gla, cr3, inst_gpa = INVALID_GPA;
+	bool cs_d;
 
 	emul_ctxt = &vcpu->inst_ctxt;
-	retval = vie_init(&emul_ctxt->vie, vcpu);
-
-	if (retval < 0) {
-		if (retval != -EFAULT) {
-			pr_err("init vie failed @ 0x%016lx:", vcpu_get_rip(vcpu));
-		}
-	} else {
-		csar = exec_vmread32(VMX_GUEST_CS_ATTR);
-		cpu_mode = get_vcpu_mode(vcpu);
+	csar = exec_vmread32(VMX_GUEST_CS_ATTR);
+	cs_d = seg_desc_def32(csar);
+	cpu_mode = get_vcpu_mode(vcpu);
+	cr3 = exec_vmread(VMX_GUEST_CR3);
+	vm_get_seg_desc(CPU_REG_CS, &desc);
 
-		retval = local_decode_instruction(cpu_mode, seg_desc_def32(csar), &emul_ctxt->vie);
+	/* VMX_GUEST_RIP is a natural-width field */
+	vie_calculate_gla(cpu_mode, CPU_REG_CS, &desc, vcpu_get_rip(vcpu), 8U, &rip_gla);
 
-		if (retval != 0) {
-			if (full_decode) {
-				pr_err("decode instruction failed @ 0x%016lx:", vcpu_get_rip(vcpu));
-				vcpu_inject_ud(vcpu);
-				retval = -EFAULT;
+	entry = vie_cache_lookup(vcpu, cpu_mode, cs_d, rip_gla, cr3);
+	if (entry != NULL) {
+		emul_ctxt->vie = entry->vie;
+		retval = 0;
+	} else {
+		retval = vie_init(&emul_ctxt->vie, vcpu, rip_gla, &inst_gpa);
+		if (retval < 0) {
+			if (retval != -EFAULT) {
+				pr_err("init vie failed @ 0x%016lx:", vcpu_get_rip(vcpu));
 			}
 		} else {
-			/*
-			 * We do operand check in instruction decode phase and
-			 * inject exception accordingly. In late instruction
-			 * emulation, it will always success.
-			 *
-			 * We only need to do dst check for movs. For other instructions,
-			 * they always has one register and one mmio which trigger EPT
-			 * by access mmio. With VMX enabled, the related check is done
-			 * by VMX itself before hit EPT violation.
-			 *
-			 */
-			if ((emul_ctxt->vie.op.op_flags & VIE_OP_F_CHECK_GVA_DI) != 0U) {
-				retval = instr_check_di(vcpu);
+			retval = local_decode_instruction(cpu_mode, cs_d, &emul_ctxt->vie);
+			if (retval != 0) {
+				if (full_decode) {
+					pr_err("decode instruction failed @ 0x%016lx:", vcpu_get_rip(vcpu));
+					vcpu_inject_ud(vcpu);
+					retval = -EFAULT;
+				}
+			} else if (inst_gpa != INVALID_GPA) {
+				vie_cache_insert(vcpu, cpu_mode, cs_d, rip_gla, cr3, inst_gpa);
 			} else {
-				retval = instr_check_gva(vcpu, cpu_mode);
+				/* instructions crossing a page boundary are not cached */
 			}
+		}
+	}
 
-			if (retval >= 0) {
-				/* return the Memory Operand byte size */
-				if ((emul_ctxt->vie.op.op_flags & VIE_OP_F_BYTE_OP) != 0U) {
-					retval = 1;
-				} else if ((emul_ctxt->vie.op.op_flags & VIE_OP_F_WORD_OP) != 0U) {
-					retval = 2;
-				} else {
-					retval = (int32_t)emul_ctxt->vie.opsize;
-				}
+	if (retval == 0) {
+		/*
+		 * We do operand check in instruction decode phase and
+		 * inject exception accordingly. In late instruction
+		 * emulation, it will always success.
+		 *
+		 * We only need to do dst check for movs. For other instructions,
+		 * they always has one register and one mmio which trigger EPT
+		 * by access mmio. With VMX enabled, the related check is done
+		 * by VMX itself before hit EPT violation.
+		 *
+		 */
+		if ((emul_ctxt->vie.op.op_flags & VIE_OP_F_CHECK_GVA_DI) != 0U) {
+			retval = instr_check_di(vcpu);
+		} else {
+			retval = instr_check_gva(vcpu, cpu_mode);
+		}
+
+		if (retval >= 0) {
+			/* return the Memory Operand byte size */
+			if ((emul_ctxt->vie.op.op_flags & VIE_OP_F_BYTE_OP) != 0U) {
+				retval = 1;
+			} else if ((emul_ctxt->vie.op.op_flags & VIE_OP_F_WORD_OP) != 0U) {
+				retval = 2;
+			} else {
+				retval = (int32_t)emul_ctxt->vie.opsize;
 			}
 		}
 	}
@@ -716,6 +716,10 @@ static void reset_vvmcs(struct acrn_vcpu *vcpu)
 
 	for (idx = 0U; idx < MAX_ACTIVE_VVMCS_NUM; idx++) {
 		vvmcs = &vcpu->arch.nested.vvmcs[idx];
+		/* drop the shadow EPT reference of a VMCS12 that wasn't VMCLEARed */
+		if (vvmcs->vmcs12_gpa != INVALID_GPA) {
+			put_vept_desc(vcpu->vm, vvmcs->vmcs12.ept_pointer);
+		}
 		vvmcs->host_state_dirty = false;
 		vvmcs->control_fields_dirty = false;
 		vvmcs->vmcs12_gpa = INVALID_GPA;
@@ -960,8 +964,8 @@ int32_t vmwrite_vmexit_handler(struct acrn_vcpu *vcpu)
 
 					if (vmcs_field == VMX_EPT_POINTER_FULL) {
 						if (cur_vvmcs->vmcs12.ept_pointer != vmcs_value) {
-							put_vept_desc(cur_vvmcs->vmcs12.ept_pointer);
-							get_vept_desc(vmcs_value);
+							put_vept_desc(vcpu->vm, cur_vvmcs->vmcs12.ept_pointer);
+							(void)get_vept_desc(vcpu->vm, vmcs_value);
 						}
 					}
 				}
@@ -1004,7 +1008,7 @@ static void merge_and_sync_control_fields(struct acrn_vcpu *vcpu, struct acrn_vm
 	/* Sync VMCS fields that are not shadowing. Don't need to sync these fields back to VMCS12. */
 
 	exec_vmwrite(VMX_MSR_BITMAP_FULL, gpa2hpa(vcpu->vm, vmcs12->msr_bitmap));
-	exec_vmwrite(VMX_EPT_POINTER_FULL, get_shadow_eptp(vmcs12->ept_pointer));
+	exec_vmwrite(VMX_EPT_POINTER_FULL, get_shadow_eptp(vcpu->vm, vmcs12->ept_pointer));
 
 	/* For VM-execution, entry and exit controls */
 	value64 = vmcs12->vm_entry_controls;
@@ -1136,7 +1140,7 @@ static void clear_vvmcs(struct acrn_vcpu *vcpu, struct acrn_vvmcs *vvmcs)
 	clear_va_vmcs(vvmcs->vmcs02);
 
 	/* This VMCS can no longer refer to any shadow EPT */
-	put_vept_desc(vvmcs->vmcs12.ept_pointer);
+	put_vept_desc(vcpu->vm, vvmcs->vmcs12.ept_pointer);
 
 	/* This vvmcs[] entry doesn't cache a VMCS12 any more */
 	vvmcs->vmcs12_gpa = INVALID_GPA;
@@ -1189,7 +1193,7 @@ int32_t vmptrld_vmexit_handler(struct acrn_vcpu *vcpu)
 					sizeof(struct acrn_vmcs12));
 
 				/* if needed, create nept_desc and allocate shadow root for the EPTP */
-				get_vept_desc(vvmcs->vmcs12.ept_pointer);
+				(void)get_vept_desc(vcpu->vm, vvmcs->vmcs12.ept_pointer);
 
 				/* Need to load shadow fields from this new VMCS12 to VMCS02 */
 				sync_vmcs12_to_vmcs02(vcpu, &vvmcs->vmcs12);
@@ -1614,7 +1618,7 @@ int32_t invvpid_vmexit_handler(struct acrn_vcpu *vcpu)
 	return 0;
 }
 
-void init_nested_vmx(__unused struct acrn_vm *vm)
+void init_nested_vmx(struct acrn_vm *vm)
 {
 	static bool initialized = false;
 
@@ -1625,4 +1629,11 @@ void init_nested_vmx(__unused struct acrn_vm *vm)
 		vmx_basic = (uint32_t)msr_read(MSR_IA32_VMX_BASIC);
 		setup_vmcs_shadowing_bitmap();
 	}
+
+	init_vept_table(vm);
+}
+
+void deinit_nested_vmx(struct acrn_vm *vm)
+{
+	deinit_vept_table(vm);
 }
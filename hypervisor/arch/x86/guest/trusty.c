@@ -238,9 +238,7 @@ void switch_world(struct acrn_vcpu *vcpu, int32_t next_world)
 
 	if (next_world == NORMAL_WORLD) {
 		/* load EPTP for next world */
-		exec_vmwrite64(VMX_EPT_POINTER_FULL,
-			hva2hpa(vcpu->vm->arch_vm.nworld_eptp) |
-			(3UL << 3U) | 0x6UL);
+		exec_vmwrite64(VMX_EPT_POINTER_FULL, get_nworld_eptp_value(vcpu->vm));
 
 #ifndef CONFIG_L1D_FLUSH_VMENTRY_ENABLED
 		cpu_l1d_flush();
@@ -21,6 +21,7 @@
 #include <lib/sprintf.h>
 #include <asm/lapic.h>
 #include <asm/irq.h>
+#include <asm/notify.h>
 #include <console.h>
 
 /* stack_frame is linked with the sequence of stack operation in arch_switch_to() */
@@ -247,6 +248,7 @@ static void vcpu_reset_internal(struct acrn_vcpu *vcpu, enum reset_mode mode)
 	vcpu->arch.exception_info.exception = VECTOR_INVALID;
 	vcpu->arch.cur_context = NORMAL_WORLD;
 	vcpu->arch.lapic_pt_enabled = false;
+	vcpu->arch.vmcs_cleared = false;
 	vcpu->arch.irq_window_enabled = false;
 	vcpu->arch.emulating_lock = false;
 	(void)memset((void *)vcpu->arch.vmcs, 0U, PAGE_SIZE);
@@ -267,6 +269,8 @@ static void vcpu_reset_internal(struct acrn_vcpu *vcpu, enum reset_mode mode)
 
 	init_iwkey(vcpu);
 	vcpu->arch.iwkey_copy_status = 0UL;
+
+	invalidate_instr_cache(vcpu);
 }
 
 struct acrn_vcpu *get_running_vcpu(uint16_t pcpu_id)
@@ -303,11 +307,29 @@ static void set_vcpu_mode(struct acrn_vcpu *vcpu, uint32_t cs_attr, uint64_t ia3
 	}
 }
 
+/*
+ * Forget about ectx in the pCPU extended context caches, so that the next
+ * switch in restores it from memory. It's always safe to clear xsave_owner.
+ */
+void invalidate_ext_context_cache(const struct ext_context *ectx)
+{
+	uint16_t pcpu_id;
+
+	for (pcpu_id = 0U; pcpu_id < get_pcpu_nums(); pcpu_id++) {
+		if (per_cpu(ext_ctx_cache, pcpu_id).xsave_owner == ectx) {
+			per_cpu(ext_ctx_cache, pcpu_id).xsave_owner = NULL;
+		}
+	}
+}
+
 static void init_xsave(struct acrn_vcpu *vcpu)
 {
 	struct ext_context *ectx = &(vcpu->arch.contexts[vcpu->arch.cur_context].ext_ctx);
 	struct xsave_area *area = &ectx->xs_area;
 
+	/* the vCPU structure may be reused from a destroyed VM */
+	invalidate_ext_context_cache(ectx);
+
 	/* if the HW has this cap, we need to prepare the buffer for potential save/restore.
 	 *  Guest may or may not enable XSAVE -- it doesn't matter.
 	 */
@@ -598,8 +620,8 @@ int32_t create_vcpu(uint16_t pcpu_id, struct acrn_vm *vm, struct acrn_vcpu **rtn
 		 */
 		vcpu->arch.pid.control.bits.nv = POSTED_INTR_VECTOR + vm->vm_id;
 
-		/* ACRN does not support vCPU migration, one vCPU always runs on
-		 * the same pCPU, so PI's ndst is never changed after startup.
+		/* Changed by vcpu_migrate() only, when the load balancer moves
+		 * the vCPU to another pCPU.
 		 */
 		vcpu->arch.pid.control.bits.ndst = per_cpu(lapic_id, pcpu_id);
 
@@ -758,8 +780,14 @@ int32_t run_vcpu(struct acrn_vcpu *vcpu)
 				exec_vmwrite(VMX_GUEST_RIP, vcpu_get_rip(vcpu) + vcpu->arch.inst_len);
 			}
 
-			/* Resume the VM */
-			status = exec_vmentry(ctx, VM_RESUME, ibrs_type);
+			if (vcpu->arch.vmcs_cleared) {
+				/* moved from another pCPU, the launch state of the VMCS is clear */
+				vcpu->arch.vmcs_cleared = false;
+				status = exec_vmentry(ctx, VM_LAUNCH, ibrs_type);
+			} else {
+				/* Resume the VM */
+				status = exec_vmentry(ctx, VM_RESUME, ibrs_type);
+			}
 		}
 
 		cs_attr = exec_vmread32(VMX_GUEST_CS_ATTR);
@@ -906,15 +934,11 @@ void rstore_xsave_area(const struct acrn_vcpu *vcpu, const struct ext_context *e
 	}
 }
 
-/* TODO:
- * Now we have switch_out and switch_in callbacks for each thread_object, and schedule
- * will call them every thread switch. We can implement lazy context swtich , which
- * only do context swtich when really need.
- */
 static void context_switch_out(struct thread_object *prev)
 {
 	struct acrn_vcpu *vcpu = container_of(prev, struct acrn_vcpu, thread_obj);
 	struct ext_context *ectx = &(vcpu->arch.contexts[vcpu->arch.cur_context].ext_ctx);
+	struct ext_context_cache *cache = &get_cpu_var(ext_ctx_cache);
 
 	/* We don't flush TLB as we assume each vcpu has different vpid */
 	ectx->ia32_star = msr_read(MSR_IA32_STAR);
@@ -925,22 +949,52 @@ static void context_switch_out(struct thread_object *prev)
 	ectx->tsc_aux = msr_read(MSR_IA32_TSC_AUX);
 
 	save_xsave_area(vcpu, ectx);
+
+	/* What was just saved stays loaded until another vCPU switches in */
+	cache->ia32_star = ectx->ia32_star;
+	cache->ia32_cstar = ectx->ia32_cstar;
+	cache->ia32_lstar = ectx->ia32_lstar;
+	cache->ia32_fmask = ectx->ia32_fmask;
+	cache->ia32_kernel_gs_base = ectx->ia32_kernel_gs_base;
+	cache->tsc_aux = ectx->tsc_aux;
+	cache->msrs_valid = true;
+	cache->xsave_owner = ectx;
+}
+
+static void lazy_msr_write(struct ext_context_cache *cache, uint32_t msr, uint64_t *loaded, uint64_t val)
+{
+	if (!cache->msrs_valid || (*loaded != val)) {
+		msr_write(msr, val);
+		*loaded = val;
+		cache->msr_writes++;
+	} else {
+		cache->msr_writes_elided++;
+	}
 }
 
+/*
+ * Only load what differs from the state left on this pCPU: nothing at all
+ * when the vCPU that switched out last is switched in again (e.g. after
+ * the idle thread ran), and only the MSRs whose values differ when vCPUs
+ * of the same guest OS share the pCPU.
+ */
 static void context_switch_in(struct thread_object *next)
 {
 	struct acrn_vcpu *vcpu = container_of(next, struct acrn_vcpu, thread_obj);
 	struct ext_context *ectx = &(vcpu->arch.contexts[vcpu->arch.cur_context].ext_ctx);
+	struct ext_context_cache *cache = &get_cpu_var(ext_ctx_cache);
 	uint64_t vmsr_val;
 
 	load_vmcs(vcpu);
 
-	msr_write(MSR_IA32_STAR, ectx->ia32_star);
-	msr_write(MSR_IA32_CSTAR, ectx->ia32_cstar);
-	msr_write(MSR_IA32_LSTAR, ectx->ia32_lstar);
-	msr_write(MSR_IA32_FMASK, ectx->ia32_fmask);
-	msr_write(MSR_IA32_KERNEL_GS_BASE, ectx->ia32_kernel_gs_base);
-	msr_write(MSR_IA32_TSC_AUX, ectx->tsc_aux);
+	cache->switch_in++;
+	lazy_msr_write(cache, MSR_IA32_STAR, &cache->ia32_star, ectx->ia32_star);
+	lazy_msr_write(cache, MSR_IA32_CSTAR, &cache->ia32_cstar, ectx->ia32_cstar);
+	lazy_msr_write(cache, MSR_IA32_LSTAR, &cache->ia32_lstar, ectx->ia32_lstar);
+	lazy_msr_write(cache, MSR_IA32_FMASK, &cache->ia32_fmask, ectx->ia32_fmask);
+	lazy_msr_write(cache, MSR_IA32_KERNEL_GS_BASE, &cache->ia32_kernel_gs_base, ectx->ia32_kernel_gs_base);
+	lazy_msr_write(cache, MSR_IA32_TSC_AUX, &cache->tsc_aux, ectx->tsc_aux);
+	cache->msrs_valid = true;
 
 	if (pcpu_has_cap(X86_FEATURE_WAITPKG)) {
 		vmsr_val = vcpu_get_guest_msr(vcpu, MSR_IA32_UMWAIT_CONTROL);
@@ -951,9 +1005,100 @@ static void context_switch_in(struct thread_object *next)
 
 	load_iwkey(vcpu);
 
-	rstore_xsave_area(vcpu, ectx);
+	if (cache->xsave_owner != ectx) {
+		rstore_xsave_area(vcpu, ectx);
+	} else if (pcpu_has_cap(X86_FEATURE_XSAVES)) {
+		/* save_xsave_area() may have set XSAVE_SSE in XCR0 */
+		if ((ectx->xcr0 & XSAVE_SSE) == 0UL) {
+			write_xcr(0, ectx->xcr0);
+		}
+		cache->xrstors_elided++;
+	} else {
+		/* no XSAVES, nothing to restore */
+	}
 }
 
+/*
+ * Only vCPUs of VMs sharing pCPUs move: RT, LAPIC passthrough, nested and
+ * secure world vCPUs stay where they are. The posted interrupt vectors are
+ * allocated per VM, so the new pCPU must not run a vCPU of the same VM yet.
+ */
+static bool vcpu_can_migrate(const struct thread_object *obj, uint16_t pcpu_id)
+{
+	const struct acrn_vcpu *vcpu = container_of(obj, struct acrn_vcpu, thread_obj);
+	const struct acrn_vm *vm = vcpu->vm;
+
+	return (vcpu->launched && (vcpu->state == VCPU_RUNNING) && !is_rt_vm(vm) &&
+		!is_lapic_pt_configured(vm) && !is_nvmx_configured(vm) && !is_vcat_configured(vm) &&
+		(vm->sworld_control.flag.supported == 0UL) &&
+		((get_vm_config(vm->vm_id)->cpu_affinity & (1UL << pcpu_id)) != 0UL) &&
+		(per_cpu(vcpu_array, pcpu_id)[vm->vm_id] == NULL));
+}
+
+/* Runs on the pCPU the vCPU moves away from, by smp_call_function(). */
+static void vcpu_leave_pcpu(void *data)
+{
+	struct acrn_vcpu *vcpu = (struct acrn_vcpu *)data;
+	struct hv_timer *timer = &vcpu_vlapic(vcpu)->vtimer.timer;
+	uint16_t pcpu_id = get_pcpu_id();
+
+	/* the VMCS may be cached by this pCPU, it must be VMCLEARed here */
+	clear_va_vmcs(vcpu->arch.vmcs);
+	if (per_cpu(vmcs_run, pcpu_id) == (void *)vcpu->arch.vmcs) {
+		per_cpu(vmcs_run, pcpu_id) = NULL;
+	}
+
+	/* the timer list is per pCPU and is not locked */
+	vcpu->arch.vtimer_moved = timer_is_started(timer);
+	del_timer(timer);
+
+	if (per_cpu(whose_iwkey, pcpu_id) == vcpu) {
+		per_cpu(whose_iwkey, pcpu_id) = NULL;
+	}
+	if (per_cpu(ever_run_vcpu, pcpu_id) == vcpu) {
+		per_cpu(ever_run_vcpu, pcpu_id) = NULL;
+	}
+}
+
+/*
+ * Move the pCPU bound state of a vCPU to the current pCPU. The next VM
+ * entry is a VMLAUNCH, and load_vmcs() points the VMCS host state to this
+ * pCPU before it.
+ */
+static void vcpu_migrate(struct thread_object *obj, uint16_t from_pcpu_id)
+{
+	struct acrn_vcpu *vcpu = container_of(obj, struct acrn_vcpu, thread_obj);
+	struct acrn_vm *vm = vcpu->vm;
+	uint16_t pcpu_id = get_pcpu_id();
+
+	smp_call_function(1UL << from_pcpu_id, vcpu_leave_pcpu, vcpu);
+	vcpu->arch.vmcs_cleared = true;
+	if (vcpu->arch.vtimer_moved) {
+		(void)add_timer(&vcpu_vlapic(vcpu)->vtimer.timer);
+	}
+
+	/* this pCPU takes the posted interrupt notifications of the vCPU from now on */
+	per_cpu(vcpu_array, pcpu_id)[vm->vm_id] = vcpu;
+	vcpu->arch.pid.control.bits.ndst = per_cpu(lapic_id, pcpu_id);
+	per_cpu(vcpu_array, from_pcpu_id)[vm->vm_id] = NULL;
+	if (per_cpu(ever_run_vcpu, pcpu_id) == NULL) {
+		per_cpu(ever_run_vcpu, pcpu_id) = vcpu;
+	}
+	bitmap_clear_lock(from_pcpu_id, &vm->hw.cpu_affinity);
+	bitmap_set_lock(pcpu_id, &vm->hw.cpu_affinity);
+
+	/* the old pCPU must restore the extended context if the vCPU comes back */
+	invalidate_ext_context_cache(&vcpu->arch.contexts[vcpu->arch.cur_context].ext_ctx);
+
+	/*
+	 * Flush what this pCPU cached for the vCPU when it last ran here, and
+	 * pick up the notifications that went to the old pCPU meanwhile.
+	 * No kick, the vCPU is in no runqueue.
+	 */
+	bitmap_set_lock(ACRN_REQUEST_EPT_FLUSH, &vcpu->arch.pending_req);
+	bitmap_set_lock(ACRN_REQUEST_VPID_FLUSH, &vcpu->arch.pending_req);
+	bitmap_set_lock(ACRN_REQUEST_EVENT, &vcpu->arch.pending_req);
+}
 
 /**
  * @pre vcpu != NULL
@@ -986,6 +1131,8 @@ int32_t prepare_vcpu(struct acrn_vm *vm, uint16_t pcpu_id)
 		vcpu->thread_obj.host_sp = build_stack_frame(vcpu);
 		vcpu->thread_obj.switch_out = context_switch_out;
 		vcpu->thread_obj.switch_in = context_switch_in;
+		vcpu->thread_obj.can_migrate = vcpu_can_migrate;
+		vcpu->thread_obj.migrate = vcpu_migrate;
 		init_thread_data(&vcpu->thread_obj, &get_vm_config(vm->vm_id)->sched_params);
 		for (i = 0; i < VCPU_EVENT_NUM; i++) {
 			init_event(&vcpu->events[i]);
@@ -13,11 +13,9 @@
 #include <asm/guest/ept.h>
 #include <asm/guest/vept.h>
 #include <asm/guest/nested.h>
+#include <hash.h>
 
 #define VETP_LOG_LEVEL			LOG_DEBUG
-#define CONFIG_MAX_GUEST_EPT_NUM	(MAX_ACTIVE_VVMCS_NUM * MAX_VCPUS_PER_VM)
-static struct vept_desc vept_desc_bucket[CONFIG_MAX_GUEST_EPT_NUM];
-static spinlock_t vept_desc_bucket_lock;
 
 /*
  * For simplicity, total platform RAM size is considered to calculate the
@@ -105,26 +103,116 @@ static void free_sept_table(uint64_t *shadow_eptp)
 	}
 }
 
+static struct hlist_head *vept_bucket(struct vept_table *table, uint64_t guest_eptp)
+{
+	return &table->buckets[hash64(guest_eptp, VEPT_HASH_BITS)];
+}
+
+/*
+ * @pre table->lock is held
+ */
+static struct vept_desc *lookup_vept_desc(struct vept_table *table, uint64_t guest_eptp)
+{
+	struct hlist_node *pos;
+	struct vept_desc *desc = NULL, *iter;
+
+	hlist_for_each(pos, vept_bucket(table, guest_eptp)) {
+		iter = hlist_entry(pos, struct vept_desc, hnode);
+		if (iter->guest_eptp == guest_eptp) {
+			desc = iter;
+			break;
+		}
+	}
+
+	return desc;
+}
+
+/*
+ * @pre table->lock is held
+ */
+static void touch_vept_desc(struct vept_table *table, struct vept_desc *desc)
+{
+	list_del(&desc->lru);
+	list_add_tail(&desc->lru, &table->lru);
+}
+
+/*
+ * @brief Remove all the shadow EPT entries below the PML4 page of a vept_desc
+ *
+ * @pre table->lock is held
+ */
+static void flush_vept_desc(struct vept_desc *desc)
+{
+	spinlock_obtain(&desc->lock);
+	free_sept_table((void *)(desc->shadow_eptp & PAGE_MASK));
+	/* Flush the hardware TLB */
+	invept((void *)(desc->shadow_eptp & PAGE_MASK));
+	spinlock_release(&desc->lock);
+}
+
+/*
+ * @brief Release the shadow EPT of a vept_desc and unhash it
+ *
+ * The descriptor goes to the head of the LRU list, to be reused first.
+ *
+ * @pre table->lock is held
+ * @pre desc->guest_eptp != 0UL
+ */
+static void release_vept_desc(struct vept_table *table, struct vept_desc *desc)
+{
+	dev_dbg(VETP_LOG_LEVEL, "[%s], vept_desc[%llx] ref[%d] shadow_eptp[%llx] guest_eptp[%llx]",
+			__func__, desc, desc->ref_count, desc->shadow_eptp, desc->guest_eptp);
+	flush_vept_desc(desc);
+	free_page(&sept_page_pool, (struct page *)(desc->shadow_eptp & PAGE_MASK));
+	hlist_del(&desc->hnode);
+	desc->shadow_eptp = 0UL;
+	desc->guest_eptp = 0UL;
+	desc->ref_count = 0U;
+
+	list_del(&desc->lru);
+	list_add(&desc->lru, &table->lru);
+}
+
+/*
+ * @brief Get an unused vept_desc, reclaiming the least recently used shadow EPT if needed
+ *
+ * @pre table->lock is held
+ * @return NULL if every vept_desc is referenced by a VMCS12
+ */
+static struct vept_desc *alloc_vept_desc(struct vept_table *table)
+{
+	struct list_head *pos;
+	struct vept_desc *desc = NULL, *iter;
+
+	list_for_each(pos, &table->lru) {
+		iter = container_of(pos, struct vept_desc, lru);
+		if (iter->ref_count == 0U) {
+			desc = iter;
+			break;
+		}
+	}
+
+	if ((desc != NULL) && (desc->guest_eptp != 0UL)) {
+		release_vept_desc(table, desc);
+	}
+
+	return desc;
+}
+
 /*
  * @brief Convert a guest EPTP to the associated vept_desc.
  * @return struct vept_desc * if existed.
  * @return NULL if non-existed.
  */
-static struct vept_desc *find_vept_desc(uint64_t guest_eptp)
+static struct vept_desc *find_vept_desc(struct acrn_vm *vm, uint64_t guest_eptp)
 {
-	uint32_t i;
+	struct vept_table *table = &vm->arch_vm.vept;
 	struct vept_desc *desc = NULL;
 
-	if (guest_eptp) {
-		spinlock_obtain(&vept_desc_bucket_lock);
-		for (i = 0L; i < CONFIG_MAX_GUEST_EPT_NUM; i++) {
-			/* Find an existed vept_desc of the guest EPTP */
-			if (vept_desc_bucket[i].guest_eptp == guest_eptp) {
-				desc = &vept_desc_bucket[i];
-				break;
-			}
-		}
-		spinlock_release(&vept_desc_bucket_lock);
+	if (guest_eptp != 0UL) {
+		spinlock_obtain(&table->lock);
+		desc = lookup_vept_desc(table, guest_eptp);
+		spinlock_release(&table->lock);
 	}
 
 	return desc;
@@ -134,11 +222,11 @@ static struct vept_desc *find_vept_desc(uint64_t guest_eptp)
  * @brief Convert a guest EPTP to a shadow EPTP.
  * @return 0 if non-existed.
  */
-uint64_t get_shadow_eptp(uint64_t guest_eptp)
+uint64_t get_shadow_eptp(struct acrn_vm *vm, uint64_t guest_eptp)
 {
 	struct vept_desc *desc = NULL;
 
-	desc = find_vept_desc(guest_eptp);
+	desc = find_vept_desc(vm, guest_eptp);
 	return (desc != NULL) ? hva2hpa((void *)desc->shadow_eptp) : 0UL;
 }
 
@@ -147,42 +235,40 @@ uint64_t get_shadow_eptp(uint64_t guest_eptp)
  *
  * If there is already an existed vept_desc associated with given guest_eptp,
  * increase its ref_count and return it. If there is not existed vept_desc
- * for guest_eptp, create one and initialize it.
+ * for guest_eptp, take an unused one, or the least recently used one that no
+ * VMCS12 refers to, and initialize it.
  *
  * @return a vept_desc which associate the guest EPTP with a shadow EPTP
  */
-struct vept_desc *get_vept_desc(uint64_t guest_eptp)
+struct vept_desc *get_vept_desc(struct acrn_vm *vm, uint64_t guest_eptp)
 {
-	uint32_t i;
+	struct vept_table *table = &vm->arch_vm.vept;
 	struct vept_desc *desc = NULL;
 
 	if (guest_eptp != 0UL) {
-		spinlock_obtain(&vept_desc_bucket_lock);
-		for (i = 0L; i < CONFIG_MAX_GUEST_EPT_NUM; i++) {
-			/* Find an existed vept_desc of the guest EPTP address bits */
-			if (vept_desc_bucket[i].guest_eptp == guest_eptp) {
-				desc = &vept_desc_bucket[i];
-				desc->ref_count++;
-				break;
-			}
-			/* Get the first empty vept_desc for the guest EPTP */
-			if (!desc && (vept_desc_bucket[i].ref_count == 0UL)) {
-				desc = &vept_desc_bucket[i];
+		spinlock_obtain(&table->lock);
+		desc = lookup_vept_desc(table, guest_eptp);
+		if (desc == NULL) {
+			desc = alloc_vept_desc(table);
+			if (desc != NULL) {
+				/* A new vept_desc, initialize it */
+				desc->shadow_eptp = (uint64_t)alloc_page(&sept_page_pool) | (guest_eptp & ~PAGE_MASK);
+				desc->guest_eptp = guest_eptp;
+				hlist_add_head(&desc->hnode, vept_bucket(table, guest_eptp));
+
+				dev_dbg(VETP_LOG_LEVEL, "[%s], vept_desc[%llx] ref[%d] shadow_eptp[%llx] guest_eptp[%llx]",
+						__func__, desc, desc->ref_count, desc->shadow_eptp, desc->guest_eptp);
+			} else {
+				pr_err("%s: VM%hu has no vept_desc left for guest EPTP 0x%lx", __func__,
+					vm->vm_id, guest_eptp);
 			}
 		}
-		ASSERT(desc != NULL, "Get vept_desc failed!");
-
-		/* A new vept_desc, initialize it */
-		if (desc->shadow_eptp == 0UL) {
-			desc->shadow_eptp = (uint64_t)alloc_page(&sept_page_pool) | (guest_eptp & ~PAGE_MASK);
-			desc->guest_eptp = guest_eptp;
-			desc->ref_count = 1UL;
 
-			dev_dbg(VETP_LOG_LEVEL, "[%s], vept_desc[%llx] ref[%d] shadow_eptp[%llx] guest_eptp[%llx]",
-					__func__, desc, desc->ref_count, desc->shadow_eptp, desc->guest_eptp);
+		if (desc != NULL) {
+			desc->ref_count++;
+			touch_vept_desc(table, desc);
 		}
-
-		spinlock_release(&vept_desc_bucket_lock);
+		spinlock_release(&table->lock);
 	}
 
 	return desc;
@@ -191,29 +277,23 @@ struct vept_desc *get_vept_desc(uint64_t guest_eptp)
 /*
  * @brief Put a vept_desc who associate with a guest_eptp
  *
- * If ref_count of the vept_desc, then release all resources used by it.
+ * The shadow EPT stays when the last reference is gone: L1 often switches
+ * back to an EPTP it used before. It's released once the vept_desc is
+ * reclaimed for another guest EPTP.
  */
-void put_vept_desc(uint64_t guest_eptp)
+void put_vept_desc(struct acrn_vm *vm, uint64_t guest_eptp)
 {
+	struct vept_table *table = &vm->arch_vm.vept;
 	struct vept_desc *desc = NULL;
 
 	if (guest_eptp != 0UL) {
-		desc = find_vept_desc(guest_eptp);
-		spinlock_obtain(&vept_desc_bucket_lock);
-		if (desc) {
+		spinlock_obtain(&table->lock);
+		desc = lookup_vept_desc(table, guest_eptp);
+		if ((desc != NULL) && (desc->ref_count > 0U)) {
 			desc->ref_count--;
-			if (desc->ref_count == 0UL) {
-				dev_dbg(VETP_LOG_LEVEL, "[%s], vept_desc[%llx] ref[%d] shadow_eptp[%llx] guest_eptp[%llx]",
-						__func__, desc, desc->ref_count, desc->shadow_eptp, desc->guest_eptp);
-				free_sept_table((void *)(desc->shadow_eptp & PAGE_MASK));
-				free_page(&sept_page_pool, (struct page *)(desc->shadow_eptp & PAGE_MASK));
-				/* Flush the hardware TLB */
-				invept((void *)(desc->shadow_eptp & PAGE_MASK));
-				desc->shadow_eptp = 0UL;
-				desc->guest_eptp = 0UL;
-			}
+			touch_vept_desc(table, desc);
 		}
-		spinlock_release(&vept_desc_bucket_lock);
+		spinlock_release(&table->lock);
 	}
 }
 
@@ -394,7 +474,7 @@ static bool is_access_violation(uint64_t ept_entry)
 bool handle_l2_ept_violation(struct acrn_vcpu *vcpu)
 {
 	uint64_t guest_eptp = vcpu->arch.nested.current_vvmcs->vmcs12.ept_pointer;
-	struct vept_desc *desc = find_vept_desc(guest_eptp);
+	struct vept_desc *desc = find_vept_desc(vcpu->vm, guest_eptp);
 	uint64_t l2_ept_violation_gpa = exec_vmread(VMX_GUEST_PHYSICAL_ADDR_FULL);
 	enum _page_table_level pt_level;
 	uint64_t guest_ept_entry, shadow_ept_entry;
@@ -402,14 +482,19 @@ bool handle_l2_ept_violation(struct acrn_vcpu *vcpu)
 	uint16_t offset;
 	bool is_l1_vmexit = true;
 
-	ASSERT(desc != NULL, "Invalid shadow EPTP!");
+	/* The current VMCS12 holds a reference, desc can't be reclaimed meanwhile */
+	if (desc != NULL) {
+		spinlock_obtain(&desc->lock);
+		p_shadow_ept_page = (uint64_t *)(desc->shadow_eptp & PAGE_MASK);
+		p_guest_ept_page = gpa2hva(vcpu->vm, desc->guest_eptp & PAGE_MASK);
+	} else {
+		/* no vept_desc was left for the guest EPTP, let L1 see the violation */
+		p_shadow_ept_page = NULL;
+		p_guest_ept_page = NULL;
+	}
 
-	spinlock_obtain(&vept_desc_bucket_lock);
 	stac();
 
-	p_shadow_ept_page = (uint64_t *)(desc->shadow_eptp & PAGE_MASK);
-	p_guest_ept_page = gpa2hva(vcpu->vm, desc->guest_eptp & PAGE_MASK);
-
 	for (pt_level = IA32E_PML4; (p_guest_ept_page != NULL) && (pt_level <= IA32E_PT); pt_level++) {
 		offset = PAGING_ENTRY_OFFSET(l2_ept_violation_gpa, pt_level);
 		guest_ept_entry = p_guest_ept_page[offset];
@@ -480,7 +565,9 @@ bool handle_l2_ept_violation(struct acrn_vcpu *vcpu)
 	}
 
 	clac();
-	spinlock_release(&vept_desc_bucket_lock);
+	if (desc != NULL) {
+		spinlock_release(&desc->lock);
+	}
 
 	return is_l1_vmexit;
 }
@@ -490,6 +577,7 @@ bool handle_l2_ept_violation(struct acrn_vcpu *vcpu)
  */
 int32_t invept_vmexit_handler(struct acrn_vcpu *vcpu)
 {
+	struct vept_table *table = &vcpu->vm->arch_vm.vept;
 	uint32_t i;
 	struct vept_desc *desc;
 	struct invept_desc operand_gla_ept;
@@ -503,36 +591,30 @@ int32_t invept_vmexit_handler(struct acrn_vcpu *vcpu)
 		} else if (type == 1 && (ept_cap_vmsr & VMX_EPT_INVEPT_SINGLE_CONTEXT) != 0UL) {
 			/* Single-context invalidation */
 			/* Find corresponding vept_desc of the invalidated EPTP */
-			desc = get_vept_desc(operand_gla_ept.eptp);
-			if (desc) {
-				spinlock_obtain(&vept_desc_bucket_lock);
-				if (desc->shadow_eptp != 0UL) {
-					/*
-					 * Since ACRN does not know which paging entries are changed,
-					 * Remove all the shadow EPT entries that ACRN created for L2 VM
-					 */
-					free_sept_table((void *)(desc->shadow_eptp & PAGE_MASK));
-					invept((void *)(desc->shadow_eptp & PAGE_MASK));
-				}
-				spinlock_release(&vept_desc_bucket_lock);
-				put_vept_desc(operand_gla_ept.eptp);
+			spinlock_obtain(&table->lock);
+			desc = lookup_vept_desc(table, operand_gla_ept.eptp);
+			if (desc != NULL) {
+				/*
+				 * Since ACRN does not know which paging entries are changed,
+				 * Remove all the shadow EPT entries that ACRN created for L2 VM
+				 */
+				flush_vept_desc(desc);
 			}
+			spinlock_release(&table->lock);
 			nested_vmx_result(VMsucceed, 0);
 		} else if ((type == 2) && (ept_cap_vmsr & VMX_EPT_INVEPT_GLOBAL_CONTEXT) != 0UL) {
 			/* Global invalidation */
-			spinlock_obtain(&vept_desc_bucket_lock);
+			spinlock_obtain(&table->lock);
 			/*
 			 * Invalidate all shadow EPTPs of L1 VM
 			 * TODO: Invalidating all L2 vCPU associated EPTPs is enough. How?
 			 */
-			for (i = 0L; i < CONFIG_MAX_GUEST_EPT_NUM; i++) {
-				if (vept_desc_bucket[i].guest_eptp != 0UL) {
-					desc = &vept_desc_bucket[i];
-					free_sept_table((void *)(desc->shadow_eptp & PAGE_MASK));
-					invept((void *)(desc->shadow_eptp & PAGE_MASK));
+			for (i = 0U; i < VEPT_DESC_NUM; i++) {
+				if (table->desc[i].guest_eptp != 0UL) {
+					flush_vept_desc(&table->desc[i]);
 				}
 			}
-			spinlock_release(&vept_desc_bucket_lock);
+			spinlock_release(&table->lock);
 			nested_vmx_result(VMsucceed, 0);
 		} else {
 			nested_vmx_result(VMfailValid, VMXERR_INVEPT_INVVPID_INVALID_OPERAND);
@@ -545,13 +627,47 @@ int32_t invept_vmexit_handler(struct acrn_vcpu *vcpu)
 void init_vept(void)
 {
 	init_vept_pool();
-	sept_page_pool.start_page = sept_pages;
-	sept_page_pool.bitmap_size = calc_sept_page_num() / 64U;
-	sept_page_pool.bitmap = sept_page_bitmap;
-        sept_page_pool.dummy_page = NULL;
-	spinlock_init(&sept_page_pool.lock);
-	memset((void *)sept_page_pool.bitmap, 0, sept_page_pool.bitmap_size * sizeof(uint64_t));
-	sept_page_pool.last_hint_id = 0UL;
-
-	spinlock_init(&vept_desc_bucket_lock);
+	init_page_pool(&sept_page_pool, "sept", sept_pages, sept_page_bitmap, calc_sept_page_num(), NULL);
+}
+
+/*
+ * @pre vm != NULL
+ */
+void init_vept_table(struct acrn_vm *vm)
+{
+	struct vept_table *table = &vm->arch_vm.vept;
+	struct vept_desc *desc;
+	uint32_t i;
+
+	spinlock_init(&table->lock);
+	(void)memset(table->buckets, 0U, sizeof(table->buckets));
+	INIT_LIST_HEAD(&table->lru);
+	for (i = 0U; i < VEPT_DESC_NUM; i++) {
+		desc = &table->desc[i];
+		desc->guest_eptp = 0UL;
+		desc->shadow_eptp = 0UL;
+		desc->ref_count = 0U;
+		spinlock_init(&desc->lock);
+		list_add_tail(&desc->lru, &table->lru);
+	}
+}
+
+/*
+ * @brief Release all the shadow EPTs of a VM, referenced or not
+ *
+ * @pre vm != NULL
+ * @pre vm->state == VM_POWERED_OFF
+ */
+void deinit_vept_table(struct acrn_vm *vm)
+{
+	struct vept_table *table = &vm->arch_vm.vept;
+	uint32_t i;
+
+	spinlock_obtain(&table->lock);
+	for (i = 0U; i < VEPT_DESC_NUM; i++) {
+		if (table->desc[i].guest_eptp != 0UL) {
+			release_vept_desc(table, &table->desc[i]);
+		}
+	}
+	spinlock_release(&table->lock);
 }
@@ -381,6 +381,10 @@ int32_t acrn_handle_pending_request(struct acrn_vcpu *vcpu)
 				}
 			}
 
+			if (bitmap_test_and_clear_lock(ACRN_REQUEST_DIRTY_LOG, pending_req_bits)) {
+				dirty_log_update_vmcs(vcpu);
+			}
+
 			if (bitmap_test_and_clear_lock(ACRN_REQUEST_VPID_FLUSH,	pending_req_bits)) {
 				flush_vpid_single(arch->vpid);
 			}
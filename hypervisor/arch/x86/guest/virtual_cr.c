@@ -532,6 +532,8 @@ void vcpu_set_cr0(struct acrn_vcpu *vcpu, uint64_t val)
 {
 	pr_dbg("%s, value: 0x%016lx rip: %016lx", __func__, val, vcpu_get_rip(vcpu));
 	vmx_write_cr0(vcpu, val);
+	/* paging mode bits may have changed, cached decodes are keyed by linear address */
+	invalidate_instr_cache(vcpu);
 }
 
 uint64_t vcpu_get_cr2(const struct acrn_vcpu *vcpu)
@@ -560,6 +562,7 @@ void vcpu_set_cr4(struct acrn_vcpu *vcpu, uint64_t val)
 {
 	pr_dbg("%s, value: 0x%016lx rip: %016lx", __func__, val, vcpu_get_rip(vcpu));
 	vmx_write_cr4(vcpu, val);
+	invalidate_instr_cache(vcpu);
 }
 
 int32_t cr_access_vmexit_handler(struct acrn_vcpu *vcpu)
@@ -698,6 +698,7 @@ int32_t create_vm(uint16_t vm_id, uint64_t pcpu_bitmap, struct acrn_vm_config *v
 
 	init_ept_pgtable(&vm->arch_vm.ept_pgtable, vm->vm_id);
 	vm->arch_vm.nworld_eptp = pgtable_create_root(&vm->arch_vm.ept_pgtable);
+	init_dirty_log(vm);
 
 	(void)memcpy_s(&vm->name[0], MAX_VM_NAME_LEN, &vm_config->name[0], MAX_VM_NAME_LEN);
 
@@ -758,6 +759,7 @@ int32_t create_vm(uint16_t vm_id, uint64_t pcpu_bitmap, struct acrn_vm_config *v
 		vm->arch_vm.vlapic_mode = VM_VLAPIC_XAPIC;
 		vm->intr_inject_delay_delta = 0UL;
 		vm->nr_emul_mmio_regions = 0U;
+		vm->nr_emul_mmio_sorted = 0U;
 		vm->vcpuid_entry_nr = 0U;
 
 		/* Set up IO bit-mask such that VM exit occurs on
@@ -945,6 +947,10 @@ int32_t shutdown_vm(struct acrn_vm *vm)
 
 	deinit_emul_io(vm);
 
+	if (is_nvmx_configured(vm)) {
+		deinit_nested_vmx(vm);
+	}
+
 	/* Free EPT allocated resources assigned to VM */
 	destroy_ept(vm);
 
@@ -68,6 +68,8 @@ static const struct hc_dispatch hc_dispatch_table[] = {
 		.handler = hcall_set_vm_memory_regions},
 	[HC_IDX(HC_VM_WRITE_PROTECT_PAGE)] = {
 		.handler = hcall_write_protect_page},
+	[HC_IDX(HC_VM_DIRTY_LOG)] = {
+		.handler = hcall_vm_dirty_log},
 	[HC_IDX(HC_VM_GPA2HPA)] = {
 		.handler = hcall_gpa_to_hpa},
 	[HC_IDX(HC_ASSIGN_PCIDEV)] = {
@@ -98,6 +100,8 @@ static const struct hc_dispatch hc_dispatch_table[] = {
 		.handler = hcall_profiling_ops},
 	[HC_IDX(HC_GET_HW_INFO)] = {
 		.handler = hcall_get_hw_info},
+	[HC_IDX(HC_GET_VMEXIT_STATS)] = {
+		.handler = hcall_get_vmexit_stats},
 	[HC_IDX(HC_INITIALIZE_TRUSTY)] = {
 		.handler = hcall_initialize_trusty,
 		.permission_flags = GUEST_FLAG_SECURE_WORLD_ENABLED},
@@ -10,6 +10,7 @@
 #include <asm/guest/vmcs.h>
 #include <asm/guest/vcpu.h>
 #include <asm/guest/vm.h>
+#include <asm/guest/ept.h>
 #include <asm/vmx.h>
 #include <asm/gdt.h>
 #include <asm/pgtable.h>
@@ -406,10 +407,14 @@ static void init_exec_ctrl(struct acrn_vcpu *vcpu)
 	 * TODO: introduce API to make this data driven based
 	 * on VMX_EPT_VPID_CAP
 	 */
-	value64 = hva2hpa(vm->arch_vm.nworld_eptp) | (3UL << 3U) | 6UL;
+	value64 = get_nworld_eptp_value(vm);
 	exec_vmwrite64(VMX_EPT_POINTER_FULL, value64);
 	pr_dbg("VMX_EPT_POINTER: 0x%016lx ", value64);
 
+	/* PML and EPT A/D flags, if dirty logging is on for the VM */
+	vcpu->arch.pml_enabled = false;
+	dirty_log_update_vmcs(vcpu);
+
 	/* Set up guest exception mask bitmap setting a bit * causes a VM exit
 	 * on corresponding guest * exception - pg 2902 24.6.3
 	 * enable VM exit on MC always
@@ -480,9 +485,10 @@ static void init_exec_ctrl(struct acrn_vcpu *vcpu)
 	exec_vmwrite(VMX_CR3_TARGET_2, 0UL);
 	exec_vmwrite(VMX_CR3_TARGET_3, 0UL);
 
-	/* Setup PAUSE-loop exiting - 24.6.13 */
+	/* Setup PAUSE-loop exiting - 24.6.13, the window adapts in pause_vmexit_handler() */
+	vcpu->arch.ple_window = PLE_WINDOW_MIN;
 	exec_vmwrite(VMX_PLE_GAP, 128U);
-	exec_vmwrite(VMX_PLE_WINDOW, 4096U);
+	exec_vmwrite(VMX_PLE_WINDOW, vcpu->arch.ple_window);
 }
 
 static void init_entry_ctrl(const struct acrn_vcpu *vcpu)
@@ -593,6 +599,10 @@ void load_vmcs(const struct acrn_vcpu *vcpu)
 	if (vcpu->launched && (*vmcs_ptr != (void *)vcpu->arch.vmcs)) {
 		load_va_vmcs(vcpu->arch.vmcs);
 		*vmcs_ptr = (void *)vcpu->arch.vmcs;
+		if (vcpu->arch.vmcs_cleared) {
+			/* moved from another pCPU, whose TSS, GDT and GS base are in the host state */
+			init_host_state();
+		}
 	}
 }
 
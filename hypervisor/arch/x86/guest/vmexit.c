@@ -22,14 +22,9 @@
 #include <asm/guest/vcpuid.h>
 #include <trace.h>
 #include <asm/rtcm.h>
+#include <asm/tsc.h>
 #include <debug/console.h>
 
-/*
- * According to "SDM APPENDIX C VMX BASIC EXIT REASONS",
- * there are 65 Basic Exit Reasons.
- */
-#define NR_VMX_EXIT_REASONS	70U
-
 static int32_t triple_fault_vmexit_handler(struct acrn_vcpu *vcpu);
 static int32_t unhandled_vmexit_handler(struct acrn_vcpu *vcpu);
 static int32_t xsetbv_vmexit_handler(struct acrn_vcpu *vcpu);
@@ -41,6 +36,7 @@ static int32_t mtf_vmexit_handler(struct acrn_vcpu *vcpu);
 static int32_t loadiwkey_vmexit_handler(struct acrn_vcpu *vcpu);
 static int32_t init_signal_vmexit_handler(__unused struct acrn_vcpu *vcpu);
 static int32_t mwait_monitor_vmexit_handler (struct acrn_vcpu *vcpu);
+static int32_t pml_full_vmexit_handler(struct acrn_vcpu *vcpu);
 
 /* VM Dispatch table for Exit condition handling */
 static const struct vm_exit_dispatch dispatch_table[NR_VMX_EXIT_REASONS] = {
@@ -201,7 +197,7 @@ static const struct vm_exit_dispatch dispatch_table[NR_VMX_EXIT_REASONS] = {
 	[VMX_EXIT_REASON_RDSEED] = {
 		.handler = unhandled_vmexit_handler},
 	[VMX_EXIT_REASON_PAGE_MODIFICATION_LOG_FULL] = {
-		.handler = unhandled_vmexit_handler},
+		.handler = pml_full_vmexit_handler},
 	[VMX_EXIT_REASON_XSAVES] = {
 		.handler = unhandled_vmexit_handler},
 	[VMX_EXIT_REASON_XRSTORS] = {
@@ -210,10 +206,88 @@ static const struct vm_exit_dispatch dispatch_table[NR_VMX_EXIT_REASONS] = {
 		.handler = loadiwkey_vmexit_handler}
 };
 
+/*
+ * Exit reasons that get a latency histogram, as row index + 1 in
+ * vmexit_stats.hist. 0 means the reason is only counted.
+ */
+static const uint8_t vmexit_hist_slot[NR_VMX_EXIT_REASONS] = {
+	[VMX_EXIT_REASON_EXCEPTION_OR_NMI] = 1U,
+	[VMX_EXIT_REASON_EXTERNAL_INTERRUPT] = 2U,
+	[VMX_EXIT_REASON_INTERRUPT_WINDOW] = 3U,
+	[VMX_EXIT_REASON_CPUID] = 4U,
+	[VMX_EXIT_REASON_HLT] = 5U,
+	[VMX_EXIT_REASON_VMCALL] = 6U,
+	[VMX_EXIT_REASON_CR_ACCESS] = 7U,
+	[VMX_EXIT_REASON_IO_INSTRUCTION] = 8U,
+	[VMX_EXIT_REASON_RDMSR] = 9U,
+	[VMX_EXIT_REASON_WRMSR] = 10U,
+	[VMX_EXIT_REASON_PAUSE] = 11U,
+	[VMX_EXIT_REASON_APIC_ACCESS] = 12U,
+	[VMX_EXIT_REASON_VIRTUALIZED_EOI] = 13U,
+	[VMX_EXIT_REASON_EPT_VIOLATION] = 14U,
+	[VMX_EXIT_REASON_EPT_MISCONFIGURATION] = 15U,
+	[VMX_EXIT_REASON_APIC_WRITE] = 16U,
+};
+
+static void record_vmexit(struct acrn_vcpu *vcpu, uint16_t basic_exit_reason, uint64_t cycles)
+{
+	struct vmexit_stats *stats = &vcpu->arch.exit_stats;
+	uint8_t slot = vmexit_hist_slot[basic_exit_reason];
+	uint16_t bucket = 0U;
+
+	stats->count[basic_exit_reason]++;
+	stats->cycles[basic_exit_reason] += cycles;
+
+	if (slot != 0U) {
+		if ((cycles >> ACRN_VMEXIT_HIST_SHIFT) != 0UL) {
+			bucket = fls64(cycles) + 1U - ACRN_VMEXIT_HIST_SHIFT;
+			if (bucket >= ACRN_VMEXIT_HIST_BUCKETS) {
+				bucket = ACRN_VMEXIT_HIST_BUCKETS - 1U;
+			}
+		}
+		stats->hist[slot - 1U][bucket]++;
+	}
+}
+
+/**
+ * @brief Add the VM exit statistics of a vCPU to stats
+ *
+ * The caller clears stats first and may call this for several vCPUs to get
+ * the statistics of a whole VM.
+ */
+void get_vmexit_stats(const struct acrn_vcpu *vcpu, struct acrn_vmexit_stats *stats)
+{
+	const struct vmexit_stats *vstats = &vcpu->arch.exit_stats;
+	uint16_t reason, slot, bucket;
+
+	stats->nr_reasons = (uint16_t)NR_VMX_EXIT_REASONS;
+	stats->nr_hist = (uint16_t)ACRN_VMEXIT_HIST_SLOTS;
+	stats->tsc_khz = get_tsc_khz();
+
+	for (reason = 0U; reason < NR_VMX_EXIT_REASONS; reason++) {
+		stats->count[reason] += vstats->count[reason];
+		stats->cycles[reason] += vstats->cycles[reason];
+
+		slot = vmexit_hist_slot[reason];
+		if (slot != 0U) {
+			stats->hist_reason[slot - 1U] = reason;
+			for (bucket = 0U; bucket < ACRN_VMEXIT_HIST_BUCKETS; bucket++) {
+				stats->hist[slot - 1U][bucket] += vstats->hist[slot - 1U][bucket];
+			}
+		}
+	}
+}
+
+void clear_vmexit_stats(struct acrn_vcpu *vcpu)
+{
+	(void)memset((void *)&vcpu->arch.exit_stats, 0U, sizeof(vcpu->arch.exit_stats));
+}
+
 int32_t vmexit_handler(struct acrn_vcpu *vcpu)
 {
 	struct vm_exit_dispatch *dispatch = NULL;
 	uint16_t basic_exit_reason;
+	uint64_t start;
 	int32_t ret;
 
 	if (get_pcpu_id() != pcpuid_from_vcpu(vcpu)) {
@@ -222,6 +296,10 @@ int32_t vmexit_handler(struct acrn_vcpu *vcpu)
 	} else if (is_vcpu_in_l2_guest(vcpu)) {
 		ret = nested_vmexit_handler(vcpu);
 	} else {
+		if (vcpu->arch.pml_enabled) {
+			dirty_log_drain_pml(vcpu);
+		}
+
 		/* Obtain interrupt info */
 		vcpu->arch.idt_vectoring_info = exec_vmread32(VMX_IDT_VEC_INFO_FIELD);
 		/* Filter out HW exception & NMI */
@@ -266,6 +344,7 @@ int32_t vmexit_handler(struct acrn_vcpu *vcpu)
 			}
 
 			/* exit dispatch handling */
+			start = rdtsc();
 			if (basic_exit_reason == VMX_EXIT_REASON_EXTERNAL_INTERRUPT) {
 				/* Handling external_interrupt should disable intr */
 				if (!is_lapic_pt_enabled(vcpu)) {
@@ -280,6 +359,7 @@ int32_t vmexit_handler(struct acrn_vcpu *vcpu)
 			} else {
 				ret = dispatch->handler(vcpu);
 			}
+			record_vmexit(vcpu, basic_exit_reason, rdtsc() - start);
 		}
 	}
 
@@ -338,8 +418,57 @@ static int32_t triple_fault_vmexit_handler(struct acrn_vcpu *vcpu)
 	return 0;
 }
 
-static int32_t pause_vmexit_handler(__unused struct acrn_vcpu *vcpu)
+/*
+ * Directed yield: a vCPU spinning on a lock whose holder was preempted
+ * can't make progress before the holder runs again. Put a vCPU of the
+ * same VM that waits in a runqueue ahead on its pCPU, starting after
+ * the spinning vCPU so that every sibling gets its turn.
+ */
+static bool yield_to_sibling(const struct acrn_vcpu *vcpu)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vcpu *target;
+	uint16_t i, vcpu_id;
+	bool boosted = false;
+
+	for (i = 1U; (i < vm->hw.created_vcpus) && !boosted; i++) {
+		vcpu_id = (vcpu->vcpu_id + i) % vm->hw.created_vcpus;
+		target = &vm->hw.vcpu_array[vcpu_id];
+		/* racy read, yield_to() checks again under the scheduler lock */
+		if ((target->state == VCPU_RUNNING) && (target->thread_obj.status == THREAD_STS_RUNNABLE)) {
+			boosted = yield_to(&target->thread_obj);
+		}
+	}
+
+	return boosted;
+}
+
+static int32_t pause_vmexit_handler(struct acrn_vcpu *vcpu)
 {
+	struct ple_stats *stats = &vcpu->arch.ple_stats;
+	uint32_t window = vcpu->arch.ple_window;
+
+	stats->exits++;
+	if (yield_to_sibling(vcpu)) {
+		/* lock holder preemption, give up the pCPU sooner next time */
+		stats->directed_yields++;
+		window = max(window >> 1U, PLE_WINDOW_MIN);
+		if (window != vcpu->arch.ple_window) {
+			stats->window_shrinks++;
+		}
+	} else {
+		/* nobody to yield to, the lock holder runs: keep spinning longer */
+		window = min(window << 1U, PLE_WINDOW_MAX);
+		if (window != vcpu->arch.ple_window) {
+			stats->window_grows++;
+		}
+	}
+
+	if (window != vcpu->arch.ple_window) {
+		vcpu->arch.ple_window = window;
+		exec_vmwrite32(VMX_PLE_WINDOW, window);
+	}
+
 	yield_current();
 	return 0;
 }
@@ -471,6 +600,12 @@ static int32_t wbinvd_vmexit_handler(struct acrn_vcpu *vcpu)
 	return 0;
 }
 
+/* The PML log was drained by vmexit_handler() already. */
+static int32_t pml_full_vmexit_handler(__unused struct acrn_vcpu *vcpu)
+{
+	return 0;
+}
+
 static int32_t loadiwkey_vmexit_handler(struct acrn_vcpu *vcpu)
 {
 	uint64_t xmm[6] = {0};
@@ -123,6 +123,10 @@ int32_t ept_violation_vmexit_handler(struct acrn_vcpu *vcpu)
 		}
 		vcpu_retain_rip(vcpu);
 		status = 0;
+	} else if (((exit_qual & 0x2UL) != 0UL) && dirty_log_handle_wp_fault(vcpu, gpa)) {
+		/* RAM write protected for dirty logging, write access is back, retry */
+		vcpu_retain_rip(vcpu);
+		status = 0;
 	} else {
 
 		io_req->io_type = ACRN_IOREQ_TYPE_MMIO;
@@ -6,29 +6,200 @@
 #include <types.h>
 #include <asm/lib/bits.h>
 #include <asm/page.h>
+#include <asm/cpu.h>
 #include <logmsg.h>
 
+static struct page_pool *page_pools[MAX_PAGE_POOL_NUM];
+static uint16_t page_pool_num;
+static spinlock_t page_pools_lock = { .head = 0U, .tail = 0U, };
 
-struct page *alloc_page(struct page_pool *pool)
+/*
+ * Take up to nr free pages from the pool bitmap, scanning from the word the
+ * last allocation was satisfied from.
+ *
+ * @pre pool->lock is held
+ */
+static uint16_t take_pages_nolock(struct page_pool *pool, struct page **pages, uint16_t nr)
 {
-	struct page *page = NULL;
 	uint64_t loop_idx, idx, bit;
+	uint16_t got = 0U;
 
-	spinlock_obtain(&pool->lock);
-	for (loop_idx = pool->last_hint_id;
-		loop_idx < (pool->last_hint_id + pool->bitmap_size); loop_idx++) {
-		idx = loop_idx % pool->bitmap_size;
-		if (*(pool->bitmap + idx) != ~0UL) {
-			bit = ffz64(*(pool->bitmap + idx));
-			bitmap_set_nolock(bit, pool->bitmap + idx);
-			page = pool->start_page + ((idx << 6U) + bit);
+	for (loop_idx = 0UL; (loop_idx < pool->bitmap_size) && (got < nr); loop_idx++) {
+		idx = pool->last_hint_id + loop_idx;
+		if (idx >= pool->bitmap_size) {
+			idx -= pool->bitmap_size;
+		}
 
+		while ((*(pool->bitmap + idx) != ~0UL) && (got < nr)) {
+			bit = ffz64(*(pool->bitmap + idx));
+			bitmap_set_nolock((uint16_t)bit, pool->bitmap + idx);
+			pages[got] = pool->start_page + ((idx << 6U) + bit);
+			got++;
 			pool->last_hint_id = idx;
+		}
+	}
+
+	return got;
+}
+
+/*
+ * @pre pool->lock is held
+ * @pre ((page - pool->start_page) >> 6U) < pool->bitmap_size
+ */
+static void put_page_nolock(struct page_pool *pool, const struct page *page)
+{
+	uint64_t idx, bit;
+
+	idx = (uint64_t)(page - pool->start_page) >> 6U;
+	bit = (uint64_t)(page - pool->start_page) & 0x3fUL;
+	bitmap_clear_nolock((uint16_t)bit, pool->bitmap + idx);
+}
+
+/*
+ * Give the nr most recently freed pages of a magazine back to the bitmap.
+ * Dirty pages sit on top, so the zero filled ones are the last to go.
+ *
+ * @pre mag->lock is held
+ */
+static void drain_magazine(struct page_pool *pool, struct page_magazine *mag, uint16_t nr)
+{
+	uint16_t i;
+
+	spinlock_obtain(&pool->lock);
+	for (i = 0U; (i < nr) && (mag->count > 0U); i++) {
+		mag->count--;
+		put_page_nolock(pool, mag->pages[mag->count]);
+	}
+	spinlock_release(&pool->lock);
+
+	mag->nr_zeroed = min(mag->nr_zeroed, mag->count);
+}
+
+/*
+ * @pre mag->lock is held
+ */
+static void refill_magazine(struct page_pool *pool, struct page_magazine *mag, uint16_t nr)
+{
+	spinlock_obtain(&pool->lock);
+	mag->count += take_pages_nolock(pool, &mag->pages[mag->count], nr);
+	spinlock_release(&pool->lock);
+}
+
+/* Pull the pages cached by every pCPU back into the bitmap. */
+static void reclaim_magazines(struct page_pool *pool)
+{
+	struct page_magazine *mag;
+	uint16_t i;
+
+	for (i = 0U; i < MAX_PCPU_NUM; i++) {
+		mag = &pool->mag[i];
+		spinlock_obtain(&mag->lock);
+		drain_magazine(pool, mag, mag->count);
+		spinlock_release(&mag->lock);
+	}
+}
+
+static struct page *magazine_alloc(struct page_pool *pool, bool *zeroed)
+{
+	struct page_magazine *mag = &pool->mag[get_pcpu_id()];
+	struct page *page = NULL;
+
+	spinlock_obtain(&mag->lock);
+	mag->active = true;
+	if (mag->count == 0U) {
+		refill_magazine(pool, mag, PAGE_MAGAZINE_BATCH);
+	}
+
+	if (mag->nr_zeroed > 0U) {
+		page = mag->pages[mag->nr_zeroed - 1U];
+		mag->pages[mag->nr_zeroed - 1U] = mag->pages[mag->count - 1U];
+		mag->nr_zeroed--;
+		mag->count--;
+		*zeroed = true;
+	} else if (mag->count > 0U) {
+		mag->count--;
+		page = mag->pages[mag->count];
+	} else {
+		/* the bitmap is empty */
+	}
+	spinlock_release(&mag->lock);
+
+	return page;
+}
+
+static void register_page_pool(struct page_pool *pool)
+{
+	uint16_t i;
+
+	spinlock_obtain(&page_pools_lock);
+	for (i = 0U; i < page_pool_num; i++) {
+		if (page_pools[i] == pool) {
 			break;
 		}
 	}
+	if ((i == page_pool_num) && (page_pool_num < MAX_PAGE_POOL_NUM)) {
+		page_pools[page_pool_num] = pool;
+		page_pool_num++;
+	}
+	spinlock_release(&page_pools_lock);
+}
+
+/*
+ * Set up or reset a pool whose allocations go through per-pCPU magazines.
+ * The pool may be reset while other pCPUs prezero pages for it, so the
+ * locks are never reinitialized: a zero filled spinlock is a free one.
+ *
+ * @pre pool is a static object, or zero filled before the first call
+ * @pre page_num is a multiple of 64
+ */
+void init_page_pool(struct page_pool *pool, const char *name, struct page *start_page,
+		uint64_t *bitmap, uint64_t page_num, struct page *dummy_page)
+{
+	struct page_magazine *mag;
+	uint16_t i;
+
+	/* magazines first, so that an idle pCPU stops refilling from the old bitmap */
+	for (i = 0U; i < MAX_PCPU_NUM; i++) {
+		mag = &pool->mag[i];
+		spinlock_obtain(&mag->lock);
+		mag->count = 0U;
+		mag->nr_zeroed = 0U;
+		mag->active = false;
+		spinlock_release(&mag->lock);
+	}
+
+	spinlock_obtain(&pool->lock);
+	pool->start_page = start_page;
+	pool->bitmap_size = page_num / 64UL;
+	pool->bitmap = bitmap;
+	pool->dummy_page = dummy_page;
+	(void)memset((void *)pool->bitmap, 0U, pool->bitmap_size * sizeof(uint64_t));
+	pool->last_hint_id = 0UL;
+	(void)strncpy_s(pool->name, sizeof(pool->name), name, sizeof(pool->name) - 1U);
+	pool->cached = true;
 	spinlock_release(&pool->lock);
 
+	register_page_pool(pool);
+}
+
+struct page *alloc_page(struct page_pool *pool)
+{
+	struct page *page = NULL;
+	bool zeroed = false;
+
+	if (pool->cached) {
+		page = magazine_alloc(pool, &zeroed);
+		if (page == NULL) {
+			reclaim_magazines(pool);
+		}
+	}
+
+	if (page == NULL) {
+		spinlock_obtain(&pool->lock);
+		(void)take_pages_nolock(pool, &page, 1U);
+		spinlock_release(&pool->lock);
+	}
+
 	ASSERT(page != NULL, "no page aviable!");
 	page = (page != NULL) ? page : pool->dummy_page;
 	if (page == NULL) {
@@ -40,7 +211,9 @@ struct page *alloc_page(struct page_pool *pool)
 		 */
 		panic("no dummy aviable!");
 	}
-	(void)memset(page, 0U, PAGE_SIZE);
+	if (!zeroed) {
+		(void)memset(page, 0U, PAGE_SIZE);
+	}
 	return page;
 }
 
@@ -49,11 +222,108 @@ struct page *alloc_page(struct page_pool *pool)
  */
 void free_page(struct page_pool *pool, struct page *page)
 {
-	uint64_t idx, bit;
+	struct page_magazine *mag;
 
-	spinlock_obtain(&pool->lock);
-	idx = (page - pool->start_page) >> 6U;
-	bit = (page - pool->start_page) & 0x3fUL;
-	bitmap_clear_nolock(bit, pool->bitmap + idx);
-	spinlock_release(&pool->lock);
+	if (page == pool->dummy_page) {
+		/* handed out when the pool ran dry, it's not in the bitmap */
+	} else if (pool->cached) {
+		mag = &pool->mag[get_pcpu_id()];
+		spinlock_obtain(&mag->lock);
+		if (mag->count == PAGE_MAGAZINE_SIZE) {
+			drain_magazine(pool, mag, PAGE_MAGAZINE_BATCH);
+		}
+		mag->pages[mag->count] = page;
+		mag->count++;
+		spinlock_release(&mag->lock);
+	} else {
+		spinlock_obtain(&pool->lock);
+		put_page_nolock(pool, page);
+		spinlock_release(&pool->lock);
+	}
+}
+
+/*
+ * Idle time work: keep PAGE_MAGAZINE_BATCH pages in each magazine this pCPU
+ * has allocated from, and zero fill one of them, so that building EPTs does
+ * not have to wait for memset().
+ *
+ * @return true if a page was zeroed, false if there is nothing left to do
+ */
+bool prezero_pool_pages(uint16_t pcpu_id)
+{
+	struct page_pool *pool;
+	struct page_magazine *mag;
+	bool done = false;
+	uint16_t i;
+
+	for (i = 0U; (i < page_pool_num) && !done; i++) {
+		pool = page_pools[i];
+		mag = &pool->mag[pcpu_id];
+
+		spinlock_obtain(&mag->lock);
+		if (mag->active) {
+			if (mag->count < PAGE_MAGAZINE_BATCH) {
+				refill_magazine(pool, mag, PAGE_MAGAZINE_BATCH - mag->count);
+			}
+			if (mag->nr_zeroed < mag->count) {
+				(void)memset(mag->pages[mag->nr_zeroed], 0U, PAGE_SIZE);
+				mag->nr_zeroed++;
+				done = true;
+			}
+		}
+		spinlock_release(&mag->lock);
+	}
+
+	return done;
+}
+
+uint16_t get_page_pool_num(void)
+{
+	return page_pool_num;
+}
+
+/*
+ * Occupancy and fragmentation of a pool, read without stopping allocations,
+ * so the numbers may be slightly off while the pool is in use.
+ *
+ * @return name of the pool, NULL if pool_id is out of range
+ */
+const char *get_page_pool_stats(uint16_t pool_id, struct page_pool_stats *stats)
+{
+	const struct page_pool *pool;
+	const char *name = NULL;
+	uint64_t idx, bits, run = 0UL;
+	uint16_t i, bit;
+
+	(void)memset(stats, 0U, sizeof(*stats));
+	if (pool_id < page_pool_num) {
+		pool = page_pools[pool_id];
+		name = pool->name;
+		stats->total = pool->bitmap_size << 6U;
+
+		for (idx = 0UL; idx < pool->bitmap_size; idx++) {
+			bits = *(pool->bitmap + idx);
+			stats->used += bitmap_weight(bits);
+			for (bit = 0U; bit < 64U; bit++) {
+				if ((bits & (1UL << bit)) == 0UL) {
+					if (run == 0UL) {
+						stats->free_extents++;
+					}
+					run++;
+					stats->largest_extent = max(stats->largest_extent, run);
+				} else {
+					run = 0UL;
+				}
+			}
+		}
+
+		for (i = 0U; i < MAX_PCPU_NUM; i++) {
+			stats->cached += pool->mag[i].count;
+			stats->zeroed += pool->mag[i].nr_zeroed;
+		}
+		/* cached pages are marked in the bitmap but not handed out */
+		stats->used -= min(stats->used, stats->cached);
+	}
+
+	return name;
 }
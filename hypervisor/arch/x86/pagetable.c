@@ -65,7 +65,7 @@ static void try_to_free_pgtable_page(const struct pgtable *table,
  * @pre: level could only IA32E_PDPT or IA32E_PD
  */
 static void split_large_page(uint64_t *pte, enum _page_table_level level,
-		__unused uint64_t vaddr, const struct pgtable *table)
+		uint64_t vaddr, const struct pgtable *table)
 {
 	uint64_t *pbase;
 	uint64_t ref_paddr, paddr, paddrinc;
@@ -86,9 +86,21 @@ static void split_large_page(uint64_t *pte, enum _page_table_level level,
 		break;
 	}
 
+	if (table->prepare_split != NULL) {
+		table->prepare_split(table, vaddr & ~((paddrinc << 9U) - 1UL), paddrinc << 9U, &ref_prot);
+	}
+
 	pbase = (uint64_t *)alloc_page(table->pool);
 	dev_dbg(DBG_LEVEL_MMU, "%s, paddr: 0x%lx, pbase: 0x%lx\n", __func__, ref_paddr, pbase);
 
+	if (table->stats != NULL) {
+		if (level == IA32E_PDPT) {
+			table->stats->split_1g++;
+		} else {
+			table->stats->split_2m++;
+		}
+	}
+
 	paddr = ref_paddr;
 	for (i = 0UL; i < PTRS_PER_PTE; i++) {
 		set_pgentry(pbase + i, paddr | ref_prot, table);
@@ -292,6 +304,135 @@ void pgtable_modify_or_del_map(uint64_t *pml4_page, uint64_t vaddr_base, uint64_
 	}
 }
 
+/*
+ * Check whether the entries of a PT page (level IA32E_PD) or of a PD page
+ * made of 2M pages (level IA32E_PDPT) map one naturally aligned, contiguous
+ * region with the same attributes, so that one large page entry of the
+ * given level can replace them.
+ *
+ * @return the large page entry, 0 if the page can't be collapsed
+ */
+static uint64_t collapse_pgtable_page(const uint64_t *page, enum _page_table_level level,
+		const struct pgtable *table)
+{
+	uint64_t paddr, prot, tweaked_prot, paddrinc, large_entry = 0UL;
+	uint64_t i;
+
+	paddr = (*page) & PDE_PFN_MASK;
+	prot = (*page) & ~PDE_PFN_MASK;
+	paddrinc = (level == IA32E_PDPT) ? PDE_SIZE : PTE_SIZE;
+
+	if (pgentry_present(table, (*page)) && mem_aligned_check(paddr, paddrinc * PTRS_PER_PTE) &&
+			(((prot & PAGE_PSE) != 0UL) == (level == IA32E_PDPT))) {
+		prot &= ~PAGE_PSE;
+		tweaked_prot = prot;
+		table->tweak_exe_right(&tweaked_prot);
+		/*
+		 * A large page would lose the execute right the entries have, the
+		 * next instruction fetch would split it again.
+		 */
+		if (table->large_page_support(level, prot) && (tweaked_prot == prot)) {
+			for (i = 1UL; i < PTRS_PER_PTE; i++) {
+				if (*(page + i) != (*page + (i * paddrinc))) {
+					break;
+				}
+			}
+			if (i == PTRS_PER_PTE) {
+				large_entry = paddr | prot | PAGE_PSE;
+			}
+		}
+	}
+
+	return large_entry;
+}
+
+/*
+ * Replace the PT page of a PD entry, or the PD page of a PDPT entry, by a
+ * large page if possible. The unlinked page is added to freed, nothing is
+ * promoted once freed is full.
+ *
+ * @return true if the entry now maps a large page
+ */
+static bool try_to_promote_pgentry(uint64_t *pgentry, enum _page_table_level level, const struct pgtable *table,
+		struct pgtable_free_list *freed)
+{
+	uint64_t *page = (level == IA32E_PDPT) ? pdpte_page_vaddr(*pgentry) : pde_page_vaddr(*pgentry);
+	uint64_t large_entry = 0UL;
+
+	if (freed->count < PGTABLE_FREE_LIST_SIZE) {
+		large_entry = collapse_pgtable_page(page, level, table);
+	}
+
+	if (large_entry != 0UL) {
+		set_pgentry(pgentry, large_entry, table);
+		freed->pages[freed->count] = page;
+		freed->count++;
+		if (table->stats != NULL) {
+			if (level == IA32E_PDPT) {
+				table->stats->promoted_1g++;
+			} else {
+				table->stats->promoted_2m++;
+			}
+		}
+	}
+
+	return (large_entry != 0UL);
+}
+
+/*
+ * Collapse the 4K and 2M mappings of [vaddr_base, vaddr_base + size) back
+ * into large pages where the large_page_support policy of the table allows
+ * it. Large pages are only ever split by pgtable_modify_or_del_map, so this
+ * undoes splits whose reason, a write protected page for example, is gone.
+ * 1G pages are only formed if promote_1g is set.
+ *
+ * The translations do not change, but the unlinked paging-structure pages
+ * are only added to freed: the caller has to flush the TLBs before it
+ * returns them to table->pool. Whatever does not fit into freed stays split.
+ *
+ * @return the number of paging-structure pages unlinked
+ */
+uint64_t pgtable_promote_map(uint64_t *pml4_page, uint64_t vaddr_base, uint64_t size,
+		const struct pgtable *table, bool promote_1g, struct pgtable_free_list *freed)
+{
+	uint64_t vaddr = vaddr_base & PDE_MASK;
+	uint64_t vaddr_end = vaddr_base + size;
+	uint64_t vaddr_next, pde_vaddr, index, promoted = 0UL;
+	uint64_t *pml4e, *pdpte, *pde, *pd_page;
+
+	dev_dbg(DBG_LEVEL_MMU, "%s, vaddr: 0x%lx, size: 0x%lx\n", __func__, vaddr_base, size);
+
+	while (vaddr < vaddr_end) {
+		vaddr_next = (vaddr & PDPTE_MASK) + PDPTE_SIZE;
+		pml4e = pml4e_offset(pml4_page, vaddr);
+		if (pgentry_present(table, (*pml4e))) {
+			pdpte = pdpte_offset(pml4e, vaddr);
+			if (pgentry_present(table, (*pdpte)) && (pdpte_large(*pdpte) == 0UL)) {
+				pd_page = pdpte_page_vaddr(*pdpte);
+				pde_vaddr = vaddr;
+				for (index = pde_index(vaddr); index < PTRS_PER_PDE; index++) {
+					pde = pd_page + index;
+					if (pgentry_present(table, (*pde)) && (pde_large(*pde) == 0UL) &&
+							try_to_promote_pgentry(pde, IA32E_PD, table, freed)) {
+						promoted++;
+					}
+					pde_vaddr = (pde_vaddr & PDE_MASK) + PDE_SIZE;
+					if (pde_vaddr >= vaddr_end) {
+						break;
+					}
+				}
+
+				if (promote_1g && try_to_promote_pgentry(pdpte, IA32E_PDPT, table, freed)) {
+					promoted++;
+				}
+			}
+		}
+		vaddr = vaddr_next;
+	}
+
+	return promoted;
+}
+
 /*
  * In PT level,
  * add [vaddr_start, vaddr_end) to [paddr_base, ...) MT PT mapping
@@ -548,3 +689,62 @@ const uint64_t *pgtable_lookup_entry(uint64_t *pml4_page, uint64_t addr, uint64_
 
 	return pret;
 }
+
+/**
+ * Same as pgtable_lookup_entry, but starts from the PD or PT page of the
+ * previous walk when addr falls into it.
+ *
+ * @pre (pml4_page != NULL) && (pg_size != NULL) && (cache != NULL)
+ */
+const uint64_t *pgtable_lookup_entry_cached(uint64_t *pml4_page, uint64_t addr, uint64_t *pg_size,
+		const struct pgtable *table, struct pgtable_walk_cache *cache)
+{
+	const uint64_t *pret = NULL;
+	uint64_t *pml4e, *pdpte, *pde, *pte;
+	uint64_t *pd_page = NULL, *pt_page = NULL;
+
+	if ((cache->pt_page != NULL) && ((addr & PDE_MASK) == cache->pt_tag)) {
+		pt_page = cache->pt_page;
+	} else if ((cache->pd_page != NULL) && ((addr & PDPTE_MASK) == cache->pd_tag)) {
+		pd_page = cache->pd_page;
+	} else {
+		pml4e = pml4e_offset(pml4_page, addr);
+		if (pgentry_present(table, (*pml4e))) {
+			pdpte = pdpte_offset(pml4e, addr);
+			if (pgentry_present(table, (*pdpte))) {
+				if (pdpte_large(*pdpte) != 0UL) {
+					*pg_size = PDPTE_SIZE;
+					pret = pdpte;
+				} else {
+					pd_page = pdpte_page_vaddr(*pdpte);
+					cache->pd_tag = addr & PDPTE_MASK;
+					cache->pd_page = pd_page;
+				}
+			}
+		}
+	}
+
+	if (pd_page != NULL) {
+		pde = pd_page + pde_index(addr);
+		if (pgentry_present(table, (*pde))) {
+			if (pde_large(*pde) != 0UL) {
+				*pg_size = PDE_SIZE;
+				pret = pde;
+			} else {
+				pt_page = pde_page_vaddr(*pde);
+				cache->pt_tag = addr & PDE_MASK;
+				cache->pt_page = pt_page;
+			}
+		}
+	}
+
+	if (pt_page != NULL) {
+		pte = pt_page + pte_index(addr);
+		if (pgentry_present(table, (*pte))) {
+			*pg_size = PTE_SIZE;
+			pret = pte;
+		}
+	}
+
+	return pret;
+}
@@ -9,6 +9,7 @@
 #include <types.h>
 #include <errno.h>
 #include <asm/lib/bits.h>
+#include <asm/lib/atomic.h>
 #include <asm/lib/spinlock.h>
 #include <asm/cpu_caps.h>
 #include <irq.h>
@@ -89,6 +90,8 @@ static inline uint64_t dmar_set_bitslice(uint64_t var, uint64_t mask, uint32_t p
 #define DMAR_INVALIDATION_QUEUE_SIZE	4096U
 #define DMAR_QI_INV_ENTRY_SIZE		16U
 #define DMAR_NUM_IR_ENTRIES_PER_PAGE	256U
+/* beyond this many page-selective requests a domain-selective one is cheaper */
+#define DMAR_IOTLB_PSI_MAX_REQS		8U
 
 #define DMAR_INV_STATUS_WRITE_SHIFT	5U
 #define DMAR_INV_CONTEXT_CACHE_DESC	0x01UL
@@ -541,39 +544,244 @@ static struct dmar_drhd_rt *device_to_dmaru(uint8_t bus, uint8_t devfun)
 	return dmaru;
 }
 
-static void dmar_issue_qi_request(struct dmar_drhd_rt *dmar_unit, struct dmar_entry invalidate_desc)
+static inline uint64_t dmar_qi_desc_type(const struct dmar_entry *desc)
 {
+	return (desc->lo_64 & 0xFUL);
+}
+
+/* Granularity field of context-cache and IOTLB descriptors */
+static inline uint64_t dmar_qi_desc_gran(const struct dmar_entry *desc)
+{
+	return (desc->lo_64 & (3UL << 4U));
+}
+
+static inline uint16_t dmar_qi_desc_did(const struct dmar_entry *desc)
+{
+	return (uint16_t)(desc->lo_64 >> 16U);
+}
+
+static inline uint64_t dmar_iotlb_desc_start(const struct dmar_entry *desc)
+{
+	return (desc->hi_64 & PAGE_MASK);
+}
+
+static inline uint64_t dmar_iotlb_desc_end(const struct dmar_entry *desc)
+{
+	return dmar_iotlb_desc_start(desc) + (PAGE_SIZE << dma_iotlb_invl_addr_am((uint8_t)desc->hi_64));
+}
+
+static inline uint8_t dmar_iec_desc_im(const struct dmar_entry *desc)
+{
+	return (uint8_t)((desc->lo_64 >> 27U) & 0x1FUL);
+}
+
+static inline uint32_t dmar_iec_desc_start(const struct dmar_entry *desc)
+{
+	return (uint32_t)((desc->lo_64 >> 32U) & 0xFFFFUL);
+}
+
+static inline uint32_t dmar_iec_desc_end(const struct dmar_entry *desc)
+{
+	return dmar_iec_desc_start(desc) + (1U << dmar_iec_desc_im(desc));
+}
+
+/*
+ * Whether the invalidation described by a already does everything b would.
+ * Global requests cover everything of their type, domain-selective requests
+ * cover the device and page-selective requests of the same domain, and
+ * ranged requests cover the ranges they contain.
+ */
+static bool dmar_qi_desc_covers(const struct dmar_entry *a, const struct dmar_entry *b)
+{
+	bool covers = false;
+
+	if (dmar_qi_desc_type(a) == dmar_qi_desc_type(b)) {
+		switch (dmar_qi_desc_type(a)) {
+		case DMAR_INV_CONTEXT_CACHE_DESC:
+			if (dmar_qi_desc_gran(a) == DMA_CONTEXT_GLOBAL_INVL) {
+				covers = true;
+			} else if (dmar_qi_desc_gran(a) == DMA_CONTEXT_DOMAIN_INVL) {
+				covers = (dmar_qi_desc_gran(b) != DMA_CONTEXT_GLOBAL_INVL) &&
+						(dmar_qi_desc_did(a) == dmar_qi_desc_did(b));
+			} else {
+				covers = (a->lo_64 == b->lo_64);
+			}
+			break;
+		case DMAR_INV_IOTLB_DESC:
+			if (dmar_qi_desc_gran(a) == DMA_IOTLB_GLOBAL_INVL) {
+				covers = true;
+			} else if (dmar_qi_desc_gran(a) == DMA_IOTLB_DOMAIN_INVL) {
+				covers = (dmar_qi_desc_gran(b) != DMA_IOTLB_GLOBAL_INVL) &&
+						(dmar_qi_desc_did(a) == dmar_qi_desc_did(b));
+			} else if (dmar_qi_desc_gran(b) == DMA_IOTLB_PAGE_INVL) {
+				/* an invalidation hinting that only leaves changed can't stand in for a full one */
+				covers = (dmar_qi_desc_did(a) == dmar_qi_desc_did(b)) &&
+					(((a->hi_64 & DMA_IOTLB_INVL_ADDR_IH_UNMODIFIED) == 0UL) ||
+						((b->hi_64 & DMA_IOTLB_INVL_ADDR_IH_UNMODIFIED) != 0UL)) &&
+					(dmar_iotlb_desc_start(a) <= dmar_iotlb_desc_start(b)) &&
+					(dmar_iotlb_desc_end(a) >= dmar_iotlb_desc_end(b));
+			} else {
+				/* a page-selective request never covers a wider one */
+			}
+			break;
+		case DMAR_INV_IEC_DESC:
+			if ((a->lo_64 & DMAR_IECI_INDEXED) == 0UL) {
+				covers = true;
+			} else if ((b->lo_64 & DMAR_IECI_INDEXED) != 0UL) {
+				covers = (dmar_iec_desc_start(a) <= dmar_iec_desc_start(b)) &&
+						(dmar_iec_desc_end(a) >= dmar_iec_desc_end(b));
+			} else {
+				/* an indexed request never covers a global one */
+			}
+			break;
+		default:
+			covers = (a->lo_64 == b->lo_64) && (a->hi_64 == b->hi_64);
+			break;
+		}
+	}
+
+	return covers;
+}
+
+void dmar_qi_batch_init(struct dmar_qi_batch *batch)
+{
+	batch->dmar_unit = NULL;
+	batch->num = 0U;
+}
+
+/*
+ * Queue all descriptors of the batch plus a single wait descriptor, kick the
+ * hardware once and wait for the wait descriptor to complete.
+ */
+void dmar_qi_batch_flush(struct dmar_qi_batch *batch)
+{
+	struct dmar_drhd_rt *dmar_unit = batch->dmar_unit;
 	struct dmar_entry *invalidate_desc_ptr;
 	uint32_t qi_status = 0U;
 	uint64_t start;
+	uint16_t i;
 
-	spinlock_obtain(&(dmar_unit->lock));
+	if ((dmar_unit != NULL) && (batch->num != 0U)) {
+		spinlock_obtain(&(dmar_unit->lock));
 
-	invalidate_desc_ptr = (struct dmar_entry *)(dmar_unit->qi_queue + dmar_unit->qi_tail);
+		for (i = 0U; i < batch->num; i++) {
+			invalidate_desc_ptr = (struct dmar_entry *)(dmar_unit->qi_queue + dmar_unit->qi_tail);
+			invalidate_desc_ptr->hi_64 = batch->desc[i].hi_64;
+			invalidate_desc_ptr->lo_64 = batch->desc[i].lo_64;
+			dmar_unit->qi_tail = (dmar_unit->qi_tail + DMAR_QI_INV_ENTRY_SIZE) % DMAR_INVALIDATION_QUEUE_SIZE;
+		}
 
-	invalidate_desc_ptr->hi_64 = invalidate_desc.hi_64;
-	invalidate_desc_ptr->lo_64 = invalidate_desc.lo_64;
-	dmar_unit->qi_tail = (dmar_unit->qi_tail + DMAR_QI_INV_ENTRY_SIZE) % DMAR_INVALIDATION_QUEUE_SIZE;
+		invalidate_desc_ptr = (struct dmar_entry *)(dmar_unit->qi_queue + dmar_unit->qi_tail);
+		invalidate_desc_ptr->hi_64 = hva2hpa(&qi_status);
+		invalidate_desc_ptr->lo_64 = DMAR_INV_WAIT_DESC_LOWER;
+		dmar_unit->qi_tail = (dmar_unit->qi_tail + DMAR_QI_INV_ENTRY_SIZE) % DMAR_INVALIDATION_QUEUE_SIZE;
 
-	invalidate_desc_ptr++;
+		qi_status = DMAR_INV_STATUS_INCOMPLETE;
+		iommu_write32(dmar_unit, DMAR_IQT_REG, dmar_unit->qi_tail);
+
+		start = cpu_ticks();
+		while (qi_status != DMAR_INV_STATUS_COMPLETED) {
+			if ((cpu_ticks() - start) > TICKS_PER_MS) {
+				pr_err("DMAR OP Timeout! @ %s", __func__);
+				break;
+			}
+			asm_pause();
+		}
 
-	invalidate_desc_ptr->hi_64 = hva2hpa(&qi_status);
-	invalidate_desc_ptr->lo_64 = DMAR_INV_WAIT_DESC_LOWER;
-	dmar_unit->qi_tail = (dmar_unit->qi_tail + DMAR_QI_INV_ENTRY_SIZE) % DMAR_INVALIDATION_QUEUE_SIZE;
+		spinlock_release(&(dmar_unit->lock));
+	}
 
-	qi_status = DMAR_INV_STATUS_INCOMPLETE;
-	iommu_write32(dmar_unit, DMAR_IQT_REG, dmar_unit->qi_tail);
+	batch->dmar_unit = NULL;
+	batch->num = 0U;
+}
 
-	start = cpu_ticks();
-	while (qi_status != DMAR_INV_STATUS_COMPLETED) {
-		if ((cpu_ticks() - start) > TICKS_PER_MS) {
-			pr_err("DMAR OP Timeout! @ %s", __func__);
+/*
+ * Fold an indexed IEC descriptor into a queued one for the buddy block, so
+ * that freeing a run of adjacent IRTEs ends up as one masked invalidation.
+ */
+static void dmar_qi_batch_merge_iec(struct dmar_qi_batch *batch, struct dmar_entry *desc)
+{
+	uint16_t i = 0U, j;
+	uint32_t index, buddy;
+	uint8_t im;
+
+	while (i < batch->num) {
+		im = dmar_iec_desc_im(desc);
+		index = dmar_iec_desc_start(desc);
+		buddy = index ^ (1U << im);
+
+		if ((im < 0x1FU) && (dmar_qi_desc_type(&batch->desc[i]) == DMAR_INV_IEC_DESC) &&
+				((batch->desc[i].lo_64 & DMAR_IECI_INDEXED) != 0UL) &&
+				(dmar_iec_desc_im(&batch->desc[i]) == im) &&
+				(dmar_iec_desc_start(&batch->desc[i]) == buddy)) {
+			batch->num--;
+			for (j = i; j < batch->num; j++) {
+				batch->desc[j] = batch->desc[j + 1U];
+			}
+			desc->lo_64 = DMAR_INV_IEC_DESC | DMAR_IECI_INDEXED |
+					dma_iec_index((uint16_t)(index & ~(1U << im)), im + 1U);
+			/* the grown block may now pair with an entry we already passed */
+			i = 0U;
+		} else {
+			i++;
+		}
+	}
+}
+
+/*
+ * Add one invalidation descriptor to the batch. Requests already covered by
+ * a queued descriptor are dropped, and queued descriptors the new one covers
+ * are replaced by it in place, so the relative order of context-cache and
+ * IOTLB invalidations is kept. The batch is flushed first when it targets
+ * another DMAR unit or is full.
+ */
+static void dmar_qi_batch_add(struct dmar_qi_batch *batch, struct dmar_drhd_rt *dmar_unit,
+		const struct dmar_entry *invalidate_desc)
+{
+	struct dmar_entry desc = *invalidate_desc;
+	bool covered = false, placed = false;
+	uint16_t i, n = 0U;
+
+	if ((batch->dmar_unit != dmar_unit) && (batch->num != 0U)) {
+		dmar_qi_batch_flush(batch);
+	}
+	batch->dmar_unit = dmar_unit;
+
+	for (i = 0U; i < batch->num; i++) {
+		if (dmar_qi_desc_covers(&batch->desc[i], &desc)) {
+			covered = true;
 			break;
 		}
-		asm_pause();
 	}
 
-	spinlock_release(&(dmar_unit->lock));
+	if (!covered) {
+		if ((dmar_qi_desc_type(&desc) == DMAR_INV_IEC_DESC) && ((desc.lo_64 & DMAR_IECI_INDEXED) != 0UL)) {
+			dmar_qi_batch_merge_iec(batch, &desc);
+		}
+
+		for (i = 0U; i < batch->num; i++) {
+			if (dmar_qi_desc_covers(&desc, &batch->desc[i])) {
+				if (!placed) {
+					batch->desc[n] = desc;
+					placed = true;
+					n++;
+				}
+			} else {
+				batch->desc[n] = batch->desc[i];
+				n++;
+			}
+		}
+		batch->num = n;
+
+		if (!placed) {
+			if (batch->num == DMAR_QI_BATCH_SIZE) {
+				dmar_qi_batch_flush(batch);
+				batch->dmar_unit = dmar_unit;
+			}
+			batch->desc[batch->num] = desc;
+			batch->num++;
+		}
+	}
 }
 
 /*
@@ -582,7 +790,7 @@ static void dmar_issue_qi_request(struct dmar_drhd_rt *dmar_unit, struct dmar_en
  * fm: function mask
  * cirg: cache-invalidation request granularity
  */
-static void dmar_invalid_context_cache(struct dmar_drhd_rt *dmar_unit,
+static void dmar_invalid_context_cache(struct dmar_qi_batch *batch, struct dmar_drhd_rt *dmar_unit,
 	uint16_t did, uint16_t sid, uint8_t fm, enum dmar_cirg_type cirg)
 {
 	struct dmar_entry invalidate_desc;
@@ -606,17 +814,17 @@ static void dmar_invalid_context_cache(struct dmar_drhd_rt *dmar_unit,
 	}
 
 	if (invalidate_desc.lo_64 != 0UL) {
-		dmar_issue_qi_request(dmar_unit, invalidate_desc);
+		dmar_qi_batch_add(batch, dmar_unit, &invalidate_desc);
 	}
 }
 
-static void dmar_invalid_context_cache_global(struct dmar_drhd_rt *dmar_unit)
+static void dmar_invalid_context_cache_global(struct dmar_qi_batch *batch, struct dmar_drhd_rt *dmar_unit)
 {
-	dmar_invalid_context_cache(dmar_unit, 0U, 0U, 0U, DMAR_CIRG_GLOBAL);
+	dmar_invalid_context_cache(batch, dmar_unit, 0U, 0U, 0U, DMAR_CIRG_GLOBAL);
 }
 
-static void dmar_invalid_iotlb(struct dmar_drhd_rt *dmar_unit, uint16_t did, uint64_t address, uint8_t am,
-			       bool hint, enum dmar_iirg_type iirg)
+static void dmar_invalid_iotlb(struct dmar_qi_batch *batch, struct dmar_drhd_rt *dmar_unit, uint16_t did,
+			       uint64_t address, uint8_t am, bool hint, enum dmar_iirg_type iirg)
 {
 	/* set Drain Reads & Drain Writes,
 	 * if hardware doesn't support it, will be ignored by hardware
@@ -649,7 +857,7 @@ static void dmar_invalid_iotlb(struct dmar_drhd_rt *dmar_unit, uint16_t did, uin
 	}
 
 	if (invalidate_desc.lo_64 != 0UL) {
-		dmar_issue_qi_request(dmar_unit, invalidate_desc);
+		dmar_qi_batch_add(batch, dmar_unit, &invalidate_desc);
 	}
 }
 
@@ -658,9 +866,49 @@ static void dmar_invalid_iotlb(struct dmar_drhd_rt *dmar_unit, uint16_t did, uin
  * all PASID-cache entries are invalidated,
  * all paging-structure-cache entries are invalidated.
  */
-static void dmar_invalid_iotlb_global(struct dmar_drhd_rt *dmar_unit)
+static void dmar_invalid_iotlb_global(struct dmar_qi_batch *batch, struct dmar_drhd_rt *dmar_unit)
 {
-	dmar_invalid_iotlb(dmar_unit, 0U, 0UL, 0U, false, DMAR_IIRG_GLOBAL);
+	dmar_invalid_iotlb(batch, dmar_unit, 0U, 0UL, 0U, false, DMAR_IIRG_GLOBAL);
+}
+
+/*
+ * Invalidate the IOTLB entries of domain did covering [address, address + size).
+ *
+ * The range is split into naturally aligned power-of-two blocks, each sent as
+ * one page-selective request with its address mask, bounded by the MAMV the
+ * unit reports. Units without page-selective invalidation, and ranges needing
+ * more than DMAR_IOTLB_PSI_MAX_REQS requests, fall back to a domain-selective
+ * invalidation.
+ */
+static void dmar_invalid_iotlb_range(struct dmar_qi_batch *batch, struct dmar_drhd_rt *dmar_unit, uint16_t did,
+			       uint64_t address, uint64_t size)
+{
+	uint64_t start = round_page_down(address);
+	uint64_t end = round_page_up(address + size);
+	uint64_t pages;
+	uint8_t am, max_am = iommu_cap_max_amask_val(dmar_unit->cap);
+	uint32_t nr_reqs = 0U;
+
+	if (iommu_cap_pgsel_inv(dmar_unit->cap) == 0U) {
+		dmar_invalid_iotlb(batch, dmar_unit, did, 0UL, 0U, false, DMAR_IIRG_DOMAIN);
+	} else {
+		while (start < end) {
+			pages = (end - start) >> PAGE_SHIFT;
+			am = (uint8_t)min(fls64(pages), (uint16_t)max_am);
+			if (start != 0UL) {
+				am = (uint8_t)min((uint16_t)am, ffs64(start >> PAGE_SHIFT));
+			}
+
+			if (nr_reqs == DMAR_IOTLB_PSI_MAX_REQS) {
+				/* supersedes the page-selective requests queued so far */
+				dmar_invalid_iotlb(batch, dmar_unit, did, 0UL, 0U, false, DMAR_IIRG_DOMAIN);
+				break;
+			}
+			dmar_invalid_iotlb(batch, dmar_unit, did, start, am, false, DMAR_IIRG_PAGE);
+			nr_reqs++;
+			start += PAGE_SIZE << am;
+		}
+	}
 }
 
 /* @pre dmar_unit->ir_table_addr != NULL */
@@ -685,7 +933,7 @@ static void dmar_set_intr_remap_table(struct dmar_drhd_rt *dmar_unit)
 	spinlock_release(&(dmar_unit->lock));
 }
 
-static void dmar_invalid_iec(struct dmar_drhd_rt *dmar_unit, uint16_t intr_index,
+static void dmar_invalid_iec(struct dmar_qi_batch *batch, struct dmar_drhd_rt *dmar_unit, uint16_t intr_index,
 				uint8_t index_mask, bool is_global)
 {
 	struct dmar_entry invalidate_desc;
@@ -700,13 +948,13 @@ static void dmar_invalid_iec(struct dmar_drhd_rt *dmar_unit, uint16_t intr_index
 	}
 
 	if (invalidate_desc.lo_64 != 0UL) {
-		dmar_issue_qi_request(dmar_unit, invalidate_desc);
+		dmar_qi_batch_add(batch, dmar_unit, &invalidate_desc);
 	}
 }
 
-static void dmar_invalid_iec_global(struct dmar_drhd_rt *dmar_unit)
+static void dmar_invalid_iec_global(struct dmar_qi_batch *batch, struct dmar_drhd_rt *dmar_unit)
 {
-	dmar_invalid_iec(dmar_unit, 0U, 0U, true);
+	dmar_invalid_iec(batch, dmar_unit, 0U, 0U, true);
 }
 
 /* @pre dmar_unit->root_table_addr != NULL */
@@ -931,10 +1179,14 @@ static void prepare_dmar(struct dmar_drhd_rt *dmar_unit)
 
 static void enable_dmar(struct dmar_drhd_rt *dmar_unit)
 {
+	struct dmar_qi_batch batch;
+
 	dev_dbg(DBG_LEVEL_IOMMU, "enable dmar uint [0x%x]", dmar_unit->drhd->reg_base_addr);
-	dmar_invalid_context_cache_global(dmar_unit);
-	dmar_invalid_iotlb_global(dmar_unit);
-	dmar_invalid_iec_global(dmar_unit);
+	dmar_qi_batch_init(&batch);
+	dmar_invalid_context_cache_global(&batch, dmar_unit);
+	dmar_invalid_iotlb_global(&batch, dmar_unit);
+	dmar_invalid_iec_global(&batch, dmar_unit);
+	dmar_qi_batch_flush(&batch);
 	dmar_enable_translation(dmar_unit);
 }
 
@@ -948,11 +1200,14 @@ static void disable_dmar(struct dmar_drhd_rt *dmar_unit)
 
 static void suspend_dmar(struct dmar_drhd_rt *dmar_unit)
 {
+	struct dmar_qi_batch batch;
 	uint32_t i;
 
-	dmar_invalid_context_cache_global(dmar_unit);
-	dmar_invalid_iotlb_global(dmar_unit);
-	dmar_invalid_iec_global(dmar_unit);
+	dmar_qi_batch_init(&batch);
+	dmar_invalid_context_cache_global(&batch, dmar_unit);
+	dmar_invalid_iotlb_global(&batch, dmar_unit);
+	dmar_invalid_iec_global(&batch, dmar_unit);
+	dmar_qi_batch_flush(&batch);
 
 	disable_dmar(dmar_unit);
 
@@ -1091,6 +1346,7 @@ static int32_t iommu_detach_device(const struct iommu_domain *domain, uint8_t bu
 	struct dmar_entry *context;
 	struct dmar_entry *root_entry;
 	struct dmar_entry *context_entry;
+	struct dmar_qi_batch batch;
 	/* source id */
 	union pci_bdf sid;
 	int32_t ret = -EINVAL;
@@ -1125,10 +1381,12 @@ static int32_t iommu_detach_device(const struct iommu_domain *domain, uint8_t bu
 			context_entry->hi_64 = 0UL;
 			iommu_flush_cache(context_entry, sizeof(struct dmar_entry));
 
-			dmar_invalid_context_cache(dmar_unit, vmid_to_domainid(domain->vm_id), sid.value, 0U,
+			dmar_qi_batch_init(&batch);
+			dmar_invalid_context_cache(&batch, dmar_unit, vmid_to_domainid(domain->vm_id), sid.value, 0U,
 							DMAR_CIRG_DEVICE);
-			dmar_invalid_iotlb(dmar_unit, vmid_to_domainid(domain->vm_id), 0UL, 0U, false,
+			dmar_invalid_iotlb(&batch, dmar_unit, vmid_to_domainid(domain->vm_id), 0UL, 0U, false,
 							DMAR_IIRG_DOMAIN);
+			dmar_qi_batch_flush(&batch);
 		}
 	} else {
 		if (is_dmar_unit_ignored(dmar_unit)) {
@@ -1179,6 +1437,7 @@ struct iommu_domain *create_iommu_domain(uint16_t vm_id, uint64_t translation_ta
 		domain->vm_id = vm_id;
 		domain->trans_table_ptr = translation_table;
 		domain->addr_width = addr_width;
+		domain->dev_count = 0U;
 
 		dev_dbg(DBG_LEVEL_IOMMU, "create domain [%d]: vm_id = %hu, ept@0x%x",
 			vmid_to_domainid(domain->vm_id), domain->vm_id, domain->trans_table_ptr);
@@ -1196,11 +1455,31 @@ void destroy_iommu_domain(struct iommu_domain *domain)
 	(void)memset(domain, 0U, sizeof(*domain));
 }
 
+void iommu_flush_iotlb_range(const struct iommu_domain *domain, uint64_t gpa, uint64_t size)
+{
+	struct dmar_drhd_rt *dmar_unit;
+	struct dmar_qi_batch batch;
+	uint32_t i;
+
+	/* the domain has been destroyed, its DID may already be reused */
+	if (domain->trans_table_ptr != 0UL) {
+		dmar_qi_batch_init(&batch);
+		for (i = 0U; i < platform_dmar_info->drhd_count; i++) {
+			dmar_unit = &dmar_drhd_units[i];
+			if (!dmar_unit->drhd->ignore) {
+				/* a unit change flushes what was batched for the previous one */
+				dmar_invalid_iotlb_range(&batch, dmar_unit, vmid_to_domainid(domain->vm_id), gpa, size);
+			}
+		}
+		dmar_qi_batch_flush(&batch);
+	}
+}
+
 /*
  * @pre (from_domain != NULL) || (to_domain != NULL)
  */
 
-int32_t move_pt_device(const struct iommu_domain *from_domain, const struct iommu_domain *to_domain, uint8_t bus, uint8_t devfun)
+int32_t move_pt_device(struct iommu_domain *from_domain, struct iommu_domain *to_domain, uint8_t bus, uint8_t devfun)
 {
 	int32_t status = 0;
 	uint16_t bus_local = bus;
@@ -1210,10 +1489,16 @@ int32_t move_pt_device(const struct iommu_domain *from_domain, const struct iomm
 	if (bus_local < ACFG_MAX_PCI_BUS_NUM) {
 		if (from_domain != NULL) {
 			status = iommu_detach_device(from_domain, bus, devfun);
+			if (status == 0) {
+				atomic_dec32(&from_domain->dev_count);
+			}
 		}
 
 		if ((status == 0) && (to_domain != NULL)) {
 			status = iommu_attach_device(to_domain, bus, devfun);
+			if (status == 0) {
+				atomic_inc32(&to_domain->dev_count);
+			}
 		}
 	} else {
 		status = -EINVAL;
@@ -1222,6 +1507,11 @@ int32_t move_pt_device(const struct iommu_domain *from_domain, const struct iomm
 	return status;
 }
 
+bool iommu_domain_has_devices(const struct iommu_domain *domain)
+{
+	return ((domain != NULL) && (domain->dev_count != 0U));
+}
+
 void enable_iommu(void)
 {
 	do_action_for_iommus(enable_dmar);
@@ -1332,6 +1622,7 @@ int32_t dmar_assign_irte(const struct intr_source *intr_src, union dmar_ir_entry
 	union dmar_ir_entry *ir_table, *ir_entry;
 	union pci_bdf sid;
 	uint64_t trigger_mode;
+	struct dmar_qi_batch batch;
 	int32_t ret = -EINVAL;
 
 	if (intr_src->is_msi) {
@@ -1382,7 +1673,9 @@ int32_t dmar_assign_irte(const struct intr_source *intr_src, union dmar_ir_entry
 				*ir_entry = *irte;
 			}
 			iommu_flush_cache(ir_entry, sizeof(union dmar_ir_entry));
-			dmar_invalid_iec(dmar_unit, *idx_out, 0U, false);
+			dmar_qi_batch_init(&batch);
+			dmar_invalid_iec(&batch, dmar_unit, *idx_out, 0U, false);
+			dmar_qi_batch_flush(&batch);
 		}
 		ret = 0;
 	}
@@ -1390,7 +1683,7 @@ int32_t dmar_assign_irte(const struct intr_source *intr_src, union dmar_ir_entry
 	return ret;
 }
 
-void dmar_free_irte(const struct intr_source *intr_src, uint16_t index)
+void dmar_free_irte_batch(const struct intr_source *intr_src, uint16_t index, struct dmar_qi_batch *batch)
 {
 	struct dmar_drhd_rt *dmar_unit;
 	union dmar_ir_entry *ir_table, *ir_entry;
@@ -1408,7 +1701,11 @@ void dmar_free_irte(const struct intr_source *intr_src, uint16_t index)
 		ir_entry->bits.remap.present = 0x0UL;
 
 		iommu_flush_cache(ir_entry, sizeof(union dmar_ir_entry));
-		dmar_invalid_iec(dmar_unit, index, 0U, false);
+		/*
+		 * The IRTE may be handed out again before the batch is flushed,
+		 * which is fine: dmar_assign_irte() invalidates it synchronously.
+		 */
+		dmar_invalid_iec(batch, dmar_unit, index, 0U, false);
 
 		if (!is_irte_reserved(dmar_unit, index)) {
 			spinlock_obtain(&dmar_unit->lock);
@@ -1416,5 +1713,13 @@ void dmar_free_irte(const struct intr_source *intr_src, uint16_t index)
 			spinlock_release(&dmar_unit->lock);
 		}
 	}
+}
+
+void dmar_free_irte(const struct intr_source *intr_src, uint16_t index)
+{
+	struct dmar_qi_batch batch;
 
+	dmar_qi_batch_init(&batch);
+	dmar_free_irte_batch(intr_src, index, &batch);
+	dmar_qi_batch_flush(&batch);
 }
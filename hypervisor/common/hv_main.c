@@ -85,6 +85,10 @@ void default_idle(__unused struct thread_object *obj)
 			cpu_dead();
 		} else if (need_shutdown_vm(pcpu_id)) {
 			shutdown_vm_from_idle(pcpu_id);
+#ifdef CONFIG_SCHED_BALANCE_ENABLED
+		} else if (sched_balance(pcpu_id)) {
+			/* pulled a vCPU from a busy pCPU, run it on the next round */
+#endif
 		} else {
 			cpu_do_idle();
 		}
@@ -104,6 +108,8 @@ void run_idle_thread(void)
 	idle->thread_entry = default_idle;
 	idle->switch_out = NULL;
 	idle->switch_in = NULL;
+	idle->can_migrate = NULL;
+	idle->migrate = NULL;
 	idle_params.prio = PRIO_IDLE;
 	init_thread_data(idle, &idle_params);
 
@@ -14,6 +14,8 @@
 #include <asm/lapic.h>
 #include <asm/guest/assign.h>
 #include <asm/guest/ept.h>
+#include <asm/guest/dirty_log.h>
+#include <asm/guest/vmexit.h>
 #include <asm/mmu.h>
 #include <hypercall.h>
 #include <errno.h>
@@ -30,6 +32,10 @@
 
 #define DBG_LEVEL_HYCALL	6U
 
+/* too large for the stack, serialized by vmexit_stats_lock */
+static struct acrn_vmexit_stats vmexit_stats_buf;
+static spinlock_t vmexit_stats_lock = { .head = 0U, .tail = 0U };
+
 typedef int32_t (*emul_dev_create) (struct acrn_vm *vm, struct acrn_vdev *dev);
 typedef int32_t (*emul_dev_destroy) (struct pci_vdev *vdev);
 struct emul_dev_ops {
@@ -616,8 +622,8 @@ int32_t hcall_notify_ioreq_finish(__unused struct acrn_vcpu *vcpu, struct acrn_v
  *@pre is_service_vm(vm)
  *@pre gpa2hpa(vm, region->service_vm_gpa) != INVALID_HPA
  */
-static void add_vm_memory_region(struct acrn_vm *vm, struct acrn_vm *target_vm,
-				const struct vm_memory_region *region,uint64_t *pml4_page)
+static void add_vm_memory_region(struct acrn_vm *vm, struct ept_txn *txn,
+				const struct vm_memory_region *region)
 {
 	uint64_t prot = 0UL, base_paddr;
 	uint64_t hpa = gpa2hpa(vm, region->service_vm_gpa);
@@ -660,30 +666,32 @@ static void add_vm_memory_region(struct acrn_vm *vm, struct acrn_vm *target_vm,
 	}
 
 	/* create gpa to hpa EPT mapping */
-	ept_add_mr(target_vm, pml4_page, hpa, region->gpa, region->size, prot);
+	ept_txn_add_mr(txn, hpa, region->gpa, region->size, prot);
 }
 
 /**
  *@pre is_service_vm(vm)
+ *@pre txn has been started on the normal world EPT of the target VM
  */
 static int32_t set_vm_memory_region(struct acrn_vm *vm,
-	struct acrn_vm *target_vm, const struct vm_memory_region *region)
+	struct ept_txn *txn, const struct vm_memory_region *region)
 {
-	uint64_t *pml4_page;
+	struct acrn_vm *target_vm = txn->vm;
 	int32_t ret = -EINVAL;
 
 	if ((region->size & (PAGE_SIZE - 1UL)) == 0UL) {
-		pml4_page = (uint64_t *)target_vm->arch_vm.nworld_eptp;
 		if (region->type == MR_ADD) {
 			/* if the GPA range is Service VM valid GPA or not */
 			if (ept_is_valid_mr(vm, region->service_vm_gpa, region->size)) {
 				/* FIXME: how to filter the alias mapping ? */
-				add_vm_memory_region(vm, target_vm, region, pml4_page);
+				add_vm_memory_region(vm, txn, region);
+				/* the new region may complete a PT page of 4K neighbours */
+				ept_txn_promote_mr(txn, region->gpa, region->size);
 				ret = 0;
 			}
 		} else {
 			if (ept_is_valid_mr(target_vm, region->gpa, region->size)) {
-				ept_del_mr(target_vm, pml4_page, region->gpa, region->size);
+				ept_txn_del_mr(txn, region->gpa, region->size);
 				ret = 0;
 			}
 		}
@@ -696,9 +704,15 @@ static int32_t set_vm_memory_region(struct acrn_vm *vm,
 	return ret;
 }
 
+/* regions copied from the Service VM with one copy_from_gpa() */
+#define MR_COPY_BATCH	16U
+
 /**
  * @brief setup ept memory mapping for multi regions
  *
+ * All the regions are applied as one EPT transaction, so the target VM is
+ * flushed once no matter how many regions there are.
+ *
  * @param vcpu Pointer to vCPU that initiates the hypercall
  * @param target_vm Pointer to target VM data structure
  * @param param1 guest physical address. This gpa points to
@@ -712,27 +726,38 @@ int32_t hcall_set_vm_memory_regions(struct acrn_vcpu *vcpu, struct acrn_vm *targ
 {
 	struct acrn_vm *vm = vcpu->vm;
 	struct set_regions regions;
-	struct vm_memory_region mr;
-	uint32_t idx;
+	struct vm_memory_region mrs[MR_COPY_BATCH];
+	struct ept_txn txn;
+	uint32_t idx, i, num;
 	int32_t ret = -1;
 
 	if (copy_from_gpa(vm, &regions, param1, sizeof(regions)) == 0) {
 
 		if (!is_poweroff_vm(target_vm) &&
 		    (is_severity_pass(target_vm->vm_id) || (target_vm->state != VM_RUNNING))) {
+			ept_txn_begin(&txn, target_vm, (uint64_t *)target_vm->arch_vm.nworld_eptp);
 			idx = 0U;
 			while (idx < regions.mr_num) {
-				if (copy_from_gpa(vm, &mr, regions.regions_gpa + idx * sizeof(mr), sizeof(mr)) != 0) {
+				num = min(regions.mr_num - idx, MR_COPY_BATCH);
+				if (copy_from_gpa(vm, mrs, regions.regions_gpa + idx * sizeof(mrs[0]),
+						num * sizeof(mrs[0])) != 0) {
 					pr_err("%s: Copy mr entry fail from vm\n", __func__);
 					break;
 				}
 
-				ret = set_vm_memory_region(vm, target_vm, &mr);
+				for (i = 0U; i < num; i++) {
+					ret = set_vm_memory_region(vm, &txn, &mrs[i]);
+					if (ret < 0) {
+						break;
+					}
+				}
 				if (ret < 0) {
 					break;
 				}
-				idx++;
+				idx += num;
 			}
+			/* the regions applied before a failure stay mapped, as they always did */
+			ept_txn_commit(&txn);
 		} else {
 			pr_err("%p %s:target_vm is invalid or Targeting to service vm", target_vm, __func__);
 		}
@@ -776,6 +801,11 @@ static int32_t write_protect_page(struct acrn_vm *vm,const struct wp_data *wp)
 
 					ept_modify_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp,
 							wp->gpa, PAGE_SIZE, prot_set, prot_clr);
+					/* write protecting split the large page, merge it back once lifted */
+					if (wp->set == 0U) {
+						ept_promote_mr(vm, (uint64_t *)vm->arch_vm.nworld_eptp,
+								wp->gpa & PDE_MASK, PDE_SIZE);
+					}
 					ret = 0;
 				}
 			}
@@ -816,6 +846,51 @@ int32_t hcall_write_protect_page(struct acrn_vcpu *vcpu, struct acrn_vm *target_
 	return ret;
 }
 
+/**
+ * @brief control dirty page logging of a guest
+ *
+ * Start or stop tracking writes to guest RAM, or fetch the bitmap of pages
+ * written since the last fetch, for live snapshot and migration.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to
+ *              struct acrn_dirty_log
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_vm_dirty_log(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_dirty_log log;
+	int32_t ret = -1;
+
+	if (!is_poweroff_vm(target_vm) && (copy_from_gpa(vm, &log, param2, sizeof(log)) == 0)) {
+		switch (log.cmd) {
+		case ACRN_DIRTY_LOG_ENABLE:
+			ret = dirty_log_enable(target_vm, log.gpa, log.size);
+			break;
+		case ACRN_DIRTY_LOG_DISABLE:
+			ret = dirty_log_disable(target_vm, log.gpa, log.size);
+			break;
+		case ACRN_DIRTY_LOG_GET:
+			ret = dirty_log_get(target_vm, log.gpa, log.size, vm, log.bitmap_gpa,
+					((log.flags & ACRN_DIRTY_LOG_CLEAR) != 0U));
+			break;
+		default:
+			pr_err("%s: invalid cmd %u", __func__, log.cmd);
+			break;
+		}
+	} else {
+		pr_err("%p %s: target_vm is invalid", target_vm, __func__);
+	}
+
+	return ret;
+}
+
 /**
  * @brief translate guest physical address to host physical address
  *
@@ -1234,6 +1309,52 @@ int32_t hcall_vm_intr_monitor(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
 	return status;
 }
 
+/**
+ * @brief Get the VM exit statistics of a VM or of one of its vCPUs.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_vmexit_stats
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_vmexit_stats(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_vmexit_stats *stats = &vmexit_stats_buf;
+	struct acrn_vcpu *target_vcpu;
+	uint16_t vcpu_id, flags, i;
+	int32_t ret = -EINVAL;
+
+	if (!is_poweroff_vm(target_vm)) {
+		spinlock_obtain(&vmexit_stats_lock);
+		if (copy_from_gpa(vm, stats, param2, sizeof(*stats)) == 0) {
+			vcpu_id = stats->vcpu_id;
+			flags = stats->flags;
+			if ((vcpu_id == ACRN_VMEXIT_STATS_ALL_VCPUS) || (vcpu_id < target_vm->hw.created_vcpus)) {
+				(void)memset((void *)stats, 0U, sizeof(*stats));
+				stats->vcpu_id = vcpu_id;
+				stats->flags = flags;
+				foreach_vcpu(i, target_vm, target_vcpu) {
+					if ((vcpu_id == ACRN_VMEXIT_STATS_ALL_VCPUS) || (vcpu_id == i)) {
+						get_vmexit_stats(target_vcpu, stats);
+						if ((flags & ACRN_VMEXIT_STATS_CLEAR) != 0U) {
+							clear_vmexit_stats(target_vcpu);
+						}
+					}
+				}
+				ret = copy_to_gpa(vm, stats, param2, sizeof(*stats));
+			}
+		}
+		spinlock_release(&vmexit_stats_lock);
+	}
+
+	return ret;
+}
+
 /**
  * @brief set upcall notifier vector
  *
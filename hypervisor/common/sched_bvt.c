@@ -12,6 +12,8 @@
 #define BVT_MCU_MS		1U
 /* context switch allowance */
 #define BVT_CSA_MCU		5U
+/* the most CPU time a directed yield may put a thread ahead of its turn */
+#define BVT_YIELD_LEAD_MCU	BVT_CSA_MCU
 
 /*
  * limit the weight range to [1, 128]. It's enough to allocate CPU resources
@@ -121,6 +123,7 @@ static void runqueue_add(struct thread_object *obj)
 			list_add_tail(&data->list, &bvt_ctl->runqueue);
 		}
 	}
+	obj->sched_ctl->nr_queued++;
 }
 
 /*
@@ -131,7 +134,10 @@ static void runqueue_remove(struct thread_object *obj)
 {
 	struct sched_bvt_data *data = (struct sched_bvt_data *)obj->data;
 
-	list_del_init(&data->list);
+	if (is_inqueue(obj)) {
+		list_del_init(&data->list);
+		obj->sched_ctl->nr_queued--;
+	}
 }
 
 /*
@@ -326,6 +332,83 @@ static void sched_bvt_wake(struct thread_object *obj)
 
 }
 
+/*
+ * Warp obj just ahead of the first thread object in the runqueue, for one
+ * pick. update_vt() sets its EVT back to its AVT once it ran. The lead it
+ * gets is bounded by BVT_YIELD_LEAD_MCU and returned in lead, the yielder
+ * is charged for it so that the boost takes nothing from the other threads.
+ */
+static bool sched_bvt_prioritize(struct thread_object *obj, uint64_t *lead)
+{
+	struct sched_bvt_control *bvt_ctl = (struct sched_bvt_control *)obj->sched_ctl->priv;
+	struct sched_bvt_data *data = (struct sched_bvt_data *)obj->data;
+	struct thread_object *first_obj;
+	int64_t evt;
+	uint64_t ticks;
+	bool boosted = false;
+
+	*lead = 0UL;
+	if (is_inqueue(obj)) {
+		first_obj = get_first_item(&bvt_ctl->runqueue, struct thread_object, data);
+		if (first_obj == obj) {
+			boosted = true;
+		} else {
+			evt = ((struct sched_bvt_data *)first_obj->data)->evt - 1;
+			ticks = v2p((uint64_t)(data->evt - evt) * data->mcu, data->vt_ratio);
+			if (ticks <= (BVT_YIELD_LEAD_MCU * data->mcu)) {
+				data->evt = evt;
+				runqueue_remove(obj);
+				runqueue_add(obj);
+				*lead = ticks;
+				boosted = true;
+			}
+		}
+	}
+
+	return boosted;
+}
+
+/*
+ * Advance the virtual time of obj as if it ran for ticks more.
+ */
+static void sched_bvt_charge(struct thread_object *obj, uint64_t ticks)
+{
+	struct sched_bvt_data *data = (struct sched_bvt_data *)obj->data;
+	uint64_t v_delta;
+
+	v_delta = p2v(ticks, data->vt_ratio) + data->residual;
+	data->avt += (int64_t)(v_delta / data->mcu);
+	data->residual = v_delta % data->mcu;
+	data->evt = data->avt;
+
+	if (is_inqueue(obj)) {
+		runqueue_remove(obj);
+		runqueue_add(obj);
+	}
+}
+
+/*
+ * Give away the thread object with the latest EVT that may go, it's the
+ * one that would wait here the longest.
+ */
+static struct thread_object *sched_bvt_steal(struct sched_control *ctl, uint16_t pcpu_id)
+{
+	struct sched_bvt_control *bvt_ctl = (struct sched_bvt_control *)ctl->priv;
+	struct thread_object *obj = NULL, *iter_obj;
+	struct list_head *pos;
+
+	for (pos = bvt_ctl->runqueue.prev; pos != &bvt_ctl->runqueue; pos = pos->prev) {
+		iter_obj = container_of(pos, struct thread_object, data);
+		if (sched_can_steal(iter_obj, pcpu_id)) {
+			obj = iter_obj;
+			runqueue_remove(obj);
+			break;
+		}
+	}
+
+	return obj;
+}
+
 struct acrn_scheduler sched_bvt = {
 	.name		= "sched_bvt",
 	.init		= sched_bvt_init,
@@ -333,5 +416,8 @@ struct acrn_scheduler sched_bvt = {
 	.pick_next	= sched_bvt_pick_next,
 	.sleep		= sched_bvt_sleep,
 	.wake		= sched_bvt_wake,
+	.prioritize	= sched_bvt_prioritize,
+	.charge		= sched_bvt_charge,
+	.steal		= sched_bvt_steal,
 	.deinit		= sched_bvt_deinit,
 };
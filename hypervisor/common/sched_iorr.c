@@ -43,6 +43,7 @@ void runqueue_add_head(struct thread_object *obj)
 
 	if (!is_inqueue(obj)) {
 		list_add(&data->list, &iorr_ctl->runqueue);
+		obj->sched_ctl->nr_queued++;
 	}
 }
 
@@ -59,6 +60,7 @@ void runqueue_add_tail(struct thread_object *obj)
 
 	if (!is_inqueue(obj)) {
 		list_add_tail(&data->list, &iorr_ctl->runqueue);
+		obj->sched_ctl->nr_queued++;
 	}
 }
 
@@ -69,7 +71,11 @@ void runqueue_add_tail(struct thread_object *obj)
 void runqueue_remove(struct thread_object *obj)
 {
 	struct sched_iorr_data *data = (struct sched_iorr_data *)obj->data;
-	list_del_init(&data->list);
+
+	if (is_inqueue(obj)) {
+		list_del_init(&data->list);
+		obj->sched_ctl->nr_queued--;
+	}
 }
 
 static void sched_tick_handler(void *param)
@@ -194,6 +200,40 @@ static void sched_iorr_wake(struct thread_object *obj)
 	runqueue_add_head(obj);
 }
 
+/*
+ * pick_next() moves the current thread object to the tail, obj runs next.
+ * It waits for a slice less, that's all the lead it gets.
+ */
+static bool sched_iorr_prioritize(struct thread_object *obj, uint64_t *lead)
+{
+	*lead = 0UL;
+	if (is_inqueue(obj)) {
+		runqueue_remove(obj);
+		runqueue_add_head(obj);
+	}
+
+	return true;
+}
+
+/* Give away the thread object at the tail, it has the longest to wait. */
+static struct thread_object *sched_iorr_steal(struct sched_control *ctl, uint16_t pcpu_id)
+{
+	struct sched_iorr_control *iorr_ctl = (struct sched_iorr_control *)ctl->priv;
+	struct thread_object *obj = NULL, *iter_obj;
+	struct list_head *pos;
+
+	for (pos = iorr_ctl->runqueue.prev; pos != &iorr_ctl->runqueue; pos = pos->prev) {
+		iter_obj = container_of(pos, struct thread_object, data);
+		if (sched_can_steal(iter_obj, pcpu_id)) {
+			obj = iter_obj;
+			runqueue_remove(obj);
+			break;
+		}
+	}
+
+	return obj;
+}
+
 struct acrn_scheduler sched_iorr = {
 	.name		= "sched_iorr",
 	.init		= sched_iorr_init,
@@ -201,5 +241,7 @@ struct acrn_scheduler sched_iorr = {
 	.pick_next	= sched_iorr_pick_next,
 	.sleep		= sched_iorr_sleep,
 	.wake		= sched_iorr_wake,
+	.prioritize	= sched_iorr_prioritize,
+	.steal		= sched_iorr_steal,
 	.deinit		= sched_iorr_deinit,
 };
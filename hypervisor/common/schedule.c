@@ -14,8 +14,14 @@
 #endif
 #include <schedule.h>
 #include <sprintf.h>
+#include <ticks.h>
 #include <asm/irq.h>
 
+/* how often an idle pCPU looks for waiting thread objects on other pCPUs */
+#define SCHED_BALANCE_INTERVAL_US	1000U
+/* a thread object stays where it is for a while after it moved, not to bounce around */
+#define SCHED_MIGRATION_COOLDOWN_US	10000U
+
 bool is_idle_thread(const struct thread_object *obj)
 {
 	uint16_t pcpu_id = obj->pcpu_id;
@@ -49,6 +55,24 @@ void release_schedule_lock(uint16_t pcpu_id, uint64_t rflag)
 	spinlock_irqrestore_release(&ctl->scheduler_lock, rflag);
 }
 
+/*
+ * Lock the pCPU a thread object belongs to. The thread object may move to
+ * another pCPU while we wait for the lock, so check again once we hold it.
+ */
+static uint16_t obtain_thread_lock(const struct thread_object *obj, uint64_t *rflag)
+{
+	uint16_t pcpu_id = obj->pcpu_id;
+
+	obtain_schedule_lock(pcpu_id, rflag);
+	while (obj->pcpu_id != pcpu_id) {
+		release_schedule_lock(pcpu_id, *rflag);
+		pcpu_id = obj->pcpu_id;
+		obtain_schedule_lock(pcpu_id, rflag);
+	}
+
+	return pcpu_id;
+}
+
 static struct acrn_scheduler *get_scheduler(uint16_t pcpu_id)
 {
 	struct sched_control *ctl = &per_cpu(sched_ctl, pcpu_id);
@@ -74,6 +98,9 @@ void init_sched(uint16_t pcpu_id)
 	ctl->flags = 0UL;
 	ctl->curr_obj = NULL;
 	ctl->pcpu_id = pcpu_id;
+	ctl->nr_queued = 0U;
+	ctl->last_balance = 0UL;
+	ctl->nr_pulled = 0UL;
 #ifdef CONFIG_SCHED_NOOP
 	ctl->scheduler = &sched_noop;
 #endif
@@ -188,11 +215,12 @@ void schedule(void)
 
 void sleep_thread(struct thread_object *obj)
 {
-	uint16_t pcpu_id = obj->pcpu_id;
-	struct acrn_scheduler *scheduler = get_scheduler(pcpu_id);
+	struct acrn_scheduler *scheduler;
+	uint16_t pcpu_id;
 	uint64_t rflag;
 
-	obtain_schedule_lock(pcpu_id, &rflag);
+	pcpu_id = obtain_thread_lock(obj, &rflag);
+	scheduler = get_scheduler(pcpu_id);
 	if (scheduler->sleep != NULL) {
 		scheduler->sleep(obj);
 	}
@@ -208,26 +236,51 @@ void sleep_thread(struct thread_object *obj)
 void sleep_thread_sync(struct thread_object *obj)
 {
 	sleep_thread(obj);
-	while (!is_blocked(obj)) {
+	/* a moving thread object is done with its old pCPU once it arrived */
+	while (!is_blocked(obj) || obj->migrating) {
 		asm_pause();
 	}
 }
 
+#ifdef CONFIG_SCHED_BALANCE_ENABLED
+/* Get an idle pCPU out of HLT, to pull a thread object that has to wait on pcpu_id. */
+static void kick_idle_pcpu(const struct thread_object *obj, uint16_t pcpu_id)
+{
+	const struct sched_control *ctl;
+	uint16_t i;
+
+	for (i = 0U; i < get_pcpu_nums(); i++) {
+		ctl = &per_cpu(sched_ctl, i);
+		if ((i != pcpu_id) && (ctl->nr_queued == 0U) && (ctl->curr_obj != NULL) &&
+				is_idle_thread(ctl->curr_obj) && obj->can_migrate(obj, i)) {
+			kick_pcpu(i);
+			break;
+		}
+	}
+}
+#endif
+
 void wake_thread(struct thread_object *obj)
 {
-	uint16_t pcpu_id = obj->pcpu_id;
 	struct acrn_scheduler *scheduler;
+	uint16_t pcpu_id;
 	uint64_t rflag;
 
-	obtain_schedule_lock(pcpu_id, &rflag);
+	pcpu_id = obtain_thread_lock(obj, &rflag);
 	if (is_blocked(obj) || obj->be_blocking) {
 		scheduler = get_scheduler(pcpu_id);
-		if (scheduler->wake != NULL) {
+		/* a moving thread object is queued when it arrives on its new pCPU */
+		if ((scheduler->wake != NULL) && !obj->migrating) {
 			scheduler->wake(obj);
 		}
 		if (is_blocked(obj)) {
 			set_thread_status(obj, THREAD_STS_RUNNABLE);
 			make_reschedule_request(pcpu_id);
+#ifdef CONFIG_SCHED_BALANCE_ENABLED
+			if ((obj->can_migrate != NULL) && (per_cpu(sched_ctl, pcpu_id).nr_queued > 1U)) {
+				kick_idle_pcpu(obj, pcpu_id);
+			}
+#endif
 		}
 		obj->be_blocking = false;
 	}
@@ -239,6 +292,45 @@ void yield_current(void)
 	make_reschedule_request(get_pcpu_id());
 }
 
+/*
+ * Directed yield: let obj, waiting in the runqueue of its pCPU, run next
+ * there. The pCPU may be another one than the current pCPU. The thread
+ * object running on the current pCPU pays for the lead obj gets, the
+ * threads obj passes keep their share.
+ *
+ * @return true if obj was put ahead
+ */
+bool yield_to(struct thread_object *obj)
+{
+	struct acrn_scheduler *scheduler;
+	struct sched_control *ctl;
+	uint16_t pcpu_id;
+	uint64_t rflag, lead = 0UL;
+	bool boosted = false;
+
+	pcpu_id = obtain_thread_lock(obj, &rflag);
+	scheduler = get_scheduler(pcpu_id);
+	if ((obj->status == THREAD_STS_RUNNABLE) && !obj->migrating && (scheduler->prioritize != NULL)) {
+		boosted = scheduler->prioritize(obj, &lead);
+		if (boosted) {
+			make_reschedule_request(pcpu_id);
+		}
+	}
+	release_schedule_lock(pcpu_id, rflag);
+
+	if (lead != 0UL) {
+		pcpu_id = get_pcpu_id();
+		ctl = &per_cpu(sched_ctl, pcpu_id);
+		obtain_schedule_lock(pcpu_id, &rflag);
+		if ((ctl->scheduler->charge != NULL) && !is_idle_thread(ctl->curr_obj)) {
+			ctl->scheduler->charge(ctl->curr_obj, lead);
+		}
+		release_schedule_lock(pcpu_id, rflag);
+	}
+
+	return boosted;
+}
+
 void run_thread(struct thread_object *obj)
 {
 	uint64_t rflag;
@@ -252,3 +344,117 @@ void run_thread(struct thread_object *obj)
 		obj->thread_entry(obj);
 	}
 }
+
+/*
+ * Whether a scheduler may hand obj over to pcpu_id: it waits in the
+ * runqueue, wasn't moved recently, and its owner allows the move.
+ *
+ * @pre the scheduler lock of obj->pcpu_id is held
+ */
+bool sched_can_steal(const struct thread_object *obj, uint16_t pcpu_id)
+{
+	return ((obj != obj->sched_ctl->curr_obj) && (obj->status == THREAD_STS_RUNNABLE) && !obj->migrating &&
+		(obj->can_migrate != NULL) &&
+		((cpu_ticks() - obj->last_migration) >= us_to_ticks(SCHED_MIGRATION_COOLDOWN_US)) &&
+		obj->can_migrate(obj, pcpu_id));
+}
+
+#ifdef CONFIG_SCHED_BALANCE_ENABLED
+static struct thread_object *steal_thread(uint16_t victim, uint16_t pcpu_id)
+{
+	struct sched_control *ctl = &per_cpu(sched_ctl, victim);
+	struct thread_object *obj = NULL;
+	uint64_t rflag;
+
+	obtain_schedule_lock(victim, &rflag);
+	/* one is running, take a waiting one only */
+	if ((ctl->scheduler->steal != NULL) && (ctl->nr_queued > 1U)) {
+		obj = ctl->scheduler->steal(ctl, pcpu_id);
+		if (obj != NULL) {
+			obj->migrating = true;
+		}
+	}
+	release_schedule_lock(victim, rflag);
+
+	return obj;
+}
+
+/*
+ * Move the arch state of obj, then queue it here. Both pCPUs are locked,
+ * in ID order, while obj->pcpu_id changes: wake_thread() and sleep_thread()
+ * on the old pCPU see the change once they get the lock.
+ */
+static void pull_thread(struct thread_object *obj, uint16_t from, uint16_t pcpu_id)
+{
+	struct sched_control *ctl = &per_cpu(sched_ctl, pcpu_id);
+	uint16_t first = min(from, pcpu_id), second = max(from, pcpu_id);
+	uint64_t rflag_first, rflag_second;
+
+	obj->migrate(obj, from);
+
+	obtain_schedule_lock(first, &rflag_first);
+	obtain_schedule_lock(second, &rflag_second);
+	obj->pcpu_id = pcpu_id;
+	obj->sched_ctl = ctl;
+	obj->last_migration = cpu_ticks();
+	obj->migrating = false;
+	ctl->nr_pulled++;
+	/* it may have been put to sleep and woken up meanwhile */
+	if (obj->status == THREAD_STS_RUNNABLE) {
+		if (ctl->scheduler->wake != NULL) {
+			ctl->scheduler->wake(obj);
+		}
+		make_reschedule_request(pcpu_id);
+	}
+	release_schedule_lock(second, rflag_second);
+	release_schedule_lock(first, rflag_first);
+}
+
+/*
+ * Work stealing from the idle loop: pull a waiting thread object from the
+ * pCPU with the most thread objects in its runqueue, or from any other
+ * pCPU with waiting thread objects if none of those may come here.
+ *
+ * @pre pcpu_id == get_pcpu_id()
+ * @return true if a thread object was pulled and the pCPU has to reschedule
+ */
+bool sched_balance(uint16_t pcpu_id)
+{
+	struct sched_control *ctl = &per_cpu(sched_ctl, pcpu_id);
+	struct thread_object *obj = NULL;
+	uint64_t now = cpu_ticks();
+	uint32_t max_queued = 1U;
+	uint16_t i, victim = INVALID_CPU_ID;
+
+	if ((ctl->scheduler->steal != NULL) && (ctl->nr_queued == 0U) &&
+			((now - ctl->last_balance) >= us_to_ticks(SCHED_BALANCE_INTERVAL_US))) {
+		ctl->last_balance = now;
+
+		/* racy reads, steal_thread() checks again under the lock */
+		for (i = 0U; i < get_pcpu_nums(); i++) {
+			if ((i != pcpu_id) && (per_cpu(sched_ctl, i).nr_queued > max_queued)) {
+				max_queued = per_cpu(sched_ctl, i).nr_queued;
+				victim = i;
+			}
+		}
+
+		if (victim != INVALID_CPU_ID) {
+			obj = steal_thread(victim, pcpu_id);
+			for (i = 0U; (i < get_pcpu_nums()) && (obj == NULL); i++) {
+				if ((i != pcpu_id) && (i != victim) && (per_cpu(sched_ctl, i).nr_queued > 1U)) {
+					obj = steal_thread(i, pcpu_id);
+					if (obj != NULL) {
+						victim = i;
+					}
+				}
+			}
+		}
+
+		if (obj != NULL) {
+			pull_thread(obj, victim, pcpu_id);
+		}
+	}
+
+	return (obj != NULL);
+}
+#endif /* CONFIG_SCHED_BALANCE_ENABLED */
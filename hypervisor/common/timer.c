@@ -41,13 +41,21 @@ bool timer_expired(const struct hv_timer *timer, uint64_t now, uint64_t *delta)
 
 bool timer_is_started(const struct hv_timer *timer)
 {
-	return (!list_empty(&timer->node));
+	return (!rb_node_empty(&timer->node));
 }
 
-static void run_timer(const struct hv_timer *timer)
+static void run_timer(struct per_cpu_timers *cpu_timer, const struct hv_timer *timer, uint64_t now)
 {
+	struct timer_stats *stats = &cpu_timer->stats;
+	uint64_t slack;
+
 	/* deadline = 0 means stop timer, we should skip */
 	if ((timer->func != NULL) && (timer->timeout != 0UL)) {
+		slack = now - timer->timeout;
+		stats->expired++;
+		stats->total_slack += slack;
+		stats->max_slack = max(stats->max_slack, slack);
+
 		timer->func(timer->priv_data);
 	}
 
@@ -57,12 +65,12 @@ static void run_timer(const struct hv_timer *timer)
 #ifndef CONFIG_RISCV64
 static inline void update_physical_timer(struct per_cpu_timers *cpu_timer)
 {
-	struct hv_timer *timer = NULL;
+	struct rb_node *first = rb_first(&cpu_timer->timer_tree);
+	struct hv_timer *timer;
 
 	/* find the next event timer */
-	if (!list_empty(&cpu_timer->timer_list)) {
-		timer = container_of((&cpu_timer->timer_list)->next,
-			struct hv_timer, node);
+	if (first != NULL) {
+		timer = rb_entry(first, struct hv_timer, node);
 
 		/* it is okay to program a expired time */
 		msr_write(MSR_IA32_TSC_DEADLINE, timer->timeout);
@@ -71,28 +79,43 @@ static inline void update_physical_timer(struct per_cpu_timers *cpu_timer)
 #endif
 
 /*
- * return true if we add the timer on the timer_list head
+ * Insert the timer into the timer tree, after the timers with the same
+ * deadline. Return true if it becomes the first timer to expire.
  */
 static bool local_add_timer(struct per_cpu_timers *cpu_timer,
 			struct hv_timer *timer)
 {
-	struct list_head *pos, *prev;
+	struct rb_node **link = &cpu_timer->timer_tree.node;
+	struct rb_node *parent = NULL;
 	struct hv_timer *tmp;
 	uint64_t tsc = timer->timeout;
+	bool leftmost = true;
 
-	prev = &cpu_timer->timer_list;
-	list_for_each(pos, &cpu_timer->timer_list) {
-		tmp = container_of(pos, struct hv_timer, node);
-		if (tmp->timeout < tsc) {
-			prev = &tmp->node;
+	while (*link != NULL) {
+		parent = *link;
+		tmp = rb_entry(parent, struct hv_timer, node);
+		if (tsc < tmp->timeout) {
+			link = &parent->left;
 		} else {
-			break;
+			link = &parent->right;
+			leftmost = false;
 		}
 	}
 
-	list_add(&timer->node, prev);
+	rb_link_node(&timer->node, parent, link);
+	rb_insert_color(&cpu_timer->timer_tree, &timer->node, leftmost);
+
+	cpu_timer->stats.added++;
+	cpu_timer->stats.nr_active++;
+	cpu_timer->stats.max_active = max(cpu_timer->stats.max_active, cpu_timer->stats.nr_active);
+
+	return leftmost;
+}
 
-	return (prev == &cpu_timer->timer_list);
+static void local_del_timer(struct per_cpu_timers *cpu_timer, struct hv_timer *timer)
+{
+	rb_erase(&cpu_timer->timer_tree, &timer->node);
+	cpu_timer->stats.nr_active--;
 }
 
 int32_t add_timer(struct hv_timer *timer)
@@ -105,7 +128,7 @@ int32_t add_timer(struct hv_timer *timer)
 	if ((timer == NULL) || (timer->func == NULL) || (timer->timeout == 0UL)) {
 		ret = -EINVAL;
 	} else {
-		ASSERT(list_empty(&timer->node), "add timer again!\n");
+		ASSERT(rb_node_empty(&timer->node), "add timer again!\n");
 
 		/* limit minimal periodic timer cycle period */
 		if (timer->mode == TICK_MODE_PERIODIC) {
@@ -114,6 +137,7 @@ int32_t add_timer(struct hv_timer *timer)
 
 		pcpu_id  = get_pcpu_id();
 		cpu_timer = &per_cpu(cpu_timers, pcpu_id);
+		timer->pcpu_id = pcpu_id;
 
 		CPU_INT_ALL_DISABLE(&rflags);
 		/* update the physical timer if we're on the timer_list head */
@@ -144,7 +168,7 @@ void initialize_timer(struct hv_timer *timer,
 			timer->mode = TICK_MODE_ONESHOT;
 			timer->period_in_cycle = 0UL;
 		}
-		INIT_LIST_HEAD(&timer->node);
+		rb_init_node(&timer->node);
 	}
 }
 
@@ -167,25 +191,31 @@ void del_timer(struct hv_timer *timer)
 	uint64_t rflags;
 
 	CPU_INT_ALL_DISABLE(&rflags);
-	if ((timer != NULL) && !list_empty(&timer->node)) {
-		list_del_init(&timer->node);
+	if ((timer != NULL) && !rb_node_empty(&timer->node)) {
+		local_del_timer(&per_cpu(cpu_timers, timer->pcpu_id), timer);
 	}
 	CPU_INT_ALL_RESTORE(rflags);
 }
 
+const struct timer_stats *get_timer_stats(uint16_t pcpu_id)
+{
+	return &per_cpu(cpu_timers, pcpu_id).stats;
+}
+
 static void init_percpu_timer(uint16_t pcpu_id)
 {
 	struct per_cpu_timers *cpu_timer;
 
 	cpu_timer = &per_cpu(cpu_timers, pcpu_id);
-	INIT_LIST_HEAD(&cpu_timer->timer_list);
+	rb_init_root(&cpu_timer->timer_tree);
+	(void)memset(&cpu_timer->stats, 0U, sizeof(cpu_timer->stats));
 }
 
 static void timer_softirq(uint16_t pcpu_id)
 {
 	struct per_cpu_timers *cpu_timer;
 	struct hv_timer *timer;
-	const struct list_head *pos, *n;
+	struct rb_node *first;
 	uint32_t tries = MAX_TIMER_ACTIONS;
 	uint64_t current_tsc = cpu_ticks();
 
@@ -198,14 +228,15 @@ static void timer_softirq(uint16_t pcpu_id)
 	 * inside func(), it will infinitely loop here, because new added timer
 	 * already passed due to previously func()'s delay.
 	 */
-	list_for_each_safe(pos, n, &cpu_timer->timer_list) {
-		timer = container_of(pos, struct hv_timer, node);
+	first = rb_first(&cpu_timer->timer_tree);
+	while (first != NULL) {
+		timer = rb_entry(first, struct hv_timer, node);
 		/* timer expried */
 		tries--;
 		if ((timer->timeout <= current_tsc) && (tries != 0U)) {
 			del_timer(timer);
 
-			run_timer(timer);
+			run_timer(cpu_timer, timer, current_tsc);
 
 			if (timer->mode == TICK_MODE_PERIODIC) {
 				/* update periodic timer fire tsc */
@@ -214,7 +245,11 @@ static void timer_softirq(uint16_t pcpu_id)
 			} else {
 				timer->timeout = 0UL;
 			}
+			first = rb_first(&cpu_timer->timer_tree);
 		} else {
+			if ((tries == 0U) && (timer->timeout <= current_tsc)) {
+				cpu_timer->stats.deferred++;
+			}
 			break;
 		}
 	}
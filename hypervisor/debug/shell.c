@@ -16,6 +16,7 @@
 #include <asm/cpuid.h>
 #include <asm/ioapic.h>
 #include <asm/host_pm.h>
+#include <asm/guest/vmexit.h>
 #else
 #include <asm/lib/string.h>
 #include <asm/plicreg.h>
@@ -48,6 +49,12 @@ static int32_t shell_dump_host_mem(int32_t argc, char **argv);
 static int32_t shell_dump_guest_mem(int32_t argc, char **argv);
 static int32_t shell_to_vm_console(int32_t argc, char **argv);
 static int32_t shell_show_cpu_int(__unused int32_t argc, __unused char **argv);
+static int32_t shell_show_timer_info(__unused int32_t argc, __unused char **argv);
+static int32_t shell_show_ext_ctx_info(__unused int32_t argc, __unused char **argv);
+static int32_t shell_show_page_pool_info(__unused int32_t argc, __unused char **argv);
+static int32_t shell_show_ept_stat(__unused int32_t argc, __unused char **argv);
+static int32_t shell_show_vmexit_info(int32_t argc, char **argv);
+static int32_t shell_show_ple_info(__unused int32_t argc, __unused char **argv);
 static int32_t shell_show_ptdev_info(__unused int32_t argc, __unused char **argv);
 static int32_t shell_show_vioapic_info(int32_t argc, char **argv);
 static int32_t shell_show_ioapic_info(__unused int32_t argc, __unused char **argv);
@@ -112,6 +119,42 @@ static struct shell_cmd shell_cmds[] = {
 		.help_str	= SHELL_CMD_INTERRUPT_HELP,
 		.fcn		= shell_show_cpu_int,
 	},
+	{
+		.str		= SHELL_CMD_TIMER,
+		.cmd_param	= SHELL_CMD_TIMER_PARAM,
+		.help_str	= SHELL_CMD_TIMER_HELP,
+		.fcn		= shell_show_timer_info,
+	},
+	{
+		.str		= SHELL_CMD_EXT_CTX,
+		.cmd_param	= SHELL_CMD_EXT_CTX_PARAM,
+		.help_str	= SHELL_CMD_EXT_CTX_HELP,
+		.fcn		= shell_show_ext_ctx_info,
+	},
+	{
+		.str		= SHELL_CMD_PAGE_POOL,
+		.cmd_param	= SHELL_CMD_PAGE_POOL_PARAM,
+		.help_str	= SHELL_CMD_PAGE_POOL_HELP,
+		.fcn		= shell_show_page_pool_info,
+	},
+	{
+		.str		= SHELL_CMD_EPT_STAT,
+		.cmd_param	= SHELL_CMD_EPT_STAT_PARAM,
+		.help_str	= SHELL_CMD_EPT_STAT_HELP,
+		.fcn		= shell_show_ept_stat,
+	},
+	{
+		.str		= SHELL_CMD_VMEXIT,
+		.cmd_param	= SHELL_CMD_VMEXIT_PARAM,
+		.help_str	= SHELL_CMD_VMEXIT_HELP,
+		.fcn		= shell_show_vmexit_info,
+	},
+	{
+		.str		= SHELL_CMD_PLE,
+		.cmd_param	= SHELL_CMD_PLE_PARAM,
+		.help_str	= SHELL_CMD_PLE_HELP,
+		.fcn		= shell_show_ple_info,
+	},
 	{
 		.str		= SHELL_CMD_PTDEV,
 		.cmd_param	= SHELL_CMD_PTDEV_PARAM,
@@ -1221,6 +1264,56 @@ static int32_t shell_show_cpu_int(__unused int32_t argc, __unused char **argv)
 	return 0;
 }
 
+/**
+ * @brief Get the timer statistics
+ *
+ * It's for debug only.
+ *
+ * @param[in]	str_max	The max size of the string containing timer info
+ * @param[inout]	str_arg	Pointer to the output timer info
+ */
+static void get_timer_info(char *str_arg, size_t str_max)
+{
+	char *str = str_arg;
+	uint16_t pcpu_id;
+	size_t len, size = str_max;
+	uint16_t pcpu_nums = get_pcpu_nums();
+	const struct timer_stats *stats;
+	uint64_t avg_slack;
+
+	len = snprintf(str, size, "\r\nCPU\tACTIVE\tMAX\tADDED\t\tEXPIRED\t\tDEFERRED\tAVG_SLACK\tMAX_SLACK");
+	if (len >= size) {
+		goto overflow;
+	}
+	size -= len;
+	str += len;
+
+	for (pcpu_id = 0U; pcpu_id < pcpu_nums; pcpu_id++) {
+		stats = get_timer_stats(pcpu_id);
+		avg_slack = (stats->expired != 0UL) ? (stats->total_slack / stats->expired) : 0UL;
+		len = snprintf(str, size, "\r\n%hu\t%u\t%u\t%-16lu%-16lu%-16lu%-16lu%lu", pcpu_id,
+			stats->nr_active, stats->max_active, stats->added, stats->expired,
+			stats->deferred, ticks_to_us(avg_slack), ticks_to_us(stats->max_slack));
+		if (len >= size) {
+			goto overflow;
+		}
+		size -= len;
+		str += len;
+	}
+	snprintf(str, size, "\r\n");
+	return;
+
+overflow:
+	printf("buffer size could not be enough! please check!\n");
+}
+
+static int32_t shell_show_timer_info(__unused int32_t argc, __unused char **argv)
+{
+	get_timer_info(shell_log_buf, SHELL_LOG_BUF_SIZE);
+	shell_puts(shell_log_buf);
+	return 0;
+}
+
 #ifndef CONFIG_RISCV64
 static void get_entry_info(const struct ptirq_remapping_info *entry, char *type,
 		uint32_t *irq, uint32_t *vector, uint64_t *dest, bool *lvl_tm,
@@ -1304,6 +1397,26 @@ static int32_t shell_loglevel(int32_t argc, char **argv)
 }
 
 #ifdef CONFIG_RISCV64
+static int32_t shell_show_ext_ctx_info(__unused int32_t argc, __unused char **argv)
+{
+	return 0;
+}
+static int32_t shell_show_page_pool_info(__unused int32_t argc, __unused char **argv)
+{
+	return 0;
+}
+static int32_t shell_show_ept_stat(__unused int32_t argc, __unused char **argv)
+{
+	return 0;
+}
+static int32_t shell_show_vmexit_info(int32_t argc, char **argv)
+{
+	return 0;
+}
+static int32_t shell_show_ple_info(__unused int32_t argc, __unused char **argv)
+{
+	return 0;
+}
 static int32_t shell_show_ptdev_info(__unused int32_t argc, __unused char **argv)
 {
 	return 0;
@@ -1321,6 +1434,342 @@ static int32_t shell_reboot(__unused int32_t argc, __unused char **argv) { retur
 static int32_t shell_rdmsr(int32_t argc, char **argv) { return 0; }
 static int32_t shell_wrmsr(int32_t argc, char **argv) { return 0; }
 #else
+/**
+ * @brief Get the extended context switch statistics
+ *
+ * It's for debug only.
+ *
+ * @param[in]	str_max	The max size of the string containing the statistics
+ * @param[inout]	str_arg	Pointer to the output statistics
+ */
+static void get_ext_ctx_info(char *str_arg, size_t str_max)
+{
+	char *str = str_arg;
+	uint16_t pcpu_id;
+	size_t len, size = str_max;
+	uint16_t pcpu_nums = get_pcpu_nums();
+	const struct ext_context_cache *cache;
+
+	len = snprintf(str, size, "\r\nCPU\tSWITCH_IN\tXRSTORS_SKIPPED\tMSR_WRITES\tMSR_WRITES_SKIPPED");
+	if (len >= size) {
+		goto overflow;
+	}
+	size -= len;
+	str += len;
+
+	for (pcpu_id = 0U; pcpu_id < pcpu_nums; pcpu_id++) {
+		cache = &per_cpu(ext_ctx_cache, pcpu_id);
+		len = snprintf(str, size, "\r\n%hu\t%-16lu%-16lu%-16lu%lu", pcpu_id, cache->switch_in,
+			cache->xrstors_elided, cache->msr_writes, cache->msr_writes_elided);
+		if (len >= size) {
+			goto overflow;
+		}
+		size -= len;
+		str += len;
+	}
+	snprintf(str, size, "\r\n");
+	return;
+
+overflow:
+	printf("buffer size could not be enough! please check!\n");
+}
+
+static int32_t shell_show_ext_ctx_info(__unused int32_t argc, __unused char **argv)
+{
+	get_ext_ctx_info(shell_log_buf, SHELL_LOG_BUF_SIZE);
+	shell_puts(shell_log_buf);
+	return 0;
+}
+
+/**
+ * @brief Get the occupancy and fragmentation of the page pools
+ *
+ * It's for debug only.
+ *
+ * @param[in]	str_max	The max size of the string containing the page pool info
+ * @param[inout]	str_arg	Pointer to the output page pool info
+ */
+static void get_page_pool_info(char *str_arg, size_t str_max)
+{
+	char *str = str_arg;
+	size_t len, size = str_max;
+	uint16_t pool_id;
+	const char *name;
+	struct page_pool_stats stats;
+
+	len = snprintf(str, size, "\r\nPOOL\t\tTOTAL\tUSED\tCACHED\tZEROED\tEXTENTS\tLARGEST");
+	if (len >= size) {
+		goto overflow;
+	}
+	size -= len;
+	str += len;
+
+	for (pool_id = 0U; pool_id < get_page_pool_num(); pool_id++) {
+		name = get_page_pool_stats(pool_id, &stats);
+		len = snprintf(str, size, "\r\n%-16s%-8lu%-8lu%-8lu%-8lu%-8lu%lu", name, stats.total, stats.used,
+			stats.cached, stats.zeroed, stats.free_extents, stats.largest_extent);
+		if (len >= size) {
+			goto overflow;
+		}
+		size -= len;
+		str += len;
+	}
+	snprintf(str, size, "\r\n");
+	return;
+
+overflow:
+	printf("buffer size could not be enough! please check!\n");
+}
+
+static int32_t shell_show_page_pool_info(__unused int32_t argc, __unused char **argv)
+{
+	get_page_pool_info(shell_log_buf, SHELL_LOG_BUF_SIZE);
+	shell_puts(shell_log_buf);
+	return 0;
+}
+
+/**
+ * @brief Get the EPT large page split and promotion counts of the VMs
+ *
+ * It's for debug only.
+ *
+ * @param[in]	str_max	The max size of the string containing the EPT info
+ * @param[inout]	str_arg	Pointer to the output EPT info
+ */
+static void get_ept_stat_info(char *str_arg, size_t str_max)
+{
+	char *str = str_arg;
+	size_t len, size = str_max;
+	uint16_t vm_id;
+	const struct acrn_vm *vm;
+	const struct pgtable_stats *stats;
+
+	len = snprintf(str, size, "\r\nVM_ID\tSPLIT_2M\tSPLIT_1G\tPROMOTED_2M\tPROMOTED_1G");
+	if (len >= size) {
+		goto overflow;
+	}
+	size -= len;
+	str += len;
+
+	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		vm = get_vm_from_vmid(vm_id);
+		if (!is_poweroff_vm(vm)) {
+			stats = &vm->arch_vm.ept_stats;
+			len = snprintf(str, size, "\r\n%-8hu%-16lu%-16lu%-16lu%lu", vm_id, stats->split_2m,
+				stats->split_1g, stats->promoted_2m, stats->promoted_1g);
+			if (len >= size) {
+				goto overflow;
+			}
+			size -= len;
+			str += len;
+		}
+	}
+	snprintf(str, size, "\r\n");
+	return;
+
+overflow:
+	printf("buffer size could not be enough! please check!\n");
+}
+
+static int32_t shell_show_ept_stat(__unused int32_t argc, __unused char **argv)
+{
+	get_ept_stat_info(shell_log_buf, SHELL_LOG_BUF_SIZE);
+	shell_puts(shell_log_buf);
+	return 0;
+}
+
+static struct acrn_vmexit_stats shell_vmexit_stats;
+
+/**
+ * @brief Get the VM exit statistics
+ *
+ * It's for debug only.
+ *
+ * @param[in]	str_max	The max size of the string containing VM exit info
+ * @param[inout]	str_arg	Pointer to the output VM exit info
+ * @param[in]	stats	VM exit statistics to print
+ */
+static void get_vmexit_info(char *str_arg, size_t str_max, const struct acrn_vmexit_stats *stats)
+{
+	char *str = str_arg;
+	size_t len, size = str_max;
+	uint16_t reason, slot, bucket;
+
+	len = snprintf(str, size, "\r\nREASON\tCOUNT\t\t\tAVG_CYCLES");
+	if (len >= size) {
+		goto overflow;
+	}
+	size -= len;
+	str += len;
+
+	for (reason = 0U; reason < stats->nr_reasons; reason++) {
+		if (stats->count[reason] == 0UL) {
+			continue;
+		}
+		len = snprintf(str, size, "\r\n0x%02x\t%-24lu%lu", reason, stats->count[reason],
+			stats->cycles[reason] / stats->count[reason]);
+		if (len >= size) {
+			goto overflow;
+		}
+		size -= len;
+		str += len;
+	}
+
+	len = snprintf(str, size, "\r\n\r\nREASON\tHANDLER CYCLES < LIMIT: COUNT");
+	if (len >= size) {
+		goto overflow;
+	}
+	size -= len;
+	str += len;
+
+	for (slot = 0U; slot < stats->nr_hist; slot++) {
+		if (stats->count[stats->hist_reason[slot]] == 0UL) {
+			continue;
+		}
+		len = snprintf(str, size, "\r\n0x%02x\t", stats->hist_reason[slot]);
+		if (len >= size) {
+			goto overflow;
+		}
+		size -= len;
+		str += len;
+
+		for (bucket = 0U; bucket < ACRN_VMEXIT_HIST_BUCKETS; bucket++) {
+			if (stats->hist[slot][bucket] == 0UL) {
+				continue;
+			}
+			if (bucket == (ACRN_VMEXIT_HIST_BUCKETS - 1U)) {
+				len = snprintf(str, size, " >=%lu:%lu", 1UL << (ACRN_VMEXIT_HIST_SHIFT + bucket - 1U),
+					stats->hist[slot][bucket]);
+			} else {
+				len = snprintf(str, size, " <%lu:%lu", 1UL << (ACRN_VMEXIT_HIST_SHIFT + bucket),
+					stats->hist[slot][bucket]);
+			}
+			if (len >= size) {
+				goto overflow;
+			}
+			size -= len;
+			str += len;
+		}
+	}
+	snprintf(str, size, "\r\n");
+	return;
+
+overflow:
+	printf("buffer size could not be enough! please check!\n");
+}
+
+static int32_t shell_show_vmexit_info(int32_t argc, char **argv)
+{
+	struct acrn_vmexit_stats *stats = &shell_vmexit_stats;
+	uint16_t vm_id, vcpu_id = ACRN_VMEXIT_STATS_ALL_VCPUS;
+	struct acrn_vm *vm;
+	struct acrn_vcpu *vcpu;
+	bool clear = false;
+	int32_t status;
+	uint16_t i;
+
+	/* User input invalidation */
+	if ((argc < 2) || (argc > 4)) {
+		return -EINVAL;
+	}
+	if (strcmp(argv[argc - 1], "clear") == 0) {
+		clear = true;
+		argc--;
+	}
+	if (argc < 2) {
+		return -EINVAL;
+	}
+
+	status = strtol_deci(argv[1]);
+	if (status < 0) {
+		return -EINVAL;
+	}
+	vm_id = sanitize_vmid((uint16_t)status);
+	vm = get_vm_from_vmid(vm_id);
+	if (is_poweroff_vm(vm)) {
+		shell_puts("No vm found in the input <vm id>\r\n");
+		return -EINVAL;
+	}
+
+	if (argc == 3) {
+		status = strtol_deci(argv[2]);
+		if ((status < 0) || ((uint16_t)status >= vm->hw.created_vcpus)) {
+			shell_puts("vcpu id is out of range\r\n");
+			return -EINVAL;
+		}
+		vcpu_id = (uint16_t)status;
+	}
+
+	(void)memset((void *)stats, 0U, sizeof(*stats));
+	foreach_vcpu(i, vm, vcpu) {
+		if ((vcpu_id == ACRN_VMEXIT_STATS_ALL_VCPUS) || (vcpu_id == i)) {
+			get_vmexit_stats(vcpu, stats);
+			if (clear) {
+				clear_vmexit_stats(vcpu);
+			}
+		}
+	}
+
+	get_vmexit_info(shell_log_buf, SHELL_LOG_BUF_SIZE, stats);
+	shell_puts(shell_log_buf);
+	return 0;
+}
+
+/**
+ * @brief Get the PAUSE-loop exiting window and statistics of the vCPUs
+ *
+ * It's for debug only.
+ *
+ * @param[in]	str_max	The max size of the string containing the PLE info
+ * @param[inout]	str_arg	Pointer to the output PLE info
+ */
+static void get_ple_info(char *str_arg, size_t str_max)
+{
+	char *str = str_arg;
+	size_t len, size = str_max;
+	uint16_t vm_id, i;
+	struct acrn_vm *vm;
+	struct acrn_vcpu *vcpu;
+	const struct ple_stats *stats;
+
+	len = snprintf(str, size, "\r\nVM_ID\tVCPU_ID\tPCPU_ID\tWINDOW\tEXITS\t\tDIRECTED\tGROWS\t\tSHRINKS");
+	if (len >= size) {
+		goto overflow;
+	}
+	size -= len;
+	str += len;
+
+	for (vm_id = 0U; vm_id < CONFIG_MAX_VM_NUM; vm_id++) {
+		vm = get_vm_from_vmid(vm_id);
+		if (is_poweroff_vm(vm)) {
+			continue;
+		}
+		foreach_vcpu(i, vm, vcpu) {
+			stats = &vcpu->arch.ple_stats;
+			len = snprintf(str, size, "\r\n%-8hu%-8hu%-8hu%-8u%-16lu%-16lu%-16lu%lu", vm_id, i,
+				pcpuid_from_vcpu(vcpu), vcpu->arch.ple_window, stats->exits, stats->directed_yields,
+				stats->window_grows, stats->window_shrinks);
+			if (len >= size) {
+				goto overflow;
+			}
+			size -= len;
+			str += len;
+		}
+	}
+	snprintf(str, size, "\r\n");
+	return;
+
+overflow:
+	printf("buffer size could not be enough! please check!\n");
+}
+
+static int32_t shell_show_ple_info(__unused int32_t argc, __unused char **argv)
+{
+	get_ple_info(shell_log_buf, SHELL_LOG_BUF_SIZE);
+	shell_puts(shell_log_buf);
+	return 0;
+}
+
 static void get_ptdev_info(char *str_arg, size_t str_max)
 {
 	char *str = str_arg;
@@ -80,6 +80,33 @@ struct shell {
 #define SHELL_CMD_INTERRUPT_PARAM	NULL
 #define SHELL_CMD_INTERRUPT_HELP	"List interrupt information per CPU"
 
+#define SHELL_CMD_TIMER			"timer"
+#define SHELL_CMD_TIMER_PARAM		NULL
+#define SHELL_CMD_TIMER_HELP		"List timer statistics per CPU: active timers and callback slack (us)"
+
+#define SHELL_CMD_EXT_CTX		"ext_ctx"
+#define SHELL_CMD_EXT_CTX_PARAM		NULL
+#define SHELL_CMD_EXT_CTX_HELP		"List vCPU switch-ins per CPU and how many XSAVE restores and MSR writes "\
+					"were skipped"
+
+#define SHELL_CMD_PAGE_POOL		"page_pool"
+#define SHELL_CMD_PAGE_POOL_PARAM	NULL
+#define SHELL_CMD_PAGE_POOL_HELP	"List occupancy and fragmentation of the hypervisor page pools"
+
+#define SHELL_CMD_EPT_STAT		"ept_stat"
+#define SHELL_CMD_EPT_STAT_PARAM	NULL
+#define SHELL_CMD_EPT_STAT_HELP		"List per VM how many EPT large pages were split and promoted back"
+
+#define SHELL_CMD_VMEXIT		"vmexit"
+#define SHELL_CMD_VMEXIT_PARAM		"<vm id> [vcpu id] [clear]"
+#define SHELL_CMD_VMEXIT_HELP		"Show VM exit counts, average handler cycles and handler latency "\
+					"histograms for a VM or one of its vCPUs"
+
+#define SHELL_CMD_PLE			"ple"
+#define SHELL_CMD_PLE_PARAM		NULL
+#define SHELL_CMD_PLE_HELP		"List the PAUSE-loop exiting window of each vCPU, its PAUSE-loop exits "\
+					"and how many of them yielded to another vCPU of the VM"
+
 #define SHELL_CMD_PTDEV			"pt"
 #define SHELL_CMD_PTDEV_PARAM		NULL
 #define SHELL_CMD_PTDEV_HELP		"Show pass-through device information"
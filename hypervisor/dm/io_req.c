@@ -598,10 +598,112 @@ hv_emulate_pio(struct acrn_vcpu *vcpu, struct io_request *io_req)
 }
 #endif
 
+/**
+ * @brief Look up the MMIO handler covering an access in the sorted index
+ *
+ * The caller must make sure the index is stable, either by holding
+ * emul_mmio_lock or by validating emul_mmio_seq afterwards.
+ *
+ * @retval 0 \p node is filled with the handler which covers the access.
+ * @retval -ENODEV No registered handler overlaps the access.
+ * @retval -EIO The access spans a registered region boundary.
+ */
+static int32_t lookup_mmio_node(struct acrn_vcpu *vcpu, uint64_t address, uint64_t size,
+		struct mem_io_node *node)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	const struct mem_io_node *mmio_node;
+	int32_t status = -ENODEV;
+	uint16_t lo, hi, mid, pos;
+	uint16_t nr = vm->nr_emul_mmio_sorted;
+
+	/* Fast path: device drivers tend to hit the same region again and again */
+	mmio_node = &(vm->emul_mmio[vcpu->mmio_hit_idx]);
+	if ((mmio_node->read_write != NULL) && (address >= mmio_node->range_start) &&
+			((address + size) <= mmio_node->range_end)) {
+		*node = *mmio_node;
+		status = 0;
+	} else if (nr > 0U) {
+		/* find the last region whose range_start <= address */
+		lo = 0U;
+		hi = nr;
+		while (lo < hi) {
+			mid = lo + ((hi - lo) >> 1U);
+			if (vm->emul_mmio[vm->emul_mmio_sorted[mid]].range_start <= address) {
+				lo = mid + 1U;
+			} else {
+				hi = mid;
+			}
+		}
+
+		if (lo > 0U) {
+			pos = vm->emul_mmio_sorted[lo - 1U];
+			mmio_node = &(vm->emul_mmio[pos]);
+			if ((address + size) <= mmio_node->range_end) {
+				*node = *mmio_node;
+				vcpu->mmio_hit_idx = pos;
+				status = 0;
+			} else if (address < mmio_node->range_end) {
+				status = -EIO;
+			} else {
+				/* no overlap with the preceding region */
+			}
+		}
+
+		/* the access must not run into the following region either */
+		if ((status != -EIO) && (lo < nr) &&
+				(vm->emul_mmio[vm->emul_mmio_sorted[lo]].range_start < (address + size))) {
+			status = -EIO;
+		}
+	} else {
+		/* no region registered */
+	}
+
+	return status;
+}
+
+static inline uint32_t mmio_index_read_begin(const struct acrn_vm *vm)
+{
+	uint32_t seq;
+
+	do {
+		seq = vm->emul_mmio_seq;
+		if ((seq & 1U) != 0U) {
+			asm_pause();
+		}
+	} while ((seq & 1U) != 0U);
+	cpu_memory_barrier();
+
+	return seq;
+}
+
+static inline bool mmio_index_read_retry(const struct acrn_vm *vm, uint32_t seq)
+{
+	cpu_memory_barrier();
+	return (vm->emul_mmio_seq != seq);
+}
+
+/* @pre vm->emul_mmio_lock is held */
+static inline void mmio_index_write_begin(struct acrn_vm *vm)
+{
+	vm->emul_mmio_seq++;
+	cpu_write_memory_barrier();
+}
+
+/* @pre vm->emul_mmio_lock is held */
+static inline void mmio_index_write_end(struct acrn_vm *vm)
+{
+	cpu_write_memory_barrier();
+	vm->emul_mmio_seq++;
+}
+
 /**
  * Use registered MMIO handlers on the given request if it falls in the range of
  * any of them.
  *
+ * The handler is looked up without emul_mmio_lock; the lock is only taken for
+ * handlers registered with hold_lock, in which case the lookup is revalidated.
+ *
  * @pre io_req->io_type == ACRN_IOREQ_TYPE_MMIO
  *
  * @retval 0 Successfully emulated by registered handlers.
@@ -611,58 +713,51 @@ hv_emulate_pio(struct acrn_vcpu *vcpu, struct io_request *io_req)
 static int32_t
 hv_emulate_mmio(struct acrn_vcpu *vcpu, struct io_request *io_req)
 {
-	int32_t status = -ENODEV;
-	bool hold_lock = true;
-	uint16_t idx;
-	uint64_t address, size, base, end;
+	int32_t status;
+	uint32_t seq;
+	uint64_t address, size;
 	struct acrn_mmio_request *mmio_req = &io_req->reqs.mmio_request;
-	struct mem_io_node *mmio_handler = NULL;
-	hv_mem_io_handler_t read_write = NULL;
-	void *handler_private_data = NULL;
+	struct mem_io_node mmio_node;
+	hv_mem_io_handler_t default_read_write = NULL;
 
 	if (is_service_vm(vcpu->vm) || is_prelaunched_vm(vcpu->vm)) {
-		read_write = mmio_default_access_handler;
+		default_read_write = mmio_default_access_handler;
 	}
 
 	address = mmio_req->address;
 	size = mmio_req->size;
 
-	spinlock_obtain(&vcpu->vm->emul_mmio_lock);
-	for (idx = 0U; idx <= vcpu->vm->nr_emul_mmio_regions; idx++) {
-		mmio_handler = &(vcpu->vm->emul_mmio[idx]);
-		if (mmio_handler->read_write != NULL) {
-			base = mmio_handler->range_start;
-			end = mmio_handler->range_end;
-
-			if (((address + size) <= base) || (address >= end)) {
-				continue;
-			} else {
-				 if ((address >= base) && ((address + size) <= end)) {
-					hold_lock = mmio_handler->hold_lock;
-					read_write = mmio_handler->read_write;
-					handler_private_data = mmio_handler->handler_private_data;
-				} else {
-					pr_fatal("Err MMIO, address:0x%lx, size:%x", address, size);
-					status = -EIO;
-				}
-				break;
-			}
+	do {
+		seq = mmio_index_read_begin(vcpu->vm);
+		status = lookup_mmio_node(vcpu, address, size, &mmio_node);
+	} while (mmio_index_read_retry(vcpu->vm, seq));
+
+	if (status == -EIO) {
+		pr_fatal("Err MMIO, address:0x%lx, size:%x", address, size);
+	} else if ((status == 0) && mmio_node.hold_lock) {
+		spinlock_obtain(&vcpu->vm->emul_mmio_lock);
+		/* The index may have changed since the lockless lookup */
+		if (vcpu->vm->emul_mmio_seq != seq) {
+			status = lookup_mmio_node(vcpu, address, size, &mmio_node);
 		}
-	}
-
-	if ((status == -ENODEV) && (read_write != NULL)) {
+		if (status == 0) {
+			status = mmio_node.read_write(io_req, mmio_node.handler_private_data);
+		} else if ((status == -ENODEV) && (default_read_write != NULL)) {
+			status = default_read_write(io_req, NULL);
+		} else {
+			/* the region was unregistered or changed to a conflicting one */
+		}
+		spinlock_release(&vcpu->vm->emul_mmio_lock);
+	} else if (status == 0) {
 		/* This mmio_handler will never modify once register, so we don't
 		 * need to hold the lock when handling the MMIO access.
 		 */
-		if (!hold_lock) {
-			spinlock_release(&vcpu->vm->emul_mmio_lock);
-		}
-		status = read_write(io_req, handler_private_data);
-		if (!hold_lock) {
-			spinlock_obtain(&vcpu->vm->emul_mmio_lock);
-		}
+		status = mmio_node.read_write(io_req, mmio_node.handler_private_data);
+	} else if (default_read_write != NULL) {
+		status = default_read_write(io_req, NULL);
+	} else {
+		/* no handler in HV, leave it to HSM */
 	}
-	spinlock_release(&vcpu->vm->emul_mmio_lock);
 
 	return status;
 }
@@ -825,6 +920,49 @@ static inline struct mem_io_node *find_free_mmio_node(struct acrn_vm *vm)
 	return mmio_node;
 }
 
+/**
+ * @brief Insert a MMIO node into the sorted index
+ *
+ * @pre vm->emul_mmio_lock is held and the index is being written
+ */
+static void mmio_index_insert(struct acrn_vm *vm, uint16_t node_idx)
+{
+	uint16_t pos = vm->nr_emul_mmio_sorted;
+	uint64_t start = vm->emul_mmio[node_idx].range_start;
+
+	while ((pos > 0U) && (vm->emul_mmio[vm->emul_mmio_sorted[pos - 1U]].range_start > start)) {
+		vm->emul_mmio_sorted[pos] = vm->emul_mmio_sorted[pos - 1U];
+		pos--;
+	}
+	vm->emul_mmio_sorted[pos] = node_idx;
+	vm->nr_emul_mmio_sorted++;
+}
+
+/**
+ * @brief Remove a MMIO node from the sorted index
+ *
+ * @pre vm->emul_mmio_lock is held and the index is being written
+ */
+static void mmio_index_remove(struct acrn_vm *vm, uint16_t node_idx)
+{
+	uint16_t pos;
+	bool found = false;
+
+	for (pos = 0U; pos < vm->nr_emul_mmio_sorted; pos++) {
+		if (found) {
+			vm->emul_mmio_sorted[pos - 1U] = vm->emul_mmio_sorted[pos];
+		} else if (vm->emul_mmio_sorted[pos] == node_idx) {
+			found = true;
+		} else {
+			/* keep searching */
+		}
+	}
+
+	if (found) {
+		vm->nr_emul_mmio_sorted--;
+	}
+}
+
 /**
  * @brief Register a MMIO handler
  *
@@ -847,12 +985,15 @@ void register_mmio_emulation_handler(struct acrn_vm *vm,
 		spinlock_obtain(&vm->emul_mmio_lock);
 		mmio_node = find_free_mmio_node(vm);
 		if (mmio_node != NULL) {
+			mmio_index_write_begin(vm);
 			/* Fill in information for this node */
 			mmio_node->hold_lock = hold_lock;
 			mmio_node->read_write = read_write;
 			mmio_node->handler_private_data = handler_private_data;
 			mmio_node->range_start = start;
 			mmio_node->range_end = end;
+			mmio_index_insert(vm, (uint16_t)(uint64_t)(mmio_node - &(vm->emul_mmio[0U])));
+			mmio_index_write_end(vm);
 		}
 		spinlock_release(&vm->emul_mmio_lock);
 	}
@@ -876,13 +1017,21 @@ void unregister_mmio_emulation_handler(struct acrn_vm *vm,
 	spinlock_obtain(&vm->emul_mmio_lock);
 	mmio_node = find_match_mmio_node(vm, start, end);
 	if (mmio_node != NULL) {
+		mmio_index_write_begin(vm);
+		mmio_index_remove(vm, (uint16_t)(uint64_t)(mmio_node - &(vm->emul_mmio[0U])));
 		(void)memset(mmio_node, 0U, sizeof(struct mem_io_node));
+		mmio_index_write_end(vm);
 	}
 	spinlock_release(&vm->emul_mmio_lock);
 }
 
 void deinit_emul_io(struct acrn_vm *vm)
 {
+	spinlock_obtain(&vm->emul_mmio_lock);
+	mmio_index_write_begin(vm);
+	vm->nr_emul_mmio_sorted = 0U;
 	(void)memset(vm->emul_mmio, 0U, sizeof(vm->emul_mmio));
+	mmio_index_write_end(vm);
+	spinlock_release(&vm->emul_mmio_lock);
 	(void)memset(vm->emul_pio, 0U, sizeof(vm->emul_pio));
 }
@@ -148,6 +148,7 @@ struct acrn_vcpu {
 
 	//struct instr_emul_ctxt inst_ctxt;
 	struct io_request req; /* used by io/ept emulation */
+	uint16_t mmio_hit_idx; /* emul_mmio index of the last MMIO handler hit */
 
 	uint64_t reg_cached;
 	uint64_t reg_updated;
@@ -146,6 +146,10 @@ struct acrn_vm {
 	spinlock_t emul_mmio_lock;	/* Used to protect emulation mmio_node concurrent access for a VM */
 	uint16_t nr_emul_mmio_regions;	/* max index of the emulated mmio_region */
 	struct mem_io_node emul_mmio[CONFIG_MAX_EMULATED_MMIO_REGIONS];
+	/* emul_mmio indexes sorted by range_start, looked up locklessly under emul_mmio_seq */
+	uint16_t emul_mmio_sorted[CONFIG_MAX_EMULATED_MMIO_REGIONS];
+	uint16_t nr_emul_mmio_sorted;	/* the number of valid entries in emul_mmio_sorted */
+	volatile uint32_t emul_mmio_seq;	/* odd while emul_mmio/emul_mmio_sorted is being updated */
 
 	struct vm_io_handler_desc emul_pio[EMUL_PIO_IDX_MAX];
 
@@ -417,6 +417,31 @@ struct ext_context {
 	uint64_t xcr0;
 };
 
+/*
+ * Extended context state still live in a pCPU's registers after a vCPU
+ * switched out. The hypervisor itself never touches these MSRs or the XSAVE
+ * state, so a vCPU switching in only needs to load what differs.
+ */
+struct ext_context_cache {
+	/* context whose XSAVE state was last saved on this pCPU, NULL if unknown */
+	const struct ext_context *xsave_owner;
+
+	/* MSR values currently loaded, valid once msrs_valid is set */
+	bool msrs_valid;
+	uint64_t ia32_star;
+	uint64_t ia32_cstar;
+	uint64_t ia32_lstar;
+	uint64_t ia32_fmask;
+	uint64_t ia32_kernel_gs_base;
+	uint64_t tsc_aux;
+
+	/* statistics */
+	uint64_t switch_in;
+	uint64_t xrstors_elided;
+	uint64_t msr_writes;
+	uint64_t msr_writes_elided;
+};
+
 struct cpu_context {
 	struct run_context run_ctx;
 	struct ext_context ext_ctx;
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2024 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef DIRTY_LOG_H
+#define DIRTY_LOG_H
+#include <types.h>
+#include <errno.h>
+#include <asm/lib/spinlock.h>
+
+struct acrn_vm;
+struct acrn_vcpu;
+struct pgtable;
+
+/*
+ * Dirty page logging of a VM. Writes are caught either by the CPU through
+ * page-modification logging (PML) into a per-vCPU log, or, when the CPU lacks
+ * PML, by removing the write access of the logged RAM in the EPT. Both end up
+ * in the bitmap, one bit per 4K page below gpa_limit.
+ */
+struct dirty_log {
+	spinlock_t lock;	/* serializes the hypercalls, never reinitialized */
+	bool enabled;
+	bool use_pml;
+	uint64_t *bitmap;
+	uint64_t gpa_limit;
+};
+
+#ifdef CONFIG_DIRTY_LOG_ENABLED
+void reserve_buffer_for_dirty_log(void);
+void init_dirty_log(struct acrn_vm *vm);
+
+/**
+ * @brief Start logging the writes to a guest RAM region
+ *
+ * @pre gpa and size are multiples of ACRN_DIRTY_LOG_ALIGN
+ * @return 0 on success, -EINVAL if the region is not mapped, -ENODEV if
+ *         the VM isn't post-launched, runs a secure world or nested guests,
+ *         or has passthrough devices
+ */
+int32_t dirty_log_enable(struct acrn_vm *vm, uint64_t gpa, uint64_t size);
+/**
+ * @brief Stop logging for the whole VM, give a guest RAM region its write access back
+ *
+ * @pre gpa and size are multiples of ACRN_DIRTY_LOG_ALIGN
+ * @return 0 on success, -EINVAL if the region is not mapped
+ */
+int32_t dirty_log_disable(struct acrn_vm *vm, uint64_t gpa, uint64_t size);
+/**
+ * @brief Report the pages of a region written since they were last reported
+ *
+ * Copies one bit per 4K page of [gpa, gpa + size) to bitmap_gpa of the
+ * Service VM. With clear, the reported pages are tracked again, and no write
+ * done after this function returns is missed.
+ *
+ * @pre gpa and size are multiples of ACRN_DIRTY_LOG_ALIGN
+ * @return 0 on success, -EINVAL if logging is off or the bitmap is not
+ *         mapped in the Service VM
+ */
+int32_t dirty_log_get(struct acrn_vm *vm, uint64_t gpa, uint64_t size,
+		struct acrn_vm *service_vm, uint64_t bitmap_gpa, bool clear);
+
+/* prepare_split hook of the EPT, see struct pgtable */
+void dirty_log_prepare_split(const struct pgtable *table, uint64_t gpa, uint64_t size, uint64_t *prot);
+/* Move the GPAs logged by the CPU into the dirty bitmap, runs on the pCPU of the vCPU */
+void dirty_log_drain_pml(struct acrn_vcpu *vcpu);
+/* Apply the logging mode of the VM to the VMCS, handles ACRN_REQUEST_DIRTY_LOG */
+void dirty_log_update_vmcs(struct acrn_vcpu *vcpu);
+/* @return true if the write fault at gpa was caused by the write protection for logging */
+bool dirty_log_handle_wp_fault(struct acrn_vcpu *vcpu, uint64_t gpa);
+#else
+static inline void reserve_buffer_for_dirty_log(void) {}
+static inline void init_dirty_log(__unused struct acrn_vm *vm) {}
+
+static inline int32_t dirty_log_enable(__unused struct acrn_vm *vm, __unused uint64_t gpa,
+		__unused uint64_t size)
+{
+	return -ENODEV;
+}
+
+static inline int32_t dirty_log_disable(__unused struct acrn_vm *vm, __unused uint64_t gpa,
+		__unused uint64_t size)
+{
+	return -ENODEV;
+}
+
+static inline int32_t dirty_log_get(__unused struct acrn_vm *vm, __unused uint64_t gpa,
+		__unused uint64_t size, __unused struct acrn_vm *service_vm,
+		__unused uint64_t bitmap_gpa, __unused bool clear)
+{
+	return -ENODEV;
+}
+
+static inline void dirty_log_prepare_split(__unused const struct pgtable *table, __unused uint64_t gpa,
+		__unused uint64_t size, __unused uint64_t *prot) {}
+static inline void dirty_log_drain_pml(__unused struct acrn_vcpu *vcpu) {}
+static inline void dirty_log_update_vmcs(__unused struct acrn_vcpu *vcpu) {}
+
+static inline bool dirty_log_handle_wp_fault(__unused struct acrn_vcpu *vcpu, __unused uint64_t gpa)
+{
+	return false;
+}
+#endif /* CONFIG_DIRTY_LOG_ENABLED */
+
+#endif /* DIRTY_LOG_H */
@@ -112,6 +112,83 @@ void ept_modify_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa,
  */
 void ept_del_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa,
 		uint64_t size);
+/**
+ * @brief Collapse split guest-physical memory mappings back into large pages
+ *
+ * Replace every PT page (and PD page) covering [gpa,gpa+size) whose entries
+ * map one contiguous host region with the same access right and memory type
+ * by a 2M (or 1G) page, as far as the large page policy of the VM allows.
+ * No 1G page is formed for a VM with a secure world, whose EPT shares the
+ * PD pages of the normal world.
+ *
+ * @param[in] vm the pointer that points to VM data structure
+ * @param[in] pml4_page The physical address of The EPTP
+ * @param[in] gpa The specified start guest physical address of guest
+ *                physical memory region to look at
+ * @param[in] size The size of guest physical memory region
+ */
+void ept_promote_mr(struct acrn_vm *vm, uint64_t *pml4_page, uint64_t gpa, uint64_t size);
+
+/**
+ * @brief A batch of EPT updates
+ *
+ * The updates are applied under a single hold of the VM's ept_lock. The
+ * guest TLB flush requests and the IOTLB invalidation for removed mappings
+ * are issued once, by ept_txn_commit.
+ */
+struct ept_txn {
+	struct acrn_vm *vm;
+	uint64_t *pml4_page;
+	bool modified;
+	uint64_t iotlb_start;	/* span of the removed or collapsed mappings */
+	uint64_t iotlb_end;
+	struct pgtable_free_list freed;	/* paging-structure pages unlinked by promotion */
+};
+
+/**
+ * @brief Start a batch of EPT updates, taking the VM's ept_lock
+ *
+ * @param[out] txn the batch to start
+ * @param[in] vm the pointer that points to VM data structure
+ * @param[in] pml4_page The physical address of The EPTP
+ */
+void ept_txn_begin(struct ept_txn *txn, struct acrn_vm *vm, uint64_t *pml4_page);
+/**
+ * @brief Map a guest-physical memory region as part of a batch
+ *
+ * Same as ept_add_mr, except that the guest is not flushed yet.
+ */
+void ept_txn_add_mr(struct ept_txn *txn, uint64_t hpa, uint64_t gpa, uint64_t size, uint64_t prot);
+/**
+ * @brief Update the access right or memory type of a region as part of a batch
+ *
+ * Same as ept_modify_mr, except that the guest is not flushed yet.
+ */
+void ept_txn_modify_mr(struct ept_txn *txn, uint64_t gpa, uint64_t size, uint64_t prot_set, uint64_t prot_clr);
+/**
+ * @brief Unmap a guest-physical memory region as part of a batch
+ *
+ * Same as ept_del_mr, except that the guest and the IOTLB are not flushed yet.
+ *
+ * @pre [gpa,gpa+size) has been mapped into host physical memory region
+ */
+void ept_txn_del_mr(struct ept_txn *txn, uint64_t gpa, uint64_t size);
+/**
+ * @brief Collapse split mappings back into large pages as part of a batch
+ *
+ * Same as ept_promote_mr, except that the guest and the IOTLB are not flushed
+ * yet. The unlinked paging-structure pages are freed by ept_txn_commit.
+ */
+void ept_txn_promote_mr(struct ept_txn *txn, uint64_t gpa, uint64_t size);
+/**
+ * @brief Finish a batch of EPT updates
+ *
+ * Release the ept_lock, then request one EPT flush on every vCPU and one
+ * IOTLB invalidation covering all removed mappings, if there were any.
+ * If promotion unlinked paging-structure pages, the EPT is flushed
+ * synchronously on the pCPUs of the VM before the pages are freed.
+ */
+void ept_txn_commit(struct ept_txn *txn);
 
 /**
  * @brief Flush address space from the page entry
@@ -132,6 +209,17 @@ void ept_flush_leaf_page(uint64_t *pge, uint64_t size);
  */
 void *get_eptp(struct acrn_vm *vm);
 
+/**
+ * @brief Get the VMCS EPT pointer value of the normal world of the vm
+ *
+ * @param[in] vm the pointer that points to VM data structure
+ *
+ * @return the EPTP with write-back paging-structure memory type and a 4-level
+ *         walk, and with the accessed/dirty flags enabled when the VM logs
+ *         dirty pages with PML.
+ */
+uint64_t get_nworld_eptp_value(const struct acrn_vm *vm);
+
 /**
  * @brief Walking through EPT table
  *
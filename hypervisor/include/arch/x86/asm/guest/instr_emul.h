@@ -86,12 +86,29 @@ struct instr_emul_vie {
 	uint64_t	gva;		/* saved gva for instruction emulation */
 };
 
+/* decoded instructions cached per vCPU */
+#define VIE_CACHE_SIZE	8U
+
+struct instr_emul_vie_cache_entry {
+	bool		valid;
+	bool		cs_d;		/* CS.D of the decode */
+	uint8_t		cpu_mode;	/* enum vm_cpu_mode of the decode */
+	uint64_t	rip_gla;	/* linear address of the instruction */
+	uint64_t	cr3;		/* guest CR3, including the PCID */
+	uint64_t	inst_gpa;	/* guest physical address the bytes were fetched from */
+	struct instr_emul_vie vie;	/* state right after decoding */
+};
+
 struct instr_emul_ctxt {
 	struct instr_emul_vie vie;
+
+	struct instr_emul_vie_cache_entry cache[VIE_CACHE_SIZE];
+	uint8_t		cache_next;	/* entry replaced on the next miss */
 };
 
 int32_t emulate_instruction(struct acrn_vcpu *vcpu);
 int32_t decode_instruction(struct acrn_vcpu *vcpu, bool full_decode);
 bool is_current_opcode_xchg(struct acrn_vcpu *vcpu);
+void invalidate_instr_cache(struct acrn_vcpu *vcpu);
 
 #endif
@@ -348,7 +348,8 @@ struct acrn_nested {
 	bool in_l2_guest;	/* To indicate if vCPU is currently in Guest mode (from L1's perspective) */
 } __aligned(PAGE_SIZE);
 
-void init_nested_vmx(__unused struct acrn_vm *vm);
+void init_nested_vmx(struct acrn_vm *vm);
+void deinit_nested_vmx(struct acrn_vm *vm);
 bool is_vcpu_in_l2_guest(struct acrn_vcpu *vcpu);
 bool is_vmx_msr(uint32_t msr);
 void init_vmx_msrs(struct acrn_vcpu *vcpu);
@@ -358,6 +359,7 @@ int32_t nested_vmexit_handler(struct acrn_vcpu *vcpu);
 struct acrn_nested {};
 
 static inline void init_nested_vmx(__unused struct acrn_vm *vm) {}
+static inline void deinit_nested_vmx(__unused struct acrn_vm *vm) {}
 static inline bool is_vcpu_in_l2_guest(__unused struct acrn_vcpu *vcpu) {
 	return false;
 }
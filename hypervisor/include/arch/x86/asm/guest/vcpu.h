@@ -107,6 +107,11 @@
 
 #define ACRN_REQUEST_SMP_CALL			11U
 
+/**
+ * @brief Request for applying the dirty page logging mode of the VM to the VMCS
+ */
+#define ACRN_REQUEST_DIRTY_LOG			12U
+
 /**
  * @}
  */
@@ -230,6 +235,31 @@ struct iwkey {
 	uint64_t integrity_key[2];
 };
 
+/*
+ * VM exit statistics, updated by vmexit_handler() on the pCPU the vCPU runs
+ * on. Readers on other pCPUs may see a snapshot that is a few exits apart
+ * between fields, which is fine for monitoring.
+ */
+struct vmexit_stats {
+	uint64_t count[NR_VMX_EXIT_REASONS];
+	uint64_t cycles[NR_VMX_EXIT_REASONS];
+	uint64_t hist[ACRN_VMEXIT_HIST_SLOTS][ACRN_VMEXIT_HIST_BUCKETS];
+};
+
+/*
+ * PAUSE-loop exiting window in TSC cycles. It shrinks when a PAUSE-loop exit
+ * finds a preempted vCPU of the same VM to yield to and grows when it doesn't.
+ */
+#define PLE_WINDOW_MIN		4096U
+#define PLE_WINDOW_MAX		(PLE_WINDOW_MIN << 6U)
+
+struct ple_stats {
+	uint64_t exits;
+	uint64_t directed_yields;	/* a preempted vCPU of the same VM was put ahead */
+	uint64_t window_grows;
+	uint64_t window_shrinks;
+};
+
 struct acrn_vcpu_arch {
 	/* vmcs region for this vcpu, MUST be 4KB-aligned. This is VMCS01 when nested VMX is enabled */
 	uint8_t vmcs[PAGE_SIZE];
@@ -240,6 +270,9 @@ struct acrn_vcpu_arch {
 	/* MSR bitmap region for this vcpu, MUST be 4-Kbyte aligned */
 	uint8_t msr_bitmap[PAGE_SIZE];
 
+	/* page-modification log for this vcpu, MUST be 4-Kbyte aligned */
+	uint64_t pml_log[VMX_PML_ENTRY_NUM] __aligned(PAGE_SIZE);
+
 	/* per vcpu lapic */
 	struct acrn_vlapic vlapic;
 
@@ -270,6 +303,10 @@ struct acrn_vcpu_arch {
 	bool irq_window_enabled;
 	bool emulating_lock;
 	bool xsave_enabled;
+	bool pml_enabled;
+	/* VMCLEARed on the pCPU the vCPU moved away from, VMLAUNCH it next */
+	bool vmcs_cleared;
+	bool vtimer_moved;
 
 	/* VCPU context state information */
 	uint32_t exit_reason;
@@ -300,6 +337,11 @@ struct acrn_vcpu_arch {
 	 * Bit 63:1 - Reserved.
 	 */
 	uint64_t iwkey_copy_status;
+
+	struct vmexit_stats exit_stats;
+
+	uint32_t ple_window;
+	struct ple_stats ple_stats;
 } __aligned(PAGE_SIZE);
 
 struct acrn_vm;
@@ -318,6 +360,7 @@ struct acrn_vcpu {
 
 	struct instr_emul_ctxt inst_ctxt;
 	struct io_request req; /* used by io/ept emulation */
+	uint16_t mmio_hit_idx; /* emul_mmio index of the last MMIO handler hit */
 
 	uint64_t reg_cached;
 	uint64_t reg_updated;
@@ -605,6 +648,7 @@ struct acrn_vcpu *get_ever_run_vcpu(uint16_t pcpu_id);
 
 void save_xsave_area(struct acrn_vcpu *vcpu, struct ext_context *ectx);
 void rstore_xsave_area(const struct acrn_vcpu *vcpu, const struct ext_context *ectx);
+void invalidate_ext_context_cache(const struct ext_context *ectx);
 void load_iwkey(struct acrn_vcpu *vcpu);
 
 /**
@@ -7,6 +7,9 @@
 #define VEPT_H
 
 #ifdef CONFIG_NVMX_ENABLED
+#include <list.h>
+#include <asm/lib/spinlock.h>
+#include <asm/guest/nested.h>
 
 #define RESERVED_BITS(start, end) (((1UL << (end - start + 1)) - 1) << start)
 #define IA32E_PML4E_RESERVED_BITS(phy_addr_width)	(RESERVED_BITS(3U, 7U) | RESERVED_BITS(phy_addr_width, 51U))
@@ -35,13 +38,40 @@ struct vept_desc {
 	 * Its PML4 address field is a HVA of the hypervisor.
 	 */
 	uint64_t shadow_eptp;
+	/*
+	 * VMCS12s referring to guest_eptp. The shadow EPT is kept when it drops
+	 * to 0, until the descriptor is reclaimed for another guest EPTP.
+	 */
 	uint32_t ref_count;
+	struct hlist_node hnode;	/* in the hash chain of guest_eptp */
+	struct list_head lru;		/* in vept_table.lru */
+	spinlock_t lock;		/* protects the shadow EPT entries */
+};
+
+/* Every VMCS12 cached by a vCPU can refer to its own guest EPTP */
+#define VEPT_DESC_NUM		(MAX_ACTIVE_VVMCS_NUM * MAX_VCPUS_PER_VM)
+#define VEPT_HASH_BITS		5U
+
+/*
+ * Shadow EPTs of a VM, looked up by guest EPTP. lock protects the hash
+ * chains, the LRU list and the reference counts. It's taken before the lock
+ * of a descriptor.
+ */
+struct vept_table {
+	spinlock_t lock;
+	struct hlist_head buckets[1U << VEPT_HASH_BITS];
+	struct list_head lru;		/* least recently used descriptor first */
+	struct vept_desc desc[VEPT_DESC_NUM];
 };
 
+struct acrn_vm;
+struct acrn_vcpu;
 void init_vept(void);
-uint64_t get_shadow_eptp(uint64_t guest_eptp);
-struct vept_desc *get_vept_desc(uint64_t guest_eptp);
-void put_vept_desc(uint64_t guest_eptp);
+void init_vept_table(struct acrn_vm *vm);
+void deinit_vept_table(struct acrn_vm *vm);
+uint64_t get_shadow_eptp(struct acrn_vm *vm, uint64_t guest_eptp);
+struct vept_desc *get_vept_desc(struct acrn_vm *vm, uint64_t guest_eptp);
+void put_vept_desc(struct acrn_vm *vm, uint64_t guest_eptp);
 bool handle_l2_ept_violation(struct acrn_vcpu *vcpu);
 int32_t invept_vmexit_handler(struct acrn_vcpu *vcpu);
 #else
@@ -32,6 +32,8 @@
 #ifdef CONFIG_HYPERV_ENABLED
 #include <asm/guest/hyperv.h>
 #endif
+#include <asm/guest/dirty_log.h>
+#include <asm/guest/vept.h>
 
 enum reset_mode {
 	POWER_ON_RESET,		/* reset by hardware Power-on */
@@ -111,6 +113,11 @@ struct vm_arch {
 	 */
 	void *sworld_eptp;
 	struct pgtable ept_pgtable;
+	struct pgtable_stats ept_stats;	/* large page splits and promotions of ept_pgtable */
+	struct dirty_log dirty_log;
+#ifdef CONFIG_NVMX_ENABLED
+	struct vept_table vept;		/* shadow EPTs for the L2 guests of this VM */
+#endif
 
 	struct acrn_vioapics vioapics;	/* Virtual IOAPIC/s */
 	struct acrn_vpic vpic;      /* Virtual PIC */
@@ -159,6 +166,10 @@ struct acrn_vm {
 	spinlock_t emul_mmio_lock;	/* Used to protect emulation mmio_node concurrent access for a VM */
 	uint16_t nr_emul_mmio_regions;	/* the emulated mmio_region number */
 	struct mem_io_node emul_mmio[CONFIG_MAX_EMULATED_MMIO_REGIONS];
+	/* emul_mmio indexes sorted by range_start, looked up locklessly under emul_mmio_seq */
+	uint16_t emul_mmio_sorted[CONFIG_MAX_EMULATED_MMIO_REGIONS];
+	uint16_t nr_emul_mmio_sorted;	/* the number of valid entries in emul_mmio_sorted */
+	volatile uint32_t emul_mmio_seq;	/* odd while emul_mmio/emul_mmio_sorted is being updated */
 
 	struct vm_io_handler_desc emul_pio[EMUL_PIO_IDX_MAX];
 
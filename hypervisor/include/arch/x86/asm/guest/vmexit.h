@@ -17,6 +17,8 @@ int32_t vmcall_vmexit_handler(struct acrn_vcpu *vcpu);
 int32_t cpuid_vmexit_handler(struct acrn_vcpu *vcpu);
 int32_t rdmsr_vmexit_handler(struct acrn_vcpu *vcpu);
 int32_t wrmsr_vmexit_handler(struct acrn_vcpu *vcpu);
+void get_vmexit_stats(const struct acrn_vcpu *vcpu, struct acrn_vmexit_stats *stats);
+void clear_vmexit_stats(struct acrn_vcpu *vcpu);
 
 extern void vm_exit(void);
 static inline uint64_t
@@ -32,6 +32,27 @@ struct page {
 	uint8_t contents[PAGE_SIZE];
 } __aligned(PAGE_SIZE);
 
+/* free pages a pCPU keeps in front of the pool bitmap */
+#define PAGE_MAGAZINE_SIZE	16U
+/* pages moved between a magazine and the bitmap under one pool lock */
+#define PAGE_MAGAZINE_BATCH	(PAGE_MAGAZINE_SIZE / 2U)
+
+#define MAX_PAGE_POOL_NUM	(CONFIG_MAX_VM_NUM + 2U)
+
+/*
+ * Per-pCPU cache of free pages of a pool. pages[0, nr_zeroed) are known to be
+ * zero filled, pages[nr_zeroed, count) are not. The lock is only contended
+ * when another pCPU reclaims the cached pages of an exhausted pool.
+ */
+struct page_magazine {
+	spinlock_t lock;
+	uint16_t count;
+	uint16_t nr_zeroed;
+	/* the pCPU allocated from the pool since it was (re)initialized */
+	bool active;
+	struct page *pages[PAGE_MAGAZINE_SIZE];
+};
+
 struct page_pool {
 	struct page *start_page;
 	spinlock_t lock;
@@ -40,8 +61,27 @@ struct page_pool {
 	uint64_t last_hint_id;
 
 	struct page *dummy_page;
+
+	/* below are only used by pools set up with init_page_pool() */
+	char name[16];
+	bool cached;
+	struct page_magazine mag[MAX_PCPU_NUM];
+};
+
+struct page_pool_stats {
+	uint64_t total;		/* pages managed by the pool */
+	uint64_t used;		/* pages handed out */
+	uint64_t cached;	/* free pages sitting in the per-pCPU magazines */
+	uint64_t zeroed;	/* cached pages that are already zero filled */
+	uint64_t free_extents;	/* runs of contiguous free pages in the bitmap */
+	uint64_t largest_extent;	/* pages in the longest such run */
 };
 
+void init_page_pool(struct page_pool *pool, const char *name, struct page *start_page,
+		uint64_t *bitmap, uint64_t page_num, struct page *dummy_page);
 struct page *alloc_page(struct page_pool *pool);
 void free_page(struct page_pool *pool, struct page *page);
+bool prezero_pool_pages(uint16_t pcpu_id);
+uint16_t get_page_pool_num(void);
+const char *get_page_pool_stats(uint16_t pool_id, struct page_pool_stats *stats);
 #endif /* PAGE_H */
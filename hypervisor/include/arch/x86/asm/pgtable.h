@@ -115,6 +115,11 @@
 /* End of ept_mem_type */
 
 #define EPT_MT_MASK		(7UL << EPT_MT_SHIFT)
+/* set by the CPU when EPTP enables the accessed and dirty flags */
+#define EPT_ACCESSED		(1UL << 8U)
+#define EPT_DIRTY		(1UL << 9U)
+/* ignored by the CPU: write access removed for dirty page logging */
+#define EPT_DIRTY_LOG_WP	(1UL << 52U)
 #define EPT_VE			(1UL << 63U)
 /* EPT leaf entry bits (bit 52 - bit 63) should be maksed  when calculate PFN */
 #define EPT_PFN_HIGH_MASK	0xFFF0000000000000UL
@@ -168,6 +173,14 @@ enum _page_table_level {
 	IA32E_PT = 3,
 };
 
+/* How often large pages of a page table were split and collapsed back */
+struct pgtable_stats {
+	uint64_t split_2m;
+	uint64_t split_1g;
+	uint64_t promoted_2m;
+	uint64_t promoted_1g;
+};
+
 struct pgtable {
 	uint64_t default_access_right;
 	uint64_t pgentry_present_mask;
@@ -176,6 +189,9 @@ struct pgtable {
 	void (*clflush_pagewalk)(const void *p);
 	void (*tweak_exe_right)(uint64_t *entry);
 	void (*recover_exe_right)(uint64_t *entry);
+	/* optional, called before the large page at vaddr is split, may adjust the new entries */
+	void (*prepare_split)(const struct pgtable *table, uint64_t vaddr, uint64_t size, uint64_t *prot);
+	struct pgtable_stats *stats;	/* optional, NULL if not tracked */
 };
 
 static inline bool pgentry_present(const struct pgtable *table, uint64_t pte)
@@ -318,6 +334,36 @@ static inline uint64_t pdpte_large(uint64_t pdpte)
 	return pdpte & PAGE_PSE;
 }
 
+/*
+ * Paging-structure pages the last pgtable_lookup_entry_cached() walk went
+ * through, so that looking up consecutive addresses only reads the last
+ * level. Only valid while the page table is not modified.
+ */
+struct pgtable_walk_cache {
+	uint64_t pd_tag;	/* address & PDPTE_MASK mapped by pd_page */
+	uint64_t *pd_page;
+	uint64_t pt_tag;	/* address & PDE_MASK mapped by pt_page */
+	uint64_t *pt_page;
+};
+
+static inline void pgtable_walk_cache_init(struct pgtable_walk_cache *cache)
+{
+	cache->pd_page = NULL;
+	cache->pt_page = NULL;
+}
+
+#define PGTABLE_FREE_LIST_SIZE	32U
+
+/*
+ * Paging-structure pages unlinked by pgtable_promote_map(). The hardware may
+ * still walk them until the TLBs are flushed, so they go back to the pool
+ * only after that.
+ */
+struct pgtable_free_list {
+	uint64_t *pages[PGTABLE_FREE_LIST_SIZE];
+	uint32_t count;
+};
+
 void init_sanitized_page(uint64_t *sanitized_page, uint64_t hpa);
 
 void *pgtable_create_root(const struct pgtable *table);
@@ -328,6 +374,8 @@ void *pgtable_create_trusty_root(const struct pgtable *table,
  */
 const uint64_t *pgtable_lookup_entry(uint64_t *pml4_page, uint64_t addr,
 		uint64_t *pg_size, const struct pgtable *table);
+const uint64_t *pgtable_lookup_entry_cached(uint64_t *pml4_page, uint64_t addr,
+		uint64_t *pg_size, const struct pgtable *table, struct pgtable_walk_cache *cache);
 
 void pgtable_add_map(uint64_t *pml4_page, uint64_t paddr_base,
 		uint64_t vaddr_base, uint64_t size,
@@ -335,6 +383,8 @@ void pgtable_add_map(uint64_t *pml4_page, uint64_t paddr_base,
 void pgtable_modify_or_del_map(uint64_t *pml4_page, uint64_t vaddr_base,
 		uint64_t size, uint64_t prot_set, uint64_t prot_clr,
 		const struct pgtable *table, uint32_t type);
+uint64_t pgtable_promote_map(uint64_t *pml4_page, uint64_t vaddr_base, uint64_t size,
+		const struct pgtable *table, bool promote_1g, struct pgtable_free_list *freed);
 /**
  * @}
  */
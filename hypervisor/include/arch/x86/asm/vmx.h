@@ -284,6 +284,12 @@
 #define VMX_EXIT_REASON_XRSTORS                                      0x00000040U
 #define VMX_EXIT_REASON_LOADIWKEY                                    0x00000045U
 
+/*
+ * According to "SDM APPENDIX C VMX BASIC EXIT REASONS",
+ * there are 65 Basic Exit Reasons.
+ */
+#define NR_VMX_EXIT_REASONS	70U
+
 /* VMX execution control bits (pin based) */
 #define VMX_PINBASED_CTLS_IRQ_EXIT     (1U<<0U)
 #define VMX_PINBASED_CTLS_NMI_EXIT     (1U<<3U)
@@ -353,6 +359,12 @@
 #define VMX_EPT_INVEPT_SINGLE_CONTEXT	(1UL << 25U)
 #define VMX_EPT_INVEPT_GLOBAL_CONTEXT	(1UL << 26U)
 
+/* EPTP bit 6: enable the accessed and dirty flags of EPT entries */
+#define VMX_EPTP_AD_ENABLE		(1UL << 6U)
+
+/* number of 8-byte GPA entries in the page-modification log */
+#define VMX_PML_ENTRY_NUM		512U
+
 #define VMX_VPID_TYPE_INDIVIDUAL_ADDR	0UL
 #define VMX_VPID_TYPE_SINGLE_CONTEXT	1UL
 #define VMX_VPID_TYPE_ALL_CONTEXT	2UL
@@ -57,6 +57,7 @@ struct iommu_domain {
 	uint16_t vm_id;
 	uint32_t addr_width;   /* address width of the domain */
 	uint64_t trans_table_ptr;
+	uint32_t dev_count;	/* devices attached by move_pt_device() */
 };
 
 union source {
@@ -510,6 +511,20 @@ struct dmar_entry {
 	uint64_t hi_64;
 };
 
+#define DMAR_QI_BATCH_SIZE	16U
+
+struct dmar_drhd_rt;
+
+/*
+ * Invalidation descriptors collected for one DMAR unit and submitted behind a
+ * single wait descriptor. Meant to live on the caller's stack.
+ */
+struct dmar_qi_batch {
+	struct dmar_drhd_rt *dmar_unit;
+	uint16_t num;
+	struct dmar_entry desc[DMAR_QI_BATCH_SIZE];
+};
+
 union dmar_ir_entry {
 	struct dmar_entry value;
 
@@ -600,7 +615,18 @@ struct iommu_domain;
  * @pre domain != NULL
  *
  */
-int32_t move_pt_device(const struct iommu_domain *from_domain, const struct iommu_domain *to_domain, uint8_t bus, uint8_t devfun);
+int32_t move_pt_device(struct iommu_domain *from_domain, struct iommu_domain *to_domain, uint8_t bus, uint8_t devfun);
+
+/**
+ * @brief Check if devices are assigned to an iommu domain.
+ *
+ * @param[in] domain iommu domain to check, may be NULL
+ *
+ * @retval true if at least one device is attached to \p domain
+ * @retval false otherwise
+ *
+ */
+bool iommu_domain_has_devices(const struct iommu_domain *domain);
 
 /**
  * @brief Create a iommu domain for a VM specified by vm_id.
@@ -710,6 +736,60 @@ int32_t dmar_assign_irte(const struct intr_source *intr_src, union dmar_ir_entry
  */
 void dmar_free_irte(const struct intr_source *intr_src, uint16_t index);
 
+/**
+ * @brief Free IRTE for Interrupt Remapping Table, deferring the invalidation.
+ *
+ * Same as dmar_free_irte, except that the interrupt entry cache invalidation is
+ * only added to \p batch. Invalidations of adjacent IRTEs are merged into one
+ * masked request, so freeing all vectors of a device costs a single wait.
+ *
+ * @param[in] intr_src filled with type of interrupt source and the source
+ * @param[in] index into Interrupt Remapping Table
+ * @param[inout] batch the batch the invalidation is queued on
+ *
+ * @pre batch != NULL
+ * @post the caller has to call dmar_qi_batch_flush before the IRTE is known to be dead
+ *
+ */
+void dmar_free_irte_batch(const struct intr_source *intr_src, uint16_t index, struct dmar_qi_batch *batch);
+
+/**
+ * @brief Init an empty batch of invalidation requests.
+ *
+ * @param[out] batch the batch to init
+ *
+ * @pre batch != NULL
+ *
+ */
+void dmar_qi_batch_init(struct dmar_qi_batch *batch);
+
+/**
+ * @brief Submit all queued invalidation requests of a batch and wait once.
+ *
+ * Does nothing if the batch is empty. The batch is empty again afterwards.
+ *
+ * @param[inout] batch the batch to flush
+ *
+ * @pre batch != NULL
+ *
+ */
+void dmar_qi_batch_flush(struct dmar_qi_batch *batch);
+
+/**
+ * @brief Invalidate the IOTLB entries of an iommu domain for a GPA range.
+ *
+ * Page-selective invalidations with address masks are used where the IOMMU
+ * supports them, on each DMAR unit that is not ignored.
+ *
+ * @param[in] domain iommu domain whose translations changed
+ * @param[in] gpa start of the guest physical range
+ * @param[in] size size of the range in bytes
+ *
+ * @pre domain != NULL
+ *
+ */
+void iommu_flush_iotlb_range(const struct iommu_domain *domain, uint64_t gpa, uint64_t size);
+
 /**
  * @brief Flash cacheline(s) for a specific address with specific size.
  *
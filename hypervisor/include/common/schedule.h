@@ -53,6 +53,8 @@ struct sched_params {
 struct thread_object;
 typedef void (*thread_entry_t)(struct thread_object *obj);
 typedef void (*switch_t)(struct thread_object *obj);
+typedef bool (*can_migrate_t)(const struct thread_object *obj, uint16_t pcpu_id);
+typedef void (*migrate_t)(struct thread_object *obj, uint16_t from_pcpu_id);
 struct thread_object {
 	char name[16];
 	uint16_t pcpu_id;
@@ -65,6 +67,16 @@ struct thread_object {
 	switch_t switch_out;
 	switch_t switch_in;
 
+	/*
+	 * Load balancing, a thread object without can_migrate stays on its pCPU.
+	 * migrate moves the arch state, it runs on the new pCPU without any
+	 * scheduler lock held while the thread object is in no runqueue.
+	 */
+	can_migrate_t can_migrate;
+	migrate_t migrate;
+	volatile bool migrating;
+	uint64_t last_migration;	/* cpu_ticks() when it moved last */
+
 	uint8_t data[THREAD_DATA_SIZE];
 };
 
@@ -75,6 +87,11 @@ struct sched_control {
 	spinlock_t scheduler_lock;	/* to protect sched_control and thread_object */
 	struct acrn_scheduler *scheduler;
 	void *priv;
+
+	/* thread objects in the runqueue, the running one included, kept by schedulers with steal */
+	uint32_t nr_queued;
+	uint64_t last_balance;		/* cpu_ticks() of the last attempt to pull a thread object */
+	uint64_t nr_pulled;		/* thread objects moved here from other pCPUs */
 };
 
 #define SCHEDULER_MAX_NUMBER 4U
@@ -93,8 +110,12 @@ struct acrn_scheduler {
 	void	(*wake)(struct thread_object *obj);
 	/* yield current thread object */
 	void	(*yield)(struct sched_control *ctl);
-	/* prioritize the thread object */
-	void	(*prioritize)(struct thread_object *obj);
+	/* prioritize the thread object, lead gets the CPU time in ticks it is given ahead */
+	bool	(*prioritize)(struct thread_object *obj, uint64_t *lead);
+	/* charge the thread object for CPU time in ticks it gave to another one */
+	void	(*charge)(struct thread_object *obj, uint64_t ticks);
+	/* take a waiting thread object that may move to pcpu_id off the runqueue */
+	struct thread_object* (*steal)(struct sched_control *ctl, uint16_t pcpu_id);
 	/* deinit private data of scheduler */
 	void	(*deinit_data)(struct thread_object *obj);
 	/* deinit scheduler */
@@ -145,8 +166,12 @@ void sleep_thread(struct thread_object *obj);
 void sleep_thread_sync(struct thread_object *obj);
 void wake_thread(struct thread_object *obj);
 void yield_current(void);
+bool yield_to(struct thread_object *obj);
 void schedule(void);
 
+bool sched_can_steal(const struct thread_object *obj, uint16_t pcpu_id);
+bool sched_balance(uint16_t pcpu_id);
+
 void arch_switch_to(void *prev_sp, void *next_sp);
 void run_idle_thread(void);
 #endif /* SCHEDULE_H */
@@ -7,7 +7,7 @@
 #ifndef COMMON_TIMER_H
 #define COMMON_TIMER_H
 
-#include <list.h>
+#include <rbtree.h>
 #include <ticks.h>
 
 /**
@@ -27,18 +27,33 @@ enum tick_mode {
 	TICK_MODE_PERIODIC,	/**< periodic mode */
 };
 
+/**
+ * @brief Statistics of the timers on one pCPU
+ */
+struct timer_stats {
+	uint32_t nr_active;		/**< timers in the timer tree */
+	uint32_t max_active;		/**< highest nr_active seen */
+	uint64_t added;			/**< timers added, including periodic re-arms */
+	uint64_t expired;		/**< timer callbacks run */
+	uint64_t deferred;		/**< softirq passes that hit MAX_TIMER_ACTIONS */
+	uint64_t total_slack;		/**< sum of callback run time - deadline, in CPU ticks */
+	uint64_t max_slack;		/**< largest callback run time - deadline, in CPU ticks */
+};
+
 /**
  * @brief Definition of timers for per-cpu
  */
 struct per_cpu_timers {
-	struct list_head timer_list;	/**< it's for runtime active timer list */
+	struct rb_root timer_tree;	/**< runtime active timers, sorted by deadline */
+	struct timer_stats stats;	/**< statistics of the timers */
 };
 
 /**
  * @brief Definition of timer
  */
 struct hv_timer {
-	struct list_head node;		/**< link all timers */
+	struct rb_node node;		/**< node in the timer tree of pcpu_id */
+	uint16_t pcpu_id;		/**< pCPU the timer was added on */
 	enum tick_mode mode;		/**< timer mode: one-shot or periodic */
 	uint64_t timeout;		/**< tsc deadline to interrupt */
 	uint64_t period_in_cycle;	/**< period of the periodic timer in CPU ticks */
@@ -57,8 +72,8 @@ struct hv_timer {
  * @param[in] timeout tsc deadline to interrupt.
  * @param[in] period_in_cycle period of the periodic timer in unit of TSC cycles.
  *
- * @remark Don't initialize a timer twice if it has been added to the timer list
- *         after calling add_timer. If you want to, delete the timer from the list first.
+ * @remark Don't initialize a timer twice if it has been added to the timer tree
+ *         after calling add_timer. If you want to, delete the timer first.
  */
 void initialize_timer(struct hv_timer *timer,
 		      timer_handle_t func, void *priv_data,
@@ -76,11 +91,11 @@ void initialize_timer(struct hv_timer *timer,
 bool timer_expired(const struct hv_timer *timer, uint64_t now, uint64_t *delta);
 
 /**
- * @brief Check if a timer is active (in the timer list) or not.
+ * @brief Check if a timer is active (in the timer tree) or not.
  *
  * @param[in] timer Pointer to timer.
  *
- * @retval true if the timer is in timer list, false otherwise.
+ * @retval true if the timer is in the timer tree, false otherwise.
  */
 bool timer_is_started(const struct hv_timer *timer);
 
@@ -114,6 +129,15 @@ int32_t add_timer(struct hv_timer *timer);
  */
 void del_timer(struct hv_timer *timer);
 
+/**
+ * @brief Get the timer statistics of a pCPU.
+ *
+ * @param[in] pcpu_id ID of the pCPU.
+ *
+ * @return Pointer to the statistics, updated as the timers run.
+ */
+const struct timer_stats *get_timer_stats(uint16_t pcpu_id);
+
 /**
  * @brief Initialize timer.
  */
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2024 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef RBTREE_H_
+#define RBTREE_H_
+
+#include <types.h>
+#include <list.h>
+
+/*
+ * Intrusive red-black tree. The user embeds struct rb_node in its own
+ * structure, walks the tree itself to find where a new node goes (so the
+ * comparison stays with the user), then links it with rb_link_node() and
+ * rebalances with rb_insert_color(). The leftmost node is cached so that
+ * the smallest key is found in O(1).
+ */
+struct rb_node {
+	struct rb_node *parent;
+	struct rb_node *left;
+	struct rb_node *right;
+	bool red;
+};
+
+struct rb_root {
+	struct rb_node *node;		/* root of the tree */
+	struct rb_node *leftmost;	/* cached first node */
+};
+
+static inline void rb_init_root(struct rb_root *root)
+{
+	root->node = NULL;
+	root->leftmost = NULL;
+}
+
+/* A node that is not in any tree points to itself. */
+static inline void rb_init_node(struct rb_node *node)
+{
+	node->parent = node;
+	node->left = NULL;
+	node->right = NULL;
+	node->red = false;
+}
+
+static inline bool rb_node_empty(const struct rb_node *node)
+{
+	return (node->parent == node);
+}
+
+static inline struct rb_node *rb_first(const struct rb_root *root)
+{
+	return root->leftmost;
+}
+
+/* Put node at *link, a NULL child pointer of parent (or the root). */
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **link)
+{
+	node->parent = parent;
+	node->left = NULL;
+	node->right = NULL;
+	*link = node;
+}
+
+/*
+ * Rebalance the tree after rb_link_node(). leftmost tells whether the
+ * node was linked left of every other node.
+ */
+void rb_insert_color(struct rb_root *root, struct rb_node *node, bool leftmost);
+void rb_erase(struct rb_root *root, struct rb_node *node);
+struct rb_node *rb_next(const struct rb_node *node);
+
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+
+#endif /* RBTREE_H_ */
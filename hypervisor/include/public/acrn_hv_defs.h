@@ -60,6 +60,7 @@
 #define HC_VM_SET_MEMORY_REGIONS    BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x02UL)
 #define HC_VM_WRITE_PROTECT_PAGE    BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x03UL)
 #define HC_SETUP_SBUF               BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x04UL)
+#define HC_VM_DIRTY_LOG             BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x05UL)
 
 /* PCI assignment*/
 #define HC_ID_PCI_BASE              0x50UL
@@ -80,6 +81,7 @@
 #define HC_SETUP_HV_NPK_LOG         BASE_HC_ID(HC_ID, HC_ID_DBG_BASE + 0x01UL)
 #define HC_PROFILING_OPS            BASE_HC_ID(HC_ID, HC_ID_DBG_BASE + 0x02UL)
 #define HC_GET_HW_INFO              BASE_HC_ID(HC_ID, HC_ID_DBG_BASE + 0x03UL)
+#define HC_GET_VMEXIT_STATS         BASE_HC_ID(HC_ID, HC_ID_DBG_BASE + 0x04UL)
 
 /* Trusty */
 #define HC_ID_TRUSTY_BASE           0x70UL
@@ -186,6 +188,48 @@ struct wp_data {
 	uint64_t gpa;
 } __aligned(8);
 
+#define ACRN_DIRTY_LOG_ENABLE		0U
+#define ACRN_DIRTY_LOG_DISABLE		1U
+#define ACRN_DIRTY_LOG_GET		2U
+
+/* ACRN_DIRTY_LOG_GET: start tracking the reported pages again */
+#define ACRN_DIRTY_LOG_CLEAR		(1U << 0U)
+
+/* gpa and size of a dirty log request must be multiples of this */
+#define ACRN_DIRTY_LOG_ALIGN		(64UL * 4096UL)
+
+/**
+ * @brief Dirty page logging of a User VM
+ *
+ * the parameter for HC_VM_DIRTY_LOG hypercall
+ *
+ * ACRN_DIRTY_LOG_ENABLE starts tracking writes to the RAM in [gpa, gpa + size);
+ * it may be issued once per RAM region. ACRN_DIRTY_LOG_GET writes one bit per
+ * 4K page of [gpa, gpa + size) to the bitmap, set for the pages written since
+ * they were last reported. ACRN_DIRTY_LOG_DISABLE stops logging for the VM
+ * and gives [gpa, gpa + size) its write access back.
+ *
+ * Logging is refused for VMs with a secure world, nested VMX or passthrough
+ * devices: the DMA writes of a passthrough device go through the EPT without
+ * being logged.
+ */
+struct acrn_dirty_log {
+	/** ACRN_DIRTY_LOG_ENABLE, ACRN_DIRTY_LOG_DISABLE or ACRN_DIRTY_LOG_GET */
+	uint32_t cmd;
+
+	/** ACRN_DIRTY_LOG_CLEAR for ACRN_DIRTY_LOG_GET */
+	uint32_t flags;
+
+	/** guest physical address of the first page */
+	uint64_t gpa;
+
+	/** size of the guest physical memory region */
+	uint64_t size;
+
+	/** Service VM guest physical address of the bitmap, for ACRN_DIRTY_LOG_GET */
+	uint64_t bitmap_gpa;
+} __aligned(8);
+
 /**
  * Setup parameter for share buffer, used for HC_SETUP_SBUF hypercall
  */
@@ -233,6 +277,60 @@ struct acrn_hw_info {
 	uint16_t reserved[3];
 } __aligned(8);
 
+#define ACRN_VMEXIT_REASON_MAX		80U
+#define ACRN_VMEXIT_HIST_SLOTS		16U
+#define ACRN_VMEXIT_HIST_BUCKETS	20U
+/* Cycles covered by histogram bucket 0; each following bucket doubles it */
+#define ACRN_VMEXIT_HIST_SHIFT		8U
+
+#define ACRN_VMEXIT_STATS_ALL_VCPUS	0xFFFFU
+#define ACRN_VMEXIT_STATS_CLEAR		(1U << 0U)
+
+/**
+ * @brief VM exit statistics of one vCPU, or of all vCPUs of a VM
+ *
+ * the parameter for HC_GET_VMEXIT_STATS hypercall
+ *
+ * count[] and cycles[] are indexed by VMX basic exit reason. Handler latency
+ * histograms are kept for the most frequent exit reasons only, hist_reason[]
+ * tells which reason each row of hist[] belongs to. Bucket 0 counts exits
+ * handled in less than (1 << ACRN_VMEXIT_HIST_SHIFT) TSC cycles, bucket i
+ * those handled in [1 << (ACRN_VMEXIT_HIST_SHIFT + i - 1),
+ * 1 << (ACRN_VMEXIT_HIST_SHIFT + i)) cycles and the last bucket everything
+ * slower.
+ */
+struct acrn_vmexit_stats {
+	/** vCPU to report, or ACRN_VMEXIT_STATS_ALL_VCPUS for the whole VM */
+	uint16_t vcpu_id;
+
+	/** ACRN_VMEXIT_STATS_CLEAR to reset the counters after reading them */
+	uint16_t flags;
+
+	/** number of valid entries in count[] and cycles[] */
+	uint16_t nr_reasons;
+
+	/** number of valid rows in hist[] */
+	uint16_t nr_hist;
+
+	/** TSC frequency, to convert cycles to time */
+	uint32_t tsc_khz;
+
+	/** Reserved */
+	uint32_t reserved;
+
+	/** exit reason of each row of hist[] */
+	uint16_t hist_reason[ACRN_VMEXIT_HIST_SLOTS];
+
+	/** number of exits per reason */
+	uint64_t count[ACRN_VMEXIT_REASON_MAX];
+
+	/** TSC cycles spent in the exit handler per reason */
+	uint64_t cycles[ACRN_VMEXIT_REASON_MAX];
+
+	/** log2 histograms of the exit handler latency */
+	uint64_t hist[ACRN_VMEXIT_HIST_SLOTS][ACRN_VMEXIT_HIST_BUCKETS];
+} __aligned(8);
+
 /**
  * Gpa to hpa translation parameter, used for HC_VM_GPA2HPA hypercall
  */
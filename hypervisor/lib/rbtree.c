@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2024 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <types.h>
+#include <rbtree.h>
+
+static inline bool rb_is_red(const struct rb_node *node)
+{
+	return ((node != NULL) && node->red);
+}
+
+static void rb_set_child(struct rb_root *root, struct rb_node *parent,
+		struct rb_node *old, struct rb_node *new_node)
+{
+	if (parent == NULL) {
+		root->node = new_node;
+	} else if (parent->left == old) {
+		parent->left = new_node;
+	} else {
+		parent->right = new_node;
+	}
+}
+
+static void rb_rotate_left(struct rb_root *root, struct rb_node *x)
+{
+	struct rb_node *y = x->right;
+
+	x->right = y->left;
+	if (y->left != NULL) {
+		y->left->parent = x;
+	}
+	y->parent = x->parent;
+	rb_set_child(root, x->parent, x, y);
+	y->left = x;
+	x->parent = y;
+}
+
+static void rb_rotate_right(struct rb_root *root, struct rb_node *x)
+{
+	struct rb_node *y = x->left;
+
+	x->left = y->right;
+	if (y->right != NULL) {
+		y->right->parent = x;
+	}
+	y->parent = x->parent;
+	rb_set_child(root, x->parent, x, y);
+	y->right = x;
+	x->parent = y;
+}
+
+void rb_insert_color(struct rb_root *root, struct rb_node *node, bool leftmost)
+{
+	struct rb_node *z = node, *p, *g, *u;
+
+	if (leftmost) {
+		root->leftmost = node;
+	}
+
+	z->red = true;
+	p = z->parent;
+	while (rb_is_red(p)) {
+		/* p is red, so it's not the root and g exists */
+		g = p->parent;
+		if (p == g->left) {
+			u = g->right;
+			if (rb_is_red(u)) {
+				p->red = false;
+				u->red = false;
+				g->red = true;
+				z = g;
+			} else {
+				if (z == p->right) {
+					z = p;
+					rb_rotate_left(root, z);
+					p = z->parent;
+				}
+				p->red = false;
+				g->red = true;
+				rb_rotate_right(root, g);
+			}
+		} else {
+			u = g->left;
+			if (rb_is_red(u)) {
+				p->red = false;
+				u->red = false;
+				g->red = true;
+				z = g;
+			} else {
+				if (z == p->left) {
+					z = p;
+					rb_rotate_right(root, z);
+					p = z->parent;
+				}
+				p->red = false;
+				g->red = true;
+				rb_rotate_left(root, g);
+			}
+		}
+		p = z->parent;
+	}
+	root->node->red = false;
+}
+
+struct rb_node *rb_next(const struct rb_node *node)
+{
+	const struct rb_node *n = node;
+	struct rb_node *next;
+
+	if (n->right != NULL) {
+		next = n->right;
+		while (next->left != NULL) {
+			next = next->left;
+		}
+	} else {
+		next = n->parent;
+		while ((next != NULL) && (n == next->right)) {
+			n = next;
+			next = n->parent;
+		}
+	}
+
+	return next;
+}
+
+/*
+ * Restore the black height after a black node was removed. x (may be
+ * NULL) took the place of the removed node under parent.
+ */
+static void rb_erase_color(struct rb_root *root, struct rb_node *node, struct rb_node *parent)
+{
+	struct rb_node *x = node, *p = parent, *w;
+
+	while ((x != root->node) && !rb_is_red(x)) {
+		if (x == p->left) {
+			w = p->right;
+			if (w->red) {
+				w->red = false;
+				p->red = true;
+				rb_rotate_left(root, p);
+				w = p->right;
+			}
+			if (!rb_is_red(w->left) && !rb_is_red(w->right)) {
+				w->red = true;
+				x = p;
+				p = x->parent;
+			} else {
+				if (!rb_is_red(w->right)) {
+					w->left->red = false;
+					w->red = true;
+					rb_rotate_right(root, w);
+					w = p->right;
+				}
+				w->red = p->red;
+				p->red = false;
+				w->right->red = false;
+				rb_rotate_left(root, p);
+				x = root->node;
+			}
+		} else {
+			w = p->left;
+			if (w->red) {
+				w->red = false;
+				p->red = true;
+				rb_rotate_right(root, p);
+				w = p->left;
+			}
+			if (!rb_is_red(w->left) && !rb_is_red(w->right)) {
+				w->red = true;
+				x = p;
+				p = x->parent;
+			} else {
+				if (!rb_is_red(w->left)) {
+					w->right->red = false;
+					w->red = true;
+					rb_rotate_left(root, w);
+					w = p->left;
+				}
+				w->red = p->red;
+				p->red = false;
+				w->left->red = false;
+				rb_rotate_right(root, p);
+				x = root->node;
+			}
+		}
+	}
+
+	if (x != NULL) {
+		x->red = false;
+	}
+}
+
+void rb_erase(struct rb_root *root, struct rb_node *node)
+{
+	struct rb_node *y, *x, *x_parent;
+	bool removed_red;
+
+	if (root->leftmost == node) {
+		root->leftmost = rb_next(node);
+	}
+
+	removed_red = node->red;
+	if (node->left == NULL) {
+		x = node->right;
+		x_parent = node->parent;
+		rb_set_child(root, node->parent, node, x);
+		if (x != NULL) {
+			x->parent = x_parent;
+		}
+	} else if (node->right == NULL) {
+		x = node->left;
+		x_parent = node->parent;
+		rb_set_child(root, node->parent, node, x);
+		x->parent = x_parent;
+	} else {
+		/* replace node by its successor y, which has no left child */
+		y = node->right;
+		while (y->left != NULL) {
+			y = y->left;
+		}
+		removed_red = y->red;
+		x = y->right;
+		if (y->parent == node) {
+			x_parent = y;
+		} else {
+			x_parent = y->parent;
+			rb_set_child(root, y->parent, y, x);
+			if (x != NULL) {
+				x->parent = x_parent;
+			}
+			y->right = node->right;
+			y->right->parent = y;
+		}
+		rb_set_child(root, node->parent, node, y);
+		y->parent = node->parent;
+		y->left = node->left;
+		y->left->parent = y;
+		y->red = node->red;
+	}
+
+	if (!removed_red) {
+		rb_erase_color(root, x, x_parent);
+	}
+
+	rb_init_node(node);
+}
@@ -198,6 +198,7 @@ BOOT_C_SRCS += release/profiling.c
 BOOT_C_SRCS += release/trace.c
 BOOT_C_SRCS += lib/sprintf.c
 BOOT_C_SRCS += lib/string.c
+BOOT_C_SRCS += lib/rbtree.c
 BOOT_C_SRCS += common/timer.c
 BOOT_C_SRCS += common/irq.c
 BOOT_C_SRCS += common/sbuf.c
@@ -171,6 +171,7 @@ LIB_C_SRCS += lib/crypto/mbedtls/sha256.c
 LIB_C_SRCS += lib/crypto/mbedtls/md.c
 LIB_C_SRCS += lib/crypto/mbedtls/md_wrap.c
 LIB_C_SRCS += lib/sprintf.c
+LIB_C_SRCS += lib/rbtree.c
 LIB_C_SRCS += arch/x86/lib/memory.c
 ifdef STACK_PROTECTOR
 LIB_C_SRCS += lib/stack_protector.c
@@ -282,6 +283,9 @@ VP_BASE_C_SRCS += arch/x86/guest/ucode.c
 ifeq ($(CONFIG_HYPERV_ENABLED),y)
 VP_BASE_C_SRCS += arch/x86/guest/hyperv.c
 endif
+ifeq ($(CONFIG_DIRTY_LOG_ENABLED),y)
+VP_BASE_C_SRCS += arch/x86/guest/dirty_log.c
+endif
 ifeq ($(CONFIG_NVMX_ENABLED),y)
 VP_BASE_C_SRCS += arch/x86/guest/nested.c
 VP_BASE_C_SRCS += arch/x86/guest/vept.c
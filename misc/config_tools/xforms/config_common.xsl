@@ -72,6 +72,14 @@
       <xsl:with-param name="value" select="'y'" />
     </xsl:call-template>
 
+    <xsl:call-template name="boolean-by-key">
+      <xsl:with-param name="key" select="'SCHED_BALANCE_ENABLED'" />
+    </xsl:call-template>
+
+    <xsl:call-template name="boolean-by-key">
+      <xsl:with-param name="key" select="'DIRTY_LOG_ENABLED'" />
+    </xsl:call-template>
+
     <xsl:call-template name="boolean-by-key">
       <xsl:with-param name="key" select="'SPLIT_LOCK_DETECTION_ENABLED'" />
     </xsl:call-template>
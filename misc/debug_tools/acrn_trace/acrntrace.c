@@ -47,7 +47,7 @@ static void display_usage(void)
 	       "[Usage] acrntrace [-i period] [-t max_time] [-ch]\n\n"
 	       "[Options]\n"
 	       "\t-h: print this message\n"
-	       "\t-i: period_in_ms: specify polling interval [1-999]\n"
+	       "\t-i: period_in_ms: specify the longest polling interval [1-999]\n"
 	       "\t-t: max time to capture trace data (in second)\n"
 	       "\t-c: clear the buffered old data (deprecated)\n"
 	       "\t-r: capture the buffered old data instead of clearing it\n"
@@ -217,12 +217,28 @@ static int create_trace_file_dir(char *dir)
 	return err;
 }
 
+/* Report entries the hypervisor overwrote since the last check */
+static int check_overrun(param_t *param)
+{
+	uint32_t cnt = param->sbuf->overrun_cnt;
+
+	if (cnt == param->overrun_cnt)
+		return 0;
+
+	pr_err("cpu %u: %u trace entries overwritten, consider a smaller '-i'\n",
+		param->devid, cnt - param->overrun_cnt);
+	param->overrun_cnt = cnt;
+	return 1;
+}
+
 /* function executed in each consumer thread */
 static void reader_fn(param_t * param)
 {
 	int ret;
 	int fd = param->trace_fd;
 	shared_buf_t *sbuf = param->sbuf;
+	uint64_t interval = period;
+	uint32_t drained;
 
 	pr_dbg("reader thread[%lu] created for FILE*[0x%p]\n",
 	       pthread_self(), fp);
@@ -234,12 +250,28 @@ static void reader_fn(param_t * param)
 	if (flags & FLAG_CLEAR_BUF)
 		sbuf_clear_buffered(sbuf);
 
+	param->overrun_start = sbuf->overrun_cnt;
+	param->overrun_cnt = sbuf->overrun_cnt;
+
 	while (1) {
+		drained = 0;
 		do {
 			ret = sbuf_write(fd, sbuf);
+			if (ret > 0)
+				drained += ret;
 		} while (ret > 0);
 
-		usleep(period);
+		/*
+		 * Poll faster while the buffer fills up quickly and back off
+		 * to the configured period once the trace rate drops.
+		 */
+		if (check_overrun(param) || (drained > sbuf->size / 4)) {
+			interval = (interval / 2 > MIN_PERIOD) ? interval / 2 : MIN_PERIOD;
+		} else if (drained < sbuf->size / 16) {
+			interval = (interval * 2 < period) ? interval * 2 : period;
+		}
+
+		usleep(interval);
 	}
 }
 
@@ -306,6 +338,18 @@ static void destory_reader(reader_struct * reader)
 	}
 
 	if (reader->param.sbuf) {
+		/* save what arrived since the last poll */
+		if (reader->param.trace_fd > 0)
+			while (sbuf_write(reader->param.trace_fd, reader->param.sbuf) > 0);
+
+		if (reader->param.sbuf->flags & OVERRUN_CNT_EN)
+			pr_info("cpu %u: %u trace entries overwritten in total\n",
+				reader->param.devid,
+				reader->param.sbuf->overrun_cnt - reader->param.overrun_start);
+		else
+			pr_info("cpu %u: overrun counting is not enabled\n",
+				reader->param.devid);
+
 		munmap(reader->param.sbuf, MMAP_SIZE);
 		reader->param.sbuf = NULL;
 	}
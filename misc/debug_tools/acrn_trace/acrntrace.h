@@ -23,6 +23,7 @@
 #define DEV_PATH_LEN		20
 #define TIME_STR_LEN		16
 #define CMD_MAX_LEN		48
+#define MIN_PERIOD		500	/* shortest polling interval, in us */
 
 #define pr_fmt(fmt)             "acrntrace: " fmt
 #define pr_info(fmt, ...)       printf(pr_fmt(fmt), ##__VA_ARGS__)
@@ -74,6 +75,8 @@ typedef struct {
 	uint32_t devid;
 	int exit_flag;
 	int trace_fd;
+	uint32_t overrun_start;	/* overrun_cnt when tracing started */
+	uint32_t overrun_cnt;	/* overrun_cnt last reported */
 	shared_buf_t *sbuf;
 	pthread_mutex_t *sbuf_lock;
 } param_t;
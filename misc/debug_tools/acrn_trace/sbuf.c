@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 #include "sbuf.h"
 #include <errno.h>
 
@@ -46,29 +47,80 @@ int sbuf_get(shared_buf_t *sbuf, uint8_t *data)
 	return sbuf->ele_size;
 }
 
+/*
+ * Write everything between head and tail to fd and consume it. The ring may
+ * wrap, so the data is passed as up to two spans in one writev().
+ */
 int sbuf_write(int fd, shared_buf_t *sbuf)
 {
-	const void *start;
-	int written;
+	struct iovec iov[2];
+	uint32_t head, tail, len, partial, done = 0;
+	int iovcnt, written;
+	off_t pos;
 
 	if (sbuf == NULL)
 		return -EINVAL;
 
-	if (sbuf_is_empty(sbuf)) {
+	head = sbuf->head;
+	/* pairs with the write barrier before the producer moves tail */
+	tail = __atomic_load_n(&sbuf->tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
 		return 0;
+
+	iov[0].iov_base = (void *)sbuf + SBUF_HEAD_SIZE + head;
+	if (tail > head) {
+		iov[0].iov_len = tail - head;
+		iovcnt = 1;
+	} else {
+		iov[0].iov_len = sbuf->size - head;
+		iov[1].iov_base = (void *)sbuf + SBUF_HEAD_SIZE;
+		iov[1].iov_len = tail;
+		iovcnt = (tail != 0) ? 2 : 1;
+	}
+	len = iov[0].iov_len + ((iovcnt == 2) ? iov[1].iov_len : 0);
+
+	while (done < len) {
+		written = writev(fd, iov, iovcnt);
+		if (written <= 0) {
+			if ((written < 0) && (errno == EINTR))
+				continue;
+			printf("Failed to write: ret %d (len %u), errno %d\n",
+				written, len - done, (written == -1) ? errno : 0);
+			break;
+		}
+		done += written;
+
+		/* short write: skip what has been written and retry */
+		while ((iovcnt > 0) && ((size_t)written >= iov[0].iov_len)) {
+			written -= iov[0].iov_len;
+			iovcnt--;
+			if (iovcnt > 0)
+				iov[0] = iov[1];
+		}
+		if (iovcnt > 0) {
+			iov[0].iov_base += written;
+			iov[0].iov_len -= written;
+		}
 	}
 
-	start = (void *)sbuf + SBUF_HEAD_SIZE + sbuf->head;
-        written = write(fd, start, sbuf->ele_size);
-	if (written != sbuf->ele_size) {
-		printf("Failed to write: ret %d (ele_size %d), errno %d\n",
-			written, sbuf->ele_size, (written == -1) ? errno : 0);
-		return -1;
+	/*
+	 * Only whole elements are consumed. Cut a partial one off the file, it
+	 * is written again in full by the next call.
+	 */
+	partial = done % sbuf->ele_size;
+	if (partial != 0) {
+		pos = lseek(fd, -(off_t)partial, SEEK_CUR);
+		if ((pos < 0) || (ftruncate(fd, pos) < 0))
+			printf("Failed to drop a partial entry, errno %d\n", errno);
+		done -= partial;
 	}
+	if (done == 0)
+		return -1;
 
-	sbuf->head = sbuf_next_ptr(sbuf->head, sbuf->ele_size, sbuf->size);
+	__atomic_store_n(&sbuf->head, sbuf_next_ptr(head, done, sbuf->size),
+			__ATOMIC_RELEASE);
 
-	return sbuf->ele_size;
+	return done;
 }
 
 int sbuf_clear_buffered(shared_buf_t *sbuf)